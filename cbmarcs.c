@@ -21,8 +21,13 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 #include "cbmarcs.h"
+#include "cbmfilt.h"
+#include "cbmhash.h"
 
 #if defined(__MSDOS__) || defined(_WIN32)
 #include <io.h>
@@ -64,8 +69,6 @@ typedef int bool;
 #endif
 #endif
 
-extern char *ProgName;
-
 /******************************************************************************
 * Constants
 ******************************************************************************/
@@ -140,6 +143,63 @@ enum { FLAG_DOUBLE_SIDED = 0x80 };
 #define min(a,b)        (((a) < (b)) ? (a) : (b))
 #endif
 
+/******************************************************************************
+* Format a message into a buffer of CBM_MAX_MSG characters
+* Messages come only from this file and are all short, so vsprintf() is safe
+* where vsnprintf() isn't available.
+******************************************************************************/
+static void FormatMsg(char *Msg, const char *Format, va_list Args)
+{
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+	vsnprintf(Msg, CBM_MAX_MSG, Format, Args);
+#else
+	vsprintf(Msg, Format, Args);
+#endif
+}
+
+/******************************************************************************
+* Record an error in the context
+* Returns -1, for the caller to return in turn
+******************************************************************************/
+static int ArcError(struct CbmContext *Ctx, int Error, const char *Format, ...)
+{
+	va_list Args;
+
+	va_start(Args, Format);
+	FormatMsg(Ctx->ErrorMsg, Format, Args);
+	va_end(Args);
+	Ctx->Error = Error;
+	return -1;
+}
+
+/******************************************************************************
+* Record the error from the last failed system call in the context
+* A short read leaves errno alone, so it's cleared first by CbmOpenDir()
+* and CbmNextEntry()
+******************************************************************************/
+static int SysError(struct CbmContext *Ctx)
+{
+	Ctx->SysErrno = errno;
+	return ArcError(Ctx, CBM_ERR_ARCHIVE, "%s",
+			errno ? strerror(errno) : "Archive format error");
+}
+
+/******************************************************************************
+* Report a problem that doesn't stop the archive from being read
+******************************************************************************/
+static void ArcWarning(struct CbmContext *Ctx, const char *Format, ...)
+{
+	va_list Args;
+	char Msg[CBM_MAX_MSG];
+
+	if (!Ctx->Warning)
+		return;
+	va_start(Args, Format);
+	FormatMsg(Msg, Format, Args);
+	va_end(Args);
+	Ctx->Warning(Ctx->UserData, Msg);
+}
+
 /******************************************************************************
 * Returns the length of an open file in bytes
 ******************************************************************************/
@@ -168,6 +228,458 @@ static long filelength(int handle)
 }
 #endif
 
+/******************************************************************************
+* Archive sources
+******************************************************************************/
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define HAVE_PREAD
+#endif
+
+static long MemReadAt(struct CbmSource *Src, unsigned long Offset, void *Buf,
+		size_t Len)
+{
+	struct CbmMemSource *Mem = (struct CbmMemSource *) Src;
+
+	if (Offset >= Mem->Len)
+		return 0;
+	if (Len > Mem->Len - Offset)
+		Len = (size_t) (Mem->Len - Offset);
+	memcpy(Buf, Mem->Data + Offset, Len);
+	return (long) Len;
+}
+
+static long MemSize(struct CbmSource *Src)
+{
+	return (long) ((struct CbmMemSource *) Src)->Len;
+}
+
+static const void *MemMap(struct CbmSource *Src, unsigned long Offset,
+		unsigned long Len)
+{
+	struct CbmMemSource *Mem = (struct CbmMemSource *) Src;
+
+	if ((Offset > Mem->Len) || (Len > Mem->Len - Offset))
+		return NULL;
+	return Mem->Data + Offset;
+}
+
+struct CbmSource *CbmInitMemSource(struct CbmMemSource *Mem, const void *Data,
+		unsigned long Len)
+{
+	Mem->Src.ReadAt = MemReadAt;
+	Mem->Src.Size = MemSize;
+	Mem->Src.Map = MemMap;
+	Mem->Data = (const unsigned char *) Data;
+	Mem->Len = Len;
+	return &Mem->Src;
+}
+
+static long FdReadAt(struct CbmSource *Src, unsigned long Offset, void *Buf,
+		size_t Len)
+{
+	int Fd = ((struct CbmFdSource *) Src)->Fd;
+
+#ifdef HAVE_PREAD
+	return (long) pread(Fd, Buf, Len, (off_t) Offset);
+#else
+	if (lseek(Fd, (long) Offset, SEEK_SET) < 0)
+		return -1;
+	return (long) read(Fd, Buf, Len);
+#endif
+}
+
+static long FdSize(struct CbmSource *Src)
+{
+	return filelength(((struct CbmFdSource *) Src)->Fd);
+}
+
+struct CbmSource *CbmInitFdSource(struct CbmFdSource *FdSrc, int Fd)
+{
+	FdSrc->Src.ReadAt = FdReadAt;
+	FdSrc->Src.Size = FdSize;
+	FdSrc->Src.Map = NULL;
+	FdSrc->Fd = Fd;
+	return &FdSrc->Src;
+}
+
+static long FileReadAt(struct CbmSource *Src, unsigned long Offset, void *Buf,
+		size_t Len)
+{
+	FILE *File = ((struct CbmFileSource *) Src)->File;
+	size_t Got;
+
+	if (fseek(File, (long) Offset, SEEK_SET) != 0)
+		return -1;
+	Got = fread(Buf, 1, Len, File);
+	if ((Got < Len) && ferror(File))
+		return -1;
+	return (long) Got;
+}
+
+static long FileSize(struct CbmSource *Src)
+{
+	return filelength(fileno(((struct CbmFileSource *) Src)->File));
+}
+
+struct CbmSource *CbmInitFileSource(struct CbmFileSource *FileSrc, FILE *File)
+{
+	FileSrc->Src.ReadAt = FileReadAt;
+	FileSrc->Src.Size = FileSize;
+	FileSrc->Src.Map = NULL;
+	FileSrc->File = File;
+	return &FileSrc->Src;
+}
+
+static long SubReadAt(struct CbmSource *Src, unsigned long Offset, void *Buf,
+		size_t Len)
+{
+	struct CbmSubSource *Sub = (struct CbmSubSource *) Src;
+
+	if (Offset >= Sub->Len)
+		return 0;
+	if (Len > Sub->Len - Offset)
+		Len = (size_t) (Sub->Len - Offset);
+	return Sub->Parent->ReadAt(Sub->Parent, Sub->Offset + Offset, Buf, Len);
+}
+
+static long SubSize(struct CbmSource *Src)
+{
+	return (long) ((struct CbmSubSource *) Src)->Len;
+}
+
+static const void *SubMap(struct CbmSource *Src, unsigned long Offset,
+		unsigned long Len)
+{
+	struct CbmSubSource *Sub = (struct CbmSubSource *) Src;
+
+	if ((Offset > Sub->Len) || (Len > Sub->Len - Offset) || !Sub->Parent->Map)
+		return NULL;
+	return Sub->Parent->Map(Sub->Parent, Sub->Offset + Offset, Len);
+}
+
+struct CbmSource *CbmInitSubSource(struct CbmSubSource *Sub,
+		struct CbmSource *Parent, unsigned long Offset, unsigned long Len)
+{
+	Sub->Src.ReadAt = SubReadAt;
+	Sub->Src.Size = SubSize;
+	Sub->Src.Map = SubMap;
+	Sub->Parent = Parent;
+	Sub->Offset = Offset;
+	Sub->Len = Len;
+	return &Sub->Src;
+}
+
+/******************************************************************************
+* Sequential reading from a source
+* These work like their stdio namesakes so the format readers need not care
+* where the archive is. Small reads are buffered, and a source that can map
+* the whole archive is read in place without any copying into the buffer.
+******************************************************************************/
+#define SRC_BUF_SIZE 512
+
+struct SrcStream {
+	struct CbmSource *Src;
+	unsigned long Pos;			/* offset of the next byte to read */
+	const unsigned char *Data;	/* Buf, or the whole archive if mapped */
+	unsigned long DataStart;	/* offset of Data in the archive */
+	unsigned long DataLen;		/* valid bytes at Data */
+	int Mapped;					/* nonzero if Data holds the whole archive */
+	unsigned char Buf[SRC_BUF_SIZE];
+};
+
+static void SrcOpen(struct SrcStream *In, struct CbmSource *Src)
+{
+	long Size;
+
+	In->Src = Src;
+	In->Pos = 0;
+	In->Data = In->Buf;
+	In->DataStart = 0;
+	In->DataLen = 0;
+	In->Mapped = 0;
+	if (Src->Map && ((Size = Src->Size(Src)) > 0)) {
+		const void *Map = Src->Map(Src, 0, (unsigned long) Size);
+		if (Map) {
+			In->Data = (const unsigned char *) Map;
+			In->DataLen = (unsigned long) Size;
+			In->Mapped = 1;
+		}
+	}
+}
+
+/* Returns the number of bytes now available at Pos */
+static long SrcFill(struct SrcStream *In)
+{
+	long Got;
+
+	if (In->Mapped)
+		return In->Pos < In->DataLen ? (long) (In->DataLen - In->Pos) : 0;
+	Got = In->Src->ReadAt(In->Src, In->Pos, In->Buf, sizeof(In->Buf));
+	In->DataStart = In->Pos;
+	In->DataLen = Got > 0 ? (unsigned long) Got : 0;
+	return Got;
+}
+
+static int SrcSeek(struct SrcStream *In, long Offset)
+{
+	if (Offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	In->Pos = (unsigned long) Offset;
+	return 0;
+}
+
+static void SrcRewind(struct SrcStream *In)
+{
+	In->Pos = 0;
+}
+
+static long SrcTell(struct SrcStream *In)
+{
+	return (long) In->Pos;
+}
+
+static long SrcSize(struct SrcStream *In)
+{
+	return In->Src->Size(In->Src);
+}
+
+static int SrcGetc(struct SrcStream *In)
+{
+	if (((In->Pos < In->DataStart) || (In->Pos - In->DataStart >= In->DataLen))
+		&& (SrcFill(In) <= 0))
+		return EOF;
+	return In->Data[In->Pos++ - In->DataStart];
+}
+
+/* Returns the number of whole items read */
+static size_t SrcRead(void *Buf, size_t Size, size_t Count, struct SrcStream *In)
+{
+	unsigned char *Out = (unsigned char *) Buf;
+	unsigned long Want = (unsigned long) Size * Count;
+	unsigned long Done = 0;
+
+	while (Done < Want) {
+		if ((In->Pos >= In->DataStart) && (In->Pos - In->DataStart < In->DataLen)) {
+			/* Copy what's already buffered */
+			unsigned long Off = In->Pos - In->DataStart;
+			unsigned long Len = In->DataLen - Off;
+			if (Len > Want - Done)
+				Len = Want - Done;
+			memcpy(Out + Done, In->Data + Off, (size_t) Len);
+			Done += Len;
+			In->Pos += Len;
+
+		} else if (!In->Mapped && (Want - Done >= sizeof(In->Buf))) {
+			/* Big reads go straight to the caller's buffer */
+			long Got = In->Src->ReadAt(In->Src, In->Pos, Out + Done,
+					(size_t) (Want - Done));
+			if (Got <= 0)
+				break;
+			Done += (unsigned long) Got;
+			In->Pos += (unsigned long) Got;
+
+		} else if (SrcFill(In) <= 0)
+			break;
+	}
+	return Size ? (size_t) (Done / Size) : 0;
+}
+
+/******************************************************************************
+* Text scanning from a source
+* Each works like the scanf() conversion named, returning 1 if it matched.
+* They work on the buffered (or mapped) bytes in place a window at a time
+* rather than calling SrcGetc() for each, since the Lynx and LBR readers
+* parse their whole directories with them.
+******************************************************************************/
+
+/* Returns the bytes available at Pos without copying them, setting Len to how
+ * many there are, or NULL at the end of the source
+ */
+static const unsigned char *SrcWindow(struct SrcStream *In, unsigned long *Len)
+{
+	if (((In->Pos < In->DataStart) || (In->Pos - In->DataStart >= In->DataLen))
+		&& (SrcFill(In) <= 0))
+		return NULL;
+	*Len = In->DataLen - (In->Pos - In->DataStart);
+	return In->Data + (In->Pos - In->DataStart);
+}
+
+static int SrcPeek(struct SrcStream *In)
+{
+	unsigned long Len;
+	const unsigned char *P = SrcWindow(In, &Len);
+
+	return P ? *P : EOF;
+}
+
+/* " " */
+static void SrcSkipSpace(struct SrcStream *In)
+{
+	const unsigned char *P;
+	unsigned long Len;
+	unsigned long i;
+
+	while ((P = SrcWindow(In, &Len)) != NULL) {
+		for (i = 0; (i < Len) && isspace(P[i]); ++i)
+			;
+		In->Pos += i;
+		if (i < Len)
+			break;
+	}
+}
+
+/* "%ld", but a number too large for a long doesn't match */
+static int SrcScanLong(struct SrcStream *In, long *Value)
+{
+	const unsigned char *P;
+	unsigned long Len;
+	unsigned long i;
+	int Ch;
+	int Negative = 0;
+	int Overflow = 0;
+	unsigned long Digits = 0;
+	long Num = 0;
+
+	SrcSkipSpace(In);
+	if (((Ch = SrcPeek(In)) == '-') || (Ch == '+')) {
+		Negative = Ch == '-';
+		++In->Pos;
+	}
+	while ((P = SrcWindow(In, &Len)) != NULL) {
+		for (i = 0; (i < Len) && isdigit(P[i]); ++i) {
+			if (Num > (LONG_MAX - (P[i] - '0')) / 10)
+				Overflow = 1;
+			else
+				Num = Num * 10 + (P[i] - '0');
+		}
+		Digits += i;
+		In->Pos += i;
+		if (i < Len)
+			break;
+	}
+	*Value = Negative ? -Num : Num;
+	return (Digits > 0) && !Overflow;
+}
+
+/* "%d", but a number too large for an int doesn't match */
+static int SrcScanInt(struct SrcStream *In, int *Value)
+{
+	long Num;
+
+	if (!SrcScanLong(In, &Num) || (Num < INT_MIN) || (Num > INT_MAX))
+		return 0;
+	*Value = (int) Num;
+	return 1;
+}
+
+/* "%s", or "%*s" if Buf is NULL; MaxLen excludes the NUL */
+static int SrcScanWord(struct SrcStream *In, char *Buf, size_t MaxLen)
+{
+	const unsigned char *P;
+	unsigned long Avail;
+	unsigned long i;
+	size_t Len = 0;
+
+	SrcSkipSpace(In);
+	while ((P = SrcWindow(In, &Avail)) != NULL) {
+		for (i = 0; (i < Avail) && !isspace(P[i]) && (!Buf || Len < MaxLen); ++i) {
+			if (Buf)
+				Buf[Len] = (char) P[i];
+			++Len;
+		}
+		In->Pos += i;
+		if (i < Avail)
+			break;
+	}
+	if (Buf)
+		Buf[Len] = '\0';
+	return Len > 0;
+}
+
+/* "%*s", also returning the number the word starts with (or 0) in Value */
+static int SrcScanNumberWord(struct SrcStream *In, long *Value)
+{
+	const unsigned char *P;
+	unsigned long Avail;
+	unsigned long i;
+	int Digits = 1;		/* nonzero while still in the leading number */
+	size_t Len = 0;
+
+	SrcSkipSpace(In);
+	*Value = 0;
+	while ((P = SrcWindow(In, &Avail)) != NULL) {
+		for (i = 0; (i < Avail) && !isspace(P[i]); ++i) {
+			if (Digits && isdigit(P[i]) && (*Value < 100000L))
+				*Value = *Value * 10 + (P[i] - '0');
+			else
+				Digits = 0;
+		}
+		Len += i;
+		In->Pos += i;
+		if (i < Avail)
+			break;
+	}
+	return Len > 0;
+}
+
+/* "%[^\r]", or "%*[^\r]" if Buf is NULL; MaxLen excludes the NUL */
+static int SrcScanLine(struct SrcStream *In, char *Buf, size_t MaxLen)
+{
+	const unsigned char *P;
+	const unsigned char *Cr;
+	unsigned long Avail;
+	unsigned long n;
+	size_t Len = 0;
+
+	while ((P = SrcWindow(In, &Avail)) != NULL) {
+		Cr = (const unsigned char *) memchr(P, '\r', (size_t) Avail);
+		n = Cr ? (unsigned long) (Cr - P) : Avail;
+		if (Buf) {
+			if (n > MaxLen - Len)
+				n = MaxLen - Len;
+			memcpy(Buf + Len, P, (size_t) n);
+		}
+		Len += (size_t) n;
+		In->Pos += n;
+		if (Cr || (Buf && Len >= MaxLen))
+			break;
+	}
+	if (Buf)
+		Buf[Len] = '\0';
+	return Len > 0;
+}
+
+/* "%*[^\r]%*c": the rest of the line and the CR ending it, without skipping
+ * any white space at the start of the next
+ */
+static void SrcEndLine(struct SrcStream *In)
+{
+	SrcScanLine(In, NULL, 0);
+	(void) SrcGetc(In);
+}
+
+/* A literal string, after optional white space as with " LYNX" */
+static int SrcScanLiteral(struct SrcStream *In, const char *Literal)
+{
+	SrcSkipSpace(In);
+	for (; *Literal; ++Literal, ++In->Pos)
+		if (SrcPeek(In) != (unsigned char) *Literal)
+			return 0;
+	return 1;
+}
+
+/* "%*[^\r]\r": the rest of the line, then any white space (including the CR)
+ * if there was anything else on the line
+ */
+static void SrcSkipLine(struct SrcStream *In)
+{
+	if (SrcScanLine(In, NULL, 0))
+		SrcSkipSpace(In);
+}
+
 
 
 /******************************************************************************
@@ -202,6 +714,171 @@ static char *ConvertCBMName(char *InString)
 	return InString;
 }
 
+/******************************************************************************
+* Copy a CBM file name as stored in the archive, without its $A0 padding
+* Returns pointer to the copy, which must hold MaxLen+1 characters
+******************************************************************************/
+static char *RawCBMName(char *Raw, const char *Name, size_t MaxLen)
+{
+	size_t Len;
+
+	for (Len = 0; (Len < MaxLen) && Name[Len]; ++Len)
+		Raw[Len] = Name[Len];
+	while (Len && (Raw[Len-1] == CBM_END_NAME))
+		--Len;
+	Raw[Len] = 0;
+	return Raw;
+}
+
+/******************************************************************************
+* Directory reading state
+* Each archive format has an Open function that reads the archive header and
+* a Next function that reads one directory entry. Everything needed to resume
+* reading is kept here and in the format's own state, and Next seeks to where
+* it left off, so the caller is free to use the file between entries.
+******************************************************************************/
+#define NEXT_SKIPPED 2		/* Next function return for an unwanted entry */
+
+/* Where the contents of the current entry are. A format's Data function sets
+   this up, as either one run of bytes in the archive or a disk image's chain
+   of sectors, the first time CbmReadEntry() is called for an entry. A run of
+   compressed bytes has a Decode function to expand it. */
+struct EntryData {
+	int Open;					/* nonzero once set up for the current entry */
+	unsigned char Prefix[2];	/* bytes returned first, e.g. a load address */
+	unsigned PrefixLen;
+	unsigned long Pos;			/* archive offset of the next byte */
+	unsigned long Left;			/* bytes left in the run or current sector */
+	int ToEnd;					/* nonzero if the run ends with the archive */
+	int Chain;					/* nonzero to follow a sector chain */
+	int DiskType;				/* the rest is only used for chains */
+	unsigned long HeaderOffset;
+	unsigned char NextTrack;	/* next sector, or track 0 after the last */
+	unsigned char NextSector;
+	unsigned Blocks;			/* sectors read, to detect a loop */
+	/* Expands the run into up to Len bytes at Out, returning the number of
+	   bytes, 0 at the end or -1 on error; NULL if the run isn't compressed */
+	long (*Decode)(struct CbmDir *Dir, unsigned char *Out, size_t Len);
+	/* Nonzero if Decode only checks the run, which holds the contents as
+	   they are in its first StoredLen bytes */
+	int Stored;
+	unsigned long StoredLen;
+};
+#define DATA_TO_END ((unsigned long) -1L)	/* Left for a run to the end */
+
+struct CbmDir {
+	struct CbmContext *Ctx;
+	struct SrcStream *InFile;	/* points to Stream */
+	enum ArchiveTypes Type;
+	unsigned Fields;			/* ArcFields needed by the caller or the filter */
+	int (*Next)(struct CbmDir *Dir);	/* returns 1, 0 at end, NEXT_SKIPPED
+										   or -1 on error */
+	void *State;				/* format-specific reading state */
+	int Done;					/* nonzero when no more entries will be read */
+	const char *Title;			/* archive title, or NULL */
+	char TitleBuf[25];
+	struct ArcTotals Totals;	/* totals of the entries read so far */
+	struct CbmEntry Entry;		/* entry to be returned by CbmNextEntry() */
+	char Name[80];				/* names pointed to by Entry */
+	char RawName[80];
+	struct EntryData Data;		/* reading the current entry's contents */
+	void *Decoder;				/* state for Data.Decode, allocated when first
+								   needed and kept for the following entries */
+	char Hash[CBM_MAX_HASH];	/* hash pointed to by Entry */
+	int Hashed;					/* nonzero once the entry has been hashed */
+	struct CbmFileSource FileSrc;	/* source when reading a FILE */
+	struct SrcStream Stream;
+};
+
+/******************************************************************************
+* Fill in the entry to return from a directory
+* Name is as stored in the archive and is converted to ASCII here
+* Returns 1 for the Next functions to return in turn
+******************************************************************************/
+static int SetEntry(struct CbmDir *Dir, const char *Name, const char *Type,
+		unsigned long Length, unsigned Blocks, const char *Storage,
+		int Compression, unsigned BlocksNow, long Checksum)
+{
+	struct CbmEntry *Entry = &Dir->Entry;
+
+	RawCBMName(Dir->RawName, Name, sizeof(Dir->RawName)-1);
+	strncpy(Dir->Name, Name, sizeof(Dir->Name)-1);
+	Dir->Name[sizeof(Dir->Name)-1] = 0;
+
+	Entry->Name = ConvertCBMName(Dir->Name);
+	Entry->Type = Type;
+	Entry->Length = Length;
+	Entry->Blocks = Blocks;
+	Entry->Storage = Storage;
+	Entry->Compression = Compression;
+	Entry->BlocksNow = BlocksNow;
+	Entry->Checksum = Checksum;
+	Entry->RawName = Dir->RawName;
+	Entry->Hash = Dir->Hash;
+	return 1;
+}
+
+static long HashEntry(struct CbmDir *Dir, const char *Name, int Read);
+
+/******************************************************************************
+* Returns nonzero if the context's filter accepts an entry
+* This only needs the fields that are known as soon as the directory entry is
+* read, so the Next functions call it before doing anything more for the entry
+* and return NEXT_SKIPPED if it's not wanted. Name is as stored in the archive.
+******************************************************************************/
+static int Wanted(struct CbmDir *Dir, const char *Name, const char *Type,
+		unsigned long Blocks)
+{
+	char AsciiName[80];
+
+	if (!Dir->Ctx->Filter)
+		return 1;
+	strncpy(AsciiName, Name, sizeof(AsciiName)-1);
+	AsciiName[sizeof(AsciiName)-1] = 0;
+	return CbmFilterMatch(Dir->Ctx->Filter, ConvertCBMName(AsciiName), Type,
+			Blocks);
+}
+
+/******************************************************************************
+* Set the current entry's contents to be a run of Len bytes at Pos
+* Returns 0 for the Data functions to return in turn
+******************************************************************************/
+static int SetDataRun(struct CbmDir *Dir, unsigned long Pos, unsigned long Len)
+{
+	Dir->Data.Chain = 0;
+	Dir->Data.Pos = Pos;
+	Dir->Data.Left = Len;
+	Dir->Data.ToEnd = Len == DATA_TO_END;
+	return 0;
+}
+
+/******************************************************************************
+* Get the next byte of the current entry's run, for a Decode function
+* The archive must already be positioned at Dir->Data.Pos.
+* Returns the byte, or EOF at the end of the run or the archive
+******************************************************************************/
+static int RunGetc(struct CbmDir *Dir)
+{
+	int Ch;
+
+	if (!Dir->Data.Left || ((Ch = SrcGetc(Dir->InFile)) == EOF))
+		return EOF;
+	++Dir->Data.Pos;
+	--Dir->Data.Left;
+	return Ch;
+}
+
+/******************************************************************************
+* Allocate the decoder state for a directory the first time it's needed
+* Returns it, or NULL if out of memory
+******************************************************************************/
+static void *GetDecoder(struct CbmDir *Dir, size_t Size)
+{
+	if (!Dir->Decoder && ((Dir->Decoder = malloc(Size)) == NULL))
+		ArcError(Dir->Ctx, CBM_ERR_MEMORY, "Out of memory");
+	return Dir->Decoder;
+}
+
 /*---------------------------------------------------------------------------*/
 
 
@@ -292,6 +969,95 @@ static const char * const ARCEntryTypes[] = {
 };
 enum {MaxARCEntry = 7};
 
+/******************************************************************************
+* Name an ARC compression type; the type comes from the archive, so it isn't
+* necessarily one in the table
+******************************************************************************/
+static const char *ARCEntryType(BYTE EntryType)
+{
+	return EntryType <= MaxARCEntry ? ARCEntryTypes[EntryType] : "?";
+}
+
+/******************************************************************************
+* Find the first entry of the archive after a self-extractor
+* The extractor's length differs between versions and patched copies, so
+* rather than trusting a known offset, the first SFX_SCAN_LEN bytes after From
+* are searched with memchr() for Mark, found MarkPos bytes into each entry
+* header. A header is only taken as the first entry if Follow() accepts it and
+* the one after it, or the end of the archive after it.
+* Follow() returns the offset of the next entry, 0 at the end of the archive,
+* or -1 if Pos doesn't hold a valid entry.
+* Returns the offset of the first entry, or -1 if none was found
+******************************************************************************/
+#define SFX_SCAN_LEN 8192L		/* how far into the file the archive may start */
+#if defined(__MSDOS__) || defined(__Z88DK)
+#define SFX_SCAN_BLOCK 1024
+#else
+#define SFX_SCAN_BLOCK 8192
+#endif
+
+typedef long (*FollowFunc)(struct SrcStream *InFile, long Pos);
+
+static long FindFirstEntry(struct SrcStream *InFile, long From, int Mark,
+		long MarkPos, FollowFunc Follow)
+{
+	unsigned char Block[SFX_SCAN_BLOCK];
+	long BlockPos = From + MarkPos;
+	long End = From + MarkPos + SFX_SCAN_LEN;
+	long Next;
+	size_t Got;
+
+	while (BlockPos < End) {
+		Got = (size_t) min((long) sizeof(Block), End - BlockPos);
+		if (SrcSeek(InFile, BlockPos) != 0)
+			return -1;
+		if ((Got = SrcRead(Block, 1, Got, InFile)) == 0)
+			return -1;
+		{
+			const unsigned char *Hit = Block;
+			size_t Left = Got;
+			const unsigned char *Found;
+
+			while ((Found = (const unsigned char *) memchr(Hit, Mark, Left)) != NULL) {
+				long Pos = BlockPos + (long) (Found - Block) - MarkPos;
+
+				if (((Next = Follow(InFile, Pos)) > 0) && (Follow(InFile, Next) >= 0))
+					return Pos;
+				Left -= (size_t) (Found + 1 - Hit);
+				Hit = Found + 1;
+			}
+		}
+		BlockPos += (long) Got;
+	}
+	return -1;
+}
+
+/* Returns nonzero if nothing follows Pos */
+static int AtEnd(struct SrcStream *InFile, long Pos)
+{
+	return (SrcSeek(InFile, Pos) == 0) && (SrcGetc(InFile) == EOF);
+}
+
+/******************************************************************************
+* Check for an ARC entry header at Pos, for FindFirstEntry()
+******************************************************************************/
+static long FollowARC(struct SrcStream *InFile, long Pos)
+{
+	struct ArchiveEntryHeader FileHeader;
+
+	if (AtEnd(InFile, Pos))
+		return 0;
+	if ((SrcSeek(InFile, Pos) != 0) ||
+		(SrcRead(&FileHeader, sizeof(FileHeader), 1, InFile) != 1) ||
+		(FileHeader.Magic != MagicARCEntry) ||
+		(FileHeader.EntryType > MaxARCEntry) ||
+		(FileHeader.BlockLength == 0) ||
+		(FileHeader.FileNameLen == 0) || (FileHeader.FileNameLen > 16) ||
+		!FileHeader.FileType || !strchr("PSURDpsurd ", FileHeader.FileType))
+		return -1;
+	return Pos + FileHeader.BlockLength * 254L;
+}
+
 
 static const BYTE MagicHeaderC64[10] = {0x9e,'(','2','0','6','3',')',0x00,0x00,0x00};
 static const BYTE MagicHeaderC128[10] = {0x9e,'(','7','1','8','3',')',0x00,0x00,0x00};
@@ -299,229 +1065,528 @@ static const BYTE MagicHeaderC128[10] = {0x9e,'(','7','1','8','3',')',0x00,0x00,
 /******************************************************************************
 * Is archive C64 ARC format?
 ******************************************************************************/
-static bool IsC64_10(FILE *InFile, const char *FileName)
+static bool IsC64_10(struct SrcStream *InFile, const char *FileName)
 {
 	static const BYTE MagicC64_10[3] = {0x85,0xfd,0xa9};
 	struct C64_10 Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic1, MagicHeaderC64, sizeof(MagicHeaderC64)) == 0)
 		&& (memcmp(Header.Magic2, MagicC64_10, sizeof(MagicC64_10)) == 0));
 }
 
-static bool IsC64_13(FILE *InFile, const char *FileName)
+static bool IsC64_13(struct SrcStream *InFile, const char *FileName)
 {
 	static const BYTE MagicC64_13[3] = {0x85,0x2f,0xa9};
 	struct C64_13 Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic1, MagicHeaderC64, sizeof(MagicHeaderC64)) == 0)
 		&& (memcmp(Header.Magic2, MagicC64_13, sizeof(MagicC64_13)) == 0));
 }
 
 
-static bool IsC64_15(FILE *InFile, const char *FileName)
+static bool IsC64_15(struct SrcStream *InFile, const char *FileName)
 {
 	static const BYTE MagicC64_15[4] = {0x8d,0x21,0xd0,0x4c};
 	struct C64_15 Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic1, MagicHeaderC64, sizeof(MagicHeaderC64)) == 0)
-		&& (memcmp(Header.Magic2, MagicC64_15, sizeof(MagicC64_15)) == 0));
+		&& ((memcmp(Header.Magic2, MagicC64_15, sizeof(MagicC64_15)) == 0)
+			/* or any other dearcer with an archive after it */
+			|| (FindFirstEntry(InFile, sizeof(Header), MagicARCEntry, 0, FollowARC) >= 0)));
 }
 
 
-static bool IsC128_15(FILE *InFile, const char *FileName)
+static bool IsC128_15(struct SrcStream *InFile, const char *FileName)
 {
 	static const BYTE MagicC128_15 = 0x4c;
 	struct C128_15 Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic1, MagicHeaderC128, sizeof(MagicHeaderC128)) == 0)
-		&& (Header.Magic2 == MagicC128_15));
+		&& ((Header.Magic2 == MagicC128_15)
+			|| (FindFirstEntry(InFile, sizeof(Header), MagicARCEntry, 0, FollowARC) >= 0)));
 }
 
-static bool IsC64_ARC(FILE *InFile, const char *FileName)
+static bool IsC64_ARC(struct SrcStream *InFile, const char *FileName)
 {
 	enum {MagicHeaderARC = 2};
 	struct C64_ARC Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& ((BYTE) Header.Magic == MagicHeaderARC)
 		&& ((BYTE) Header.EntryType <= MaxARCEntry));
 }
 
 /******************************************************************************
-* Read directory
+* Open directory
 ******************************************************************************/
-static int DirARC(FILE *InFile, enum ArchiveTypes ArcType,
-		struct ArcTotals *Totals, DisplayStartFunc DisplayStart,
-		DisplayEntryFunc DisplayEntry)
+struct ARCState {
+	long CurrentPos;		/* offset of the next entry header */
+	long EntryPos;			/* offset of the current entry's header */
+};
+
+static int OpenARC(struct CbmDir *Dir)
 {
+	struct ARCState *S = (struct ARCState *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct SrcStream *InFile = Dir->InFile;
+	struct ArcTotals *Totals = &Dir->Totals;
 	long CurrentPos;
+	long DearcerLen = 0;	/* length of the dearcer's header */
+	long KnownPos = 0;		/* where the archive starts after an unpatched one */
 
-	Totals->ArchiveEntries = 0;
-	Totals->TotalBlocks = 0;
-	Totals->TotalBlocksNow = 0;
-	Totals->TotalLength = 0;
-	Totals->DearcerBlocks = 0;
-	Totals->Version = 0;
-
-	if (fseek(InFile, 0, SEEK_SET) != 0) {
-		perror(ProgName);
-		return 2;
+	if (SrcSeek(InFile, 0) != 0) {
+		return SysError(Ctx);
 	}
 
 /******************************************************************************
-* Find the version number and first archive entry offset for each format
+* Find the version number and the dearcer for each format
 ******************************************************************************/
-	switch (ArcType) {
+	switch (Dir->Type) {
 		case C64_ARC:	/* Not a self dearcer -- just the arc data */
-			CurrentPos = 0L;
 			break;
 
 		case C64_10: {
 			struct C64_10 Header;
 
-			if (fread(&Header, sizeof(Header), 1, InFile) != 1) {
-				fprintf(stderr,"%s: Archive format error\n", ProgName);
-				return 2;
+			if (SrcRead(&Header, sizeof(Header), 1, InFile) != 1) {
+				return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 			}
-
-			CurrentPos = 1016;
-/*
-			CurrentPos = ((Header.FirstOffH << 8) |
-							Header.FirstOffL) -
-							CF_LE_W(Header.StartAddress) + 2;
-*/
+			DearcerLen = sizeof(Header);
+			KnownPos = 1016;
 			Totals->Version = -CF_LE_W(Header.Version);
-			Totals->DearcerBlocks = (int) ((CurrentPos-1) / 254 + 1);
 		}
 		break;
 
 		case C64_13: {
 			struct C64_13 Header;
 
-			if (fread(&Header, sizeof(Header), 1, InFile) != 1) {
-				fprintf(stderr,"%s: Archive format error\n", ProgName);
-				return 2;
+			if (SrcRead(&Header, sizeof(Header), 1, InFile) != 1) {
+				return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 			}
-
-			CurrentPos = 1778;
-/*
-			CurrentPos = ((Header.FirstOffH << 8) |
-							Header.FirstOffL) -
-							CF_LE_W(Header.StartAddress) + 2;
-*/
+			DearcerLen = sizeof(Header);
+			KnownPos = 1778;
 			Totals->Version = -CF_LE_W(Header.Version);
-			Totals->DearcerBlocks = (int) ((CurrentPos-1) / 254 + 1);
 		}
 		break;
 
 		case C64_15: {
 			struct C64_15 Header;
 
-			if (fread(&Header, sizeof(Header), 1, InFile) != 1) {
-				fprintf(stderr,"%s: Archive format error\n", ProgName);
-				return 2;
+			if (SrcRead(&Header, sizeof(Header), 1, InFile) != 1) {
+				return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 			}
-
-			CurrentPos = 2286;
-/*
-			fseek(InFile, CF_LE_W(Header.StartPointer) -
-					CF_LE_W(Header.StartAddress) + 2, SEEK_SET);
-			fread(&FileHeaderNew, sizeof(FileHeaderNew), 1, InFile);
-			CurrentPos = ((FileHeaderNew.FirstOffH << 8) |
-							FileHeaderNew.FirstOffL) -
-							CF_LE_W(Header.StartAddress) + 2;
-*/
+			DearcerLen = sizeof(Header);
+			KnownPos = 2286;
 			Totals->Version = -CF_LE_W(Header.Version);
-			Totals->DearcerBlocks = (int) ((CurrentPos-1) / 254 + 1);
 		}
 		break;
 
 		case C128_15: {
 			struct C128_15 Header;
 
-			if (fread(&Header, sizeof(Header), 1, InFile) != 1) {
-				fprintf(stderr,"%s: Archive format error\n", ProgName);
-				return 2;
+			if (SrcRead(&Header, sizeof(Header), 1, InFile) != 1) {
+				return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 			}
-
-			CurrentPos = 2285;
-/*
-			fseek(InFile, CF_LE_W(Header.StartPointer) -
-					CF_LE_W(Header.StartAddress) + 2, SEEK_SET);
-			fread(&FileHeaderNew, sizeof(FileHeaderNew), 1, InFile);
-			CurrentPos = ((FileHeaderNew.FirstOffH << 8) |
-							FileHeaderNew.FirstOffL) -
-							CF_LE_W(Header.StartAddress) + 2;
-*/
+			DearcerLen = sizeof(Header);
+			KnownPos = 2285;
 			Totals->Version = -CF_LE_W(Header.Version);
-			Totals->DearcerBlocks = (int) ((CurrentPos-1) / 254 + 1);
 		}
 		break;
 
 		default:
-			return 2;		/* wrong archive type */
+			return ArcError(Ctx, CBM_ERR_UNSUPPORTED, "Wrong archive type");
+	}
+
+	/* An archive too short to be confirmed, such as one entry followed by
+	   padding, can still be read after a dearcer of known length */
+	CurrentPos = 0L;
+	if (DearcerLen) {
+		CurrentPos = FindFirstEntry(InFile, DearcerLen, MagicARCEntry, 0, FollowARC);
+		if (CurrentPos < 0)
+			CurrentPos = KnownPos;
+		Totals->DearcerBlocks = (int) ((CurrentPos-1) / 254 + 1);
 	}
-/*printf("DirArc CurrentPos: %ld\n", CurrentPos);*/
+
+	S->CurrentPos = CurrentPos;
+	return 0;
+}
 
 /******************************************************************************
-* Read the archive directory contents
+* Read the next directory entry
 ******************************************************************************/
-	if (fseek(InFile, CurrentPos, SEEK_SET) != 0) {
-		perror(ProgName);
-		return 2;
+static int NextARC(struct CbmDir *Dir)
+{
+	struct ARCState *S = (struct ARCState *) Dir->State;
+	struct SrcStream *InFile = Dir->InFile;
+	struct ArcTotals *Totals = &Dir->Totals;
+	char EntryName[17];
+	long FileLen;
+	struct ArchiveEntryHeader FileHeader;
+/*	struct ArchiveHeaderNew FileHeaderNew;*/
+
+	if (SrcSeek(InFile, S->CurrentPos) != 0) {
+		return SysError(Dir->Ctx);
+	}
+	if (SrcRead(&FileHeader, sizeof(FileHeader), 1, InFile) != 1)
+		return 0;
+	if (FileHeader.Magic != MagicARCEntry)
+		return 0;
+	if (FileHeader.BlockLength == 0) {
+		/* The next entry would be this one again */
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 	}
-	DisplayStart(ArcType, NULL);
+	if ((FileHeader.FileNameLen >= sizeof(EntryName)) ||
+		(SrcRead(&EntryName, FileHeader.FileNameLen, 1, InFile) != 1))
+		return 0;
+	EntryName[FileHeader.FileNameLen] = 0;
+
+	FileLen = (long) (FileHeader.LengthH << 16L) | CF_LE_W(FileHeader.LengthL);
+	S->EntryPos = S->CurrentPos;
+	S->CurrentPos += FileHeader.BlockLength * 254;
+	if (!Wanted(Dir, EntryName, FileTypes(FileHeader.FileType),
+				(unsigned long) ((FileLen-1) / 254 + 1)))
+		return NEXT_SKIPPED;
+	++Totals->ArchiveEntries;
+	Totals->TotalLength += FileLen;
+	Totals->TotalBlocks += (int) ((FileLen-1) / 254 + 1);
+	Totals->TotalBlocksNow += FileHeader.BlockLength;
+
+	return SetEntry(Dir,
+		EntryName,
+		FileTypes(FileHeader.FileType),
+		(unsigned long) FileLen,
+		(unsigned) ((FileLen-1) / 254 + 1),
+		ARCEntryType(FileHeader.EntryType),
+		(int) (100 - (FileHeader.BlockLength * 100L / (FileLen / 254 + 1))),
+		(unsigned) FileHeader.BlockLength,
+		(long) CF_LE_W(FileHeader.Checksum)
+	);
+}
 
-	while (1) {
-		char EntryName[17];
-		long FileLen;
-		struct ArchiveEntryHeader FileHeader;
-/*		struct ArchiveHeaderNew FileHeaderNew;*/
+/******************************************************************************
+* Expand the current entry
+* Every method but storing first packs each run of a byte as the control byte
+* from the entry header, a count (0 for 256) and the byte; the control byte
+* itself is packed as a run of 1. Squeezing then Huffman codes the packed
+* bytes, and crunching LZW codes them. The expanded bytes are summed as they're
+* produced and checked against the entry's checksum at the end.
+******************************************************************************/
+enum ARCMethods {ARC_STORED, ARC_PACKED, ARC_SQUEEZED, ARC_CRUNCHED};
+
+#define SQ_MAX_NODES 256		/* Huffman tree nodes, enough for 257 codes */
+#define SQ_EOF 256				/* Huffman code ending the data */
+#define LZW_CLEAR 256			/* LZW code emptying the table */
+#define LZW_END 257				/* LZW code ending the data */
+#define LZW_FIRST 258			/* first code added to the table */
+#define LZW_MAX_BITS 12
+#define LZW_CODES (1 << LZW_MAX_BITS)
+#define LZW_NONE LZW_CODES		/* no previous code since the table was emptied */
+
+struct ARCDecoder {
+	int Method;					/* ARCMethods */
+	BYTE Control;				/* packing control byte */
+	WORD Checksum;				/* sum of the bytes from the entry header */
+	WORD Sum;					/* sum of the bytes produced so far */
+	unsigned long Left;			/* bytes still to be produced */
+	BYTE RunByte;				/* byte being repeated, */
+	unsigned RunLeft;			/* and the number of times still to go */
+	unsigned long BitBuf;		/* bits read but not yet used, lowest first */
+	unsigned Bits;
+	short Tree[SQ_MAX_NODES][2];	/* squeezing: child of each node for 0 and 1,
+									   or -1 - the code for a leaf */
+	unsigned Nodes;
+	WORD Prefix[LZW_CODES];		/* crunching: code for all but the last byte, */
+	BYTE Suffix[LZW_CODES];		/* and the last byte, for each code */
+	BYTE Stack[LZW_CODES];		/* bytes of a code still to be returned */
+	unsigned StackLen;
+	unsigned NextCode;			/* next code to add to the table */
+	unsigned Width;				/* bits in each code */
+	unsigned OldCode;			/* previous code, or LZW_NONE */
+	BYTE FirstByte;				/* first byte of the previous code */
+};
 
-		if (fread(&FileHeader, sizeof(FileHeader), 1, InFile) != 1)
-			break;
-		if (FileHeader.Magic != MagicARCEntry)
-			break;
-		if (fread(&EntryName, FileHeader.FileNameLen, 1, InFile) != 1)
+static int CorruptData(struct CbmDir *Dir)
+{
+	return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Compressed data is corrupt");
+}
+
+/******************************************************************************
+* Get the next Width bits of squeezed or crunched data
+* Returns them or -1 on error
+******************************************************************************/
+static long GetARCBits(struct CbmDir *Dir, struct ARCDecoder *D, unsigned Width)
+{
+	long Value;
+	int Ch;
+
+	while (D->Bits < Width) {
+		if ((Ch = RunGetc(Dir)) == EOF)
+			return CorruptData(Dir);
+		D->BitBuf |= (unsigned long) Ch << D->Bits;
+		D->Bits += 8;
+	}
+	Value = (long) (D->BitBuf & ((1UL << Width) - 1));
+	D->BitBuf >>= Width;
+	D->Bits -= Width;
+	return Value;
+}
+
+/******************************************************************************
+* Get the next squeezed byte by following the Huffman tree to a leaf
+* Returns it or -1 on error
+******************************************************************************/
+static int UnsqueezeByte(struct CbmDir *Dir, struct ARCDecoder *D)
+{
+	int Node = 0;
+	long Bit;
+
+	if (!D->Nodes)
+		return CorruptData(Dir);	/* there's nothing but the end */
+	while (Node >= 0) {
+		if ((unsigned) Node >= D->Nodes)
+			return CorruptData(Dir);
+		if ((Bit = GetARCBits(Dir, D, 1)) < 0)
+			return -1;
+		Node = D->Tree[Node][Bit];
+	}
+	Node = -1 - Node;
+	return Node == SQ_EOF ? CorruptData(Dir) : Node;
+}
+
+/******************************************************************************
+* Get the next crunched byte, reading another code when the last is used up
+* Returns it or -1 on error
+******************************************************************************/
+static int UncrunchByte(struct CbmDir *Dir, struct ARCDecoder *D)
+{
+	long Code;
+	unsigned InCode;
+
+	if (D->StackLen)
+		return D->Stack[--D->StackLen];
+
+	for (;;) {
+		if ((Code = GetARCBits(Dir, D, D->Width)) < 0)
+			return -1;
+		if (Code != LZW_CLEAR)
 			break;
-		EntryName[FileHeader.FileNameLen] = 0;
-
-		FileLen = (long) (FileHeader.LengthH << 16L) | CF_LE_W(FileHeader.LengthL);
-		DisplayEntry(
-			ConvertCBMName(EntryName),
-			FileTypes(FileHeader.FileType),
-			(long) FileLen,
-			(unsigned) ((FileLen-1) / 254 + 1),
-			ARCEntryTypes[FileHeader.EntryType],
-			(int) (100 - (FileHeader.BlockLength * 100L / (FileLen / 254 + 1))),
-			(unsigned) FileHeader.BlockLength,
-			(long) CF_LE_W(FileHeader.Checksum)
-		);
-
-		CurrentPos += FileHeader.BlockLength * 254;
-		if (fseek(InFile, CurrentPos, SEEK_SET) != 0) {
-			perror(ProgName);
-			return 2;
-		}
-		++Totals->ArchiveEntries;
-		Totals->TotalLength += FileLen;
-		Totals->TotalBlocks += (int) ((FileLen-1) / 254 + 1);
-		Totals->TotalBlocksNow += FileHeader.BlockLength;
-	};
+		D->NextCode = LZW_FIRST;
+		D->Width = 9;
+		D->OldCode = LZW_NONE;
+	}
+	if (Code == LZW_END)
+		return CorruptData(Dir);	/* it ended early */
+	if (D->OldCode == LZW_NONE) {
+		if (Code > 0xff)
+			return CorruptData(Dir);
+		D->OldCode = (unsigned) Code;
+		D->FirstByte = (BYTE) Code;
+		return (int) Code;
+	}
+
+	/* A code may be the one about to be added, which starts and ends with the
+	   first byte of the previous one */
+	InCode = (unsigned) Code;
+	if (InCode > D->NextCode)
+		return CorruptData(Dir);
+	if (InCode == D->NextCode) {
+		if (InCode >= LZW_CODES)
+			return CorruptData(Dir);
+		D->Stack[D->StackLen++] = D->FirstByte;
+		InCode = D->OldCode;
+	}
+	/* Bytes come out last first, so they're stacked to return in order */
+	while (InCode > 0xff) {
+		if (D->StackLen >= LZW_CODES - 1)
+			return CorruptData(Dir);
+		D->Stack[D->StackLen++] = D->Suffix[InCode];
+		InCode = D->Prefix[InCode];
+	}
+	D->FirstByte = (BYTE) InCode;
+
+	if (D->NextCode < LZW_CODES) {
+		D->Prefix[D->NextCode] = (WORD) D->OldCode;
+		D->Suffix[D->NextCode] = D->FirstByte;
+		if ((++D->NextCode == (1U << D->Width)) && (D->Width < LZW_MAX_BITS))
+			++D->Width;
+	}
+	D->OldCode = (unsigned) Code;
+	return D->FirstByte;
+}
+
+/******************************************************************************
+* Get the next packed byte
+* Returns it or -1 on error
+******************************************************************************/
+static int PackedByte(struct CbmDir *Dir, struct ARCDecoder *D)
+{
+	int Ch;
+
+	switch (D->Method) {
+		case ARC_SQUEEZED:
+			return UnsqueezeByte(Dir, D);
+
+		case ARC_CRUNCHED:
+			return UncrunchByte(Dir, D);
+
+		default:
+			if ((Ch = RunGetc(Dir)) == EOF)
+				return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Entry is truncated");
+			return Ch;
+	}
+}
+
+/******************************************************************************
+* Add the ARC checksum of Len bytes, which is their sum, to Sum
+* Only the low 16 bits are kept, so the bytes are summed into a wider total
+* eight at a time without it ever having to be reduced.
+******************************************************************************/
+unsigned CbmArcSum(unsigned Sum, const void *Buf, size_t Len)
+{
+	const unsigned char *P = (const unsigned char *) Buf;
+	unsigned long Total = Sum;
+
+	for (; Len >= 8; Len -= 8, P += 8)
+		Total += (unsigned long) P[0] + P[1] + P[2] + P[3] +
+			P[4] + P[5] + P[6] + P[7];
+	while (Len--)
+		Total += *P++;
+	return (unsigned) (Total & 0xffff);
+}
+
+/******************************************************************************
+* Expand up to Len bytes of the current entry, the Decode function for ARC
+* Returns the number of bytes, 0 at the end or -1 on error
+******************************************************************************/
+static long DecodeARC(struct CbmDir *Dir, unsigned char *Out, size_t Len)
+{
+	struct ARCDecoder *D = (struct ARCDecoder *) Dir->Decoder;
+	size_t Done = 0;
+	int Ch, Count;
+
+	while ((Done < Len) && D->Left) {
+		if (D->RunLeft) {
+			/* Copy as much of the run as there's room for */
+			size_t Chunk = Len - Done;
+			if (Chunk > D->RunLeft)
+				Chunk = D->RunLeft;
+			if (Chunk > D->Left)
+				Chunk = (size_t) D->Left;
+			memset(Out + Done, D->RunByte, Chunk);
+			D->RunLeft -= (unsigned) Chunk;
+			D->Left -= Chunk;
+			Done += Chunk;
+			continue;
+		}
+
+		if ((Ch = PackedByte(Dir, D)) < 0)
+			return -1;
+		D->RunByte = (BYTE) Ch;
+		D->RunLeft = 1;
+		if ((D->Method != ARC_STORED) && ((BYTE) Ch == D->Control)) {
+			if (((Count = PackedByte(Dir, D)) < 0) ||
+				((Ch = PackedByte(Dir, D)) < 0))
+				return -1;
+			D->RunByte = (BYTE) Ch;
+			D->RunLeft = Count ? (unsigned) Count : 256;
+		}
+	}
+	D->Sum = (WORD) CbmArcSum(D->Sum, Out, Done);
+
+	/* Any mismatch is reported once everything has been returned */
+	if (!Done && (D->Sum != D->Checksum)) {
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Checksum error");
+	}
+	return (long) Done;
+}
+
+/******************************************************************************
+* Set up to expand the current entry, reading the Huffman tree of a squeezed
+* one
+******************************************************************************/
+static int DataARC(struct CbmDir *Dir)
+{
+	struct ARCState *S = (struct ARCState *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct SrcStream *InFile = Dir->InFile;
+	struct ArchiveEntryHeader FileHeader;
+	struct ARCDecoder *D;
+	BYTE Extra[3];				/* packing control byte and date */
+	BYTE Node[4];
+	unsigned long HeaderLen, Len;
+	unsigned i;
+
+	if ((SrcSeek(InFile, S->EntryPos) != 0) ||
+		(SrcRead(&FileHeader, sizeof(FileHeader), 1, InFile) != 1) ||
+		(SrcSeek(InFile, SrcTell(InFile) + FileHeader.FileNameLen) != 0) ||
+		(SrcRead(Extra, sizeof(Extra), 1, InFile) != 1)) {
+		return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+	}
+	if (FileHeader.EntryType > MaxARCEntry) {
+		return ArcError(Ctx, CBM_ERR_ARCHIVE, "Unknown compression type %u",
+				(unsigned) FileHeader.EntryType);
+	}
+	if (FileHeader.EntryType > ARC_CRUNCHED) {
+		return ArcError(Ctx, CBM_ERR_UNSUPPORTED, "Can't read %s entries",
+				ARCEntryTypes[FileHeader.EntryType]);
+	}
+	if ((D = (struct ARCDecoder *) GetDecoder(Dir, sizeof(*D))) == NULL)
+		return -1;
+
+	D->Method = FileHeader.EntryType;
+	D->Control = Extra[0];
+	D->Checksum = CF_LE_W(FileHeader.Checksum);
+	D->Sum = 0;
+	D->Left = ((unsigned long) FileHeader.LengthH << 16) | CF_LE_W(FileHeader.LengthL);
+	D->RunLeft = 0;
+	D->BitBuf = 0;
+	D->Bits = 0;
+	D->Nodes = 0;
+	D->StackLen = 0;
+	D->NextCode = LZW_FIRST;
+	D->Width = 9;
+	D->OldCode = LZW_NONE;
+
+	/* The entry takes up whole blocks, the last of which may not be full */
+	HeaderLen = sizeof(FileHeader) + FileHeader.FileNameLen + sizeof(Extra);
+	Len = FileHeader.BlockLength * 254UL;
+	SetDataRun(Dir, (unsigned long) S->EntryPos + HeaderLen,
+			Len > HeaderLen ? Len - HeaderLen : 0);
+	Dir->Data.Decode = DecodeARC;
+	Dir->Data.Stored = D->Method == ARC_STORED;
+	Dir->Data.StoredLen = D->Left;
+
+	if (D->Method == ARC_SQUEEZED) {
+		/* The tree is a count of nodes, then the two children of each */
+		if (SrcRead(Node, 2, 1, InFile) != 1)
+			return CorruptData(Dir);
+		D->Nodes = Node[0] | (Node[1] << 8);
+		if (D->Nodes > SQ_MAX_NODES)
+			return CorruptData(Dir);
+		for (i = 0; i < D->Nodes; ++i) {
+			if (SrcRead(Node, sizeof(Node), 1, InFile) != 1)
+				return CorruptData(Dir);
+			D->Tree[i][0] = (short) (WORD) (Node[0] | (Node[1] << 8));
+			D->Tree[i][1] = (short) (WORD) (Node[2] | (Node[3] << 8));
+		}
+		Len = 2 + D->Nodes * 4UL;
+		Dir->Data.Pos += Len;
+		Dir->Data.Left = Dir->Data.Left > Len ? Dir->Data.Left - Len : 0;
+	}
 	return 0;
 }
 
@@ -580,77 +1645,85 @@ struct LynxNew {
 /******************************************************************************
 * Is archive Lynx format?
 ******************************************************************************/
-static bool IsLynx(FILE *InFile, const char *FileName)
+static bool IsLynx(struct SrcStream *InFile, const char *FileName)
 {
 	struct Lynx Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic, MagicHeaderLynx, sizeof(MagicHeaderLynx)) == 0));
 }
 
-static bool IsLynxNew(FILE *InFile, const char *FileName)
+static bool IsLynxNew(struct SrcStream *InFile, const char *FileName)
 {
 	struct LynxNew Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic, MagicHeaderLynxNew, sizeof(MagicHeaderLynxNew)) == 0));
 }
 
 /******************************************************************************
-* Read directory
+* Open directory
 ******************************************************************************/
-static int DirLynx(FILE *InFile, enum ArchiveTypes LynxType,
-		struct ArcTotals *Totals, DisplayStartFunc DisplayStart,
-		DisplayEntryFunc DisplayEntry)
+struct LynxState {
+	long Pos;				/* offset of the next directory entry */
+	int NumFiles;			/* entries left to read */
+	int ExpectLastLength;	/* nonzero if the last entry has a block length */
+	long BlocksBefore;		/* blocks in the entries already read */
+	long DirBlocks;			/* blocks before the first file's data */
+	unsigned long DataPos;	/* where the current entry's data is */
+	unsigned long DataLen;
+};
+
+static int OpenLynx(struct CbmDir *Dir)
 {
-	int NumFiles;
+	struct LynxState *S = (struct LynxState *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct SrcStream *InFile = Dir->InFile;
+	struct ArcTotals *Totals = &Dir->Totals;
 	char LynxVer[10];
 	char LynxName[16];
-	int ExpectLastLength;
-
-	Totals->ArchiveEntries = 0;
-	Totals->TotalBlocks = 0;
-	Totals->TotalBlocksNow = 0;
-	Totals->TotalLength = 0;
-	Totals->DearcerBlocks = 0;
-	Totals->Version = 0;
 
 /******************************************************************************
 * Find the version number and first archive entry offset for each format
 ******************************************************************************/
-	switch (LynxType) {
+	switch (Dir->Type) {
 		case Lynx:
-			if (fseek(InFile, 0, SEEK_SET) != 0) {
-				perror(ProgName);
-				return 2;
+			if (SrcSeek(InFile, 0) != 0) {
+				return SysError(Ctx);
 			}
-			if (fscanf(InFile, " %*s LYNX %s %*[^\r]", LynxVer) != 1) {
-				fprintf(stderr,"%s: Archive format error\n", ProgName);
-				return 2;
+			/* " %*s LYNX %s %*[^\r]" */
+			if (!SrcScanNumberWord(InFile, &S->DirBlocks) ||
+				!SrcScanLiteral(InFile, "LYNX") ||
+				!SrcScanWord(InFile, LynxVer, sizeof(LynxVer)-1)) {
+				return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 			}
-			getc(InFile);				/* Get CR without killing whitespace */
+			SrcSkipSpace(InFile);
+			SrcEndLine(InFile);
 			Totals->Version = RomanToDec(LynxVer);
 			Totals->DearcerBlocks = 0;
-			ExpectLastLength = Totals->Version >= 10;
+			S->ExpectLastLength = Totals->Version >= 10;
 			break;
 
 		case LynxNew:
-/*			fseek(InFile, CF_LE_W(Header.Type.LynxNew.EndHeaderAddr) -
-						CF_LE_W(Header.Type.LynxNew.StartAddress) + 5, SEEK_SET); */
+/*			SrcSeek(InFile, CF_LE_W(Header.Type.LynxNew.EndHeaderAddr) -
+						CF_LE_W(Header.Type.LynxNew.StartAddress) + 5); */
 
-			if (fseek(InFile, 0x5F, SEEK_SET) != 0) {
-				perror(ProgName);
-				return 2;
+			if (SrcSeek(InFile, 0x5F) != 0) {
+				return SysError(Ctx);
 			}
-			if (fscanf(InFile, " %*s *%15s %s %*[^\r]", LynxName, LynxVer) != 2) {
-				fprintf(stderr,"%s: Archive format error\n", ProgName);
-				return 2;
+			/* " %*s *%15s %s %*[^\r]" */
+			if (!SrcScanNumberWord(InFile, &S->DirBlocks) ||
+				!SrcScanLiteral(InFile, "*") ||
+				!SrcScanWord(InFile, LynxName, sizeof(LynxName)-1) ||
+				!SrcScanWord(InFile, LynxVer, sizeof(LynxVer)-1)) {
+				return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 			}
-			getc(InFile);				/* Get CR without killing whitespace */
+			SrcSkipSpace(InFile);
+			SrcEndLine(InFile);
 
 			if (isupper(*LynxVer))
 				Totals->Version = RomanToDec(LynxVer);	/* Lynx */
@@ -659,40 +1732,58 @@ static int DirLynx(FILE *InFile, enum ArchiveTypes LynxType,
 
 			/* Only old versions of Lynx need this FALSE */
 			/* Ultra-Lynx looks like it always has Version > 10 */
-			ExpectLastLength = Totals->Version >= 10;
+			S->ExpectLastLength = Totals->Version >= 10;
 
 			Totals->DearcerBlocks = 0;
 			break;
 
 		default:
-			return 2;		/* wrong archive type */
+			return ArcError(Ctx, CBM_ERR_UNSUPPORTED, "Wrong archive type");
 	}
 
-	if (fscanf(InFile, "%d%*[^\r]\r", &NumFiles) != 1) {
-		fprintf(stderr,"%s: Archive format error\n", ProgName);
-		return 2;
+	if (!SrcScanInt(InFile, &S->NumFiles)) {
+		return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 	}
-	DisplayStart(LynxType, NULL);
+	SrcSkipLine(InFile);
+	S->Pos = SrcTell(InFile);
+	return 0;
+}
 
 /******************************************************************************
-* Read the archive directory contents
+* Read the next directory entry
 ******************************************************************************/
-	for (; NumFiles--;) {
-		char EntryName[17];
-		char FileType[2];
-		int FileBlocks;
-		long FileLen = 0;
-		int ReadCount = fscanf(InFile, "%16[^\r]%*[^\r]", EntryName);
-		(void) getc(InFile);	/* eat the CR here because Sun won't in scanf */
-		ReadCount += fscanf(InFile, "%d%*[^\r]", &FileBlocks);
-		(void) getc(InFile);
-		ReadCount += fscanf(InFile, "%1s%*[^\r]", FileType);
-		(void) getc(InFile);	/* eat the CR without killing whitespace so
-						   ftell() will be correct, below */
-		if (ReadCount != 3) {
-			fprintf(stderr,"%s: Archive format error\n", ProgName);
-			return 2;
-		}
+static int NextLynx(struct CbmDir *Dir)
+{
+	struct LynxState *S = (struct LynxState *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct SrcStream *InFile = Dir->InFile;
+	struct ArcTotals *Totals = &Dir->Totals;
+	char EntryName[17];
+	char FileType[2];
+	int FileBlocks = 0;
+	long FileLen = 0;
+	int ReadCount;
+	int IsWanted;
+
+	if (S->NumFiles <= 0)
+		return 0;
+	--S->NumFiles;
+	if (SrcSeek(InFile, S->Pos) != 0) {
+		return SysError(Ctx);
+	}
+
+	/* Each field is on its own line and anything after it is ignored */
+	ReadCount = SrcScanLine(InFile, EntryName, sizeof(EntryName)-1);
+	SrcEndLine(InFile);
+	ReadCount += SrcScanInt(InFile, &FileBlocks);
+	SrcEndLine(InFile);
+	ReadCount += SrcScanWord(InFile, FileType, sizeof(FileType)-1);
+	SrcEndLine(InFile);
+	if (ReadCount != 3) {
+		return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+	}
+	IsWanted = Wanted(Dir, EntryName, FileTypes(FileType[0]),
+			(unsigned long) FileBlocks);
 
 /******************************************************************************
 * Find the exact length of the file.
@@ -705,35 +1796,54 @@ static int DirLynx(FILE *InFile, enum ArchiveTypes LynxType,
 *  Lynx thinks the padding is part of the file, too.
 * Should check for an error return from filelength()
 ******************************************************************************/
-		if (NumFiles || ExpectLastLength) {
-			int LastBlockSize = 0;
-			if (fscanf(InFile, "%d%*[^\r]\r", &LastBlockSize) != 1) {
-				fprintf(stderr,"%s: Archive format error\n", ProgName);
-				return 2;
-			}
-			FileLen = (long) ((FileBlocks-1) * 254L + LastBlockSize - 1);
-		} else				/* last entry -- calculate based on file size */
-			FileLen = filelength(fileno(InFile)) - Totals->TotalBlocksNow * 254L -
-							(((ftell(InFile) - 1) / 254) + 1) * 254L;
-
-		DisplayEntry(
-			ConvertCBMName(EntryName),
-			FileTypes(FileType[0]),
-			(long) FileLen,
-			FileBlocks,
-			"Stored",
-			0,
-			FileBlocks,
-			-1L
-		);
-
-		++Totals->ArchiveEntries;
-		Totals->TotalLength += FileLen;
-		/* The following two values should equal */
-		Totals->TotalBlocks += (int) ((FileLen-1) / 254 + 1);
-		Totals->TotalBlocksNow += FileBlocks;
-	};
-	return 0;
+	if (S->NumFiles || S->ExpectLastLength) {
+		int LastBlockSize = 0;
+		if (!SrcScanInt(InFile, &LastBlockSize)) {
+			return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+		}
+		SrcSkipLine(InFile);
+		FileLen = (long) ((FileBlocks-1) * 254L + LastBlockSize - 1);
+	} else if (IsWanted && (Dir->Fields & FIELD_LENGTH))	/* last entry -- calculate based on file size */
+		FileLen = SrcSize(InFile) - S->BlocksBefore * 254L -
+						(((SrcTell(InFile) - 1) / 254) + 1) * 254L;
+	S->Pos = SrcTell(InFile);
+	/* Each file's data starts on a block boundary after the directory */
+	S->DataPos = (unsigned long) (S->DirBlocks + S->BlocksBefore) * 254L;
+	S->DataLen = (S->NumFiles || S->ExpectLastLength) ?
+		(FileLen > 0 ? (unsigned long) FileLen : 0) : DATA_TO_END;
+	S->BlocksBefore += FileBlocks;
+	if (!IsWanted)
+		return NEXT_SKIPPED;
+
+	++Totals->ArchiveEntries;
+	Totals->TotalLength += FileLen;
+	/* The following two values should equal */
+	Totals->TotalBlocks += (Dir->Fields & FIELD_LENGTH) ?
+		(int) ((FileLen-1) / 254 + 1) : FileBlocks;
+	Totals->TotalBlocksNow += FileBlocks;
+
+	return SetEntry(Dir,
+		EntryName,
+		FileTypes(FileType[0]),
+		(unsigned long) FileLen,
+		(unsigned) FileBlocks,
+		"Stored",
+		0,
+		(unsigned) FileBlocks,
+		-1L
+	);
+}
+
+/******************************************************************************
+* Find the current entry's data
+******************************************************************************/
+static int DataLynx(struct CbmDir *Dir)
+{
+	struct LynxState *S = (struct LynxState *) Dir->State;
+
+	if (S->DirBlocks <= 0)
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+	return SetDataRun(Dir, S->DataPos, S->DataLen);
 }
 
 
@@ -812,6 +1922,20 @@ static const char * const LHAEntryTypes[] = {
 /* A */ "lhA",
 /* B */ "lhB"
 };
+static const char LHAMethods[] = "0123456789AB";	/* indexes LHAEntryTypes */
+
+/******************************************************************************
+* Name an LHA compression type, from the character between "-lh" and "-"
+* Returns NULL if it isn't one in the table.
+******************************************************************************/
+static const char *LHAEntryType(BYTE EntryType)
+{
+	const char *Method;
+
+	if (!EntryType || (Method = strchr(LHAMethods, EntryType)) == NULL)
+		return NULL;
+	return LHAEntryTypes[Method - LHAMethods];
+}
 
 static const  BYTE MagicLHAEntry[3] = {'-','l','h'};
 
@@ -829,258 +1953,1229 @@ struct LHA {
 	BYTE Magic[sizeof(MagicHeaderLHA)] PACK;
 };
 
+/******************************************************************************
+* Check for an LHA entry header at Pos, for FindFirstEntry()
+* The header's method and sum are checked as well, since "-lh" is short
+* enough to turn up in the extractor.
+******************************************************************************/
+static long FollowLHA(struct SrcStream *InFile, long Pos)
+{
+	BYTE Header[2 + 255];
+	unsigned Sum = 0;
+	unsigned i;
+
+	if (AtEnd(InFile, Pos))
+		return 0;
+	if ((SrcSeek(InFile, Pos) != 0) || (SrcRead(Header, 1, 1, InFile) != 1))
+		return -1;
+	if (Header[0] == 0)
+		return 0;		/* end of archive marker */
+	if ((Header[0] < sizeof(struct LHAEntryHeader) - 2) ||
+		(SrcRead(Header + 1, (size_t) Header[0] + 1, 1, InFile) != 1) ||
+		(memcmp(((struct LHAEntryHeader *) Header)->HeadID, MagicLHAEntry,
+				sizeof(MagicLHAEntry)) != 0) ||
+		!LHAEntryType(((struct LHAEntryHeader *) Header)->EntryType) ||
+		(((struct LHAEntryHeader *) Header)->Magic != '-'))
+		return -1;
+	for (i = 0; i < Header[0]; ++i)
+		Sum += Header[2 + i];
+	if ((Sum & 0xff) != Header[1])
+		return -1;
+	return Pos + Header[0] + CF_LE_L(((struct LHAEntryHeader *) Header)->PackSize) + 2;
+}
+
 /******************************************************************************
 * Is archive LHA format?
 ******************************************************************************/
-static bool IsLHA_SFX(FILE *InFile, const char *FileName)
+static bool IsLHA_SFX(struct SrcStream *InFile, const char *FileName)
 {
 	struct LHA_SFX Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic, MagicHeaderLHASFX, sizeof(MagicHeaderLHASFX)) == 0));
 }
 
-static bool IsLHA(FILE *InFile, const char *FileName)
+static bool IsLHA(struct SrcStream *InFile, const char *FileName)
 {
 	struct LHA Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic, MagicHeaderLHA, sizeof(MagicHeaderLHA)) == 0));
 }
 
 
 /******************************************************************************
-* Read directory
+* Open directory
 ******************************************************************************/
-static int DirLHA(FILE *InFile, enum ArchiveTypes LHAType,
-		struct ArcTotals *Totals, DisplayStartFunc DisplayStart,
-		DisplayEntryFunc DisplayEntry)
-{
-	long CurrentPos;
+struct LHAState {
+	long CurrentPos;		/* offset of the next entry header */
+	long EntryPos;			/* offset of the current entry's header */
+};
 
-	Totals->ArchiveEntries = 0;
-	Totals->TotalBlocks = 0;
-	Totals->TotalBlocksNow = 0;
-	Totals->TotalLength = 0;
+static int OpenLHA(struct CbmDir *Dir)
+{
+	struct LHAState *S = (struct LHAState *) Dir->State;
+	struct ArcTotals *Totals = &Dir->Totals;
 
 /******************************************************************************
 * Find the version number and first archive entry offset for each format
 ******************************************************************************/
-	switch (LHAType) {
+	switch (Dir->Type) {
 		case LHA_SFX:
-			CurrentPos = 0xE89;		/* Must be a better way than this */
+			S->CurrentPos = FindFirstEntry(Dir->InFile, sizeof(struct LHA_SFX),
+					'-', 2, FollowLHA);	/* at HeadID */
+			if (S->CurrentPos < 0)
+				S->CurrentPos = 0xE89;	/* after the usual extractor */
 			Totals->Version = 0;
-			Totals->DearcerBlocks = (int) ((CurrentPos-1) / 254 + 1);
+			Totals->DearcerBlocks = (int) ((S->CurrentPos-1) / 254 + 1);
 			break;
 
 		case LHA:
-			CurrentPos = 0;
+			S->CurrentPos = 0;
 			Totals->Version = 0;
 			Totals->DearcerBlocks = 0;
 			break;
 
 		default:
-			return 2;		/* wrong archive type */
+			return ArcError(Dir->Ctx, CBM_ERR_UNSUPPORTED, "Wrong archive type");
 	}
+	return 0;
+}
 
 /******************************************************************************
-* Read the archive directory contents
+* Read the next directory entry
 ******************************************************************************/
-	if (fseek(InFile, CurrentPos, SEEK_SET) != 0) {
-		perror(ProgName);
-		return 2;
+static int NextLHA(struct CbmDir *Dir)
+{
+	struct LHAState *S = (struct LHAState *) Dir->State;
+	struct SrcStream *InFile = Dir->InFile;
+	struct ArcTotals *Totals = &Dir->Totals;
+	struct LHAEntryHeader FileHeader;
+	struct LHAEntryFileName EntryFileName;
+	char FileName[80];  /* must be > sizeof(EntryFileName) */
+	const char *Method;
+
+	if (SrcSeek(InFile, S->CurrentPos) != 0) {
+		return SysError(Dir->Ctx);
 	}
-	DisplayStart(LHAType, NULL);
-
-	while (1) {
-		struct LHAEntryHeader FileHeader;
-		struct LHAEntryFileName EntryFileName;
-		char FileName[80];  /* must be > sizeof(EntryFileName) */
-
-		if (fread(&FileHeader, sizeof(FileHeader), 1, InFile) != 1)
-			break;
-		if (memcmp(FileHeader.HeadID, MagicLHAEntry, sizeof(MagicLHAEntry)) != 0)
-			break;
-		/* 2-byte checksum is stored as part of the filename but not counted here */
-		if (FileHeader.FileNameLen > sizeof(EntryFileName.FileName)-2)
-			break;  /* exceeds limit; probably corrupt */
-		if (fread(&EntryFileName, FileHeader.FileNameLen+2, 1, InFile) != 1)
-			break;
-
-		memcpy(FileName, EntryFileName.FileName, FileHeader.FileNameLen);
-		FileName[min(sizeof(FileName)-1, FileHeader.FileNameLen)] = 0;
-		DisplayEntry(
-			ConvertCBMName(FileName),
-			FileTypes(EntryFileName.FileName[FileHeader.FileNameLen-2] ? ' ' : EntryFileName.FileName[FileHeader.FileNameLen-1]),
-			(long) CF_LE_L(FileHeader.OrigSize),
-			CF_LE_L(FileHeader.OrigSize) ? (unsigned) ((CF_LE_L(FileHeader.OrigSize)-1) / 254 + 1) : 0,
-			LHAEntryTypes[FileHeader.EntryType - '0'],
-			CF_LE_L(FileHeader.OrigSize) ? (int) (100 - (CF_LE_L(FileHeader.PackSize) * 100L / CF_LE_L(FileHeader.OrigSize))) : 100,
-			CF_LE_L(FileHeader.PackSize) ? (unsigned) ((CF_LE_L(FileHeader.PackSize)-1) / 254 + 1) : 0,
-			(long) (unsigned) (EntryFileName.FileName[FileHeader.FileNameLen+1] << 8) | EntryFileName.FileName[FileHeader.FileNameLen]
-		);
-
-		CurrentPos += FileHeader.HeadSize + CF_LE_L(FileHeader.PackSize) + 2;
-		fseek(InFile, CurrentPos, SEEK_SET);
-		++Totals->ArchiveEntries;
-		Totals->TotalLength += CF_LE_L(FileHeader.OrigSize);
-		Totals->TotalBlocks += (int) ((CF_LE_L(FileHeader.OrigSize)-1) / 254 + 1);
-		Totals->TotalBlocksNow += (int) ((CF_LE_L(FileHeader.PackSize)-1) / 254 + 1);
-	};
-	return 0;
+	if (SrcRead(&FileHeader, sizeof(FileHeader), 1, InFile) != 1)
+		return 0;
+	if (memcmp(FileHeader.HeadID, MagicLHAEntry, sizeof(MagicLHAEntry)) != 0)
+		return 0;
+	/* 2-byte checksum is stored as part of the filename but not counted here */
+	if (FileHeader.FileNameLen > sizeof(EntryFileName.FileName)-2)
+		return 0;  /* exceeds limit; probably corrupt */
+	if ((Method = LHAEntryType(FileHeader.EntryType)) == NULL)
+		Method = "?";
+	/* The name also holds the file type and is followed by the checksum */
+	if (Dir->Fields & (FIELD_NAME | FIELD_TYPE | FIELD_CHECKSUM)) {
+		if (SrcRead(&EntryFileName, FileHeader.FileNameLen+2, 1, InFile) != 1)
+			return 0;
+	} else
+		memset(&EntryFileName, 0, sizeof(EntryFileName));
+
+	memcpy(FileName, EntryFileName.FileName, FileHeader.FileNameLen);
+	FileName[min(sizeof(FileName)-1, FileHeader.FileNameLen)] = 0;
+
+	S->EntryPos = S->CurrentPos;
+	S->CurrentPos += FileHeader.HeadSize + CF_LE_L(FileHeader.PackSize) + 2;
+	if (!Wanted(Dir, FileName,
+				FileTypes(EntryFileName.FileName[FileHeader.FileNameLen-2] ? ' ' : EntryFileName.FileName[FileHeader.FileNameLen-1]),
+				CF_LE_L(FileHeader.OrigSize) ? (unsigned long) ((CF_LE_L(FileHeader.OrigSize)-1) / 254 + 1) : 0))
+		return NEXT_SKIPPED;
+	++Totals->ArchiveEntries;
+	Totals->TotalLength += CF_LE_L(FileHeader.OrigSize);
+	Totals->TotalBlocks += (int) ((CF_LE_L(FileHeader.OrigSize)-1) / 254 + 1);
+	Totals->TotalBlocksNow += (int) ((CF_LE_L(FileHeader.PackSize)-1) / 254 + 1);
+
+	return SetEntry(Dir,
+		FileName,
+		FileTypes(EntryFileName.FileName[FileHeader.FileNameLen-2] ? ' ' : EntryFileName.FileName[FileHeader.FileNameLen-1]),
+		(unsigned long) CF_LE_L(FileHeader.OrigSize),
+		CF_LE_L(FileHeader.OrigSize) ? (unsigned) ((CF_LE_L(FileHeader.OrigSize)-1) / 254 + 1) : 0,
+		Method,
+		CF_LE_L(FileHeader.OrigSize) ? (int) (100 - (CF_LE_L(FileHeader.PackSize) * 100L / CF_LE_L(FileHeader.OrigSize))) : 100,
+		CF_LE_L(FileHeader.PackSize) ? (unsigned) ((CF_LE_L(FileHeader.PackSize)-1) / 254 + 1) : 0,
+		(long) (unsigned) (EntryFileName.FileName[FileHeader.FileNameLen+1] << 8) | EntryFileName.FileName[FileHeader.FileNameLen]
+	);
 }
 
-
-
-/*---------------------------------------------------------------------------*/
-
-
 /******************************************************************************
-* T64 reading routines
+* LHA decoding
+* -lh1- entries are LZSS coded with a 4K window, their bytes and match lengths
+* coded by an adaptive Huffman tree and the top bits of match positions by a
+* fixed one. -lh4- and -lh5- entries have 4K and 8K windows, coded by static
+* Huffman codes sent at the start of each block. Static codes are found by
+* looking their first bits up in a table, then following a tree for the rest
+* of the longer ones. The expanded bytes are CRC-16 checked at the end.
 ******************************************************************************/
-struct T64Header {
-	BYTE Magic[32] PACK;
-	BYTE MinorVersion PACK;
-	BYTE MajorVersion PACK;
-	WORD Entries PACK;		/* Room for this many files in tape directory */
-	WORD Used PACK;			/* Number of files in archive (sometimes just 0) */
-	WORD unused PACK;
-	BYTE TapeName[24] PACK;
-};
-
-struct T64EntryHeader {
-	BYTE EntryType PACK;
-	BYTE FileType PACK;
-	WORD StartAddr PACK;
-	WORD EndAddr PACK;
-	WORD unused1 PACK;
-	LONG FileOffset PACK;
-	LONG unused2 PACK;
-	BYTE FileName[16] PACK;
+#define LH_THRESHOLD 3			/* shortest match */
+#define LH_MAX_DICBIT 13		/* bits in a position in the largest window */
+#define LH_MAX_WINDOW (1U << LH_MAX_DICBIT)
+#define LH_MAX_CODE 16			/* bits in the longest static code */
+#define LH_NC 510				/* byte codes, then match lengths 3 to 256 */
+#define LH_CBIT 9				/* bits in a count of those codes */
+#define LH_NT 19				/* codes for their lengths */
+#define LH_TBIT 5
+#define LH_PBIT 4				/* bits in a count of position codes */
+#define LH_NPT 64				/* most position or length codes of any method */
+#define LH_CTABLE_BITS 12
+#define LH_PTTABLE_BITS 8
+
+#define LH1_MATCH 60			/* longest -lh1- match */
+#define LH1_NCHAR (256 + LH1_MATCH - LH_THRESHOLD + 1)
+#define LH1_T (LH1_NCHAR * 2 - 1)	/* nodes in the adaptive tree */
+#define LH1_ROOT (LH1_T - 1)
+#define LH1_MAX_FREQ 0x8000		/* halve the counts when the root gets here */
+#define LH1_NP 64				/* codes for the top 6 bits of positions */
+
+/* Number of -lh1- position codes of each length from 3 bits */
+static const BYTE LH1PositionCodes[] = {1, 3, 8, 12, 24, 16};
+
+/* CRC-16 for polynomial 0xA001 of each byte value followed by 0 to 7 zero
+   bytes, so eight bytes can be added at a time */
+static const WORD CRC16Table[8][256] = {
+	{
+		0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+		0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+		0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+		0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+		0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+		0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+		0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+		0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+		0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+		0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+		0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+		0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+		0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+		0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+		0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+		0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+		0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+		0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+		0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+		0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+		0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+		0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+		0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+		0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+		0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+		0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+		0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+		0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+		0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+		0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+		0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+		0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+	},
+	{
+		0x0000, 0x9001, 0x6001, 0xF000, 0xC002, 0x5003, 0xA003, 0x3002,
+		0xC007, 0x5006, 0xA006, 0x3007, 0x0005, 0x9004, 0x6004, 0xF005,
+		0xC00D, 0x500C, 0xA00C, 0x300D, 0x000F, 0x900E, 0x600E, 0xF00F,
+		0x000A, 0x900B, 0x600B, 0xF00A, 0xC008, 0x5009, 0xA009, 0x3008,
+		0xC019, 0x5018, 0xA018, 0x3019, 0x001B, 0x901A, 0x601A, 0xF01B,
+		0x001E, 0x901F, 0x601F, 0xF01E, 0xC01C, 0x501D, 0xA01D, 0x301C,
+		0x0014, 0x9015, 0x6015, 0xF014, 0xC016, 0x5017, 0xA017, 0x3016,
+		0xC013, 0x5012, 0xA012, 0x3013, 0x0011, 0x9010, 0x6010, 0xF011,
+		0xC031, 0x5030, 0xA030, 0x3031, 0x0033, 0x9032, 0x6032, 0xF033,
+		0x0036, 0x9037, 0x6037, 0xF036, 0xC034, 0x5035, 0xA035, 0x3034,
+		0x003C, 0x903D, 0x603D, 0xF03C, 0xC03E, 0x503F, 0xA03F, 0x303E,
+		0xC03B, 0x503A, 0xA03A, 0x303B, 0x0039, 0x9038, 0x6038, 0xF039,
+		0x0028, 0x9029, 0x6029, 0xF028, 0xC02A, 0x502B, 0xA02B, 0x302A,
+		0xC02F, 0x502E, 0xA02E, 0x302F, 0x002D, 0x902C, 0x602C, 0xF02D,
+		0xC025, 0x5024, 0xA024, 0x3025, 0x0027, 0x9026, 0x6026, 0xF027,
+		0x0022, 0x9023, 0x6023, 0xF022, 0xC020, 0x5021, 0xA021, 0x3020,
+		0xC061, 0x5060, 0xA060, 0x3061, 0x0063, 0x9062, 0x6062, 0xF063,
+		0x0066, 0x9067, 0x6067, 0xF066, 0xC064, 0x5065, 0xA065, 0x3064,
+		0x006C, 0x906D, 0x606D, 0xF06C, 0xC06E, 0x506F, 0xA06F, 0x306E,
+		0xC06B, 0x506A, 0xA06A, 0x306B, 0x0069, 0x9068, 0x6068, 0xF069,
+		0x0078, 0x9079, 0x6079, 0xF078, 0xC07A, 0x507B, 0xA07B, 0x307A,
+		0xC07F, 0x507E, 0xA07E, 0x307F, 0x007D, 0x907C, 0x607C, 0xF07D,
+		0xC075, 0x5074, 0xA074, 0x3075, 0x0077, 0x9076, 0x6076, 0xF077,
+		0x0072, 0x9073, 0x6073, 0xF072, 0xC070, 0x5071, 0xA071, 0x3070,
+		0x0050, 0x9051, 0x6051, 0xF050, 0xC052, 0x5053, 0xA053, 0x3052,
+		0xC057, 0x5056, 0xA056, 0x3057, 0x0055, 0x9054, 0x6054, 0xF055,
+		0xC05D, 0x505C, 0xA05C, 0x305D, 0x005F, 0x905E, 0x605E, 0xF05F,
+		0x005A, 0x905B, 0x605B, 0xF05A, 0xC058, 0x5059, 0xA059, 0x3058,
+		0xC049, 0x5048, 0xA048, 0x3049, 0x004B, 0x904A, 0x604A, 0xF04B,
+		0x004E, 0x904F, 0x604F, 0xF04E, 0xC04C, 0x504D, 0xA04D, 0x304C,
+		0x0044, 0x9045, 0x6045, 0xF044, 0xC046, 0x5047, 0xA047, 0x3046,
+		0xC043, 0x5042, 0xA042, 0x3043, 0x0041, 0x9040, 0x6040, 0xF041
+	},
+	{
+		0x0000, 0xC051, 0xC0A1, 0x00F0, 0xC141, 0x0110, 0x01E0, 0xC1B1,
+		0xC281, 0x02D0, 0x0220, 0xC271, 0x03C0, 0xC391, 0xC361, 0x0330,
+		0xC501, 0x0550, 0x05A0, 0xC5F1, 0x0440, 0xC411, 0xC4E1, 0x04B0,
+		0x0780, 0xC7D1, 0xC721, 0x0770, 0xC6C1, 0x0690, 0x0660, 0xC631,
+		0xCA01, 0x0A50, 0x0AA0, 0xCAF1, 0x0B40, 0xCB11, 0xCBE1, 0x0BB0,
+		0x0880, 0xC8D1, 0xC821, 0x0870, 0xC9C1, 0x0990, 0x0960, 0xC931,
+		0x0F00, 0xCF51, 0xCFA1, 0x0FF0, 0xCE41, 0x0E10, 0x0EE0, 0xCEB1,
+		0xCD81, 0x0DD0, 0x0D20, 0xCD71, 0x0CC0, 0xCC91, 0xCC61, 0x0C30,
+		0xD401, 0x1450, 0x14A0, 0xD4F1, 0x1540, 0xD511, 0xD5E1, 0x15B0,
+		0x1680, 0xD6D1, 0xD621, 0x1670, 0xD7C1, 0x1790, 0x1760, 0xD731,
+		0x1100, 0xD151, 0xD1A1, 0x11F0, 0xD041, 0x1010, 0x10E0, 0xD0B1,
+		0xD381, 0x13D0, 0x1320, 0xD371, 0x12C0, 0xD291, 0xD261, 0x1230,
+		0x1E00, 0xDE51, 0xDEA1, 0x1EF0, 0xDF41, 0x1F10, 0x1FE0, 0xDFB1,
+		0xDC81, 0x1CD0, 0x1C20, 0xDC71, 0x1DC0, 0xDD91, 0xDD61, 0x1D30,
+		0xDB01, 0x1B50, 0x1BA0, 0xDBF1, 0x1A40, 0xDA11, 0xDAE1, 0x1AB0,
+		0x1980, 0xD9D1, 0xD921, 0x1970, 0xD8C1, 0x1890, 0x1860, 0xD831,
+		0xE801, 0x2850, 0x28A0, 0xE8F1, 0x2940, 0xE911, 0xE9E1, 0x29B0,
+		0x2A80, 0xEAD1, 0xEA21, 0x2A70, 0xEBC1, 0x2B90, 0x2B60, 0xEB31,
+		0x2D00, 0xED51, 0xEDA1, 0x2DF0, 0xEC41, 0x2C10, 0x2CE0, 0xECB1,
+		0xEF81, 0x2FD0, 0x2F20, 0xEF71, 0x2EC0, 0xEE91, 0xEE61, 0x2E30,
+		0x2200, 0xE251, 0xE2A1, 0x22F0, 0xE341, 0x2310, 0x23E0, 0xE3B1,
+		0xE081, 0x20D0, 0x2020, 0xE071, 0x21C0, 0xE191, 0xE161, 0x2130,
+		0xE701, 0x2750, 0x27A0, 0xE7F1, 0x2640, 0xE611, 0xE6E1, 0x26B0,
+		0x2580, 0xE5D1, 0xE521, 0x2570, 0xE4C1, 0x2490, 0x2460, 0xE431,
+		0x3C00, 0xFC51, 0xFCA1, 0x3CF0, 0xFD41, 0x3D10, 0x3DE0, 0xFDB1,
+		0xFE81, 0x3ED0, 0x3E20, 0xFE71, 0x3FC0, 0xFF91, 0xFF61, 0x3F30,
+		0xF901, 0x3950, 0x39A0, 0xF9F1, 0x3840, 0xF811, 0xF8E1, 0x38B0,
+		0x3B80, 0xFBD1, 0xFB21, 0x3B70, 0xFAC1, 0x3A90, 0x3A60, 0xFA31,
+		0xF601, 0x3650, 0x36A0, 0xF6F1, 0x3740, 0xF711, 0xF7E1, 0x37B0,
+		0x3480, 0xF4D1, 0xF421, 0x3470, 0xF5C1, 0x3590, 0x3560, 0xF531,
+		0x3300, 0xF351, 0xF3A1, 0x33F0, 0xF241, 0x3210, 0x32E0, 0xF2B1,
+		0xF181, 0x31D0, 0x3120, 0xF171, 0x30C0, 0xF091, 0xF061, 0x3030
+	},
+	{
+		0x0000, 0xFC01, 0xB801, 0x4400, 0x3001, 0xCC00, 0x8800, 0x7401,
+		0x6002, 0x9C03, 0xD803, 0x2402, 0x5003, 0xAC02, 0xE802, 0x1403,
+		0xC004, 0x3C05, 0x7805, 0x8404, 0xF005, 0x0C04, 0x4804, 0xB405,
+		0xA006, 0x5C07, 0x1807, 0xE406, 0x9007, 0x6C06, 0x2806, 0xD407,
+		0xC00B, 0x3C0A, 0x780A, 0x840B, 0xF00A, 0x0C0B, 0x480B, 0xB40A,
+		0xA009, 0x5C08, 0x1808, 0xE409, 0x9008, 0x6C09, 0x2809, 0xD408,
+		0x000F, 0xFC0E, 0xB80E, 0x440F, 0x300E, 0xCC0F, 0x880F, 0x740E,
+		0x600D, 0x9C0C, 0xD80C, 0x240D, 0x500C, 0xAC0D, 0xE80D, 0x140C,
+		0xC015, 0x3C14, 0x7814, 0x8415, 0xF014, 0x0C15, 0x4815, 0xB414,
+		0xA017, 0x5C16, 0x1816, 0xE417, 0x9016, 0x6C17, 0x2817, 0xD416,
+		0x0011, 0xFC10, 0xB810, 0x4411, 0x3010, 0xCC11, 0x8811, 0x7410,
+		0x6013, 0x9C12, 0xD812, 0x2413, 0x5012, 0xAC13, 0xE813, 0x1412,
+		0x001E, 0xFC1F, 0xB81F, 0x441E, 0x301F, 0xCC1E, 0x881E, 0x741F,
+		0x601C, 0x9C1D, 0xD81D, 0x241C, 0x501D, 0xAC1C, 0xE81C, 0x141D,
+		0xC01A, 0x3C1B, 0x781B, 0x841A, 0xF01B, 0x0C1A, 0x481A, 0xB41B,
+		0xA018, 0x5C19, 0x1819, 0xE418, 0x9019, 0x6C18, 0x2818, 0xD419,
+		0xC029, 0x3C28, 0x7828, 0x8429, 0xF028, 0x0C29, 0x4829, 0xB428,
+		0xA02B, 0x5C2A, 0x182A, 0xE42B, 0x902A, 0x6C2B, 0x282B, 0xD42A,
+		0x002D, 0xFC2C, 0xB82C, 0x442D, 0x302C, 0xCC2D, 0x882D, 0x742C,
+		0x602F, 0x9C2E, 0xD82E, 0x242F, 0x502E, 0xAC2F, 0xE82F, 0x142E,
+		0x0022, 0xFC23, 0xB823, 0x4422, 0x3023, 0xCC22, 0x8822, 0x7423,
+		0x6020, 0x9C21, 0xD821, 0x2420, 0x5021, 0xAC20, 0xE820, 0x1421,
+		0xC026, 0x3C27, 0x7827, 0x8426, 0xF027, 0x0C26, 0x4826, 0xB427,
+		0xA024, 0x5C25, 0x1825, 0xE424, 0x9025, 0x6C24, 0x2824, 0xD425,
+		0x003C, 0xFC3D, 0xB83D, 0x443C, 0x303D, 0xCC3C, 0x883C, 0x743D,
+		0x603E, 0x9C3F, 0xD83F, 0x243E, 0x503F, 0xAC3E, 0xE83E, 0x143F,
+		0xC038, 0x3C39, 0x7839, 0x8438, 0xF039, 0x0C38, 0x4838, 0xB439,
+		0xA03A, 0x5C3B, 0x183B, 0xE43A, 0x903B, 0x6C3A, 0x283A, 0xD43B,
+		0xC037, 0x3C36, 0x7836, 0x8437, 0xF036, 0x0C37, 0x4837, 0xB436,
+		0xA035, 0x5C34, 0x1834, 0xE435, 0x9034, 0x6C35, 0x2835, 0xD434,
+		0x0033, 0xFC32, 0xB832, 0x4433, 0x3032, 0xCC33, 0x8833, 0x7432,
+		0x6031, 0x9C30, 0xD830, 0x2431, 0x5030, 0xAC31, 0xE831, 0x1430
+	},
+	{
+		0x0000, 0xC03D, 0xC079, 0x0044, 0xC0F1, 0x00CC, 0x0088, 0xC0B5,
+		0xC1E1, 0x01DC, 0x0198, 0xC1A5, 0x0110, 0xC12D, 0xC169, 0x0154,
+		0xC3C1, 0x03FC, 0x03B8, 0xC385, 0x0330, 0xC30D, 0xC349, 0x0374,
+		0x0220, 0xC21D, 0xC259, 0x0264, 0xC2D1, 0x02EC, 0x02A8, 0xC295,
+		0xC781, 0x07BC, 0x07F8, 0xC7C5, 0x0770, 0xC74D, 0xC709, 0x0734,
+		0x0660, 0xC65D, 0xC619, 0x0624, 0xC691, 0x06AC, 0x06E8, 0xC6D5,
+		0x0440, 0xC47D, 0xC439, 0x0404, 0xC4B1, 0x048C, 0x04C8, 0xC4F5,
+		0xC5A1, 0x059C, 0x05D8, 0xC5E5, 0x0550, 0xC56D, 0xC529, 0x0514,
+		0xCF01, 0x0F3C, 0x0F78, 0xCF45, 0x0FF0, 0xCFCD, 0xCF89, 0x0FB4,
+		0x0EE0, 0xCEDD, 0xCE99, 0x0EA4, 0xCE11, 0x0E2C, 0x0E68, 0xCE55,
+		0x0CC0, 0xCCFD, 0xCCB9, 0x0C84, 0xCC31, 0x0C0C, 0x0C48, 0xCC75,
+		0xCD21, 0x0D1C, 0x0D58, 0xCD65, 0x0DD0, 0xCDED, 0xCDA9, 0x0D94,
+		0x0880, 0xC8BD, 0xC8F9, 0x08C4, 0xC871, 0x084C, 0x0808, 0xC835,
+		0xC961, 0x095C, 0x0918, 0xC925, 0x0990, 0xC9AD, 0xC9E9, 0x09D4,
+		0xCB41, 0x0B7C, 0x0B38, 0xCB05, 0x0BB0, 0xCB8D, 0xCBC9, 0x0BF4,
+		0x0AA0, 0xCA9D, 0xCAD9, 0x0AE4, 0xCA51, 0x0A6C, 0x0A28, 0xCA15,
+		0xDE01, 0x1E3C, 0x1E78, 0xDE45, 0x1EF0, 0xDECD, 0xDE89, 0x1EB4,
+		0x1FE0, 0xDFDD, 0xDF99, 0x1FA4, 0xDF11, 0x1F2C, 0x1F68, 0xDF55,
+		0x1DC0, 0xDDFD, 0xDDB9, 0x1D84, 0xDD31, 0x1D0C, 0x1D48, 0xDD75,
+		0xDC21, 0x1C1C, 0x1C58, 0xDC65, 0x1CD0, 0xDCED, 0xDCA9, 0x1C94,
+		0x1980, 0xD9BD, 0xD9F9, 0x19C4, 0xD971, 0x194C, 0x1908, 0xD935,
+		0xD861, 0x185C, 0x1818, 0xD825, 0x1890, 0xD8AD, 0xD8E9, 0x18D4,
+		0xDA41, 0x1A7C, 0x1A38, 0xDA05, 0x1AB0, 0xDA8D, 0xDAC9, 0x1AF4,
+		0x1BA0, 0xDB9D, 0xDBD9, 0x1BE4, 0xDB51, 0x1B6C, 0x1B28, 0xDB15,
+		0x1100, 0xD13D, 0xD179, 0x1144, 0xD1F1, 0x11CC, 0x1188, 0xD1B5,
+		0xD0E1, 0x10DC, 0x1098, 0xD0A5, 0x1010, 0xD02D, 0xD069, 0x1054,
+		0xD2C1, 0x12FC, 0x12B8, 0xD285, 0x1230, 0xD20D, 0xD249, 0x1274,
+		0x1320, 0xD31D, 0xD359, 0x1364, 0xD3D1, 0x13EC, 0x13A8, 0xD395,
+		0xD681, 0x16BC, 0x16F8, 0xD6C5, 0x1670, 0xD64D, 0xD609, 0x1634,
+		0x1760, 0xD75D, 0xD719, 0x1724, 0xD791, 0x17AC, 0x17E8, 0xD7D5,
+		0x1540, 0xD57D, 0xD539, 0x1504, 0xD5B1, 0x158C, 0x15C8, 0xD5F5,
+		0xD4A1, 0x149C, 0x14D8, 0xD4E5, 0x1450, 0xD46D, 0xD429, 0x1414
+	},
+	{
+		0x0000, 0xD101, 0xE201, 0x3300, 0x8401, 0x5500, 0x6600, 0xB701,
+		0x4801, 0x9900, 0xAA00, 0x7B01, 0xCC00, 0x1D01, 0x2E01, 0xFF00,
+		0x9002, 0x4103, 0x7203, 0xA302, 0x1403, 0xC502, 0xF602, 0x2703,
+		0xD803, 0x0902, 0x3A02, 0xEB03, 0x5C02, 0x8D03, 0xBE03, 0x6F02,
+		0x6007, 0xB106, 0x8206, 0x5307, 0xE406, 0x3507, 0x0607, 0xD706,
+		0x2806, 0xF907, 0xCA07, 0x1B06, 0xAC07, 0x7D06, 0x4E06, 0x9F07,
+		0xF005, 0x2104, 0x1204, 0xC305, 0x7404, 0xA505, 0x9605, 0x4704,
+		0xB804, 0x6905, 0x5A05, 0x8B04, 0x3C05, 0xED04, 0xDE04, 0x0F05,
+		0xC00E, 0x110F, 0x220F, 0xF30E, 0x440F, 0x950E, 0xA60E, 0x770F,
+		0x880F, 0x590E, 0x6A0E, 0xBB0F, 0x0C0E, 0xDD0F, 0xEE0F, 0x3F0E,
+		0x500C, 0x810D, 0xB20D, 0x630C, 0xD40D, 0x050C, 0x360C, 0xE70D,
+		0x180D, 0xC90C, 0xFA0C, 0x2B0D, 0x9C0C, 0x4D0D, 0x7E0D, 0xAF0C,
+		0xA009, 0x7108, 0x4208, 0x9309, 0x2408, 0xF509, 0xC609, 0x1708,
+		0xE808, 0x3909, 0x0A09, 0xDB08, 0x6C09, 0xBD08, 0x8E08, 0x5F09,
+		0x300B, 0xE10A, 0xD20A, 0x030B, 0xB40A, 0x650B, 0x560B, 0x870A,
+		0x780A, 0xA90B, 0x9A0B, 0x4B0A, 0xFC0B, 0x2D0A, 0x1E0A, 0xCF0B,
+		0xC01F, 0x111E, 0x221E, 0xF31F, 0x441E, 0x951F, 0xA61F, 0x771E,
+		0x881E, 0x591F, 0x6A1F, 0xBB1E, 0x0C1F, 0xDD1E, 0xEE1E, 0x3F1F,
+		0x501D, 0x811C, 0xB21C, 0x631D, 0xD41C, 0x051D, 0x361D, 0xE71C,
+		0x181C, 0xC91D, 0xFA1D, 0x2B1C, 0x9C1D, 0x4D1C, 0x7E1C, 0xAF1D,
+		0xA018, 0x7119, 0x4219, 0x9318, 0x2419, 0xF518, 0xC618, 0x1719,
+		0xE819, 0x3918, 0x0A18, 0xDB19, 0x6C18, 0xBD19, 0x8E19, 0x5F18,
+		0x301A, 0xE11B, 0xD21B, 0x031A, 0xB41B, 0x651A, 0x561A, 0x871B,
+		0x781B, 0xA91A, 0x9A1A, 0x4B1B, 0xFC1A, 0x2D1B, 0x1E1B, 0xCF1A,
+		0x0011, 0xD110, 0xE210, 0x3311, 0x8410, 0x5511, 0x6611, 0xB710,
+		0x4810, 0x9911, 0xAA11, 0x7B10, 0xCC11, 0x1D10, 0x2E10, 0xFF11,
+		0x9013, 0x4112, 0x7212, 0xA313, 0x1412, 0xC513, 0xF613, 0x2712,
+		0xD812, 0x0913, 0x3A13, 0xEB12, 0x5C13, 0x8D12, 0xBE12, 0x6F13,
+		0x6016, 0xB117, 0x8217, 0x5316, 0xE417, 0x3516, 0x0616, 0xD717,
+		0x2817, 0xF916, 0xCA16, 0x1B17, 0xAC16, 0x7D17, 0x4E17, 0x9F16,
+		0xF014, 0x2115, 0x1215, 0xC314, 0x7415, 0xA514, 0x9614, 0x4715,
+		0xB815, 0x6914, 0x5A14, 0x8B15, 0x3C14, 0xED15, 0xDE15, 0x0F14
+	},
+	{
+		0x0000, 0xC010, 0xC023, 0x0033, 0xC045, 0x0055, 0x0066, 0xC076,
+		0xC089, 0x0099, 0x00AA, 0xC0BA, 0x00CC, 0xC0DC, 0xC0EF, 0x00FF,
+		0xC111, 0x0101, 0x0132, 0xC122, 0x0154, 0xC144, 0xC177, 0x0167,
+		0x0198, 0xC188, 0xC1BB, 0x01AB, 0xC1DD, 0x01CD, 0x01FE, 0xC1EE,
+		0xC221, 0x0231, 0x0202, 0xC212, 0x0264, 0xC274, 0xC247, 0x0257,
+		0x02A8, 0xC2B8, 0xC28B, 0x029B, 0xC2ED, 0x02FD, 0x02CE, 0xC2DE,
+		0x0330, 0xC320, 0xC313, 0x0303, 0xC375, 0x0365, 0x0356, 0xC346,
+		0xC3B9, 0x03A9, 0x039A, 0xC38A, 0x03FC, 0xC3EC, 0xC3DF, 0x03CF,
+		0xC441, 0x0451, 0x0462, 0xC472, 0x0404, 0xC414, 0xC427, 0x0437,
+		0x04C8, 0xC4D8, 0xC4EB, 0x04FB, 0xC48D, 0x049D, 0x04AE, 0xC4BE,
+		0x0550, 0xC540, 0xC573, 0x0563, 0xC515, 0x0505, 0x0536, 0xC526,
+		0xC5D9, 0x05C9, 0x05FA, 0xC5EA, 0x059C, 0xC58C, 0xC5BF, 0x05AF,
+		0x0660, 0xC670, 0xC643, 0x0653, 0xC625, 0x0635, 0x0606, 0xC616,
+		0xC6E9, 0x06F9, 0x06CA, 0xC6DA, 0x06AC, 0xC6BC, 0xC68F, 0x069F,
+		0xC771, 0x0761, 0x0752, 0xC742, 0x0734, 0xC724, 0xC717, 0x0707,
+		0x07F8, 0xC7E8, 0xC7DB, 0x07CB, 0xC7BD, 0x07AD, 0x079E, 0xC78E,
+		0xC881, 0x0891, 0x08A2, 0xC8B2, 0x08C4, 0xC8D4, 0xC8E7, 0x08F7,
+		0x0808, 0xC818, 0xC82B, 0x083B, 0xC84D, 0x085D, 0x086E, 0xC87E,
+		0x0990, 0xC980, 0xC9B3, 0x09A3, 0xC9D5, 0x09C5, 0x09F6, 0xC9E6,
+		0xC919, 0x0909, 0x093A, 0xC92A, 0x095C, 0xC94C, 0xC97F, 0x096F,
+		0x0AA0, 0xCAB0, 0xCA83, 0x0A93, 0xCAE5, 0x0AF5, 0x0AC6, 0xCAD6,
+		0xCA29, 0x0A39, 0x0A0A, 0xCA1A, 0x0A6C, 0xCA7C, 0xCA4F, 0x0A5F,
+		0xCBB1, 0x0BA1, 0x0B92, 0xCB82, 0x0BF4, 0xCBE4, 0xCBD7, 0x0BC7,
+		0x0B38, 0xCB28, 0xCB1B, 0x0B0B, 0xCB7D, 0x0B6D, 0x0B5E, 0xCB4E,
+		0x0CC0, 0xCCD0, 0xCCE3, 0x0CF3, 0xCC85, 0x0C95, 0x0CA6, 0xCCB6,
+		0xCC49, 0x0C59, 0x0C6A, 0xCC7A, 0x0C0C, 0xCC1C, 0xCC2F, 0x0C3F,
+		0xCDD1, 0x0DC1, 0x0DF2, 0xCDE2, 0x0D94, 0xCD84, 0xCDB7, 0x0DA7,
+		0x0D58, 0xCD48, 0xCD7B, 0x0D6B, 0xCD1D, 0x0D0D, 0x0D3E, 0xCD2E,
+		0xCEE1, 0x0EF1, 0x0EC2, 0xCED2, 0x0EA4, 0xCEB4, 0xCE87, 0x0E97,
+		0x0E68, 0xCE78, 0xCE4B, 0x0E5B, 0xCE2D, 0x0E3D, 0x0E0E, 0xCE1E,
+		0x0FF0, 0xCFE0, 0xCFD3, 0x0FC3, 0xCFB5, 0x0FA5, 0x0F96, 0xCF86,
+		0xCF79, 0x0F69, 0x0F5A, 0xCF4A, 0x0F3C, 0xCF2C, 0xCF1F, 0x0F0F
+	},
+	{
+		0x0000, 0xCCC1, 0xD981, 0x1540, 0xF301, 0x3FC0, 0x2A80, 0xE641,
+		0xA601, 0x6AC0, 0x7F80, 0xB341, 0x5500, 0x99C1, 0x8C81, 0x4040,
+		0x0C01, 0xC0C0, 0xD580, 0x1941, 0xFF00, 0x33C1, 0x2681, 0xEA40,
+		0xAA00, 0x66C1, 0x7381, 0xBF40, 0x5901, 0x95C0, 0x8080, 0x4C41,
+		0x1802, 0xD4C3, 0xC183, 0x0D42, 0xEB03, 0x27C2, 0x3282, 0xFE43,
+		0xBE03, 0x72C2, 0x6782, 0xAB43, 0x4D02, 0x81C3, 0x9483, 0x5842,
+		0x1403, 0xD8C2, 0xCD82, 0x0143, 0xE702, 0x2BC3, 0x3E83, 0xF242,
+		0xB202, 0x7EC3, 0x6B83, 0xA742, 0x4103, 0x8DC2, 0x9882, 0x5443,
+		0x3004, 0xFCC5, 0xE985, 0x2544, 0xC305, 0x0FC4, 0x1A84, 0xD645,
+		0x9605, 0x5AC4, 0x4F84, 0x8345, 0x6504, 0xA9C5, 0xBC85, 0x7044,
+		0x3C05, 0xF0C4, 0xE584, 0x2945, 0xCF04, 0x03C5, 0x1685, 0xDA44,
+		0x9A04, 0x56C5, 0x4385, 0x8F44, 0x6905, 0xA5C4, 0xB084, 0x7C45,
+		0x2806, 0xE4C7, 0xF187, 0x3D46, 0xDB07, 0x17C6, 0x0286, 0xCE47,
+		0x8E07, 0x42C6, 0x5786, 0x9B47, 0x7D06, 0xB1C7, 0xA487, 0x6846,
+		0x2407, 0xE8C6, 0xFD86, 0x3147, 0xD706, 0x1BC7, 0x0E87, 0xC246,
+		0x8206, 0x4EC7, 0x5B87, 0x9746, 0x7107, 0xBDC6, 0xA886, 0x6447,
+		0x6008, 0xACC9, 0xB989, 0x7548, 0x9309, 0x5FC8, 0x4A88, 0x8649,
+		0xC609, 0x0AC8, 0x1F88, 0xD349, 0x3508, 0xF9C9, 0xEC89, 0x2048,
+		0x6C09, 0xA0C8, 0xB588, 0x7949, 0x9F08, 0x53C9, 0x4689, 0x8A48,
+		0xCA08, 0x06C9, 0x1389, 0xDF48, 0x3909, 0xF5C8, 0xE088, 0x2C49,
+		0x780A, 0xB4CB, 0xA18B, 0x6D4A, 0x8B0B, 0x47CA, 0x528A, 0x9E4B,
+		0xDE0B, 0x12CA, 0x078A, 0xCB4B, 0x2D0A, 0xE1CB, 0xF48B, 0x384A,
+		0x740B, 0xB8CA, 0xAD8A, 0x614B, 0x870A, 0x4BCB, 0x5E8B, 0x924A,
+		0xD20A, 0x1ECB, 0x0B8B, 0xC74A, 0x210B, 0xEDCA, 0xF88A, 0x344B,
+		0x500C, 0x9CCD, 0x898D, 0x454C, 0xA30D, 0x6FCC, 0x7A8C, 0xB64D,
+		0xF60D, 0x3ACC, 0x2F8C, 0xE34D, 0x050C, 0xC9CD, 0xDC8D, 0x104C,
+		0x5C0D, 0x90CC, 0x858C, 0x494D, 0xAF0C, 0x63CD, 0x768D, 0xBA4C,
+		0xFA0C, 0x36CD, 0x238D, 0xEF4C, 0x090D, 0xC5CC, 0xD08C, 0x1C4D,
+		0x480E, 0x84CF, 0x918F, 0x5D4E, 0xBB0F, 0x77CE, 0x628E, 0xAE4F,
+		0xEE0F, 0x22CE, 0x378E, 0xFB4F, 0x1D0E, 0xD1CF, 0xC48F, 0x084E,
+		0x440F, 0x88CE, 0x9D8E, 0x514F, 0xB70E, 0x7BCF, 0x6E8F, 0xA24E,
+		0xE20E, 0x2ECF, 0x3B8F, 0xF74E, 0x110F, 0xDDCE, 0xC88E, 0x044F
+	}
 };
 
-/* File types in T64 tape archives */
-/* At least one archive writing program uses the 1541 file types */
-static const char * const T64FileTypes[] = {
-/* 0 */	"SEQ",
-/* 1 */ "PRG",
-/* 2 */ "?2?",
-/* 3 */ "?3?",
-/* 4 */ "?4?",
-/* 5 */ "?5?",
-/* 6 */ "?6?",
-/* 7 */ "?7?"
+struct LHADecoder {
+	int Method;					/* digit from the -lhN- entry type */
+	WORD Checksum;				/* CRC from the entry header */
+	WORD Crc;					/* CRC of the bytes produced so far */
+	unsigned long Left;			/* bytes still to be produced */
+	unsigned long BitBuf;		/* bits read but not yet used, highest first */
+	unsigned Bits;
+	unsigned Padding;			/* zero bytes added past the end of the data */
+	BYTE Window[LH_MAX_WINDOW];	/* the last bytes produced */
+	unsigned WinPos;
+	unsigned WinMask;
+	unsigned MatchPos;			/* window position of the match being copied, */
+	unsigned MatchLeft;			/* and its bytes still to go */
+	unsigned NP;				/* position codes */
+	unsigned BlockLeft;			/* codes left in the static Huffman block */
+	BYTE CLen[LH_NC];			/* bits in each byte and match length code, */
+	WORD CTable[1 << LH_CTABLE_BITS];	/* and the code for their first bits */
+	BYTE PtLen[LH_NPT];			/* the same for position and length codes */
+	WORD PtTable[1 << LH_PTTABLE_BITS];
+	WORD Tree[2 * LH_NC - 1][2];	/* child for 0 and 1 of nodes of codes
+									   longer than the tables */
+	WORD Freq[LH1_T + 1];		/* -lh1-: count for each node, */
+	WORD Son[LH1_T];			/* its first child, or LH1_T + the code of a
+								   leaf, */
+	WORD Parent[LH1_T + LH1_NCHAR];	/* and the parent of each node and leaf */
 };
 
-struct T64 {
-	BYTE Magic[20] PACK;  /* room for terminating NUL */
-};
+/******************************************************************************
+* Add the CRC-16 of Len bytes to Crc
+* Eight bytes are looked up at once in separate tables, so the lookups don't
+* wait on each other as they do a byte at a time.
+******************************************************************************/
+unsigned CbmCRC16(unsigned Crc, const void *Buf, size_t Len)
+{
+	const unsigned char *P = (const unsigned char *) Buf;
+
+	Crc &= 0xffff;
+	for (; Len >= 8; Len -= 8, P += 8)
+		Crc = (unsigned) CRC16Table[7][(P[0] ^ Crc) & 0xff] ^
+			CRC16Table[6][P[1] ^ (Crc >> 8)] ^ CRC16Table[5][P[2]] ^
+			CRC16Table[4][P[3]] ^ CRC16Table[3][P[4]] ^ CRC16Table[2][P[5]] ^
+			CRC16Table[1][P[6]] ^ CRC16Table[0][P[7]];
+	while (Len--)
+		Crc = (Crc >> 8) ^ CRC16Table[0][(Crc ^ *P++) & 0xff];
+	return Crc;
+}
 
 /******************************************************************************
-* Is archive T64 format?
+* Read enough of the data for the next Width bits
+* A code's first bits are looked at before its length is known, so a few
+* zeros are added past the end.
+* Returns 0 or -1 on error
 ******************************************************************************/
-static bool IsT64(FILE *InFile, const char *FileName)
+static int FillLHABits(struct CbmDir *Dir, struct LHADecoder *D, unsigned Width)
 {
-	struct T64 Header;
-	(void) FileName;
+	int Ch;
 
-	rewind(InFile);
+	while (D->Bits < Width) {
+		if ((Ch = RunGetc(Dir)) == EOF) {
+			if (++D->Padding > 4)
+				return CorruptData(Dir);
+			Ch = 0;
+		}
+		D->BitBuf = (D->BitBuf << 8) | (unsigned) Ch;
+		D->Bits += 8;
+	}
+	return 0;
+}
 
-	if (fread(&Header, sizeof(Header.Magic) - 1, 1, InFile) != 1)
-		return 0;
+static unsigned PeekLHABits(struct LHADecoder *D, unsigned Width)
+{
+	return (unsigned) ((D->BitBuf >> (D->Bits - Width)) & ((1UL << Width) - 1));
+}
 
-	/* Zero terminate just in case */
-	Header.Magic[sizeof(Header.Magic) - 1] = '\0';
+/******************************************************************************
+* Get the next Width bits
+* Returns them or -1 on error
+******************************************************************************/
+static long GetLHABits(struct CbmDir *Dir, struct LHADecoder *D, unsigned Width)
+{
+	unsigned Value;
 
-	/* Common headers are 'C64 tape image file' and 'C64S tape file' but
-	 * lots of variants exist. The FAQ suggests the following check:
-	 */
-	return (strstr((char *) Header.Magic, "C64") != NULL &&
-			strstr((char *) Header.Magic, "tape") != NULL);
+	if (FillLHABits(Dir, D, Width) < 0)
+		return -1;
+	Value = PeekLHABits(D, Width);
+	D->Bits -= Width;
+	return (long) Value;
 }
 
 /******************************************************************************
-* Read directory
+* Get the next static Huffman code, whose first TableBits bits index Table
+* Returns it or -1 on error
 ******************************************************************************/
-static int DirT64(FILE *InFile, enum ArchiveTypes ArchiveType,
-		struct ArcTotals *Totals, DisplayStartFunc DisplayStart,
-		DisplayEntryFunc DisplayEntry)
+static long GetLHACode(struct CbmDir *Dir, struct LHADecoder *D,
+		const WORD *Table, unsigned TableBits, const BYTE *Len, unsigned NChar)
 {
-	char TapeName[25];
-	int NumFiles;
-	struct T64Header Header;
-
-	Totals->ArchiveEntries = 0;
-	Totals->TotalBlocks = 0;
-	Totals->TotalBlocksNow = 0;
-	Totals->TotalLength = 0;
-	Totals->DearcerBlocks = 0;
-	Totals->Version = 0;
+	unsigned Peek, Code, Mask;
 
-	if (fseek(InFile, 0, SEEK_SET) != 0) {
-		perror(ProgName);
-		return 2;
-	}
-	if (fread(&Header, sizeof(Header), 1, InFile) != 1) {
-		fprintf(stderr,"%s: Archive format error\n", ProgName);
-		return 2;
+	if (FillLHABits(Dir, D, LH_MAX_CODE) < 0)
+		return -1;
+	Peek = PeekLHABits(D, LH_MAX_CODE);
+	Code = Table[Peek >> (LH_MAX_CODE - TableBits)];
+	for (Mask = 1U << (LH_MAX_CODE - TableBits - 1); Code >= NChar; Mask >>= 1) {
+		if (!Mask)
+			return CorruptData(Dir);
+		Code = D->Tree[Code][(Peek & Mask) != 0];
 	}
-	memcpy(TapeName, Header.TapeName, sizeof(TapeName)-1);
-	TapeName[sizeof(TapeName)-1] = '\0';
-	ConvertCBMName(TapeName);
-	DisplayStart(ArchiveType, TapeName);
-
-	Totals->Version = -(Header.MajorVersion * 10 + Header.MinorVersion);
-	Totals->ArchiveEntries = CF_LE_W(Header.Used);
+	D->Bits -= Len[Code];
+	return (long) Code;
+}
 
 /******************************************************************************
-* Read the archive directory contents
+* Make the lookup table for canonical Huffman codes from their lengths, adding
+* tree nodes for the bits of codes longer than TableBits
+* Returns 0 or -1 if they aren't a complete set of codes
 ******************************************************************************/
-	for (NumFiles = CF_LE_W(Header.Used); NumFiles; --NumFiles) {
-		struct T64EntryHeader FileHeader;
-		char FileName[17];
-		unsigned FileLength;
-
-		if (fread(&FileHeader, sizeof(FileHeader), 1, InFile) != 1)
-			break;
-
-		memcpy(FileName, FileHeader.FileName, 16);
-		FileName[16] = 0;
-		FileLength = CF_LE_W(FileHeader.EndAddr) - CF_LE_W(FileHeader.StartAddr) + 2;
-		DisplayEntry(
-			ConvertCBMName(FileName),
-			FileHeader.FileType & CBM_CLOSED ?
-				CBMFileTypes[FileHeader.FileType & CBM_TYPE] :
-				T64FileTypes[FileHeader.FileType],
-			(long) FileLength,
-			(unsigned) (FileLength / 254 + 1),
-			"Stored",
-			0,
-			(unsigned) (FileLength / 254 + 1),
-			(long) -1L
-		);
-
-		Totals->TotalLength += FileLength;
-		Totals->TotalBlocks += (int) (FileLength / 254 + 1);
+static int MakeLHATable(struct CbmDir *Dir, struct LHADecoder *D,
+		unsigned NChar, const BYTE *BitLen, unsigned TableBits, WORD *Table)
+{
+	unsigned long Count[LH_MAX_CODE + 1];
+	unsigned long Start[LH_MAX_CODE + 2];	/* first code of each length */
+	unsigned long Weight[LH_MAX_CODE + 1];	/* table entries or codes per code */
+	unsigned long Code, Next;
+	unsigned Jut = LH_MAX_CODE - TableBits;
+	unsigned Ch, Len, Avail, i;
+	WORD *Node;
+
+	memset(Count, 0, sizeof(Count));
+	for (Ch = 0; Ch < NChar; ++Ch) {
+		if (BitLen[Ch] > LH_MAX_CODE)
+			return CorruptData(Dir);
+		++Count[BitLen[Ch]];
+	}
+	Start[1] = 0;
+	for (i = 1; i <= LH_MAX_CODE; ++i)
+		Start[i + 1] = Start[i] + (Count[i] << (LH_MAX_CODE - i));
+	if (Start[LH_MAX_CODE + 1] != 1UL << LH_MAX_CODE)
+		return CorruptData(Dir);
+
+	for (i = 1; i <= TableBits; ++i) {
+		Start[i] >>= Jut;
+		Weight[i] = 1UL << (TableBits - i);
+	}
+	for (; i <= LH_MAX_CODE; ++i)
+		Weight[i] = 1UL << (LH_MAX_CODE - i);
+	/* The entries for longer codes are filled in as their trees are made */
+	for (Code = Start[TableBits + 1] >> Jut; Code < 1UL << TableBits; ++Code)
+		Table[Code] = 0;
+
+	Avail = NChar;
+	for (Ch = 0; Ch < NChar; ++Ch) {
+		if ((Len = BitLen[Ch]) == 0)
+			continue;
+		Next = Start[Len] + Weight[Len];
+		if (Len <= TableBits) {
+			for (Code = Start[Len]; Code < Next; ++Code)
+				Table[Code] = (WORD) Ch;
+		} else {
+			Code = Start[Len];
+			Node = &Table[Code >> Jut];
+			for (i = Len - TableBits; i; --i) {
+				if (!*Node) {
+					if (Avail >= 2 * LH_NC - 1)
+						return CorruptData(Dir);
+					D->Tree[Avail][0] = D->Tree[Avail][1] = 0;
+					*Node = (WORD) Avail++;
+				}
+				Node = &D->Tree[*Node][(Code & (1UL << (Jut - 1))) != 0];
+				Code <<= 1;
+			}
+			*Node = (WORD) Ch;
+		}
+		Start[Len] = Next;
 	}
-
-	Totals->TotalBlocksNow = Totals->TotalBlocks;
 	return 0;
 }
 
+/******************************************************************************
+* Read the lengths of the position codes or of the code length codes and make
+* their table. Lengths up to 6 are 3 bits, and longer ones 7 followed by a 1
+* for each bit more and a 0. After the Special'th one (if not 0) is a 2-bit
+* count of zeros.
+* Returns 0 or -1 on error
+******************************************************************************/
+static int ReadPtLen(struct CbmDir *Dir, struct LHADecoder *D, unsigned NN,
+		unsigned NBit, unsigned Special)
+{
+	long Num, Run;
+	unsigned Peek, Mask, Len, i;
 
-
-/*---------------------------------------------------------------------------*/
-
+	if ((Num = GetLHABits(Dir, D, NBit)) < 0)
+		return -1;
+	if (!Num) {
+		/* A single code takes no bits */
+		if ((Num = GetLHABits(Dir, D, NBit)) < 0)
+			return -1;
+		if ((unsigned long) Num >= NN)
+			return CorruptData(Dir);
+		memset(D->PtLen, 0, NN);
+		for (i = 0; i < 1U << LH_PTTABLE_BITS; ++i)
+			D->PtTable[i] = (WORD) Num;
+		return 0;
+	}
+	if ((unsigned long) Num > NN)
+		return CorruptData(Dir);
+
+	for (i = 0; i < (unsigned) Num; ) {
+		if (FillLHABits(Dir, D, LH_MAX_CODE) < 0)
+			return -1;
+		Peek = PeekLHABits(D, LH_MAX_CODE);
+		Len = Peek >> (LH_MAX_CODE - 3);
+		if (Len == 7) {
+			for (Mask = 1U << (LH_MAX_CODE - 4); Peek & Mask; Mask >>= 1)
+				++Len;
+			if (Len > LH_MAX_CODE)
+				return CorruptData(Dir);
+		}
+		D->Bits -= Len < 7 ? 3 : Len - 3;
+		D->PtLen[i++] = (BYTE) Len;
+		if (i == Special) {
+			if ((Run = GetLHABits(Dir, D, 2)) < 0)
+				return -1;
+			if (i + (unsigned) Run > NN)
+				return CorruptData(Dir);
+			while (Run--)
+				D->PtLen[i++] = 0;
+		}
+	}
+	memset(D->PtLen + i, 0, NN - i);
+	return MakeLHATable(Dir, D, NN, D->PtLen, LH_PTTABLE_BITS, D->PtTable);
+}
 
 /******************************************************************************
-* D64/X64 reading routines
+* Read the lengths of the byte and match length codes, coded with the code
+* length codes, and make their table. Codes 0 to 2 are runs of zeros.
+* Returns 0 or -1 on error
 ******************************************************************************/
-struct X64Header {
+static int ReadCLen(struct CbmDir *Dir, struct LHADecoder *D)
+{
+	long Num, Code;
+	unsigned i;
+
+	if ((Num = GetLHABits(Dir, D, LH_CBIT)) < 0)
+		return -1;
+	if (!Num) {
+		if ((Num = GetLHABits(Dir, D, LH_CBIT)) < 0)
+			return -1;
+		if (Num >= LH_NC)
+			return CorruptData(Dir);
+		memset(D->CLen, 0, LH_NC);
+		for (i = 0; i < 1U << LH_CTABLE_BITS; ++i)
+			D->CTable[i] = (WORD) Num;
+		return 0;
+	}
+	if (Num > LH_NC)
+		return CorruptData(Dir);
+
+	for (i = 0; i < (unsigned) Num; ) {
+		if ((Code = GetLHACode(Dir, D, D->PtTable, LH_PTTABLE_BITS, D->PtLen,
+						LH_NT)) < 0)
+			return -1;
+		if (Code > 2) {
+			D->CLen[i++] = (BYTE) (Code - 2);
+			continue;
+		}
+		/* Runs are 1, 3 to 18 or 20 to 531 zeros */
+		if (Code == 0)
+			Code = 1;
+		else if (Code == 1) {
+			if ((Code = GetLHABits(Dir, D, 4)) < 0)
+				return -1;
+			Code += 3;
+		} else {
+			if ((Code = GetLHABits(Dir, D, LH_CBIT)) < 0)
+				return -1;
+			Code += 20;
+		}
+		if (i + (unsigned) Code > (unsigned) Num)
+			return CorruptData(Dir);
+		memset(D->CLen + i, 0, (size_t) Code);
+		i += (unsigned) Code;
+	}
+	memset(D->CLen + i, 0, LH_NC - i);
+	return MakeLHATable(Dir, D, LH_NC, D->CLen, LH_CTABLE_BITS, D->CTable);
+}
+
+/******************************************************************************
+* Get the next -lh5- byte or match length code, reading the code tables at the
+* start of each block
+* Returns it or -1 on error
+******************************************************************************/
+static long LH5Code(struct CbmDir *Dir, struct LHADecoder *D)
+{
+	long Size;
+
+	if (!D->BlockLeft) {
+		if ((Size = GetLHABits(Dir, D, 16)) < 0)
+			return -1;
+		if (!Size)
+			return CorruptData(Dir);
+		D->BlockLeft = (unsigned) Size;
+		if ((ReadPtLen(Dir, D, LH_NT, LH_TBIT, 3) < 0) ||
+			(ReadCLen(Dir, D) < 0) ||
+			(ReadPtLen(Dir, D, D->NP, LH_PBIT, 0) < 0))
+			return -1;
+	}
+	--D->BlockLeft;
+	return GetLHACode(Dir, D, D->CTable, LH_CTABLE_BITS, D->CLen, LH_NC);
+}
+
+/******************************************************************************
+* Get the next -lh5- match position, a code for its number of bits followed by
+* all but the top one
+* Returns it or -1 on error
+******************************************************************************/
+static long LH5Position(struct CbmDir *Dir, struct LHADecoder *D)
+{
+	long Bits, Rest;
+
+	if ((Bits = GetLHACode(Dir, D, D->PtTable, LH_PTTABLE_BITS, D->PtLen,
+					D->NP)) < 0)
+		return -1;
+	if (Bits <= 1)
+		return Bits;
+	if ((Rest = GetLHABits(Dir, D, (unsigned) Bits - 1)) < 0)
+		return -1;
+	return (1L << (Bits - 1)) + Rest;
+}
+
+/******************************************************************************
+* Set up the -lh1- adaptive tree with every code equally likely, and the table
+* for the fixed position codes
+* Returns 0 or -1 on error
+******************************************************************************/
+static int StartLH1(struct CbmDir *Dir, struct LHADecoder *D)
+{
+	unsigned i, j;
+
+	for (i = 0; i < LH1_NCHAR; ++i) {
+		D->Freq[i] = 1;
+		D->Son[i] = (WORD) (i + LH1_T);
+		D->Parent[i + LH1_T] = (WORD) i;
+	}
+	for (i = 0, j = LH1_NCHAR; j <= LH1_ROOT; i += 2, ++j) {
+		D->Freq[j] = (WORD) (D->Freq[i] + D->Freq[i + 1]);
+		D->Son[j] = (WORD) i;
+		D->Parent[i] = D->Parent[i + 1] = (WORD) j;
+	}
+	D->Freq[LH1_T] = 0xffff;	/* stops the search in UpdateLH1 */
+	D->Parent[LH1_ROOT] = 0;
+
+	for (i = j = 0; j < sizeof(LH1PositionCodes); i += LH1PositionCodes[j++])
+		memset(D->PtLen + i, (int) j + 3, LH1PositionCodes[j]);
+	return MakeLHATable(Dir, D, LH1_NP, D->PtLen, LH_PTTABLE_BITS, D->PtTable);
+}
+
+/******************************************************************************
+* Halve the counts in the -lh1- tree and rebuild it
+******************************************************************************/
+static void RebuildLH1(struct LHADecoder *D)
+{
+	unsigned i, j, k, Freq;
+
+	/* Gather the leaves at the start, in order */
+	for (i = j = 0; i < LH1_T; ++i) {
+		if (D->Son[i] >= LH1_T) {
+			D->Freq[j] = (WORD) ((D->Freq[i] + 1) / 2);
+			D->Son[j] = D->Son[i];
+			++j;
+		}
+	}
+	/* Join pairs of nodes, inserting each new one where its count belongs */
+	for (i = 0, j = LH1_NCHAR; j < LH1_T; i += 2, ++j) {
+		Freq = D->Freq[i] + D->Freq[i + 1];
+		for (k = j; Freq < D->Freq[k - 1]; --k)
+			;
+		memmove(D->Freq + k + 1, D->Freq + k, (j - k) * sizeof(D->Freq[0]));
+		D->Freq[k] = (WORD) Freq;
+		memmove(D->Son + k + 1, D->Son + k, (j - k) * sizeof(D->Son[0]));
+		D->Son[k] = (WORD) i;
+	}
+	for (i = 0; i < LH1_T; ++i) {
+		if ((k = D->Son[i]) >= LH1_T)
+			D->Parent[k] = (WORD) i;
+		else
+			D->Parent[k] = D->Parent[k + 1] = (WORD) i;
+	}
+}
+
+/******************************************************************************
+* Count another use of code Ch in the -lh1- tree, moving each node whose count
+* goes up past those with lower counts
+******************************************************************************/
+static void UpdateLH1(struct LHADecoder *D, unsigned Ch)
+{
+	unsigned Node, Freq, Swap, i, j;
+
+	if (D->Freq[LH1_ROOT] == LH1_MAX_FREQ)
+		RebuildLH1(D);
+	Node = D->Parent[Ch + LH1_T];
+	do {
+		Freq = ++D->Freq[Node];
+		if (Freq > D->Freq[Swap = Node + 1]) {
+			while (Freq > D->Freq[++Swap])
+				;
+			--Swap;
+			D->Freq[Node] = D->Freq[Swap];
+			D->Freq[Swap] = (WORD) Freq;
+
+			i = D->Son[Node];
+			D->Parent[i] = (WORD) Swap;
+			if (i < LH1_T)
+				D->Parent[i + 1] = (WORD) Swap;
+			j = D->Son[Swap];
+			D->Son[Swap] = (WORD) i;
+			D->Parent[j] = (WORD) Node;
+			if (j < LH1_T)
+				D->Parent[j + 1] = (WORD) Node;
+			D->Son[Node] = (WORD) j;
+			Node = Swap;
+		}
+	} while ((Node = D->Parent[Node]) != 0);
+}
+
+/******************************************************************************
+* Get the next -lh1- byte or match length code
+* Returns it or -1 on error
+******************************************************************************/
+static long LH1Code(struct CbmDir *Dir, struct LHADecoder *D)
+{
+	unsigned Node = D->Son[LH1_ROOT];
+	long Bit;
+
+	while (Node < LH1_T) {
+		if ((Bit = GetLHABits(Dir, D, 1)) < 0)
+			return -1;
+		Node = D->Son[Node + (unsigned) Bit];
+	}
+	Node -= LH1_T;
+	UpdateLH1(D, Node);
+	return (long) Node;
+}
+
+/******************************************************************************
+* Get the next -lh1- match position, a code for its top 6 bits then the rest
+* Returns it or -1 on error
+******************************************************************************/
+static long LH1Position(struct CbmDir *Dir, struct LHADecoder *D)
+{
+	long High, Low;
+
+	if (((High = GetLHACode(Dir, D, D->PtTable, LH_PTTABLE_BITS, D->PtLen,
+						LH1_NP)) < 0) ||
+		((Low = GetLHABits(Dir, D, 6)) < 0))
+		return -1;
+	return (High << 6) | Low;
+}
+
+/******************************************************************************
+* Expand up to Len bytes of the current entry, the Decode function for LHA
+* Returns the number of bytes, 0 at the end or -1 on error
+******************************************************************************/
+static long DecodeLHA(struct CbmDir *Dir, unsigned char *Out, size_t Len)
+{
+	struct LHADecoder *D = (struct LHADecoder *) Dir->Decoder;
+	size_t Done = 0;
+	long Code, Pos;
+	int Ch;
+
+	while ((Done < Len) && D->Left) {
+		if (D->MatchLeft) {
+			/* Copy as much of the match as there's room for */
+			size_t Chunk = Len - Done;
+			if (Chunk > D->MatchLeft)
+				Chunk = D->MatchLeft;
+			if (Chunk > D->Left)
+				Chunk = (size_t) D->Left;
+			D->MatchLeft -= (unsigned) Chunk;
+			D->Left -= Chunk;
+			while (Chunk--) {
+				Out[Done++] = D->Window[D->WinPos] = D->Window[D->MatchPos];
+				D->WinPos = (D->WinPos + 1) & D->WinMask;
+				D->MatchPos = (D->MatchPos + 1) & D->WinMask;
+			}
+			continue;
+		}
+
+		if (D->Method == 0) {
+			if ((Ch = RunGetc(Dir)) == EOF)
+				return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Entry is truncated");
+			Out[Done++] = (BYTE) Ch;
+			--D->Left;
+			continue;
+		}
+
+		if ((Code = D->Method == 1 ? LH1Code(Dir, D) : LH5Code(Dir, D)) < 0)
+			return -1;
+		if (Code < 256) {
+			Out[Done++] = D->Window[D->WinPos] = (BYTE) Code;
+			D->WinPos = (D->WinPos + 1) & D->WinMask;
+			--D->Left;
+			continue;
+		}
+		if ((Pos = D->Method == 1 ? LH1Position(Dir, D) : LH5Position(Dir, D)) < 0)
+			return -1;
+		D->MatchLeft = (unsigned) (Code - 256 + LH_THRESHOLD);
+		D->MatchPos = (unsigned) (D->WinPos - Pos - 1) & D->WinMask;
+	}
+	D->Crc = (WORD) CbmCRC16(D->Crc, Out, Done);
+
+	/* Any mismatch is reported once everything has been returned */
+	if (!Done && (D->Crc != D->Checksum)) {
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Checksum error");
+	}
+	return (long) Done;
+}
+
+/******************************************************************************
+* Set up to expand the current entry, getting its CRC from after the name
+******************************************************************************/
+static int DataLHA(struct CbmDir *Dir)
+{
+	struct LHAState *S = (struct LHAState *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct SrcStream *InFile = Dir->InFile;
+	struct LHAEntryHeader FileHeader;
+	struct LHADecoder *D;
+	BYTE Crc[2];
+	int Method;
+
+	if ((SrcSeek(InFile, S->EntryPos) != 0) ||
+		(SrcRead(&FileHeader, sizeof(FileHeader), 1, InFile) != 1) ||
+		(SrcSeek(InFile, SrcTell(InFile) + FileHeader.FileNameLen) != 0) ||
+		(SrcRead(Crc, sizeof(Crc), 1, InFile) != 1)) {
+		return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+	}
+	Method = FileHeader.EntryType - '0';
+	if ((Method != 0) && (Method != 1) && (Method != 4) && (Method != 5)) {
+		return ArcError(Ctx, CBM_ERR_UNSUPPORTED, "Can't read -lh%c- entries",
+				FileHeader.EntryType);
+	}
+	if ((D = (struct LHADecoder *) GetDecoder(Dir, sizeof(*D))) == NULL)
+		return -1;
+
+	D->Method = Method;
+	D->Checksum = (WORD) (Crc[0] | (Crc[1] << 8));
+	D->Crc = 0;
+	D->Left = (unsigned long) CF_LE_L(FileHeader.OrigSize);
+	D->BitBuf = 0;
+	D->Bits = 0;
+	D->Padding = 0;
+	memset(D->Window, ' ', sizeof(D->Window));
+	D->WinPos = 0;
+	D->WinMask = (Method == 5 ? LH_MAX_WINDOW : LH_MAX_WINDOW / 2) - 1;
+	D->MatchLeft = 0;
+	D->NP = Method == 5 ? LH_MAX_DICBIT + 1 : LH_MAX_DICBIT;
+	D->BlockLeft = 0;
+
+	SetDataRun(Dir, (unsigned long) S->EntryPos + FileHeader.HeadSize + 2,
+			(unsigned long) CF_LE_L(FileHeader.PackSize));
+	Dir->Data.Decode = DecodeLHA;
+	Dir->Data.Stored = Method == 0;
+	Dir->Data.StoredLen = D->Left;
+
+	if (Method == 1)
+		return StartLH1(Dir, D);
+	return 0;
+}
+
+
+
+/*---------------------------------------------------------------------------*/
+
+
+/******************************************************************************
+* T64 reading routines
+******************************************************************************/
+struct T64Header {
+	BYTE Magic[32] PACK;
+	BYTE MinorVersion PACK;
+	BYTE MajorVersion PACK;
+	WORD Entries PACK;		/* Room for this many files in tape directory */
+	WORD Used PACK;			/* Number of files in archive (sometimes just 0) */
+	WORD unused PACK;
+	BYTE TapeName[24] PACK;
+};
+
+struct T64EntryHeader {
+	BYTE EntryType PACK;
+	BYTE FileType PACK;
+	WORD StartAddr PACK;
+	WORD EndAddr PACK;
+	WORD unused1 PACK;
+	LONG FileOffset PACK;
+	LONG unused2 PACK;
+	BYTE FileName[16] PACK;
+};
+
+/* File types in T64 tape archives */
+/* At least one archive writing program uses the 1541 file types */
+static const char * const T64FileTypes[] = {
+/* 0 */	"SEQ",
+/* 1 */ "PRG",
+/* 2 */ "?2?",
+/* 3 */ "?3?",
+/* 4 */ "?4?",
+/* 5 */ "?5?",
+/* 6 */ "?6?",
+/* 7 */ "?7?"
+};
+
+/******************************************************************************
+* Name the type of a T64 entry; the type comes from the archive, so it isn't
+* necessarily one in the table
+******************************************************************************/
+static const char *T64EntryType(BYTE FileType)
+{
+	if (FileType & CBM_CLOSED)
+		return CBMFileTypes[FileType & CBM_TYPE];
+	if (FileType < sizeof(T64FileTypes) / sizeof(T64FileTypes[0]))
+		return T64FileTypes[FileType];
+	return "???";
+}
+
+struct T64 {
+	BYTE Magic[20] PACK;  /* room for terminating NUL */
+};
+
+/******************************************************************************
+* Is archive T64 format?
+******************************************************************************/
+static bool IsT64(struct SrcStream *InFile, const char *FileName)
+{
+	struct T64 Header;
+	(void) FileName;
+
+	SrcRewind(InFile);
+
+	if (SrcRead(&Header, sizeof(Header.Magic) - 1, 1, InFile) != 1)
+		return 0;
+
+	/* Zero terminate just in case */
+	Header.Magic[sizeof(Header.Magic) - 1] = '\0';
+
+	/* Common headers are 'C64 tape image file' and 'C64S tape file' but
+	 * lots of variants exist. The FAQ suggests the following check:
+	 */
+	return (strstr((char *) Header.Magic, "C64") != NULL &&
+			strstr((char *) Header.Magic, "tape") != NULL);
+}
+
+/******************************************************************************
+* Open directory
+******************************************************************************/
+struct T64State {
+	long Pos;				/* offset of the next directory entry */
+	int NumFiles;			/* entries left to read */
+	unsigned long DataPos;	/* where the current entry's data is */
+	unsigned DataLen;
+	unsigned LoadAddr;		/* which isn't stored with the data */
+};
+
+static int OpenT64(struct CbmDir *Dir)
+{
+	struct T64State *S = (struct T64State *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct SrcStream *InFile = Dir->InFile;
+	struct ArcTotals *Totals = &Dir->Totals;
+	struct T64Header Header;
+
+	if (SrcSeek(InFile, 0) != 0) {
+		return SysError(Ctx);
+	}
+	if (SrcRead(&Header, sizeof(Header), 1, InFile) != 1) {
+		return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+	}
+	memcpy(Dir->TitleBuf, Header.TapeName, sizeof(Header.TapeName));
+	Dir->TitleBuf[sizeof(Header.TapeName)] = '\0';
+	Dir->Title = ConvertCBMName(Dir->TitleBuf);
+
+	Totals->Version = -(Header.MajorVersion * 10 + Header.MinorVersion);
+	Totals->ArchiveEntries = CF_LE_W(Header.Used);
+
+	S->NumFiles = CF_LE_W(Header.Used);
+	S->Pos = sizeof(Header);
+	return 0;
+}
+
+/******************************************************************************
+* Read the next directory entry
+******************************************************************************/
+static int NextT64(struct CbmDir *Dir)
+{
+	struct T64State *S = (struct T64State *) Dir->State;
+	struct SrcStream *InFile = Dir->InFile;
+	struct ArcTotals *Totals = &Dir->Totals;
+	struct T64EntryHeader FileHeader;
+	char FileName[17];
+	const char *Type;
+	unsigned FileLength;
+
+	if (S->NumFiles <= 0)
+		return 0;
+	--S->NumFiles;
+	if (SrcSeek(InFile, S->Pos) != 0) {
+		return SysError(Dir->Ctx);
+	}
+	if (SrcRead(&FileHeader, sizeof(FileHeader), 1, InFile) != 1)
+		return 0;
+	S->Pos += sizeof(FileHeader);
+	Type = T64EntryType(FileHeader.FileType);
+
+	memcpy(FileName, FileHeader.FileName, 16);
+	FileName[16] = 0;
+	FileLength = CF_LE_W(FileHeader.EndAddr) - CF_LE_W(FileHeader.StartAddr) + 2;
+	if (!Wanted(Dir, FileName, Type,
+				(unsigned long) (FileLength / 254 + 1))) {
+		/* The header count included this one */
+		--Totals->ArchiveEntries;
+		return NEXT_SKIPPED;
+	}
+	S->DataPos = (unsigned long) CF_LE_L(FileHeader.FileOffset);
+	S->DataLen = FileLength >= 2 ? FileLength - 2 : 0;
+	S->LoadAddr = CF_LE_W(FileHeader.StartAddr);
+
+	Totals->TotalLength += FileLength;
+	Totals->TotalBlocks += (int) (FileLength / 254 + 1);
+	Totals->TotalBlocksNow = Totals->TotalBlocks;
+
+	return SetEntry(Dir,
+		FileName,
+		Type,
+		(unsigned long) FileLength,
+		(unsigned) (FileLength / 254 + 1),
+		"Stored",
+		0,
+		(unsigned) (FileLength / 254 + 1),
+		(long) -1L
+	);
+}
+
+/******************************************************************************
+* Find the current entry's data, which follows its load address
+******************************************************************************/
+static int DataT64(struct CbmDir *Dir)
+{
+	struct T64State *S = (struct T64State *) Dir->State;
+
+	Dir->Data.Prefix[0] = (unsigned char) (S->LoadAddr & 0xff);
+	Dir->Data.Prefix[1] = (unsigned char) ((S->LoadAddr >> 8) & 0xff);
+	Dir->Data.PrefixLen = 2;
+	return SetDataRun(Dir, S->DataPos, S->DataLen);
+}
+
+
+
+/*---------------------------------------------------------------------------*/
+
+
+/******************************************************************************
+* D64/X64 reading routines
+******************************************************************************/
+struct X64Header {
 	BYTE Magic[4] PACK;
 	BYTE MajorVersion PACK;
 	BYTE MinorVersion PACK;
@@ -1291,48 +3386,65 @@ static unsigned long Location1581TS(unsigned char Track, unsigned char Sector)
 }
 #define MAX_CAPACITY_1581 3200  /* disk capacity in blocks */
 
+/******************************************************************************
+* Return disk image offset of a sector for the given type of disk, or -1 if
+* the track isn't on the disk
+******************************************************************************/
+static long LocationTS(int Type, unsigned char Track, unsigned char Sector)
+{
+	if (Track == 0)
+		return -1;
+	if (Type == 1581)
+		return Track > 80 ? -1 : (long) Location1581TS(Track, Sector);
+	else if (Type == 8250)
+		return Track > 154 ? -1 : (long) Location8250TS(Track, Sector);
+	else if (Type == 1571)
+		return Track > 70 ? -1 : (long) Location1571TS(Track, Sector);
+	else /* if (Type == 1541) */
+		return Track > 42 ? -1 : (long) Location1541TS(Track, Sector);
+}
+
+/******************************************************************************
+* Return the capacity of a type of disk in blocks
+* This is a fail-safe for the largest file that can exist on the disk. It's
+* slightly larger than the actual value, but it's only used to detect a
+* track/sector chain loop.
+******************************************************************************/
+static unsigned DiskCapacity(int Type)
+{
+	if (Type == 1581)
+		return MAX_CAPACITY_1581;
+	else if (Type == 8250)
+		return MAX_CAPACITY_8250;
+	else if (Type == 1571)
+		return MAX_CAPACITY_1571;
+	else /* if (Type == 1541) */
+		return MAX_CAPACITY_1541;
+}
+
 /******************************************************************************
 * Follow chain of file sectors in disk image, counting total bytes in the file
 ******************************************************************************/
-static unsigned long CountCBMBytes(FILE *DiskImage, int Type,
+static unsigned long CountCBMBytes(struct CbmContext *Ctx, struct SrcStream *DiskImage, int Type,
 		unsigned long Offset, unsigned char FirstTrack,
 		unsigned char FirstSector)
 {
 	struct D64DataBlock DataBlock;
-	unsigned int BlockCount = 0, MaxBlocks;
+	unsigned int BlockCount = 0, MaxBlocks = DiskCapacity(Type);
 
 	DataBlock.NextTrack = FirstTrack;		/* prime the track & sector */
 	DataBlock.NextSector = FirstSector;
-	/* Use the disk capacity as a fail-safe for the largest file that can exist
-	 * on the disk. It's slightly larger than the actual value, but it's only
-	 * used to detect a track/sector chain loop. */
-	if (Type == 1581)
-		MaxBlocks = MAX_CAPACITY_1581;
-	else if (Type == 8250)
-		MaxBlocks = MAX_CAPACITY_8250;
-	else if (Type == 1571)
-		MaxBlocks = MAX_CAPACITY_1571;
-	else /* if (Type == 1541) */
-		MaxBlocks = MAX_CAPACITY_1541;
 	do {
-		long SectorOfs;
-		if (Type == 1581)
-			SectorOfs = Location1581TS(DataBlock.NextTrack, DataBlock.NextSector);
-		else if (Type == 8250)
-			SectorOfs = Location8250TS(DataBlock.NextTrack, DataBlock.NextSector);
-		else if (Type == 1571)
-			SectorOfs = Location1571TS(DataBlock.NextTrack, DataBlock.NextSector);
-		else /* if (Type == 1541) */
-			SectorOfs = Location1541TS( DataBlock.NextTrack, DataBlock.NextSector);
-		if ((fseek(DiskImage, SectorOfs + Offset, SEEK_SET) != 0) ||
-			(fread(&DataBlock, sizeof(DataBlock), 1, DiskImage) != 1)) {
-			fprintf(stderr,"%s: Archive format error\n", ProgName);
+		long SectorOfs = LocationTS(Type, DataBlock.NextTrack, DataBlock.NextSector);
+		if ((SectorOfs < 0) || (SrcSeek(DiskImage, SectorOfs + Offset) != 0) ||
+			(SrcRead(&DataBlock, sizeof(DataBlock), 1, DiskImage) != 1)) {
+			ArcWarning(Ctx, "Archive format error");
 			return 0;  /* no better way to indicate error */
 		}
 		++BlockCount;
 		if (BlockCount > MaxBlocks) {
 			/* We found a loop in the track/sector chain */
-			fprintf(stderr,"%s: File chain loop detected\n", ProgName);
+			ArcWarning(Ctx, "File chain loop detected");
 			return 0;  /* no better way to indicate error */
 		}
 	} while (DataBlock.NextTrack > 0);
@@ -1342,32 +3454,197 @@ static unsigned long CountCBMBytes(FILE *DiskImage, int Type,
 
 
 /******************************************************************************
-* Returns nonzero if the given sector contains a valid 1541 header block
+* Return the number of sectors on a track of a type of disk
 ******************************************************************************/
-static int is_1541_header(struct Raw1541DiskHeader *header) {
-	return (header->Format == 'A') &&
-			/* Flag is for double sided, but some images have '*' there */
-			((header->Flag == 0) || (header->Flag == '*')) &&
-			(header->Filler2[3] == (BYTE) CBM_END_NAME);
+static int SectorsOnTrack(int Type, int Track)
+{
+	if (Type == 1581)
+		return 40;
+	else if (Type == 8250) {
+		if (Track > 77)
+			Track -= 77;	/* both sides have the same layout */
+		return Track <= 39 ? 29 : Track <= 53 ? 27 : Track <= 64 ? 25 : 23;
+	} else {	/* 1541 or 1571 */
+		if ((Type == 1571) && (Track > 35))
+			Track -= 35;	/* both sides have the same layout */
+		return Track <= 17 ? 21 : Track <= 24 ? 19 : Track <= 30 ? 18 : 17;
+	}
 }
 
 /******************************************************************************
-* Returns nonzero if the given sector contains a valid 1571 header block
+* Returns nonzero if a whole track is kept for the DOS, so its free blocks
+* aren't counted: the directory track, and the 1571's second BAM track
 ******************************************************************************/
-static int is_1571_header(struct Raw1541DiskHeader *header) {
-	return (header->Format == 'A') &&
-			/* Flag is marked as reserved, but some images have '*' there */
-			(header->Flag == FLAG_DOUBLE_SIDED) &&
-			(header->Filler2[3] == (BYTE) CBM_END_NAME);
+static int IsDOSTrack(int Type, int Track)
+{
+	if (Type == 1581)
+		return Track == 40;
+	else if (Type == 8250)
+		return Track == 39;
+	else
+		return (Track == 18) || ((Type == 1571) && (Track == 53));
 }
 
 /******************************************************************************
-* Returns nonzero if the given sector contains a valid 1581 header block
+* Count the free sectors in a track's BAM bitmap, one bit per sector
+* Bits past the end of the track are ignored, since some disks have junk there
 ******************************************************************************/
-static int is_1581_header(struct Raw1581DiskHeader *header) {
-	return (header->Format == 'D') &&
-				(header->Flag == 0) &&
-				(header->Filler3[0] == (BYTE) CBM_END_NAME) &&
+static unsigned CountFreeSectors(const BYTE *Bitmap, int Sectors)
+{
+	static const BYTE NibbleBits[16] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4};
+	unsigned Free = 0;
+	unsigned Bits;
+
+	for (; Sectors > 0; ++Bitmap, Sectors -= 8) {
+		Bits = *Bitmap;
+		if (Sectors < 8)
+			Bits &= (1U << Sectors) - 1;
+		Free += NibbleBits[Bits & 0x0f] + NibbleBits[Bits >> 4];
+	}
+	return Free;
+}
+
+/******************************************************************************
+* Read one sector of a disk image into Buf
+******************************************************************************/
+static int ReadSector(struct SrcStream *DiskImage, int Type, unsigned long Offset,
+		unsigned char Track, unsigned char Sector, BYTE *Buf)
+{
+	long SectorOfs = LocationTS(Type, Track, Sector);
+	if ((SectorOfs < 0) || (SrcSeek(DiskImage, SectorOfs + Offset) != 0) ||
+		(SrcRead(Buf, BYTES_PER_SECTOR, 1, DiskImage) != 1))
+		return -1;
+	return 0;
+}
+
+/* Called with the free sector bitmap of each track in a BAM */
+typedef void (*BAMTrackFunc)(void *UserData, int Track, const BYTE *Bitmap);
+
+/******************************************************************************
+* Go through the BAM of a disk image, one track at a time
+* Returns -1 if the BAM can't be read
+******************************************************************************/
+static int WalkBAM(struct SrcStream *DiskImage, int Type, unsigned long Offset,
+		BAMTrackFunc TrackFunc, void *UserData)
+{
+	BYTE BAM[BYTES_PER_SECTOR];
+	int Track, Block;
+
+	switch (Type) {
+		case 1541:
+		case 1571:
+			/* The first side's bitmaps are in the header: 4 bytes a track,
+			   the first being the free count */
+			if (ReadSector(DiskImage, Type, Offset, 18, 0, BAM) < 0)
+				return -1;
+			for (Track = 1; Track <= 35; ++Track)
+				TrackFunc(UserData, Track, &BAM[Track * 4 + 1]);
+			if (Type == 1571) {
+				/* The second side's bitmaps are at 53/0, 3 bytes a track */
+				if (ReadSector(DiskImage, Type, Offset, 53, 0, BAM) < 0)
+					return -1;
+				for (Track = 36; Track <= 70; ++Track)
+					TrackFunc(UserData, Track, &BAM[(Track - 36) * 3]);
+			}
+			break;
+
+		case 1581:
+			/* Two BAM blocks after the header, of 40 tracks each with 6 bytes
+			   a track, the first being the free count */
+			for (Block = 1; Block <= 2; ++Block) {
+				if (ReadSector(DiskImage, Type, Offset, 40, (unsigned char) Block,
+							   BAM) < 0)
+					return -1;
+				for (Track = 0; Track < 40; ++Track)
+					TrackFunc(UserData, Track + (Block - 1) * 40 + 1,
+							  &BAM[0x10 + Track * 6 + 1]);
+			}
+			break;
+
+		case 8250: {
+			/* A chain of BAM blocks on track 38 starting at 38/0, each holding
+			   the tracks from BAM[4] up to BAM[5] with 5 bytes a track, the
+			   first being the free count. The 8050 has 2 and the 8250 4. */
+			unsigned char NextSector = 0;
+			for (Block = 0; Block < 4; ++Block) {
+				if (ReadSector(DiskImage, Type, Offset, 38, NextSector, BAM) < 0)
+					return -1;
+				if ((BAM[4] < 1) || (BAM[5] <= BAM[4]) || (BAM[5] > 155) ||
+					(BAM[5] - BAM[4] > 50))
+					return -1;
+				for (Track = BAM[4]; Track < BAM[5]; ++Track)
+					TrackFunc(UserData, Track, &BAM[6 + (Track - BAM[4]) * 5 + 1]);
+				if (BAM[0] != 38)
+					break;	/* the last block links to the directory */
+				NextSector = BAM[1];
+			}
+			break;
+		}
+
+		default:
+			return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+* Count the blocks free on a disk image from the bitmaps in its BAM, the way
+* the drive does: blocks on the DOS tracks aren't counted as free.
+* Returns -1 if the BAM can't be read.
+******************************************************************************/
+struct FreeCount {
+	int Type;
+	unsigned Free;
+};
+
+static void AddFreeSectors(void *UserData, int Track, const BYTE *Bitmap)
+{
+	struct FreeCount *Count = (struct FreeCount *) UserData;
+
+	if (!IsDOSTrack(Count->Type, Track))
+		Count->Free += CountFreeSectors(Bitmap, SectorsOnTrack(Count->Type, Track));
+}
+
+static int CountBlocksFree(struct SrcStream *DiskImage, int Type,
+		unsigned long Offset)
+{
+	struct FreeCount Count;
+
+	Count.Type = Type;
+	Count.Free = 0;
+	if (WalkBAM(DiskImage, Type, Offset, AddFreeSectors, &Count) < 0)
+		return -1;
+	return (int) Count.Free;
+}
+
+
+/******************************************************************************
+* Returns nonzero if the given sector contains a valid 1541 header block
+******************************************************************************/
+static int is_1541_header(struct Raw1541DiskHeader *header) {
+	return (header->Format == 'A') &&
+			/* Flag is for double sided, but some images have '*' there */
+			((header->Flag == 0) || (header->Flag == '*')) &&
+			(header->Filler2[3] == (BYTE) CBM_END_NAME);
+}
+
+/******************************************************************************
+* Returns nonzero if the given sector contains a valid 1571 header block
+******************************************************************************/
+static int is_1571_header(struct Raw1541DiskHeader *header) {
+	return (header->Format == 'A') &&
+			/* Flag is marked as reserved, but some images have '*' there */
+			(header->Flag == FLAG_DOUBLE_SIDED) &&
+			(header->Filler2[3] == (BYTE) CBM_END_NAME);
+}
+
+/******************************************************************************
+* Returns nonzero if the given sector contains a valid 1581 header block
+******************************************************************************/
+static int is_1581_header(struct Raw1581DiskHeader *header) {
+	return (header->Format == 'D') &&
+				(header->Flag == 0) &&
+				(header->Filler3[0] == (BYTE) CBM_END_NAME) &&
 				(header->Filler3[1] == (BYTE) CBM_END_NAME);
 }
 
@@ -1401,13 +3678,13 @@ struct X64 {
 /******************************************************************************
 * Is archive disk image format?
 ******************************************************************************/
-static bool IsX64(FILE *InFile, const char *FileName)
+static bool IsX64(struct SrcStream *InFile, const char *FileName)
 {
 	struct X64 Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic, MagicHeaderX64, sizeof(MagicHeaderX64)) == 0));
 }
 
@@ -1418,17 +3695,17 @@ static bool IsX64(FILE *InFile, const char *FileName)
 * Here, we just try a bunch of likely values for the contents of track 1,
 *  sector 0, but we could go to tracks 18 and 40 (& 39 & others) instead
 ******************************************************************************/
-static bool IsD64(FILE *InFile, const char *FileName)
+static bool IsD64(struct SrcStream *InFile, const char *FileName)
 {
 	char *NameExt;
 	struct D64 Header;
 
-	rewind(InFile);
+	SrcRewind(InFile);
 	return ((FileName && (NameExt = strrchr(FileName, '.')) != 0
 			&& (!stricmp(NameExt, D64_EXTENSION) || !stricmp(NameExt, D80_EXTENSION) ||
 				!stricmp(NameExt, D71_EXTENSION) || !stricmp(NameExt, D82_EXTENSION) ||
 				!stricmp(NameExt, D81_EXTENSION)))
-		|| ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+		|| ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 			&& ((memcmp(Header.Magic, MagicHeaderD64, sizeof(MagicHeaderD64)) == 0)
 			||  (memcmp(Header.Magic, MagicHeaderImage1, sizeof(MagicHeaderImage1)) == 0)
 			||  (memcmp(Header.Magic, MagicHeaderImage2, sizeof(MagicHeaderImage2)) == 0)
@@ -1442,7 +3719,7 @@ static bool IsD64(FILE *InFile, const char *FileName)
 /******************************************************************************
 * Can't tell a raw 1581 image yet
 ******************************************************************************/
-static bool IsC1581(FILE *InFile, const char *FileName)
+static bool IsC1581(struct SrcStream *InFile, const char *FileName)
 {
 	(void) InFile;
 	(void) FileName;
@@ -1450,30 +3727,34 @@ static bool IsC1581(FILE *InFile, const char *FileName)
 }
 
 /******************************************************************************
-* Read directory
+* Open directory
 ******************************************************************************/
-static int DirD64(FILE *InFile, enum ArchiveTypes D64Type,
-		struct ArcTotals *Totals, DisplayStartFunc DisplayStart,
-		DisplayEntryFunc DisplayEntry)
+struct D64State {
+	int DiskType;			/* type of disk image--1541, 1571, 1581, 8250 */
+	unsigned long HeaderOffset;	/* size of the image header before track 1 */
+	unsigned char DirTrack;		/* first block of the directory */
+	unsigned char DirSector;
+	struct D64DirBlock DirBlock;	/* directory block being read */
+	int EntryCount;			/* next entry to look at in DirBlock */
+};
+
+static int OpenD64(struct CbmDir *Dir)
 {
+	struct D64State *S = (struct D64State *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct SrcStream *InFile = Dir->InFile;
+	struct ArcTotals *Totals = &Dir->Totals;
+	struct D64DirBlock *DirBlock = &S->DirBlock;
 	char DiskLabel[24];  /* Holds the disk label plus filler, version and format */
 	long CurrentPos;
 	unsigned long HeaderOffset;
 	int DiskType = 0;			/* type of disk image--1541, 1581, 8250; 0=unknown */
-	struct D64DirBlock DirBlock;
 	struct X64Header Header;
 
-	Totals->ArchiveEntries = 0;
-	Totals->TotalBlocks = 0;
-	Totals->TotalBlocksNow = 0;
-	Totals->TotalLength = 0;
-	Totals->DearcerBlocks = 0;
-	Totals->Version = 0;
-
 /******************************************************************************
 * Find the version number and header size for each format
 ******************************************************************************/
-	switch (D64Type) {
+	switch (Dir->Type) {
 		case D64:
 			HeaderOffset = 0;			/* No header on D64 images */
 			DiskType = 0;				/* Might be 1541 or 1581 */
@@ -1481,13 +3762,11 @@ static int DirD64(FILE *InFile, enum ArchiveTypes D64Type,
 
 		case X64:
 			HeaderOffset = 0x40;		/* X64 header takes 64 bytes */
-			if (fseek(InFile, 0, SEEK_SET) != 0) {
-				perror(ProgName);
-				return 2;
+			if (SrcSeek(InFile, 0) != 0) {
+				return SysError(Ctx);
 			}
-			if (fread(&Header, sizeof(Header), 1, InFile) != 1) {
-				fprintf(stderr,"%s: Archive format error\n", ProgName);
-				return 2;
+			if (SrcRead(&Header, sizeof(Header), 1, InFile) != 1) {
+				return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 			}
 			switch (Header.DeviceType) {
 				case DT_2031:
@@ -1512,9 +3791,9 @@ static int DirD64(FILE *InFile, enum ArchiveTypes D64Type,
 				case DT_8250:	DiskType = 8250; break;
 
 				default:
-					fprintf(stderr,"%s: Unsupported X64 disk image type (#%d)\n",
-						ProgName, Header.DeviceType);
-					return 3;
+					return ArcError(Ctx, CBM_ERR_UNSUPPORTED,
+							"Unsupported X64 disk image type (#%d)",
+							Header.DeviceType);
 			}
 
 			Totals->Version = -(Header.MajorVersion * 10 +
@@ -1524,7 +3803,7 @@ static int DirD64(FILE *InFile, enum ArchiveTypes D64Type,
 			break;
 
 		default:
-			return 2;		/* wrong archive type */
+			return ArcError(Ctx, CBM_ERR_UNSUPPORTED, "Wrong archive type");
 	}
 
 /******************************************************************************
@@ -1535,13 +3814,12 @@ static int DirD64(FILE *InFile, enum ArchiveTypes D64Type,
 	if ((DiskType == 1541) || !DiskType) {
 		struct Raw1541DiskHeader DirHeader1541;
 		CurrentPos = Location1541TS(18,0) + HeaderOffset;
-		if ((fseek(InFile, CurrentPos, SEEK_SET) != 0) ||
-			(fread(&DirHeader1541, sizeof(DirHeader1541), 1, InFile) != 1)) {
-			fprintf(stderr,"%s: Archive format error\n", ProgName);
-			return 2;
+		if ((SrcSeek(InFile, CurrentPos) != 0) ||
+			(SrcRead(&DirHeader1541, sizeof(DirHeader1541), 1, InFile) != 1)) {
+			return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 		}
-		DirBlock.NextTrack = DirHeader1541.FirstTrack;
-		DirBlock.NextSector = DirHeader1541.FirstSector;
+		DirBlock->NextTrack = DirHeader1541.FirstTrack;
+		DirBlock->NextSector = DirHeader1541.FirstSector;
 		if (!is_1541_header(&DirHeader1541)) {
 			if (DiskType == 1541)	/* only mark good or bad if we know the type */
 				DiskType = -1;		/* Bad archive */
@@ -1557,13 +3835,12 @@ static int DirD64(FILE *InFile, enum ArchiveTypes D64Type,
 	if ((DiskType == 1571) || !DiskType) {
 		struct Raw1541DiskHeader DirHeader1541;
 		CurrentPos = Location1571TS(18,0) + HeaderOffset;
-		if ((fseek(InFile, CurrentPos, SEEK_SET) != 0) ||
-			(fread(&DirHeader1541, sizeof(DirHeader1541), 1, InFile) != 1)) {
-			fprintf(stderr,"%s: Archive format error\n", ProgName);
-			return 2;
+		if ((SrcSeek(InFile, CurrentPos) != 0) ||
+			(SrcRead(&DirHeader1541, sizeof(DirHeader1541), 1, InFile) != 1)) {
+			return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 		}
-		DirBlock.NextTrack = DirHeader1541.FirstTrack;
-		DirBlock.NextSector = DirHeader1541.FirstSector;
+		DirBlock->NextTrack = DirHeader1541.FirstTrack;
+		DirBlock->NextSector = DirHeader1541.FirstSector;
 		if (!is_1571_header(&DirHeader1541)) {
 			if (DiskType == 1571)	/* only mark good or bad if we know the type */
 				DiskType = -1;		/* Bad archive */
@@ -1580,14 +3857,13 @@ static int DirD64(FILE *InFile, enum ArchiveTypes D64Type,
 	if ((DiskType == 8250) || !DiskType) {
 		struct Raw8250DiskHeader DirHeader8250;
 		CurrentPos = Location8250TS(39,0) + HeaderOffset;
-		if ((fseek(InFile, CurrentPos, SEEK_SET) != 0) ||
-			(fread(&DirHeader8250, sizeof(DirHeader8250), 1, InFile) != 1)) {
-			fprintf(stderr,"%s: Archive format error\n", ProgName);
-			return 2;
+		if ((SrcSeek(InFile, CurrentPos) != 0) ||
+			(SrcRead(&DirHeader8250, sizeof(DirHeader8250), 1, InFile) != 1)) {
+			return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 		}
 		/* DirHeader8250.FirstTrack/Sector points to the BAM, not directory */
-		DirBlock.NextTrack = 39;
-		DirBlock.NextSector = 1;
+		DirBlock->NextTrack = 39;
+		DirBlock->NextSector = 1;
 		if (!is_8250_header(&DirHeader8250)) {
 			if (DiskType == 8250)	/* only mark good or bad if we know the type */
 				DiskType = -1;		/* Bad archive */
@@ -1603,13 +3879,12 @@ static int DirD64(FILE *InFile, enum ArchiveTypes D64Type,
 	if ((DiskType == 1581) || !DiskType) {
 		struct Raw1581DiskHeader DirHeader1581;
 		CurrentPos = Location1581TS(40,0) + HeaderOffset;
-		if ((fseek(InFile, CurrentPos, SEEK_SET) != 0) ||
-			(fread(&DirHeader1581, sizeof(DirHeader1581), 1, InFile) != 1)) {
-			fprintf(stderr,"%s: Archive format error\n", ProgName);
-			return 2;
+		if ((SrcSeek(InFile, CurrentPos) != 0) ||
+			(SrcRead(&DirHeader1581, sizeof(DirHeader1581), 1, InFile) != 1)) {
+			return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 		}
-		DirBlock.NextTrack = DirHeader1581.FirstTrack;
-		DirBlock.NextSector = DirHeader1581.FirstSector;
+		DirBlock->NextTrack = DirHeader1581.FirstTrack;
+		DirBlock->NextSector = DirHeader1581.FirstSector;
 		if (!is_1581_header(&DirHeader1581))
 			DiskType = -1;		/* Bad archive */
 		else
@@ -1622,101 +3897,664 @@ static int DirD64(FILE *InFile, enum ArchiveTypes D64Type,
 
 
 	if (DiskType == -1) {
-		fprintf(stderr,"%s: Unsupported disk image format\n",
-			ProgName);
-		return 3;
+		return ArcError(Ctx, CBM_ERR_UNSUPPORTED,
+				"Unsupported disk image format");
 	}
 
 	/* Display the diskette label, terminate for safety's sake */
 	DiskLabel[sizeof(DiskLabel)-1] = '\0';
-	ConvertCBMName(DiskLabel);
-	DisplayStart(D64Type, DiskLabel);
+	strcpy(Dir->TitleBuf, ConvertCBMName(DiskLabel));
+	Dir->Title = Dir->TitleBuf;
+
+	S->DiskType = DiskType;
+	S->HeaderOffset = HeaderOffset;
+	S->DirTrack = DirBlock->NextTrack;
+	S->DirSector = DirBlock->NextSector;
+	S->EntryCount = D64_ENTRIES_PER_BLOCK;	/* read the first block next */
+	Totals->BlocksFree = CountBlocksFree(InFile, DiskType, HeaderOffset);
+	return 0;
+}
 
 /******************************************************************************
-* Go through the entire directory
+* Read the next directory entry
+* Go through the entire directory, a block at a time
 ******************************************************************************/
-	while (DirBlock.NextTrack > 0) {
-		int EntryCount;
-		CurrentPos = HeaderOffset;
-		if (DiskType == 1581)
-			CurrentPos += Location1581TS(DirBlock.NextTrack, DirBlock.NextSector);
-		else if (DiskType == 8250)
-			CurrentPos += Location8250TS(DirBlock.NextTrack, DirBlock.NextSector);
-		else if (DiskType == 1571)
-			CurrentPos += Location1571TS( DirBlock.NextTrack, DirBlock.NextSector);
-		else /* if (DiskType == 1541) */
-			CurrentPos += Location1541TS( DirBlock.NextTrack, DirBlock.NextSector);
-		if (fseek(InFile, CurrentPos, SEEK_SET) != 0) {
-			perror(ProgName);
-			return 2;
-		}
-		if (fread(&DirBlock, sizeof(DirBlock), 1, InFile) != 1) {
-			fprintf(stderr,"%s: Archive format error\n", ProgName);
-			return 2;
+static int NextD64(struct CbmDir *Dir)
+{
+	struct D64State *S = (struct D64State *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct SrcStream *InFile = Dir->InFile;
+	struct ArcTotals *Totals = &Dir->Totals;
+	struct D64DirBlock *DirBlock = &S->DirBlock;
+	struct D64EntryHeader *DirEntry;
+	char FileName[17];
+	char *EndName;
+	long FileLength;
+
+	do {
+		if (S->EntryCount >= D64_ENTRIES_PER_BLOCK) {
+			long CurrentPos;
+
+			if (DirBlock->NextTrack == 0)
+				return 0;
+			CurrentPos = LocationTS(S->DiskType, DirBlock->NextTrack,
+					DirBlock->NextSector);
+			if (CurrentPos < 0) {
+				return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+			}
+			if (SrcSeek(InFile, CurrentPos + (long) S->HeaderOffset) != 0) {
+				return SysError(Ctx);
+			}
+			if (SrcRead(DirBlock, sizeof(*DirBlock), 1, InFile) != 1) {
+				return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+			}
+			S->EntryCount = 0;
 		}
 
 		/* Look at each entry in the block */
-		for (EntryCount=0; EntryCount < D64_ENTRIES_PER_BLOCK; ++EntryCount) {
-			BYTE FileType = DirBlock.Entry[EntryCount].FileType;
-			if ((FileType & CBM_CLOSED) != 0) {
-				char FileName[17];
-				char *EndName;
-				long FileLength;
-
-				if ((FileType & CBM_TYPE) == CBM_CBM)
-					/* Can't follow track & sector links for a 1581 partition */
-					FileLength = 256 *	/* not 254 because whole partition is data */
-								CF_LE_W(DirBlock.Entry[EntryCount].FileBlocks);
-				else
-				{
-					/* Save some time if we're not wide */
-					if (WideFormat)
-					{
-						/* Don't walk the file chain for a zero-length file */
-						if (CF_LE_W(DirBlock.Entry[EntryCount].FileBlocks))
-							FileLength = CountCBMBytes(
-											InFile,
-											DiskType,
-											HeaderOffset,
-											DirBlock.Entry[EntryCount].FirstTrack,
-											DirBlock.Entry[EntryCount].FirstSector
-										 );
-						else
-							FileLength = 0;
-					}
-					else
-						/* We could approximate based on blocks, but this will
-						 * be completely ignored, so don't bother */
-						FileLength = 0;
-				}
+		DirEntry = &DirBlock->Entry[S->EntryCount++];
+	} while ((DirEntry->FileType & CBM_CLOSED) == 0);
+
+	strncpy(FileName, (char *) DirEntry->FileName, sizeof(FileName)-1);
+	FileName[sizeof(FileName)-1] = 0;
+	if ((EndName = strchr(FileName, CBM_END_NAME)) != NULL)
+		*EndName = 0;
+
+	/* Decide before following the sector chain */
+	if (!Wanted(Dir, FileName, CBMFileTypes[DirEntry->FileType & CBM_TYPE],
+			CF_LE_W(DirEntry->FileBlocks)))
+		return NEXT_SKIPPED;
+
+	if ((DirEntry->FileType & CBM_TYPE) == CBM_CBM) {
+		/* Can't follow track & sector links for a 1581 partition */
+		FileLength = 256 *	/* not 254 because whole partition is data */
+					CF_LE_W(DirEntry->FileBlocks);
+		Dir->Hashed = 1;	/* nor hash it */
+	}
+	else if (Dir->Ctx->Hash)
+	{
+		/* Hashing follows the chain anyway, so the length comes for free.
+		   As below, the chain of a zero-length file isn't followed. */
+		FileLength = HashEntry(Dir, FileName, CF_LE_W(DirEntry->FileBlocks) != 0);
+		if (FileLength < 0)
+			FileLength = 0;
+	}
+	else
+	{
+		/* Save some time if the length isn't wanted */
+		if (Dir->Fields & FIELD_LENGTH)
+		{
+			/* Don't walk the file chain for a zero-length file */
+			if (CF_LE_W(DirEntry->FileBlocks))
+				FileLength = CountCBMBytes(
+								Ctx,
+								InFile,
+								S->DiskType,
+								S->HeaderOffset,
+								DirEntry->FirstTrack,
+								DirEntry->FirstSector
+							 );
+			else
+				FileLength = 0;
+		}
+		else
+			/* We could approximate based on blocks, but this will
+			 * be completely ignored, so don't bother */
+			FileLength = 0;
+	}
+
+	Totals->TotalLength += FileLength;
+	Totals->TotalBlocks += CF_LE_W(DirEntry->FileBlocks);
+	Totals->TotalBlocksNow = Totals->TotalBlocks;
+	++Totals->ArchiveEntries;
+
+	return SetEntry(Dir,
+		FileName,
+		CBMFileTypes[DirEntry->FileType & CBM_TYPE],
+		(unsigned long) FileLength,
+		CF_LE_W(DirEntry->FileBlocks),
+		"Stored",
+		0,
+		CF_LE_W(DirEntry->FileBlocks),
+		(long) -1L
+	);
+}
+
+/******************************************************************************
+* Find the current entry's data at the start of its sector chain
+******************************************************************************/
+static int DataD64(struct CbmDir *Dir)
+{
+	struct D64State *S = (struct D64State *) Dir->State;
+	struct D64EntryHeader *DirEntry = &S->DirBlock.Entry[S->EntryCount-1];
+
+	if ((DirEntry->FileType & CBM_TYPE) == CBM_CBM)
+		return ArcError(Dir->Ctx, CBM_ERR_UNSUPPORTED,
+				"Can't read the contents of a partition");
+	Dir->Data.Chain = 1;
+	Dir->Data.DiskType = S->DiskType;
+	Dir->Data.HeaderOffset = S->HeaderOffset;
+	Dir->Data.NextTrack = DirEntry->FirstTrack;
+	Dir->Data.NextSector = DirEntry->FirstSector;
+	return 0;
+}
+
+
+/******************************************************************************
+* Disk image checking
+* Each sector of the disk has an owner: nobody, the DOS, or a file numbered
+* from 1 in directory order. All the chains are followed once through an
+* in-memory copy of the image, marking the owner of each sector they use,
+* then the owners are compared with the BAM.
+******************************************************************************/
+#define OWNER_DOS ((WORD) 0xffff)	/* header, BAM and directory sectors */
+
+struct CheckName {
+	char Name[19];				/* in quotes for messages */
+};
+
+struct DiskCheck {
+	struct CbmDir *Dir;
+	struct CbmDiskCheck *Result;
+	int Type;					/* type of disk image--1541, 1571, 1581, 8250 */
+	const BYTE *Image;			/* whole disk image, including any header */
+	unsigned long ImageLen;
+	unsigned long Offset;		/* size of the image header before track 1 */
+	WORD *Owner;				/* owner of each sector, by index on the disk */
+	struct CheckName *Names;	/* name of each file, by owner - 1 */
+	unsigned NumNames;
+};
+
+/******************************************************************************
+* Find a sector in the image
+* Returns a pointer to it and sets its index on the disk, or NULL if there's no
+* such sector
+******************************************************************************/
+static const BYTE *CheckSector(struct DiskCheck *Chk, unsigned Track,
+		unsigned Sector, unsigned *Index)
+{
+	long SectorOfs;
+
+	if ((Track > 255) ||
+		((SectorOfs = LocationTS(Chk->Type, (unsigned char) Track, 0)) < 0) ||
+		(Sector >= (unsigned) SectorsOnTrack(Chk->Type, (int) Track)))
+		return NULL;
+	SectorOfs += (long) Sector * BYTES_PER_SECTOR;
+	if ((unsigned long) SectorOfs + Chk->Offset + BYTES_PER_SECTOR > Chk->ImageLen)
+		return NULL;
+	*Index = (unsigned) (SectorOfs / BYTES_PER_SECTOR);
+	return Chk->Image + Chk->Offset + SectorOfs;
+}
+
+/******************************************************************************
+* Describe the owner of a sector for a message
+******************************************************************************/
+static const char *OwnerName(struct DiskCheck *Chk, WORD Owner)
+{
+	return Owner == OWNER_DOS ? "the directory" : Chk->Names[Owner - 1].Name;
+}
 
-				strncpy(FileName, (char *) DirBlock.Entry[EntryCount].FileName, sizeof(FileName)-1);
-				FileName[sizeof(FileName)-1] = 0;
-				if ((EndName = strchr(FileName, CBM_END_NAME)) != NULL)
-					*EndName = 0;
-
-				DisplayEntry(
-					ConvertCBMName(FileName),
-					CBMFileTypes[DirBlock.Entry[EntryCount].FileType & CBM_TYPE],
-					FileLength,
-					CF_LE_W(DirBlock.Entry[EntryCount].FileBlocks),
-					"Stored",
-					0,
-					CF_LE_W(DirBlock.Entry[EntryCount].FileBlocks),
-					(long) -1L
-				);
-				Totals->TotalLength += FileLength;
-				Totals->TotalBlocks += CF_LE_W(DirBlock.Entry[EntryCount].FileBlocks);
-				++Totals->ArchiveEntries;
+/******************************************************************************
+* Mark one sector as belonging to Owner
+* Returns the sector, or NULL if it can't be, which has been reported
+******************************************************************************/
+static const BYTE *ClaimSector(struct DiskCheck *Chk, WORD Owner,
+		unsigned Track, unsigned Sector)
+{
+	struct CbmContext *Ctx = Chk->Dir->Ctx;
+	const BYTE *Data;
+	unsigned Index;
+
+	if ((Data = CheckSector(Chk, Track, Sector, &Index)) == NULL) {
+		++Chk->Result->BadLinks;
+		ArcWarning(Ctx, "%s links to bad sector %u/%u", OwnerName(Chk, Owner),
+				Track, Sector);
+	} else if (Chk->Owner[Index] == Owner) {
+		++Chk->Result->Loops;
+		ArcWarning(Ctx, "%s loops back to %u/%u", OwnerName(Chk, Owner),
+				Track, Sector);
+	} else if (Chk->Owner[Index]) {
+		++Chk->Result->CrossLinked;
+		ArcWarning(Ctx, "%s is cross-linked with %s at %u/%u",
+				OwnerName(Chk, Owner), OwnerName(Chk, Chk->Owner[Index]),
+				Track, Sector);
+	} else {
+		Chk->Owner[Index] = Owner;
+		return Data;
+	}
+	return NULL;
+}
+
+/******************************************************************************
+* Mark a chain of sectors as belonging to Owner, up to its end or a problem
+* Returns the number of sectors marked
+******************************************************************************/
+static unsigned ClaimChain(struct DiskCheck *Chk, WORD Owner,
+		unsigned Track, unsigned Sector)
+{
+	const BYTE *Data;
+	unsigned Count = 0;
+
+	while (Track && ((Data = ClaimSector(Chk, Owner, Track, Sector)) != NULL)) {
+		++Count;
+		Track = Data[0];
+		Sector = Data[1];
+	}
+	return Count;
+}
+
+/******************************************************************************
+* Mark the sectors used by a directory entry
+******************************************************************************/
+static void ClaimEntry(struct DiskCheck *Chk, const struct D64EntryHeader *DirEntry)
+{
+	WORD Owner = (WORD) Chk->NumNames;
+
+	if ((DirEntry->FileType & CBM_TYPE) == CBM_CBM) {
+		/* A 1581 partition is a run of sectors without any links */
+		unsigned Track = DirEntry->FirstTrack;
+		unsigned Sector = DirEntry->FirstSector;
+		unsigned Blocks = CF_LE_W(DirEntry->FileBlocks);
+		while (Blocks-- && ClaimSector(Chk, Owner, Track, Sector))
+			if (++Sector >= (unsigned) SectorsOnTrack(Chk->Type, (int) Track)) {
+				++Track;
+				Sector = 0;
 			}
+		return;
+	}
+	ClaimChain(Chk, Owner, DirEntry->FirstTrack, DirEntry->FirstSector);
+	if (((DirEntry->FileType & CBM_TYPE) == CBM_REL) && DirEntry->FirstSideTrack)
+		/* the side sectors of a relative file */
+		ClaimChain(Chk, Owner, DirEntry->FirstSideTrack, DirEntry->FirstSideSector);
+}
 
+/******************************************************************************
+* Compare a track's BAM bitmap with the owners of its sectors
+******************************************************************************/
+static void CheckBAMTrack(void *UserData, int Track, const BYTE *Bitmap)
+{
+	struct DiskCheck *Chk = (struct DiskCheck *) UserData;
+	struct CbmContext *Ctx = Chk->Dir->Ctx;
+	unsigned Sector;
+	unsigned Index;
+	int Free;
+
+	for (Sector = 0; CheckSector(Chk, (unsigned) Track, Sector, &Index); ++Sector) {
+		Free = (Bitmap[Sector / 8] >> (Sector % 8)) & 1;
+		if (Free && Chk->Owner[Index]) {
+			++Chk->Result->FreeUsed;
+			ArcWarning(Ctx, "%u/%u is used by %s but free in the BAM",
+					(unsigned) Track, Sector, OwnerName(Chk, Chk->Owner[Index]));
+		} else if (!Free && !Chk->Owner[Index]) {
+			++Chk->Result->Orphans;
+			ArcWarning(Ctx, "%u/%u is allocated in the BAM but not used",
+					(unsigned) Track, Sector);
 		}
 	}
+}
 
-	Totals->TotalBlocksNow = Totals->TotalBlocks;
+/******************************************************************************
+* Add the name of the next file to be claimed
+* Returns -1 if out of memory
+******************************************************************************/
+static int AddCheckName(struct DiskCheck *Chk, const BYTE *FileName)
+{
+	char *Name;
+
+	/* The array doubles whenever it's full */
+	if (!(Chk->NumNames & (Chk->NumNames - 1))) {
+		struct CheckName *Names = (struct CheckName *) realloc(Chk->Names,
+				(Chk->NumNames ? 2 * Chk->NumNames : 1) * sizeof(*Names));
+		if (!Names)
+			return -1;
+		Chk->Names = Names;
+	}
+	Name = Chk->Names[Chk->NumNames++].Name;
+	Name[0] = '"';
+	RawCBMName(Name + 1, (const char *) FileName, 16);
+	ConvertCBMName(Name + 1);
+	strcat(Name, "\"");
+	return 0;
+}
+
+/******************************************************************************
+* Mark the owners of all the sectors used on the disk
+* Returns -1 on error
+******************************************************************************/
+static int ClaimDisk(struct DiskCheck *Chk, unsigned char DirTrack,
+		unsigned char DirSector)
+{
+	const BYTE *Data;
+	const struct D64DirBlock *DirBlock;
+	unsigned Track, Sector, Blocks, Index, i;
+
+	/* The header and BAM sectors */
+	switch (Chk->Type) {
+		case 1571:
+			/* All of the second BAM track is kept from use */
+			for (Sector = 0; Sector < (unsigned) SectorsOnTrack(Chk->Type, 53);
+				 ++Sector)
+				ClaimSector(Chk, OWNER_DOS, 53, Sector);
+			/* fall through */
+		case 1541:
+			ClaimSector(Chk, OWNER_DOS, 18, 0);
+			break;
+
+		case 1581:
+			for (Sector = 0; Sector <= 2; ++Sector)
+				ClaimSector(Chk, OWNER_DOS, 40, Sector);
+			break;
+
+		case 8250:
+			/* The header links to the BAM blocks, which link to the directory */
+			ClaimSector(Chk, OWNER_DOS, 39, 0);
+			for (Track = 38, Sector = 0; (Track == 38) &&
+				 ((Data = ClaimSector(Chk, OWNER_DOS, Track, Sector)) != NULL); ) {
+				Track = Data[0];
+				Sector = Data[1];
+			}
+			break;
+	}
+
+	/* The directory chain, then the files in it. Its sectors are all claimed
+	   first so that files linking into the directory are found as such. */
+	Blocks = ClaimChain(Chk, OWNER_DOS, DirTrack, DirSector);
+	for (Track = DirTrack, Sector = DirSector; Blocks--; ) {
+		DirBlock = (const struct D64DirBlock *)
+				CheckSector(Chk, Track, Sector, &Index);
+		for (i = 0; i < D64_ENTRIES_PER_BLOCK; ++i) {
+			const struct D64EntryHeader *DirEntry = &DirBlock->Entry[i];
+			if (!(DirEntry->FileType & CBM_CLOSED))
+				continue;	/* deleted, or never closed so freed on validation */
+			if (AddCheckName(Chk, DirEntry->FileName) < 0)
+				return ArcError(Chk->Dir->Ctx, CBM_ERR_MEMORY, "Out of memory");
+			++Chk->Result->Files;
+			ClaimEntry(Chk, DirEntry);
+		}
+		Track = DirBlock->NextTrack;
+		Sector = DirBlock->NextSector;
+	}
+	return 0;
+}
+
+/******************************************************************************
+* Check the chains of a disk image against each other and against its BAM
+******************************************************************************/
+static int CheckD64(struct CbmDir *Dir, struct CbmDiskCheck *Result)
+{
+	struct D64State *S = (struct D64State *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct SrcStream *InFile = Dir->InFile;
+	struct DiskCheck Chk;
+	BYTE *Copy = NULL;
+	int Status;
+
+	memset(&Chk, 0, sizeof(Chk));
+	Chk.Dir = Dir;
+	Chk.Result = Result;
+	Chk.Type = S->DiskType;
+	Chk.Offset = S->HeaderOffset;
+
+	/* Get the image in memory once rather than reading it a sector at a time */
+	if (InFile->Mapped) {
+		Chk.Image = InFile->Data;
+		Chk.ImageLen = InFile->DataLen;
+	} else {
+		long Size = SrcSize(InFile);
+		if (Size < 0)
+			return SysError(Ctx);
+		Chk.ImageLen = (unsigned long) Size;
+		if (((unsigned long) (size_t) Chk.ImageLen != Chk.ImageLen) ||
+			((Copy = (BYTE *) malloc((size_t) Chk.ImageLen + 1)) == NULL))
+			return ArcError(Ctx, CBM_ERR_MEMORY, "Out of memory");
+		if ((SrcSeek(InFile, 0) != 0) ||
+			(SrcRead(Copy, 1, (size_t) Chk.ImageLen, InFile) != Chk.ImageLen)) {
+			free(Copy);
+			return SysError(Ctx);
+		}
+		Chk.Image = Copy;
+	}
+
+	if ((Chk.Owner = (WORD *) calloc(DiskCapacity(Chk.Type),
+									 sizeof(*Chk.Owner))) == NULL)
+		Status = ArcError(Ctx, CBM_ERR_MEMORY, "Out of memory");
+	else if ((Status = ClaimDisk(&Chk, S->DirTrack, S->DirSector)) == 0 &&
+			 (WalkBAM(InFile, Chk.Type, Chk.Offset, CheckBAMTrack, &Chk) < 0))
+		Status = ArcError(Ctx, CBM_ERR_ARCHIVE, "Can't read the BAM");
+
+	free(Chk.Names);
+	free(Chk.Owner);
+	free(Copy);
+	return Status;
+}
+
+/******************************************************************************
+* Check a disk image; see cbmarcs.h
+******************************************************************************/
+int CbmCheckDisk(struct CbmDir *Dir, struct CbmDiskCheck *Check)
+{
+	struct CbmContext *Ctx = Dir->Ctx;
+
+	Ctx->Error = CBM_OK;
+	Ctx->SysErrno = 0;
+	Ctx->ErrorMsg[0] = '\0';
+	errno = 0;
+	memset(Check, 0, sizeof(*Check));
+	if (Dir->Next != NextD64)
+		return ArcError(Ctx, CBM_ERR_UNSUPPORTED, "Not a disk image");
+	return CheckD64(Dir, Check);
+}
+
+/******************************************************************************
+* Disk image name index
+* The directory is read once into an array of entries, which are chained in a
+* hash table by name. A name without wildcards is found by hashing it; a
+* pattern with them is compared against each entry in memory.
+******************************************************************************/
+#define NO_ENTRY ((unsigned) -1)	/* end of a hash chain */
+
+struct CbmNameIndex {
+	struct CbmIndexEntry *Entries;	/* in directory order */
+	unsigned NumEntries;
+	unsigned *Next;				/* next entry in the same hash chain */
+	unsigned *Buckets;			/* first entry in each hash chain */
+	unsigned Mask;				/* number of buckets - 1 */
+};
+
+/******************************************************************************
+* Hash a name with 32-bit FNV-1a
+******************************************************************************/
+static unsigned long HashName(const char *Name)
+{
+	unsigned long Hash = 2166136261UL;
+
+	while (*Name) {
+		Hash ^= (unsigned char) *Name++;
+		Hash = (Hash * 16777619UL) & 0xffffffffUL;
+	}
+	return Hash;
+}
+
+/******************************************************************************
+* Match a name against a pattern with Commodore drive wildcards; see cbmarcs.h
+******************************************************************************/
+int CbmMatchName(const char *Pattern, const char *Name, int IgnoreCase)
+{
+	for (; *Pattern; ++Pattern, ++Name) {
+		if (*Pattern == '*')
+			return 1;		/* the rest of the name matches */
+		if (!*Name || ((*Pattern != '?') && (*Pattern != *Name) &&
+			(!IgnoreCase || (toupper((unsigned char) *Pattern) !=
+							 toupper((unsigned char) *Name)))))
+			return 0;
+	}
+	return !*Name;
+}
+
+/******************************************************************************
+* Add the next directory entry to the index, growing the array as needed
+* Returns -1 if out of memory
+******************************************************************************/
+static int AddIndexEntry(struct CbmNameIndex *Index,
+		const struct D64EntryHeader *DirEntry)
+{
+	struct CbmIndexEntry *Entry;
+	char *EndName;
+
+	/* The array doubles whenever it's full */
+	if (!(Index->NumEntries & (Index->NumEntries - 1))) {
+		struct CbmIndexEntry *Entries = (struct CbmIndexEntry *) realloc(
+				Index->Entries,
+				(Index->NumEntries ? 2 * Index->NumEntries : 1) * sizeof(*Entries));
+		if (!Entries)
+			return -1;
+		Index->Entries = Entries;
+	}
+	Entry = &Index->Entries[Index->NumEntries];
+	strncpy(Entry->Name, (const char *) DirEntry->FileName, sizeof(Entry->Name)-1);
+	Entry->Name[sizeof(Entry->Name)-1] = 0;
+	if ((EndName = strchr(Entry->Name, CBM_END_NAME)) != NULL)
+		*EndName = 0;
+	Entry->Type = CBMFileTypes[DirEntry->FileType & CBM_TYPE];
+	Entry->Blocks = CF_LE_W(DirEntry->FileBlocks);
+	Entry->Number = Index->NumEntries++;
+	Entry->Track = DirEntry->FirstTrack;
+	Entry->Sector = DirEntry->FirstSector;
+	return 0;
+}
+
+/******************************************************************************
+* Read every entry of the directory into the index
+* Returns 0 or -1 on error
+******************************************************************************/
+static int ReadIndexEntries(struct CbmDir *Dir, struct CbmNameIndex *Index)
+{
+	struct D64State *S = (struct D64State *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct D64DirBlock DirBlock;
+	unsigned Blocks = DiskCapacity(S->DiskType);
+	long CurrentPos;
+	int i;
+
+	DirBlock.NextTrack = S->DirTrack;
+	DirBlock.NextSector = S->DirSector;
+	while (DirBlock.NextTrack) {
+		/* A directory can't be longer than the disk unless it loops */
+		if (!Blocks--)
+			return ArcError(Ctx, CBM_ERR_ARCHIVE, "Directory chain loop detected");
+		CurrentPos = LocationTS(S->DiskType, DirBlock.NextTrack,
+				DirBlock.NextSector);
+		if (CurrentPos < 0) {
+			return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+		}
+		if (SrcSeek(Dir->InFile, CurrentPos + (long) S->HeaderOffset) != 0) {
+			return SysError(Ctx);
+		}
+		if (SrcRead(&DirBlock, sizeof(DirBlock), 1, Dir->InFile) != 1) {
+			return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+		}
+		for (i = 0; i < D64_ENTRIES_PER_BLOCK; ++i)
+			if ((DirBlock.Entry[i].FileType & CBM_CLOSED) &&
+				(AddIndexEntry(Index, &DirBlock.Entry[i]) < 0))
+				return ArcError(Ctx, CBM_ERR_MEMORY, "Out of memory");
+	}
+	return 0;
+}
+
+/******************************************************************************
+* Hash every entry into its chain, keeping each chain in directory order
+* Returns 0 or -1 if out of memory
+******************************************************************************/
+static int HashIndexEntries(struct CbmNameIndex *Index)
+{
+	unsigned Buckets = 1;
+	unsigned i, Bucket;
+
+	/* At least twice as many buckets as entries keeps the chains short */
+	while (Buckets < 2 * Index->NumEntries)
+		Buckets *= 2;
+	Index->Mask = Buckets - 1;
+	if (((Index->Buckets = (unsigned *) malloc(Buckets * sizeof(unsigned))) == NULL) ||
+		((Index->Next = (unsigned *) malloc((Index->NumEntries + 1) *
+											sizeof(unsigned))) == NULL))
+		return -1;
+	for (i = 0; i < Buckets; ++i)
+		Index->Buckets[i] = NO_ENTRY;
+	/* Adding from the end at the head of each chain puts it in order */
+	for (i = Index->NumEntries; i--; ) {
+		Bucket = (unsigned) (HashName(Index->Entries[i].Name) & Index->Mask);
+		Index->Next[i] = Index->Buckets[Bucket];
+		Index->Buckets[Bucket] = i;
+	}
 	return 0;
 }
 
+/******************************************************************************
+* Index the files in a disk image directory by name; see cbmarcs.h
+******************************************************************************/
+struct CbmNameIndex *CbmIndexNames(struct CbmDir *Dir)
+{
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct CbmNameIndex *Index;
+
+	Ctx->Error = CBM_OK;
+	Ctx->SysErrno = 0;
+	Ctx->ErrorMsg[0] = '\0';
+	errno = 0;
+	if (Dir->Next != NextD64) {
+		ArcError(Ctx, CBM_ERR_UNSUPPORTED, "Not a disk image");
+		return NULL;
+	}
+	if ((Index = (struct CbmNameIndex *) calloc(1, sizeof(*Index))) == NULL) {
+		ArcError(Ctx, CBM_ERR_MEMORY, "Out of memory");
+		return NULL;
+	}
+	if (ReadIndexEntries(Dir, Index) < 0) {
+		CbmFreeIndex(Index);
+		return NULL;
+	}
+	if (HashIndexEntries(Index) < 0) {
+		ArcError(Ctx, CBM_ERR_MEMORY, "Out of memory");
+		CbmFreeIndex(Index);
+		return NULL;
+	}
+	return Index;
+}
+
+/******************************************************************************
+* Find the next file in the index matching a pattern; see cbmarcs.h
+******************************************************************************/
+const struct CbmIndexEntry *CbmFindName(const struct CbmNameIndex *Index,
+		const char *Pattern, const struct CbmIndexEntry *After)
+{
+	unsigned i;
+
+	if (strpbrk(Pattern, "*?")) {
+		for (i = After ? After->Number + 1 : 0; i < Index->NumEntries; ++i)
+			if (CbmMatchName(Pattern, Index->Entries[i].Name, 0))
+				return &Index->Entries[i];
+		return NULL;
+	}
+
+	/* Names that are the same are chained together in directory order */
+	i = After ? Index->Next[After->Number] :
+		Index->Buckets[HashName(Pattern) & Index->Mask];
+	for (; i != NO_ENTRY; i = Index->Next[i])
+		if (strcmp(Pattern, Index->Entries[i].Name) == 0)
+			return &Index->Entries[i];
+	return NULL;
+}
+
+void CbmFreeIndex(struct CbmNameIndex *Index)
+{
+	if (Index) {
+		free(Index->Entries);
+		free(Index->Next);
+		free(Index->Buckets);
+		free(Index);
+	}
+}
+
 
 
 /*---------------------------------------------------------------------------*/
@@ -1737,17 +4575,17 @@ static const BYTE MagicHeaderP00[8] = {'C','6','4','F','i','l','e',0};
 * Is archive x00 format?
 * X00 must be checked after the other _00 types because it is more lenient
 ******************************************************************************/
-static bool IsX00(FILE *InFile, const char *FileName)
+static bool IsX00(struct SrcStream *InFile, const char *FileName)
 {
 	struct X00 Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic, MagicHeaderP00, sizeof(MagicHeaderP00)) == 0));
 }
 
-static bool IsX00Ext(FILE *InFile, const char *FileName, char Ext)
+static bool IsX00Ext(struct SrcStream *InFile, const char *FileName, char Ext)
 {
 	char *NameExt;
 
@@ -1756,33 +4594,33 @@ static bool IsX00Ext(FILE *InFile, const char *FileName, char Ext)
 		&& (toupper(*++NameExt) == Ext));
 }
 
-static bool IsP00(FILE *InFile, const char *FileName)
+static bool IsP00(struct SrcStream *InFile, const char *FileName)
 {
 	return IsX00Ext(InFile, FileName, 'P');
 }
 
-static bool IsS00(FILE *InFile, const char *FileName)
+static bool IsS00(struct SrcStream *InFile, const char *FileName)
 {
 	return IsX00Ext(InFile, FileName, 'S');
 }
 
-static bool IsU00(FILE *InFile, const char *FileName)
+static bool IsU00(struct SrcStream *InFile, const char *FileName)
 {
 	return IsX00Ext(InFile, FileName, 'U');
 }
 
-static bool IsD00(FILE *InFile, const char *FileName)
+static bool IsD00(struct SrcStream *InFile, const char *FileName)
 {
 	return IsX00Ext(InFile, FileName, 'D');
 }
 
-static bool IsR00(FILE *InFile, const char *FileName)
+static bool IsR00(struct SrcStream *InFile, const char *FileName)
 {
 	struct X00 Header;
 	char *NameExt;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic, MagicHeaderP00, sizeof(MagicHeaderP00)) == 0)
 		&& (FileName != NULL)
 		&& ((NameExt = strrchr(FileName, '.')) != NULL)
@@ -1790,48 +4628,61 @@ static bool IsR00(FILE *InFile, const char *FileName)
 }
 
 /******************************************************************************
-* Read directory
+* Open directory
 ******************************************************************************/
-static int DirP00(FILE *InFile, enum ArchiveTypes ArchiveType,
-		struct ArcTotals *Totals, DisplayStartFunc DisplayStart,
-		DisplayEntryFunc DisplayEntry)
-{
-	long FileLength;
-	char FileName[17];
+struct X00State {
 	struct X00 Header;
-	const char *FileType;
+	int Read;				/* nonzero once the entry has been read */
+};
 
-	Totals->ArchiveEntries = 0;
-	Totals->TotalBlocks = 0;
-	Totals->TotalBlocksNow = 0;
-	Totals->TotalLength = 0;
-	Totals->DearcerBlocks = 0;
-	Totals->Version = 0;
+static int OpenP00(struct CbmDir *Dir)
+{
+	struct X00State *S = (struct X00State *) Dir->State;
+	struct SrcStream *InFile = Dir->InFile;
 
 /******************************************************************************
 * P00 is just a regular file with a simple header prepended, so just read the
 * header and display the name
 ******************************************************************************/
-	if (fseek(InFile, 0, SEEK_SET) != 0) {
-		perror(ProgName);
-		return 2;
+	if (SrcSeek(InFile, 0) != 0) {
+		return SysError(Dir->Ctx);
 	}
-	if (fread(&Header, sizeof(Header), 1, InFile) != 1) {
-		fprintf(stderr,"%s: Archive format error\n", ProgName);
-		return 2;
+	if (SrcRead(&S->Header, sizeof(S->Header), 1, InFile) != 1) {
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 	}
-	DisplayStart(ArchiveType, NULL);
-	FileLength = filelength(fileno(InFile)) - sizeof(Header);
-	strncpy(FileName, (char *) Header.FileName, sizeof(FileName)-1);
-	FileName[sizeof(FileName)-1] = 0;		/* never need this on a good P00 file */
+	return 0;
+}
+
+/******************************************************************************
+* Read the next directory entry
+******************************************************************************/
+static int NextP00(struct CbmDir *Dir)
+{
+	struct X00State *S = (struct X00State *) Dir->State;
+	struct ArcTotals *Totals = &Dir->Totals;
+	long FileLength;
+	char FileName[17];
+	const char *FileType;
+
+	if (S->Read)
+		return 0;
+	S->Read = 1;
+
+	/* The length is needed for the block counts, too */
+	if (Dir->Fields & (FIELD_LENGTH | FIELD_BLOCKS | FIELD_BLOCKSNOW))
+		FileLength = SrcSize(Dir->InFile) - sizeof(S->Header);
+	else
+		FileLength = 0;
+	strncpy(FileName, (char *) S->Header.FileName, sizeof(FileName)-1);
+	FileName[sizeof(FileName)-1] = 0;		/* never need this on a good P00 file */
 
 	/* If archive type is unknown, see if file is REL */
 /*
-	if ((ArchiveType == X00) && (Header.RecordSize > 0))
+	if ((ArchiveType == X00) && (S->Header.RecordSize > 0))
 		ArchiveType = R00;
 */
 
-	switch (ArchiveType) {
+	switch (Dir->Type) {
 		case S00: FileType = "SEQ"; break;
 		case P00: FileType = "PRG"; break;
 		case U00: FileType = "USR"; break;
@@ -1840,22 +4691,33 @@ static int DirP00(FILE *InFile, enum ArchiveTypes ArchiveType,
 		case X00:
 		default:  FileType = "???"; break;
 	}
+	if (!Wanted(Dir, FileName, FileType, (unsigned long) (FileLength / 254 + 1)))
+		return NEXT_SKIPPED;
+
+	Totals->ArchiveEntries = 1;
+	Totals->TotalLength = FileLength;
+	Totals->TotalBlocks = Totals->TotalBlocksNow = (int) (FileLength / 254 + 1);
 
-	DisplayEntry(
-		ConvertCBMName(FileName),
+	return SetEntry(Dir,
+		FileName,
 		FileType,
-		(long) FileLength,
+		(unsigned long) FileLength,
 		(unsigned) (FileLength / 254 + 1),
 		"Stored",
 		0,
 		(unsigned) (FileLength / 254 + 1),
 		(long) -1
 	);
+}
 
-	Totals->ArchiveEntries = 1;
-	Totals->TotalLength = FileLength;
-	Totals->TotalBlocks = Totals->TotalBlocksNow = (int) (FileLength / 254 + 1);
-	return 0;
+/******************************************************************************
+* Find the current entry's data, which is the rest of the file
+******************************************************************************/
+static int DataP00(struct CbmDir *Dir)
+{
+	struct X00State *S = (struct X00State *) Dir->State;
+
+	return SetDataRun(Dir, sizeof(S->Header), DATA_TO_END);
 }
 
 
@@ -1888,70 +4750,92 @@ struct N64 {
 * This N64 check must come last because several other formats use a similar,
 *  but longer, magic number.
 ******************************************************************************/
-static bool IsN64(FILE *InFile, const char *FileName)
+static bool IsN64(struct SrcStream *InFile, const char *FileName)
 {
 	enum {MagicHeaderN64Version = 1};
 	struct N64 Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic, MagicHeaderN64, sizeof(MagicHeaderN64)) == 0)
 		&& (Header.Version == MagicHeaderN64Version));
 }
 
 /******************************************************************************
-* Read directory
+* Open directory
 ******************************************************************************/
-static int DirN64(FILE *InFile, enum ArchiveTypes ArchiveType,
-		struct ArcTotals *Totals, DisplayStartFunc DisplayStart,
-		DisplayEntryFunc DisplayEntry)
-{
-	long FileLength;
-	char FileName[17];
+struct N64State {
 	struct N64Header Header;
+	int Read;				/* nonzero once the entry has been read */
+};
 
-	Totals->ArchiveEntries = 0;
-	Totals->TotalBlocks = 0;
-	Totals->TotalBlocksNow = 0;
-	Totals->TotalLength = 0;
-	Totals->DearcerBlocks = 0;
-	Totals->Version = 0;
+static int OpenN64(struct CbmDir *Dir)
+{
+	struct N64State *S = (struct N64State *) Dir->State;
+	struct SrcStream *InFile = Dir->InFile;
 
 /******************************************************************************
 * N64 is just a regular file with a simple header prepended, so just read the
 * header and display the name
 ******************************************************************************/
-	if (fseek(InFile, 4, SEEK_SET) != 0) {
-		perror(ProgName);
-		return 2;
+	if (SrcSeek(InFile, 4) != 0) {
+		return SysError(Dir->Ctx);
 	}
-	if (fread(&Header, sizeof(Header), 1, InFile) != 1) {
-		fprintf(stderr,"%s: Archive format error\n", ProgName);
-		return 2;
+	if (SrcRead(&S->Header, sizeof(S->Header), 1, InFile) != 1) {
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 	}
-	DisplayStart(ArchiveType, NULL);
+	return 0;
+}
+
+/******************************************************************************
+* Read the next directory entry
+******************************************************************************/
+static int NextN64(struct CbmDir *Dir)
+{
+	struct N64State *S = (struct N64State *) Dir->State;
+	struct ArcTotals *Totals = &Dir->Totals;
+	long FileLength;
+	char FileName[17];
+
+	if (S->Read)
+		return 0;
+	S->Read = 1;
 
-	strncpy(FileName, (char *) Header.FileName, sizeof(FileName)-1);
+	strncpy(FileName, (char *) S->Header.FileName, sizeof(FileName)-1);
 	FileName[sizeof(FileName)-1] = 0;
 
-	FileLength = CF_LE_L(Header.FileLength);
+	FileLength = CF_LE_L(S->Header.FileLength);
+	if (!Wanted(Dir, FileName, CBMFileTypes[S->Header.FileType & CBM_TYPE],
+			(unsigned long) (FileLength / 254 + 1)))
+		return NEXT_SKIPPED;
 
-	DisplayEntry(
-		ConvertCBMName(FileName),
-		CBMFileTypes[Header.FileType & CBM_TYPE],
-		(long) FileLength,
+	Totals->ArchiveEntries = 1;
+	Totals->TotalLength = FileLength;
+	Totals->TotalBlocks = Totals->TotalBlocksNow = (int) (FileLength / 254 + 1);
+
+	return SetEntry(Dir,
+		FileName,
+		CBMFileTypes[S->Header.FileType & CBM_TYPE],
+		(unsigned long) FileLength,
 		(unsigned) (FileLength / 254 + 1),
 		(const char *) "Stored",
 		0,
 		(unsigned) (FileLength / 254 + 1),
 		(long) -1
 	);
+}
 
-	Totals->ArchiveEntries = 1;
-	Totals->TotalLength = FileLength;
-	Totals->TotalBlocks = Totals->TotalBlocksNow = (int) (FileLength / 254 + 1);
-	return 0;
+/******************************************************************************
+* Find the current entry's data, which follows the header
+******************************************************************************/
+static int DataN64(struct CbmDir *Dir)
+{
+	enum {N64_DATA_OFFSET = 256};
+	struct N64State *S = (struct N64State *) Dir->State;
+
+	return SetDataRun(Dir, N64_DATA_OFFSET,
+			(unsigned long) CF_LE_L(S->Header.FileLength));
 }
 
 
@@ -1973,83 +4857,141 @@ struct LBR {
 /******************************************************************************
 * Is archive LBR format?
 ******************************************************************************/
-static bool IsLBR(FILE *InFile, const char *FileName)
+static bool IsLBR(struct SrcStream *InFile, const char *FileName)
 {
 	struct LBR Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic, MagicHeaderLBR, sizeof(MagicHeaderLBR)) == 0));
 }
 
 /******************************************************************************
-* Read directory
+* Open directory
 ******************************************************************************/
-static int DirLBR(FILE *InFile, enum ArchiveTypes LBRType,
-		struct ArcTotals *Totals, DisplayStartFunc DisplayStart,
-		DisplayEntryFunc DisplayEntry)
-{
-	int NumFiles;
+struct LBRState {
+	long Pos;				/* offset of the next directory entry */
+	int NumFiles;			/* entries left to read */
+	unsigned long DataBefore;	/* bytes of data in the entries already read */
+	unsigned long DataLen;		/* of the current entry */
+	unsigned long DataStart;	/* where the data starts, or 0 if not known */
+};
 
-	Totals->ArchiveEntries = 0;
-	Totals->TotalBlocks = 0;
-	Totals->TotalBlocksNow = 0;
-	Totals->TotalLength = 0;
-	Totals->DearcerBlocks = 0;
-	Totals->Version = 0;
+static int OpenLBR(struct CbmDir *Dir)
+{
+	struct LBRState *S = (struct LBRState *) Dir->State;
+	struct SrcStream *InFile = Dir->InFile;
 
 /******************************************************************************
 * Get the number of files in the archive
 ******************************************************************************/
-	if (fseek(InFile, 3, SEEK_SET) != 0) {
-		perror(ProgName);
-		return 2;
+	if (SrcSeek(InFile, 3) != 0) {
+		return SysError(Dir->Ctx);
+	}
+
+	if (!SrcScanInt(InFile, &S->NumFiles)) {
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+	}
+	SrcSkipLine(InFile);
+	S->Pos = SrcTell(InFile);
+	return 0;
+}
+
+/******************************************************************************
+* Read one directory entry at the current position
+* EntryName must hold 17 characters and FileType 2
+* Returns nonzero if it was read
+******************************************************************************/
+static int ReadLBREntry(struct SrcStream *InFile, char *EntryName,
+		char *FileType, long *FileLen)
+{
+	int ReadCount;
+
+	/* Each field is on its own line and anything after it is ignored */
+	ReadCount = SrcScanLine(InFile, EntryName, 16);
+	SrcEndLine(InFile);
+	ReadCount += SrcScanWord(InFile, FileType, 1);
+	SrcEndLine(InFile);
+	ReadCount += SrcScanLong(InFile, FileLen);
+	SrcEndLine(InFile);
+	return ReadCount == 3;
+}
+
+/******************************************************************************
+* Read the next directory entry
+******************************************************************************/
+static int NextLBR(struct CbmDir *Dir)
+{
+	struct LBRState *S = (struct LBRState *) Dir->State;
+	struct SrcStream *InFile = Dir->InFile;
+	struct ArcTotals *Totals = &Dir->Totals;
+	char EntryName[17];
+	char FileType[2];
+	long FileLen;
+
+	if (S->NumFiles <= 0)
+		return 0;
+	--S->NumFiles;
+	if (SrcSeek(InFile, S->Pos) != 0) {
+		return SysError(Dir->Ctx);
 	}
 
-	if (fscanf(InFile, " %d%*[^\r]\r", &NumFiles) != 1) {
-		fprintf(stderr,"%s: Archive format error\n", ProgName);
-		return 2;
+	if (!ReadLBREntry(InFile, EntryName, FileType, &FileLen)) {
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 	}
-	DisplayStart(LBRType, NULL);
+	S->Pos = SrcTell(InFile);
+	/* The files' data follows the directory in the same order */
+	S->DataLen = FileLen > 0 ? (unsigned long) FileLen : 0;
+	S->DataBefore += S->DataLen;
+	if (!Wanted(Dir, EntryName, FileTypes(FileType[0]),
+				(unsigned long) ((FileLen-1) / 254 + 1)))
+		return NEXT_SKIPPED;
+
+	++Totals->ArchiveEntries;
+	Totals->TotalLength += FileLen;
+	Totals->TotalBlocks += (int) ((FileLen-1) / 254 + 1);
+	Totals->TotalBlocksNow = Totals->TotalBlocks;
+
+	return SetEntry(Dir,
+		EntryName,
+		FileTypes(FileType[0]),
+		(unsigned long) FileLen,
+		(unsigned) ((FileLen-1) / 254 + 1),
+		"Stored",
+		0,
+		(unsigned) ((FileLen-1) / 254 + 1),
+		-1L
+	);
+}
 
 /******************************************************************************
-* Read the archive directory contents
+* Find the current entry's data
+* The data starts right after the directory, so the first time this is called
+* the rest of the directory is skipped to find its end
 ******************************************************************************/
-	for (; NumFiles--;) {
+static int DataLBR(struct CbmDir *Dir)
+{
+	struct LBRState *S = (struct LBRState *) Dir->State;
+	struct SrcStream *InFile = Dir->InFile;
+
+	if (!S->DataStart) {
 		char EntryName[17];
 		char FileType[2];
 		long FileLen;
-		int ReadCount = fscanf(InFile, "%16[^\r]%*[^\r]", EntryName);
-		(void) getc(InFile);	/* eat the CR here because Sun won't in scanf */
-		ReadCount += fscanf(InFile, "%1s%*[^\r]", FileType);
-		(void) getc(InFile);
-		ReadCount += fscanf(InFile, " %ld%*[^\r]", &FileLen);
-		(void) getc(InFile);	/* eat the CR without killing whitespace so
-						   ftell() will be correct, below */
-		if (ReadCount != 3) {
-			fprintf(stderr,"%s: Archive format error\n", ProgName);
-			return 2;
-		}
-
-		DisplayEntry(
-			ConvertCBMName(EntryName),
-			FileTypes(FileType[0]),
-			(long) FileLen,
-			(unsigned) ((FileLen-1) / 254 + 1),
-			"Stored",
-			0,
-			(unsigned) ((FileLen-1) / 254 + 1),
-			-1L
-		);
-
-		++Totals->ArchiveEntries;
-		Totals->TotalLength += FileLen;
-		Totals->TotalBlocks += (int) ((FileLen-1) / 254 + 1);
-	};
+		int i;
 
-	Totals->TotalBlocksNow = Totals->TotalBlocks;
-	return 0;
+		if (SrcSeek(InFile, S->Pos) != 0) {
+			return SysError(Dir->Ctx);
+		}
+		for (i = 0; i < S->NumFiles; ++i)
+			if (!ReadLBREntry(InFile, EntryName, FileType, &FileLen)) {
+				return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+			}
+		S->DataStart = (unsigned long) SrcTell(InFile);
+	}
+	return SetDataRun(Dir, S->DataStart + S->DataBefore - S->DataLen,
+			S->DataLen);
 }
 
 
@@ -2062,8 +5004,8 @@ static int DirLBR(FILE *InFile, enum ArchiveTypes LBRType,
 * tape. It takes multiple levels of decoding to make sense of.
 * One feature that Commodore built-in to the format is that everything is
 * written to tape twice, so that if one copy is bad the other one can be used.
-* This feature is not used here so this decoder is more susceptible to noisy
-* inputs than it could be.
+* That's done for headers and data blocks whose checksums are bad, but a
+* pulse that can't be decoded in either copy still ends the tape.
 ******************************************************************************/
 
 struct TAPHeader {
@@ -2080,13 +5022,13 @@ static const BYTE MagicHeaderTAP[12] =
 /******************************************************************************
 * Is archive TAP format?
 ******************************************************************************/
-static bool IsTAP(FILE *InFile, const char *FileName)
+static bool IsTAP(struct SrcStream *InFile, const char *FileName)
 {
 	struct TAPHeader Header;
 	(void) FileName;
 
-	rewind(InFile);
-	return ((fread(&Header, sizeof(Header), 1, InFile) == 1)
+	SrcRewind(InFile);
+	return ((SrcRead(&Header, sizeof(Header), 1, InFile) == 1)
 		&& (memcmp(Header.Magic, MagicHeaderTAP, sizeof(MagicHeaderTAP)) == 0));
 }
 
@@ -2189,10 +5131,10 @@ static const char* TapeType(enum HeaderTypes HeaderType)
  * Nread is a pointer to the number of bytes read in (0,1,4) (not accurate on
  * EOF)
  */
-static BYTE TapReadDuration(FILE *f, int Version, int *Nread)
+static BYTE TapReadDuration(struct SrcStream *f, int Version, int *Nread)
 {
 	int d1, d2, d3, Duration;
-	int ch = getc(f);
+	int ch = SrcGetc(f);
 	if (ch == EOF)
 		return 0;
 	*Nread = 1;
@@ -2205,9 +5147,9 @@ static BYTE TapReadDuration(FILE *f, int Version, int *Nread)
 		return 255;
 
 	/* For Version==1, 0 means read a 24 bit extended value */
-	d1 = getc(f);
-	d2 = getc(f);
-	d3 = getc(f);
+	d1 = SrcGetc(f);
+	d2 = SrcGetc(f);
+	d3 = SrcGetc(f);
 	if (d3 == EOF)
 		return 0;
 	*Nread += 3;
@@ -2248,206 +5190,298 @@ static BYTE TapeChecksum(BYTE *Buf, int Len)
 	return Csum;
 }
 
-/* Validates that the tape header is correct.
+/* Validates that a copy of a tape header or data block is correct.
  * Returns 0 on success, nonzero on failure
  */
-static int CheckTapeHeader(struct TapeHeader *Header, int Len, int Which)
+static int CheckTapeBlock(BYTE *Block, int Len, int Which)
 {
-	return memcmp(&Header->Countdown, Which ? Countdown2 : Countdown1, sizeof(Countdown1)) ||
-	   TapeChecksum((BYTE *)&Header->HeaderType, Len - sizeof(Countdown1));
+	return memcmp(Block, Which ? Countdown2 : Countdown1, sizeof(Countdown1)) ||
+	   TapeChecksum(Block + sizeof(Countdown1), Len - (int) sizeof(Countdown1));
 }
 
-static int DirTAP(FILE *InFile, enum ArchiveTypes ArchiveType,
-		struct ArcTotals *Totals, DisplayStartFunc DisplayStart,
-		DisplayEntryFunc DisplayEntry)
+/******************************************************************************
+* Decode the two copies of the next block from the pulses at the current
+* position, keeping the first Size bytes in Buf. A header block is known to fit,
+* so with Header set this stops once Buf is full.
+* *Flen is the number of bytes of pulses left, and *FirstLen is set to the
+* number of bytes in the first copy.
+* Returns the number of bytes decoded or -1 on error
+******************************************************************************/
+static long ReadTapBlock(struct CbmDir *Dir, int Version, LONG *Flen,
+		BYTE *Buf, unsigned long Size, int Header, unsigned long *FirstLen)
 {
-	struct TAPHeader FileHeader;
-	LONG Flen;
-	enum HeaderDataState HeadDataState = AwaitingHeader;
-	char FileName[17];
-	int DelayedFile = 0;
-	LONG DelayedFileLen = 0;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct SrcStream *InFile = Dir->InFile;
+	unsigned long Bufidx = 0;
+	enum TapState State = SYNCSEARCH;
+	int GotCopy = 0;
+	int Databyte = 0;
+	int Bitnum = 0;
+
+	*FirstLen = 0;
+	/* Loop to read two duplicate blocks to then interpet */
+	for (; *Flen > 0 && (!Header || Bufidx < Size) && GotCopy < 2;) {
+		int BytesRead;
+		enum TapSignal Signal;
+		BYTE Duration = TapReadDuration(InFile, Version, &BytesRead);
+		if(Duration == 0) {
+			DEBUGLOG("FLEN %ld\n", (long)*Flen);
+			return ArcError(Ctx, CBM_ERR_ARCHIVE, "Corrupt file (too short)");
+		}
+		*Flen -= BytesRead;
+		Signal = SignalDuration(Duration);
+		if(Signal == TAP_INVALID) {
+			DEBUGLOG("Warning: too long/short pulse: %d\n", Duration);
+		}
 
-	Totals->ArchiveEntries = 0;
-	Totals->TotalBlocks = 0;
-	Totals->TotalBlocksNow = 0;
-	Totals->TotalLength = 0;
-	Totals->DearcerBlocks = 0;
-	Totals->Version = 0;
+		switch (State) {
+			case SYNCSEARCH:
+				if(Signal == TAP_SHORT) {
+					++Bitnum;
+					if(Bitnum > SyncLen) {
+						/* We found a sync header; now look for the first byte */
+						State = BYTESEARCH;
+						Bitnum = 0;
+					}
+				} else
+					/* Start counting over */
+					Bitnum = 0;
+				break;
+
+			case BYTESEARCH:
+				if(Signal == TAP_MARK)
+					/* Probably the start of a byte */
+					State = BYTELONG;
+				break;
+
+			case BYTELONG:
+				if(Signal == TAP_LONG) {
+					/* It is indeed a start of byte signal */
+					State = GETBIT0;
+					Bitnum = 0;
+					Databyte = 0;
+				} else if(Signal == TAP_SHORT) {
+					/* Between the two copies of the tape header, there are 60 shorts.
+					 * Go to the start and wait for the first byte of the next header.
+					 * After we read two copies (in header mode) we can examine them */
+					if (++GotCopy == 1)
+						*FirstLen = Bufidx;
+					State = SYNCSEARCH;
+				} else {
+					return ArcError(Ctx, CBM_ERR_ARCHIVE, "Data decoding error %d @%lu", Signal, Bufidx);
+					/* State = BYTESEARCH; */  /* To attempt to go on, switch states */
+				}
+				break;
+
+			case GETBIT0:
+				/* Get the first of two bit transitions (long or short) */
+				if(Signal == TAP_SHORT)
+					State = GETBITL;
+				else if(Signal == TAP_LONG)
+					State = GETBITS;
+				else {
+					return ArcError(Ctx, CBM_ERR_ARCHIVE, "Data decoding error %d @%lu", Signal, Bufidx);
+					/* State = BYTESEARCH; */  /* To attempt to go on, switch states */
+				}
+				break;
+
+			case GETBITL:
+				/* Get the second of two bit transitions (a long) */
+				/* This should be a zero bit */
+				if(Signal == TAP_LONG) {
+					/* This is a zero bit */
+					++Bitnum;
+					if (Bitnum == 9) {
+						if (!(CountBits(Databyte) & 1)) {
+							/* TODO: continue and hope the second header is uncorrupted */
+							return ArcError(Ctx, CBM_ERR_ARCHIVE, "Bad parity");
+						}
+						if (Bufidx < Size)
+							Buf[Bufidx] = (BYTE) Databyte;
+						++Bufidx;
+						State = BYTESEARCH;
+					} else {
+						Databyte >>= 1;
+						State = GETBIT0;
+					}
+				} else {
+					return ArcError(Ctx, CBM_ERR_ARCHIVE, "Data decoding error %d @%lu", Signal, Bufidx);
+					/* State = BYTESEARCH; */  /* To attempt to go on, switch states */
+				}
+				break;
+
+			case GETBITS:
+				/* Get the second of two bit transitions (a short) */
+				/* This should be a one bit */
+				if(Signal == TAP_SHORT) {
+					/* This is a one bit */
+					++Bitnum;
+					if (Bitnum == 9) {
+						if (CountBits(Databyte) & 1) {
+							/* TODO: continue and hope the second header is uncorrupted */
+							return ArcError(Ctx, CBM_ERR_ARCHIVE, "Bad parity");
+						}
+						if (Bufidx < Size)
+							Buf[Bufidx] = (BYTE) Databyte;
+						++Bufidx;
+						State = BYTESEARCH;
+					} else {
+						Databyte >>= 1;
+						Databyte |= 0x80;
+						State = GETBIT0;
+					}
+				} else {
+					return ArcError(Ctx, CBM_ERR_ARCHIVE, "Data decoding error %d @%lu", Signal, Bufidx);
+					/* State = BYTESEARCH; */  /* To attempt to go on, switch states */
+				}
+				break;
+		}
+	}
+	if (!GotCopy)
+		*FirstLen = Bufidx;
+	return (long) Bufidx;
+}
+
+/******************************************************************************
+* Open directory
+******************************************************************************/
+struct TAPState {
+	long Pos;				/* offset of the next pulse */
+	LONG Flen;				/* bytes of pulses left to read */
+	int Version;			/* TAP file version */
+	enum HeaderDataState HeadDataState;
+	char FileName[17];		/* name of the last file found, for display */
+	char RawName[17];		/* and as stored on tape */
+	int DelayedFile;		/* nonzero if a SEQ file is waiting for its length */
+	LONG DelayedFileLen;
+	long DelayedFilePos;	/* offset of its first data block */
+	int Pending;			/* nonzero if a program is waiting to be returned */
+	enum HeaderTypes PendingType;
+	LONG PendingLen;
+	long PendingPos;
+	WORD PendingLoadAddr;
+	long End;				/* offset of the end of the pulses */
+	long EntryPos;			/* offset of the current entry's data blocks, */
+	int EntrySeq;			/* nonzero if they're SEQ header blocks */
+	LONG EntryLen;
+	WORD EntryLoadAddr;		/* a program's load address */
+};
+
+static int OpenTAP(struct CbmDir *Dir)
+{
+	struct TAPState *S = (struct TAPState *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct SrcStream *InFile = Dir->InFile;
+	struct TAPHeader FileHeader;
 
-	if (fseek(InFile, 0, SEEK_SET) != 0) {
-		perror(ProgName);
-		return 2;
+	if (SrcSeek(InFile, 0) != 0) {
+		return SysError(Ctx);
 	}
-	if (fread(&FileHeader, sizeof(FileHeader), 1, InFile) != 1) {
-		fprintf(stderr,"%s: Archive format error\n", ProgName);
-		return 2;
+	if (SrcRead(&FileHeader, sizeof(FileHeader), 1, InFile) != 1) {
+		return ArcError(Ctx, CBM_ERR_ARCHIVE, "Archive format error");
 	}
 	if (FileHeader.Version != 0 && FileHeader.Version != 1) {
-		fprintf(stderr,"%s: TAP version %d is unsupported\n", ProgName, FileHeader.Version);
-		return 2;
+		return ArcError(Ctx, CBM_ERR_ARCHIVE, "TAP version %d is unsupported",
+						FileHeader.Version);
 	}
-	DisplayStart(ArchiveType, NULL);
 
 	DEBUGLOG("File version %d\n", (int) FileHeader.Version);
 	DEBUGLOG("%ld bytes long\n", (long) CF_LE_L(FileHeader.Size));
 	DEBUGLOG("%d platform\n", (int) FileHeader.Platform);
 	DEBUGLOG("%d video\n", (int) FileHeader.Video);
-	Flen = CF_LE_L(FileHeader.Size);
-	Totals->Version = FileHeader.Version;
+	S->Flen = CF_LE_L(FileHeader.Size);
+	S->Version = FileHeader.Version;
+	S->HeadDataState = AwaitingHeader;
+	S->Pos = sizeof(FileHeader);
+	S->End = S->Pos + S->Flen;
+	Dir->Totals.Version = FileHeader.Version;
+	return 0;
+}
 
-	/* Loop looking for header and data blocks */
-	while (Flen > 0) {
-		unsigned Bufidx = 0;
-		unsigned char Buffer[TAPE_HEADER_LEN * 2]; /* Buffer for both copies of header/data */
-		enum TapState State = SYNCSEARCH;
-		int GotCopy = 0;
-		int Databyte = 0;
-		int Bitnum = 0;
-		DEBUGLOG("Now reading %s\n", HeadDataState == AwaitingHeader ? "header" : "data");
-
-		/* Loop to read two duplicate blocks to then interpet */
-		for (; Flen > 0 &&
-			   (HeadDataState == AwaitingData || Bufidx < sizeof(Buffer)) &&
-			   GotCopy < 2;) {
-			int BytesRead;
-			enum TapSignal Signal;
-			BYTE Duration = TapReadDuration(InFile, FileHeader.Version, &BytesRead);
-			if(Duration == 0) {
-				DEBUGLOG("FLEN %ld\n", (long)Flen);
-				fprintf(stderr, "Error: corrupt file (too short)\n");
-				return 2;
-			}
-			Flen -= BytesRead;
-			Signal = SignalDuration(Duration);
-			if(Signal == TAP_INVALID) {
-				DEBUGLOG("Warning: too long/short pulse: %d\n", Duration);
-			}
+/******************************************************************************
+* Return the file named in the last header found, whose data blocks start at
+* Pos
+* Returns NEXT_SKIPPED if the filter rejects it, which still ends the call
+******************************************************************************/
+static int TapEntry(struct CbmDir *Dir, enum HeaderTypes HeaderType, LONG Len,
+		long Pos, WORD LoadAddr)
+{
+	struct TAPState *S = (struct TAPState *) Dir->State;
+	struct ArcTotals *Totals = &Dir->Totals;
+	const char *Type = TapeType(HeaderType);
+
+	S->EntryPos = Pos;
+	S->EntrySeq = HeaderType == HeaderTypeSeqHead;
+	S->EntryLen = Len;
+	S->EntryLoadAddr = LoadAddr;
+
+	if (!Wanted(Dir, S->FileName, Type, (unsigned long) (Len / 254 + 1)))
+		return NEXT_SKIPPED;
+	++Totals->ArchiveEntries;
+	Totals->TotalBlocks += (int) (Len / 254 + 1);
+	Totals->TotalBlocksNow = Totals->TotalBlocks;
+	Totals->TotalLength += Len;
+	SetEntry(Dir,
+		S->FileName,
+		Type,
+		(unsigned long) Len,
+		(unsigned) (Len / 254 + 1),
+		"Stored",
+		0,
+		(unsigned) (Len / 254 + 1),
+		-1L
+	);
+	/* The display name had its control characters removed */
+	strcpy(Dir->RawName, S->RawName);
+	return 1;
+}
 
-			switch (State) {
-				case SYNCSEARCH:
-					if(Signal == TAP_SHORT) {
-						++Bitnum;
-						if(Bitnum > SyncLen) {
-							/* We found a sync header; now look for the first byte */
-							State = BYTESEARCH;
-							Bitnum = 0;
-						}
-					} else
-						/* Start counting over */
-						Bitnum = 0;
-					break;
+/******************************************************************************
+* Read the next directory entry
+* Blocks are decoded until one completes a file
+******************************************************************************/
+static int NextTAP(struct CbmDir *Dir)
+{
+	struct TAPState *S = (struct TAPState *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	struct SrcStream *InFile = Dir->InFile;
+
+	if (S->Pending) {
+		/* A program found along with the end of a SEQ file */
+		S->Pending = 0;
+		return TapEntry(Dir, S->PendingType, S->PendingLen, S->PendingPos,
+				S->PendingLoadAddr);
+	}
 
-				case BYTESEARCH:
-					if(Signal == TAP_MARK)
-						/* Probably the start of a byte */
-						State = BYTELONG;
-					break;
+	if ((S->Flen > 0) && (SrcSeek(InFile, S->Pos) != 0)) {
+		return SysError(Ctx);
+	}
 
-				case BYTELONG:
-					if(Signal == TAP_LONG) {
-						/* It is indeed a start of byte signal */
-						State = GETBIT0;
-						Bitnum = 0;
-						Databyte = 0;
-					} else if(Signal == TAP_SHORT) {
-						/* Between the two copies of the tape header, there are 60 shorts.
-						 * Go to the start and wait for the first byte of the next header.
-						 * After we read two copies (in header mode) we can examine them */
-						++GotCopy;
-						State = SYNCSEARCH;
-					} else {
-						fprintf(stderr, "Error: data decoding error %d @%d\n", Signal, Bufidx);
-						return 2;
-						/* State = BYTESEARCH; */  /* To attempt to go on, switch states */
-					}
-					break;
-
-				case GETBIT0:
-					/* Get the first of two bit transitions (long or short) */
-					if(Signal == TAP_SHORT)
-						State = GETBITL;
-					else if(Signal == TAP_LONG)
-						State = GETBITS;
-					else {
-						fprintf(stderr, "Error: data decoding error %d @%d\n", Signal, Bufidx);
-						return 2;
-						/* State = BYTESEARCH; */  /* To attempt to go on, switch states */
-					}
-					break;
-
-				case GETBITL:
-					/* Get the second of two bit transitions (a long) */
-					/* This should be a zero bit */
-					if(Signal == TAP_LONG) {
-						/* This is a zero bit */
-						++Bitnum;
-						if (Bitnum == 9) {
-							if (!(CountBits(Databyte) & 1)) {
-								fprintf(stderr, "Error: bad parity\n");
-								/* TODO: continue and hope the second header is uncorrupted */
-								return 2;
-							}
-							if(HeadDataState == AwaitingHeader)
-								/* Only save header data */
-								Buffer[Bufidx] = (unsigned char) Databyte;
-							else
-								DEBUGLOG("%02x ", (int) Databyte);
-							++Bufidx;
-							State = BYTESEARCH;
-						} else {
-							Databyte >>= 1;
-							State = GETBIT0;
-						}
-					} else {
-						fprintf(stderr, "Error: data decoding error %d @%d\n", Signal, Bufidx);
-						return 2;
-						/* State = BYTESEARCH; */  /* To attempt to go on, switch states */
-					}
-					break;
-
-				case GETBITS:
-					/* Get the second of two bit transitions (a short) */
-					/* This should be a one bit */
-					if(Signal == TAP_SHORT) {
-						/* This is a one bit */
-						++Bitnum;
-						if (Bitnum == 9) {
-							if (CountBits(Databyte) & 1) {
-								fprintf(stderr, "Error: bad parity\n");
-								/* TODO: continue and hope the second header is uncorrupted */
-								return 2;
-							}
-							if(HeadDataState == AwaitingHeader)
-								/* Only save header data */
-								Buffer[Bufidx] = (unsigned char) Databyte;
-							else
-								DEBUGLOG("%02x ", (int) Databyte);
-							++Bufidx;
-							State = BYTESEARCH;
-						} else {
-							Databyte >>= 1;
-							Databyte |= 0x80;
-							State = GETBIT0;
-						}
-					} else {
-						fprintf(stderr, "Error: data decoding error %d @%d\n", Signal, Bufidx);
-						return 2;
-						/* State = BYTESEARCH; */  /* To attempt to go on, switch states */
-					}
-					break;
-			}
-		}
+	/* Loop looking for header and data blocks */
+	while (S->Flen > 0) {
+		unsigned char Buffer[TAPE_HEADER_LEN * 2]; /* Buffer for both copies of header/data */
+		unsigned long FirstLen;
+		long Read;
+		unsigned Bufidx;
+		int GotEntry = 0;
+		DEBUGLOG("Now reading %s\n", S->HeadDataState == AwaitingHeader ? "header" : "data");
+
+		/* Read two duplicate blocks to then interpet, only keeping headers */
+		if ((Read = ReadTapBlock(Dir, S->Version, &S->Flen, Buffer,
+						S->HeadDataState == AwaitingHeader ? sizeof(Buffer) : 0,
+						S->HeadDataState == AwaitingHeader, &FirstLen)) < 0)
+			return -1;
+		Bufidx = Read > (long) sizeof(Buffer) ? (unsigned) sizeof(Buffer) : (unsigned) Read;
+		S->Pos = SrcTell(InFile);
 
 		/* We have read two copies of a header or data block. Now examine them.
 		 * Skip checking if there is no data; probably EOF
 		 */
 		if(Bufidx) {
-			if(HeadDataState == AwaitingHeader) {
+			if(S->HeadDataState == AwaitingHeader) {
 				if(Bufidx < 2*MinHeaderSize) {
 					/* Something went wrong */
-					fprintf(stderr, "Error: corrupted data; minimum data underflow (%d < %d)\n", Bufidx, 2*MinHeaderSize);
-					return 2;
+					return ArcError(Ctx, CBM_ERR_ARCHIVE, "Corrupted data; minimum data underflow (%d < %d)", Bufidx, 2*MinHeaderSize);
 				} else {
 					/* Point to the first copy of the header block for now */
 					struct TapeHeader *GoodHeader = (struct TapeHeader *) Buffer;
@@ -2455,51 +5489,39 @@ static int DirTAP(FILE *InFile, enum ArchiveTypes ArchiveType,
 					DEBUGLOG("HeaderType %d %s\n", GoodHeader->HeaderType, TapeType((enum HeaderTypes) GoodHeader->HeaderType));
 
 					/* Match the countdown bytes and validate the checksum. */
-					if (CheckTapeHeader(GoodHeader, Bufidx/2, 0)) {
+					if (CheckTapeBlock((BYTE *) GoodHeader, Bufidx/2, 0)) {
 						/* Main header is bad; try the backup header instead */
 						DEBUGLOG("First header bad; trying second\n");
 						GoodHeader = (struct TapeHeader *) (Buffer + Bufidx/2);
-						if (CheckTapeHeader(GoodHeader, Bufidx/2, 1)) {
-							fprintf(stderr, "Error: Bad header\n");
-							return 2;
+						if (CheckTapeBlock((BYTE *) GoodHeader, Bufidx/2, 1)) {
+							return ArcError(Ctx, CBM_ERR_ARCHIVE, "Bad header");
 						}
 					}
 
-					if(DelayedFile && GoodHeader->HeaderType != HeaderTypeSeqData) {
+					if(S->DelayedFile && GoodHeader->HeaderType != HeaderTypeSeqData) {
 						/* A previous SEQ file is now finished & the size is known */
-						++Totals->ArchiveEntries;
-						Totals->TotalBlocks += (int) (DelayedFileLen / 254 + 1);
-						Totals->TotalBlocksNow = Totals->TotalBlocks;
-						Totals->TotalLength += DelayedFileLen;
-						DisplayEntry(
-							ConvertCBMName(FileName),
-							TapeType(HeaderTypeSeqHead),
-							(long) DelayedFileLen,
-							(unsigned) (DelayedFileLen / 254 + 1),
-							"Stored",
-							0,
-							(unsigned) (DelayedFileLen / 254 + 1),
-							-1L
-						);
-						DelayedFile = 0;
+						GotEntry = TapEntry(Dir, HeaderTypeSeqHead, S->DelayedFileLen,
+								S->DelayedFilePos, 0);
+						S->DelayedFile = 0;
 					}
 
-					if(GoodHeader->HeaderType == HeaderTypeEndOfTape)
+					if(GoodHeader->HeaderType == HeaderTypeEndOfTape) {
 						/* End of tape; stop looking */
-						break;
+						S->Flen = 0;
+						return GotEntry;
+					}
 
 					/* HeaderTypeSeqData contains only HeaderType and the rest is data */
 					if(GoodHeader->HeaderType == HeaderTypeSeqData) {
 						DEBUGLOG("Another %ld bytes of SEQ data\n", Bufidx/2 - sizeof(Countdown1) - 1);
 						/* Don't count Counter, HeaderType or Checksum in the length */
-						DelayedFileLen += Bufidx/2 - sizeof(Countdown1) - 2;
+						S->DelayedFileLen += Bufidx/2 - sizeof(Countdown1) - 2;
 
 					} else {
 						LONG Len;
 						int i;
 						if(Bufidx != 2*TAPE_HEADER_LEN) {
-							fprintf(stderr, "Error: data underflow (%d < %u)\n", Bufidx, 2*TAPE_HEADER_LEN);
-							return 2;
+							return ArcError(Ctx, CBM_ERR_ARCHIVE, "Data underflow (%d < %u)", Bufidx, 2*TAPE_HEADER_LEN);
 						}
 						DEBUGLOG("StartAddr %d\n", (int) CF_LE_W(GoodHeader->StartAddr));
 						DEBUGLOG("EndAddr %d\n", (int) CF_LE_W(GoodHeader->EndAddr));
@@ -2514,9 +5536,11 @@ static int DirTAP(FILE *InFile, enum ArchiveTypes ArchiveType,
 						/* This header type is entirely data after the HeaderType byte */
 						for (i=0; i < 16; ++i)
 							/* Strip off control characters, which some tapes use (e.g. fast loaders) */
-							FileName[i] = GoodHeader->FileName[i] < 0x80 && GoodHeader->FileName[i] >= 0x20 ? GoodHeader->FileName[i] : ' ';
-						FileName[sizeof(FileName)-1] = 0;
-						DEBUGLOG("Tape name: %s\n", FileName);
+							S->FileName[i] = GoodHeader->FileName[i] < 0x80 && GoodHeader->FileName[i] >= 0x20 ? GoodHeader->FileName[i] : ' ';
+						S->FileName[sizeof(S->FileName)-1] = 0;
+						memcpy(S->RawName, GoodHeader->FileName, sizeof(S->RawName)-1);
+						RawCBMName(S->RawName, S->RawName, sizeof(S->RawName)-1);
+						DEBUGLOG("Tape name: %s\n", S->FileName);
 
 						/* To calculate the length for SEQ files we need to loop over all its data
 						 * blocks and add up their lengths. The start/end addresses in the header
@@ -2529,32 +5553,28 @@ static int DirTAP(FILE *InFile, enum ArchiveTypes ArchiveType,
 						 * size.
 						 * Delay generation of a SEQ file until the size can be calculated */
 						if(GoodHeader->HeaderType == HeaderTypeSeqHead) {
-							DelayedFile = 1;
-							DelayedFileLen = 0;
-						} else {
-							++Totals->ArchiveEntries;
-							Totals->TotalBlocks += (int) (Len / 254 + 1);
-							Totals->TotalBlocksNow = Totals->TotalBlocks;
-							Totals->TotalLength += Len;
-							DisplayEntry(
-								ConvertCBMName(FileName),
-								TapeType((enum HeaderTypes) GoodHeader->HeaderType),
-								(long) Len,
-								(unsigned) (Len / 254 + 1),
-								"Stored",
-								0,
-								(unsigned) (Len / 254 + 1),
-								-1L
-							);
-						}
+							S->DelayedFile = 1;
+							S->DelayedFileLen = 0;
+							S->DelayedFilePos = S->Pos;
+						} else if (GotEntry) {
+							/* Return this one next time */
+							S->Pending = 1;
+							S->PendingType = (enum HeaderTypes) GoodHeader->HeaderType;
+							S->PendingLen = Len;
+							S->PendingPos = S->Pos;
+							S->PendingLoadAddr = CF_LE_W(GoodHeader->StartAddr);
+						} else
+							GotEntry = TapEntry(Dir,
+									(enum HeaderTypes) GoodHeader->HeaderType, Len,
+									S->Pos, CF_LE_W(GoodHeader->StartAddr));
 					}
 
 					if(GoodHeader->HeaderType == HeaderTypeSeqHead || GoodHeader->HeaderType == HeaderTypeSeqData) {
 						/* After a SEQ block always comes another header block */
-						HeadDataState = AwaitingHeader;
+						S->HeadDataState = AwaitingHeader;
 					} else
 						/* Next comes a data block */
-						HeadDataState = AwaitingData;
+						S->HeadDataState = AwaitingData;
 				}
 
 			} else /* AwaitingData */ {
@@ -2563,34 +5583,163 @@ static int DirTAP(FILE *InFile, enum ArchiveTypes ArchiveType,
 				DEBUGLOG("Skipping over %u bytes of data\n", Bufidx);
 
 				/* Next comes another header block */
-				HeadDataState = AwaitingHeader;
+				S->HeadDataState = AwaitingHeader;
 			}
 		}
 		DEBUGLOG("\n");
+		if (GotEntry)
+			return GotEntry;
 	}
 
-	if(DelayedFile) {
+	if(S->DelayedFile) {
 		/* A previous SEQ file is now finished & the size is known */
-		++Totals->ArchiveEntries;
-		Totals->TotalBlocks += (int) (DelayedFileLen / 254 + 1);
-		Totals->TotalBlocksNow = Totals->TotalBlocks;
-		Totals->TotalLength += DelayedFileLen;
-		DisplayEntry(
-			ConvertCBMName(FileName),
-			TapeType(HeaderTypeSeqHead),
-			(long) DelayedFileLen,
-			(unsigned) (DelayedFileLen / 254 + 1),
-			"Stored",
-			0,
-			(unsigned) (DelayedFileLen / 254 + 1),
-			-1L
-		);
-		DelayedFile = 0;
+		S->DelayedFile = 0;
+		return TapEntry(Dir, HeaderTypeSeqHead, S->DelayedFileLen,
+				S->DelayedFilePos, 0);
 	}
 
 	return 0;
 }
 
+/******************************************************************************
+* TAP data decoding
+* A program is in the data block following its header, and a SEQ file in the
+* header blocks following its own. Each block is decoded whole, and whichever
+* of its two copies has the right countdown and checksum is used.
+******************************************************************************/
+#define TAPE_DATA_LEN (sizeof(Countdown1) + 65536UL + 1)	/* largest program block */
+
+struct TAPDecoder {
+	LONG Flen;				/* bytes of pulses left */
+	int Seq;				/* nonzero if the data is in SEQ header blocks */
+	unsigned long Left;		/* bytes of the file still to be returned */
+	const BYTE *Block;		/* bytes of the last block not yet returned, */
+	unsigned long BlockLeft;
+	unsigned Blocks;		/* blocks read */
+	int Bad;				/* nonzero if a block had no good copy */
+	BYTE Buffer[TAPE_DATA_LEN * 2];	/* both copies of the last block */
+};
+
+/******************************************************************************
+* Decode the next block of the current entry
+* Returns 0 or -1 on error
+******************************************************************************/
+static int NextTapData(struct CbmDir *Dir, struct TAPDecoder *D)
+{
+	struct TAPState *S = (struct TAPState *) Dir->State;
+	struct CbmContext *Ctx = Dir->Ctx;
+	unsigned long Len, FirstLen, SecondLen, Skip;
+	long Read;
+	BYTE *Copy;
+
+	if ((!D->Seq && D->Blocks) || (D->Flen <= 0)) {
+		return ArcError(Ctx, CBM_ERR_ARCHIVE, "Entry is truncated");
+	}
+	/* SEQ blocks are read as headers, as NextTAP() does */
+	if ((Read = ReadTapBlock(Dir, S->Version, &D->Flen, D->Buffer,
+					D->Seq ? 2 * TAPE_HEADER_LEN : sizeof(D->Buffer), D->Seq,
+					&FirstLen)) < 0)
+		return -1;
+	Dir->Data.Pos = (unsigned long) SrcTell(Dir->InFile);
+	++D->Blocks;
+	if ((unsigned long) Read > sizeof(D->Buffer))
+		Read = (long) sizeof(D->Buffer);
+	if (FirstLen > (unsigned long) Read)
+		FirstLen = (unsigned long) Read;
+	SecondLen = (unsigned long) Read - FirstLen;
+
+	/* A block is its countdown, the header type of a SEQ block, the data and
+	   the checksum */
+	Skip = sizeof(Countdown1) + (D->Seq ? 1 : 0);
+	Len = D->Seq ? TAPE_HEADER_LEN : Skip + D->Left + 1;
+	if ((FirstLen == Len) && !CheckTapeBlock(D->Buffer, (int) Len, 0))
+		Copy = D->Buffer;
+	else if ((SecondLen == Len) &&
+			!CheckTapeBlock(D->Buffer + FirstLen, (int) Len, 1))
+		Copy = D->Buffer + FirstLen;
+	else {
+		/* Neither is good, so use the first whole one and say so at the end */
+		if (FirstLen >= Len)
+			Copy = D->Buffer;
+		else if (SecondLen >= Len)
+			Copy = D->Buffer + FirstLen;
+		else
+			return ArcError(Ctx, CBM_ERR_ARCHIVE, "Entry is truncated");
+		D->Bad = 1;
+	}
+	if (D->Seq && (Copy[sizeof(Countdown1)] != HeaderTypeSeqData)) {
+		return ArcError(Ctx, CBM_ERR_ARCHIVE, "Entry is truncated");
+	}
+
+	D->Block = Copy + Skip;
+	D->BlockLeft = Len - Skip - 1;
+	if (D->BlockLeft > D->Left)
+		D->BlockLeft = D->Left;
+	return 0;
+}
+
+/******************************************************************************
+* Copy up to Len bytes of the current entry, the Decode function for TAP
+* Returns the number of bytes, 0 at the end or -1 on error
+******************************************************************************/
+static long DecodeTAP(struct CbmDir *Dir, unsigned char *Out, size_t Len)
+{
+	struct TAPDecoder *D = (struct TAPDecoder *) Dir->Decoder;
+	size_t Done = 0;
+	size_t Chunk;
+
+	while ((Done < Len) && D->Left) {
+		if (!D->BlockLeft) {
+			if (NextTapData(Dir, D) < 0)
+				return -1;
+			continue;
+		}
+		Chunk = Len - Done;
+		if (Chunk > D->BlockLeft)
+			Chunk = (size_t) D->BlockLeft;
+		memcpy(Out + Done, D->Block, Chunk);
+		D->Block += Chunk;
+		D->BlockLeft -= Chunk;
+		D->Left -= Chunk;
+		Done += Chunk;
+	}
+
+	/* A block with no good copy is reported once everything has been
+	   returned */
+	if (!Done && D->Bad) {
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Checksum error");
+	}
+	return (long) Done;
+}
+
+/******************************************************************************
+* Set up to decode the current entry's blocks, a program's starting with its
+* load address
+******************************************************************************/
+static int DataTAP(struct CbmDir *Dir)
+{
+	struct TAPState *S = (struct TAPState *) Dir->State;
+	struct TAPDecoder *D;
+
+	if ((D = (struct TAPDecoder *) GetDecoder(Dir, sizeof(*D))) == NULL)
+		return -1;
+	D->Flen = (LONG) (S->End - S->EntryPos);
+	D->Seq = S->EntrySeq;
+	D->Left = (unsigned long) S->EntryLen;
+	D->BlockLeft = 0;
+	D->Blocks = 0;
+	D->Bad = 0;
+
+	if (!D->Seq) {
+		Dir->Data.Prefix[0] = (unsigned char) (S->EntryLoadAddr & 0xff);
+		Dir->Data.Prefix[1] = (unsigned char) ((S->EntryLoadAddr >> 8) & 0xff);
+		Dir->Data.PrefixLen = 2;
+	}
+	SetDataRun(Dir, (unsigned long) S->EntryPos, 0);
+	Dir->Data.Decode = DecodeTAP;
+	return 0;
+}
+
 
 
 /*---------------------------------------------------------------------------*/
@@ -2599,7 +5748,7 @@ static int DirTAP(FILE *InFile, enum ArchiveTypes ArchiveType,
 /******************************************************************************
 * Array of functions to determine archive types
 ******************************************************************************/
-bool (* const TestFunctions[])(FILE *, const char *) = {
+static bool (* const TestFunctions[])(struct SrcStream *, const char *) = {
 	IsC64_ARC,
 	IsC64_10,
 	IsC64_13,
@@ -2628,58 +5777,707 @@ bool (* const TestFunctions[])(FILE *, const char *) = {
 
 /******************************************************************************
 * Read the archive and determine which type it is
-* File is already open; name is used for P00 etc. type detection
+* Name is used for P00 etc. type detection
 ******************************************************************************/
-enum ArchiveTypes DetermineArchiveType(FILE *InFile, const char *FileName)
+enum ArchiveTypes DetermineSourceType(struct CbmSource *Src,
+		const char *FileName)
 {
 	enum ArchiveTypes ArchiveType;
+	struct SrcStream InFile;
 
+	SrcOpen(&InFile, Src);
 	for (ArchiveType = 0; TestFunctions[ArchiveType] != NULL; ++ArchiveType)
-		if ((*TestFunctions[ArchiveType])(InFile, FileName))
+		if ((*TestFunctions[ArchiveType])(&InFile, FileName))
 			break;
 
 	return ArchiveType;
 }
 
 /******************************************************************************
-* Array of functions to read archive directories
+* Check for one archive type alone, without trying any that come before it
 ******************************************************************************/
-int (* const DirFunctions[])(FILE *, enum ArchiveTypes, struct ArcTotals *,
-	DisplayStartFunc, DisplayEntryFunc) = {
-/* C64_ARC */	DirARC,
-/* C64_10 */ 	DirARC,
-/* C64_13 */ 	DirARC,
-/* C64_15 */ 	DirARC,
-/* C128_15 */	DirARC,
-/* LHA_SFX */	DirLHA,
-/* LHA */		DirLHA,
-/* Lynx */		DirLynx,
-/* LynxNew */	DirLynx,
-/* T64 */		DirT64,
-/* D64 */		DirD64,
-/* C1581 */		DirD64,
-/* X64 */		DirD64,
-/* P00 */		DirP00,
-/* S00 */		DirP00,
-/* U00 */		DirP00,
-/* R00 */		DirP00,
-/* D00 */		DirP00,
-/* X00 */		DirP00,
-/* N64 */		DirN64,
-/* LBR */		DirLBR,
-/* TAP */		DirTAP
-};
-
-/******************************************************************************
-* Read and display the archive directory
-******************************************************************************/
-int DirArchive(FILE *InFile, enum ArchiveTypes ArchiveType,
-		struct ArcTotals *Totals,
-		DisplayStartFunc DisplayStart, DisplayEntryFunc DisplayEntry)
+int CbmIsArchiveType(struct CbmSource *Src, enum ArchiveTypes ArchiveType,
+		const char *FileName)
 {
+	struct SrcStream InFile;
+
 	if (ArchiveType >= UnknownArchive)
-		return 3;
+		return 0;
+	SrcOpen(&InFile, Src);
+	return (*TestFunctions[ArchiveType])(&InFile, FileName);
+}
+
+/******************************************************************************
+* As DetermineSourceType() for an archive file that is already open
+******************************************************************************/
+enum ArchiveTypes DetermineArchiveType(FILE *InFile, const char *FileName)
+{
+	struct CbmFileSource FileSrc;
 
-	return DirFunctions[ArchiveType](InFile, ArchiveType, Totals,
-									 DisplayStart, DisplayEntry);
+	return DetermineSourceType(CbmInitFileSource(&FileSrc, InFile), FileName);
+}
+
+/******************************************************************************
+* Array of functions to read archive directories
+******************************************************************************/
+static const struct DirFormat {
+	int (*Open)(struct CbmDir *Dir);	/* returns 0 or -1 on error */
+	int (*Next)(struct CbmDir *Dir);	/* returns 1, 0 at end or -1 on error */
+	int (*Data)(struct CbmDir *Dir);	/* returns 0 or -1 on error; NULL if
+										   entries' data can't be read */
+	size_t StateSize;
+} DirFormats[] = {
+/* C64_ARC */	{OpenARC, NextARC, DataARC, sizeof(struct ARCState)},
+/* C64_10 */ 	{OpenARC, NextARC, DataARC, sizeof(struct ARCState)},
+/* C64_13 */ 	{OpenARC, NextARC, DataARC, sizeof(struct ARCState)},
+/* C64_15 */ 	{OpenARC, NextARC, DataARC, sizeof(struct ARCState)},
+/* C128_15 */	{OpenARC, NextARC, DataARC, sizeof(struct ARCState)},
+/* LHA_SFX */	{OpenLHA, NextLHA, DataLHA, sizeof(struct LHAState)},
+/* LHA */		{OpenLHA, NextLHA, DataLHA, sizeof(struct LHAState)},
+/* Lynx */		{OpenLynx, NextLynx, DataLynx, sizeof(struct LynxState)},
+/* LynxNew */	{OpenLynx, NextLynx, DataLynx, sizeof(struct LynxState)},
+/* T64 */		{OpenT64, NextT64, DataT64, sizeof(struct T64State)},
+/* D64 */		{OpenD64, NextD64, DataD64, sizeof(struct D64State)},
+/* C1581 */		{OpenD64, NextD64, DataD64, sizeof(struct D64State)},
+/* X64 */		{OpenD64, NextD64, DataD64, sizeof(struct D64State)},
+/* P00 */		{OpenP00, NextP00, DataP00, sizeof(struct X00State)},
+/* S00 */		{OpenP00, NextP00, DataP00, sizeof(struct X00State)},
+/* U00 */		{OpenP00, NextP00, DataP00, sizeof(struct X00State)},
+/* R00 */		{OpenP00, NextP00, DataP00, sizeof(struct X00State)},
+/* D00 */		{OpenP00, NextP00, DataP00, sizeof(struct X00State)},
+/* X00 */		{OpenP00, NextP00, DataP00, sizeof(struct X00State)},
+/* N64 */		{OpenN64, NextN64, DataN64, sizeof(struct N64State)},
+/* LBR */		{OpenLBR, NextLBR, DataLBR, sizeof(struct LBRState)},
+/* TAP */		{OpenTAP, NextTAP, DataTAP, sizeof(struct TAPState)}
+};
+
+/******************************************************************************
+* Set up a context with default options: all fields and no callbacks
+******************************************************************************/
+void CbmInitContext(struct CbmContext *Ctx)
+{
+	memset(Ctx, 0, sizeof(*Ctx));
+	Ctx->Fields = FIELD_ALL;
+}
+
+/******************************************************************************
+* Start reading an archive directory from Src, or from File if Src is NULL
+* Returns NULL on error, with the details left in the context
+******************************************************************************/
+static struct CbmDir *OpenDir(struct CbmContext *Ctx, struct CbmSource *Src,
+		FILE *File, enum ArchiveTypes ArchiveType)
+{
+	struct CbmDir *Dir;
+
+	Ctx->Error = CBM_OK;
+	Ctx->SysErrno = 0;
+	Ctx->ErrorMsg[0] = '\0';
+	errno = 0;
+
+	if (ArchiveType >= UnknownArchive) {
+		ArcError(Ctx, CBM_ERR_UNSUPPORTED, "Not a known Commodore archive");
+		return NULL;
+	}
+	if (Ctx->Hash != CBM_HASH_NONE) {
+		struct CbmHash Hash;
+		if (CbmHashInit(&Hash, Ctx->Hash) < 0) {
+			ArcError(Ctx, CBM_ERR_UNSUPPORTED, "Hash type isn't supported");
+			return NULL;
+		}
+	}
+	Ctx->EntryHash = "";
+
+	if (((Dir = (struct CbmDir *) calloc(1, sizeof(*Dir))) == NULL) ||
+		((Dir->State = calloc(1, DirFormats[ArchiveType].StateSize)) == NULL)) {
+		free(Dir);
+		ArcError(Ctx, CBM_ERR_MEMORY, "Out of memory");
+		return NULL;
+	}
+	if (!Src)
+		Src = CbmInitFileSource(&Dir->FileSrc, File);
+	SrcOpen(&Dir->Stream, Src);
+	Dir->Ctx = Ctx;
+	Dir->InFile = &Dir->Stream;
+	Dir->Type = ArchiveType;
+	Dir->Next = DirFormats[ArchiveType].Next;
+	/* The filter needs its fields even when the caller doesn't */
+	Dir->Fields = Ctx->Fields | (Ctx->Filter ? Ctx->Filter->Fields : 0);
+	Dir->Totals.BlocksFree = -1;
+
+	if (DirFormats[ArchiveType].Open(Dir) < 0) {
+		CbmCloseDir(Dir);
+		return NULL;
+	}
+	return Dir;
+}
+
+struct CbmDir *CbmOpenSource(struct CbmContext *Ctx, struct CbmSource *Src,
+		enum ArchiveTypes ArchiveType)
+{
+	return OpenDir(Ctx, Src, NULL, ArchiveType);
+}
+
+struct CbmDir *CbmOpenDir(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType)
+{
+	return OpenDir(Ctx, NULL, InFile, ArchiveType);
+}
+
+/******************************************************************************
+* Read the next directory entry
+* Returns 1 with the entry filled in, 0 at the end of the directory or -1 on
+* error, with the details left in the context. The entry's strings are valid
+* until the next call.
+******************************************************************************/
+int CbmNextEntry(struct CbmDir *Dir, struct CbmEntry *Entry)
+{
+	int Status;
+
+	if (Dir->Done)
+		return 0;
+
+	/* Filtered out entries are skipped here */
+	Dir->Data.Open = 0;
+	Dir->Hash[0] = '\0';
+	Dir->Hashed = 0;
+	do {
+		errno = 0;
+		Status = Dir->Next(Dir);
+	} while (Status == NEXT_SKIPPED);
+	if (Status > 0) {
+		/* Formats that don't hash while reading the directory do so here */
+		if (Dir->Ctx->Hash && !Dir->Hashed && DirFormats[Dir->Type].Data)
+			HashEntry(Dir, Dir->Entry.Name, 1);
+		*Entry = Dir->Entry;
+	} else
+		Dir->Done = 1;
+	return Status;
+}
+
+/******************************************************************************
+* Move on to the next sector in a chain
+* Returns 0 or -1 on error
+******************************************************************************/
+static int NextDataSector(struct CbmDir *Dir)
+{
+	struct EntryData *Data = &Dir->Data;
+	struct D64DataBlock Link;
+	long SectorOfs = LocationTS(Data->DiskType, Data->NextTrack,
+			Data->NextSector);
+
+	if (++Data->Blocks > DiskCapacity(Data->DiskType)) {
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "File chain loop detected");
+	}
+	if (SectorOfs < 0) {
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+	}
+	SectorOfs += (long) Data->HeaderOffset;
+	if (SrcSeek(Dir->InFile, SectorOfs) != 0) {
+		return SysError(Dir->Ctx);
+	}
+	if (SrcRead(&Link, sizeof(Link), 1, Dir->InFile) != 1) {
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+	}
+	Data->Pos = (unsigned long) SectorOfs + sizeof(Link);
+	Data->NextTrack = Link.NextTrack;
+	Data->NextSector = Link.NextSector;
+	/* The last sector's link holds the offset of its last byte instead */
+	if (Link.NextTrack)
+		Data->Left = BYTES_PER_SECTOR - sizeof(Link);
+	else
+		Data->Left = Link.NextSector >= sizeof(Link) ?
+			Link.NextSector - sizeof(Link) + 1 : 0;
+	return 0;
+}
+
+/******************************************************************************
+* Read the contents of the current entry, which may still be being read by a
+* Next function
+* Returns the number of bytes read, 0 at the end or -1 on error
+******************************************************************************/
+static long ReadData(struct CbmDir *Dir, void *Buf, size_t Len)
+{
+	struct EntryData *Data = &Dir->Data;
+	unsigned char *Out = (unsigned char *) Buf;
+	size_t Done = 0;
+
+	errno = 0;
+	if (!Data->Open) {
+		if (!DirFormats[Dir->Type].Data) {
+			return ArcError(Dir->Ctx, CBM_ERR_UNSUPPORTED,
+					"Can't read entries in this type of archive");
+		}
+		memset(Data, 0, sizeof(*Data));
+		if (DirFormats[Dir->Type].Data(Dir) < 0)
+			return -1;
+		Data->Open = 1;
+	}
+
+	if (Data->Decode) {
+		if (Data->PrefixLen && Len) {
+			Done = Len < Data->PrefixLen ? Len : Data->PrefixLen;
+			memcpy(Out, Data->Prefix + sizeof(Data->Prefix) - Data->PrefixLen,
+					Done);
+			Data->PrefixLen -= (unsigned) Done;
+			return (long) Done;
+		}
+		if (SrcSeek(Dir->InFile, (long) Data->Pos) != 0) {
+			return SysError(Dir->Ctx);
+		}
+		return Data->Decode(Dir, Out, Len);
+	}
+
+	while (Done < Len) {
+		size_t Chunk = Len - Done;
+		size_t Got;
+
+		if (Data->PrefixLen) {
+			if (Chunk > Data->PrefixLen)
+				Chunk = Data->PrefixLen;
+			memcpy(Out + Done, Data->Prefix + sizeof(Data->Prefix) -
+					Data->PrefixLen, Chunk);
+			Data->PrefixLen -= (unsigned) Chunk;
+			Done += Chunk;
+			continue;
+		}
+
+		if (!Data->Left) {
+			if (!Data->Chain || !Data->NextTrack)
+				break;
+			if (NextDataSector(Dir) < 0)
+				return -1;
+			continue;
+		}
+
+		if (Chunk > Data->Left)
+			Chunk = (size_t) Data->Left;
+		if (SrcSeek(Dir->InFile, (long) Data->Pos) != 0) {
+			return SysError(Dir->Ctx);
+		}
+		Got = SrcRead(Out + Done, 1, Chunk, Dir->InFile);
+		Done += Got;
+		Data->Pos += Got;
+		Data->Left -= Got;
+		if (Got < Chunk) {
+			if (errno) {
+				return SysError(Dir->Ctx);
+			}
+			/* The archive ends early */
+			if (Data->Chain) {
+				return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+			}
+			if (!Data->ToEnd)
+				ArcWarning(Dir->Ctx, "Entry is truncated");
+			Data->Left = 0;
+			break;
+		}
+	}
+	return (long) Done;
+}
+
+/******************************************************************************
+* Read the contents of the entry last returned by CbmNextEntry()
+* Returns the number of bytes read, 0 at the end or -1 on error
+******************************************************************************/
+long CbmReadEntry(struct CbmDir *Dir, void *Buf, size_t Len)
+{
+	if (!Dir->Data.Open && (Dir->Done || !Dir->Entry.Name)) {
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "No entry to read");
+	}
+	return ReadData(Dir, Buf, Len);
+}
+
+/******************************************************************************
+* Set up to find where the contents of the current entry are, rather than to
+* read them
+* Returns 0 or -1 on error
+******************************************************************************/
+static int LocateData(struct CbmDir *Dir)
+{
+	struct EntryData *Data = &Dir->Data;
+
+	errno = 0;
+	if (Dir->Done || !Dir->Entry.Name) {
+		return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "No entry to read");
+	}
+	if (!DirFormats[Dir->Type].Data) {
+		return ArcError(Dir->Ctx, CBM_ERR_UNSUPPORTED,
+				"Can't read entries in this type of archive");
+	}
+	memset(Data, 0, sizeof(*Data));
+	if (DirFormats[Dir->Type].Data(Dir) < 0)
+		return -1;
+	/* CbmReadEntry() starts at the beginning regardless, as with a hash */
+	Data->Open = 0;
+	return 0;
+}
+
+/******************************************************************************
+* Find where the contents of the entry last returned by CbmNextEntry() are
+* stored, when they're one run of bytes in the archive
+* Returns 1 with Extent filled in, 0 if they're stored some other way or -1 on
+* error
+******************************************************************************/
+int CbmEntryExtent(struct CbmDir *Dir, struct CbmExtent *Extent)
+{
+	struct EntryData *Data = &Dir->Data;
+	unsigned long Left;
+	long Size;
+
+	if (LocateData(Dir) < 0)
+		return -1;
+	if (Data->Chain || Data->Decode)
+		return 0;
+
+	if ((Size = SrcSize(Dir->InFile)) < 0) {
+		return SysError(Dir->Ctx);
+	}
+	Left = (unsigned long) Size > Data->Pos ? (unsigned long) Size - Data->Pos : 0;
+	if (Data->Left < Left)
+		Left = Data->Left;
+	else if ((Data->Left > Left) && !Data->ToEnd)
+		ArcWarning(Dir->Ctx, "Entry is truncated");
+
+	memcpy(Extent->Prefix, Data->Prefix, sizeof(Extent->Prefix));
+	Extent->PrefixLen = Data->PrefixLen;
+	Extent->Offset = Data->Pos;
+	Extent->Length = Left;
+	return 1;
+}
+
+/******************************************************************************
+* Find the slices of a disk image holding the contents of the entry last
+* returned by CbmNextEntry(), by following its chain of sectors
+* Returns the number of slices filled in, 0 if the contents aren't in a chain or
+* -1 on error
+******************************************************************************/
+long CbmEntrySlices(struct CbmDir *Dir, struct CbmSlice *Slices, unsigned Max)
+{
+	struct EntryData *Data = &Dir->Data;
+	unsigned Count = 0;
+	long Size;
+
+	if (LocateData(Dir) < 0)
+		return -1;
+	if (!Data->Chain)
+		return 0;
+
+	if ((Size = SrcSize(Dir->InFile)) < 0) {
+		return SysError(Dir->Ctx);
+	}
+	while (Data->NextTrack) {
+		if (NextDataSector(Dir) < 0)
+			return -1;
+		if (Data->Pos + Data->Left > (unsigned long) Size) {
+			return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+		}
+		if (!Data->Left)
+			continue;
+		if (Count >= Max) {
+			return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "File chain loop detected");
+		}
+		Slices[Count].Offset = Data->Pos;
+		Slices[Count].Length = (unsigned) Data->Left;
+		++Count;
+	}
+	return (long) Count;
+}
+
+/******************************************************************************
+* Random access to the contents of an entry
+* An entry in a chain of sectors is indexed by the number of each sector on the
+* disk, so any offset in it can be found without following the chain again.
+******************************************************************************/
+#define SECTOR_DATA (BYTES_PER_SECTOR - 2)	/* bytes after each sector's link */
+
+struct CbmFile {
+	struct CbmDir *Dir;
+	unsigned long Length;		/* bytes in the entry */
+	unsigned long Pos;			/* offset of the next byte to read */
+	unsigned char Prefix[2];	/* bytes that come before the data */
+	unsigned PrefixLen;
+	unsigned long Offset;		/* archive offset of a run, or the disk */
+	WORD *Sector;				/* sector number of each piece of a chain, */
+	unsigned Sectors;			/* or NULL for a run */
+};
+
+/******************************************************************************
+* Index the sectors of the current entry's chain, already set up in Dir->Data
+* Returns 0 or -1 on error
+******************************************************************************/
+static int IndexChain(struct CbmFile *File)
+{
+	struct CbmDir *Dir = File->Dir;
+	struct EntryData *Data = &Dir->Data;
+	unsigned Max = 0;
+	long Size;
+
+	if ((Size = SrcSize(Dir->InFile)) < 0) {
+		return SysError(Dir->Ctx);
+	}
+	File->Offset = Data->HeaderOffset;
+	while (Data->NextTrack) {
+		if (NextDataSector(Dir) < 0)
+			return -1;
+		if (Data->Pos + Data->Left > (unsigned long) Size) {
+			return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+		}
+		if (!Data->Left)
+			continue;
+		if (File->Sectors >= Max) {
+			/* The index doubles whenever it's full */
+			WORD *Sector = (WORD *) realloc(File->Sector,
+					(Max ? 2 * Max : 16) * sizeof(*Sector));
+			if (!Sector) {
+				return ArcError(Dir->Ctx, CBM_ERR_MEMORY, "Out of memory");
+			}
+			File->Sector = Sector;
+			Max = Max ? 2 * Max : 16;
+		}
+		File->Sector[File->Sectors++] = (WORD)
+			((Data->Pos - 2 - Data->HeaderOffset) / BYTES_PER_SECTOR);
+		/* Only the last sector can hold less than a full one */
+		File->Length += Data->Left;
+	}
+	return 0;
+}
+
+/******************************************************************************
+* Open the contents of the entry last returned by CbmNextEntry() for random
+* access
+* Returns the file, or NULL on error
+******************************************************************************/
+struct CbmFile *CbmOpenFile(struct CbmDir *Dir)
+{
+	struct EntryData *Data = &Dir->Data;
+	struct CbmFile *File;
+	struct CbmExtent Extent;
+	int Run;
+
+	if ((Run = CbmEntryExtent(Dir, &Extent)) < 0)
+		return NULL;
+	if (!Run && Data->Decode) {
+		/* A stored entry is read as it is, without checking it */
+		if (!Data->Stored) {
+			ArcError(Dir->Ctx, CBM_ERR_UNSUPPORTED, Dir->Type == TAP ?
+					"Can't seek in the files of a tape image" :
+					"Can't seek in a compressed entry");
+			return NULL;
+		}
+		if (Data->StoredLen > Data->Left) {
+			ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Entry is truncated");
+			return NULL;
+		}
+		memset(&Extent, 0, sizeof(Extent));
+		Extent.Offset = Data->Pos;
+		Extent.Length = Data->StoredLen;
+		Run = 1;
+	}
+	if ((File = (struct CbmFile *) calloc(1, sizeof(*File))) == NULL) {
+		ArcError(Dir->Ctx, CBM_ERR_MEMORY, "Out of memory");
+		return NULL;
+	}
+	File->Dir = Dir;
+	if (Run) {
+		memcpy(File->Prefix, Extent.Prefix, sizeof(File->Prefix));
+		File->PrefixLen = Extent.PrefixLen;
+		File->Offset = Extent.Offset;
+		File->Length = Extent.PrefixLen + Extent.Length;
+	} else if (IndexChain(File) < 0) {
+		CbmCloseFile(File);
+		return NULL;
+	}
+	return File;
+}
+
+/******************************************************************************
+* Read from the current position in a file opened with CbmOpenFile()
+* Returns the number of bytes read, 0 at the end or -1 on error
+******************************************************************************/
+long CbmReadFile(struct CbmFile *File, void *Buf, size_t Len)
+{
+	struct CbmDir *Dir = File->Dir;
+	unsigned char *Out = (unsigned char *) Buf;
+	size_t Done = 0;
+
+	errno = 0;
+	while ((Done < Len) && (File->Pos < File->Length)) {
+		unsigned long Left = File->Length - File->Pos;
+		unsigned long Pos;
+		size_t Chunk = Len - Done;
+
+		if (File->Pos < File->PrefixLen) {
+			Out[Done++] = File->Prefix[File->Pos++];
+			continue;
+		}
+		if (File->Sector) {
+			/* Up to the end of the sector holding Pos */
+			unsigned long InSector = File->Pos % SECTOR_DATA;
+			Pos = File->Offset + File->Sector[File->Pos / SECTOR_DATA] *
+				(unsigned long) BYTES_PER_SECTOR + 2 + InSector;
+			if (Left > SECTOR_DATA - InSector)
+				Left = SECTOR_DATA - InSector;
+		} else
+			Pos = File->Offset + File->Pos - File->PrefixLen;
+		if (Chunk > Left)
+			Chunk = (size_t) Left;
+
+		if (SrcSeek(Dir->InFile, (long) Pos) != 0) {
+			return SysError(Dir->Ctx);
+		}
+		if (SrcRead(Out + Done, 1, Chunk, Dir->InFile) != Chunk) {
+			if (errno) {
+				return SysError(Dir->Ctx);
+			}
+			return ArcError(Dir->Ctx, CBM_ERR_ARCHIVE, "Archive format error");
+		}
+		Done += Chunk;
+		File->Pos += Chunk;
+	}
+	return (long) Done;
+}
+
+/******************************************************************************
+* Set the position in a file opened with CbmOpenFile()
+* Returns 0 or -1 if it's past the end
+******************************************************************************/
+int CbmSeekFile(struct CbmFile *File, unsigned long Offset)
+{
+	if (Offset > File->Length) {
+		return ArcError(File->Dir->Ctx, CBM_ERR_ARCHIVE,
+				"Seek past the end of the entry");
+	}
+	File->Pos = Offset;
+	return 0;
+}
+
+unsigned long CbmFileLength(const struct CbmFile *File)
+{
+	return File->Length;
+}
+
+void CbmCloseFile(struct CbmFile *File)
+{
+	free(File->Sector);
+	free(File);
+}
+
+/******************************************************************************
+* Hash the current entry's contents, or nothing if Read is 0
+* A problem reading them only loses the hash, so it's reported as a warning
+* naming the entry, whose Name is as stored in the archive.
+* Returns the number of bytes hashed or -1 on error.
+******************************************************************************/
+#define HASH_BUF_SIZE 1024	/* bytes of an entry hashed at a time */
+
+static long HashEntry(struct CbmDir *Dir, const char *Name, int Read)
+{
+	struct CbmContext *Ctx = Dir->Ctx;
+	char AsciiName[80];
+	struct CbmHash Hash;
+	unsigned char Buf[HASH_BUF_SIZE];
+	unsigned long Total = 0;
+	long Got = 0;
+
+	Dir->Hashed = 1;
+	CbmHashInit(&Hash, Ctx->Hash);
+	Dir->Data.Open = 0;
+	while (Read && ((Got = ReadData(Dir, Buf, sizeof(Buf))) > 0)) {
+		CbmHashUpdate(&Hash, Buf, (size_t) Got);
+		Total += (unsigned long) Got;
+	}
+	/* CbmReadEntry() starts at the beginning again */
+	Dir->Data.Open = 0;
+
+	if (Got < 0) {
+		strncpy(AsciiName, Name, sizeof(AsciiName)-1);
+		AsciiName[sizeof(AsciiName)-1] = 0;
+		ArcWarning(Ctx, "%s: %s", ConvertCBMName(AsciiName), Ctx->ErrorMsg);
+		Ctx->Error = CBM_OK;
+		Ctx->SysErrno = 0;
+		Ctx->ErrorMsg[0] = '\0';
+		return -1;
+	}
+	CbmHashHex(&Hash, Dir->Hash);
+	return (long) Total;
+}
+
+/******************************************************************************
+* Return the archive title (e.g. the disk label), or NULL if it has none
+******************************************************************************/
+const char *CbmDirTitle(const struct CbmDir *Dir)
+{
+	return Dir->Title;
+}
+
+/******************************************************************************
+* Return how far into the archive the directory has been read
+******************************************************************************/
+unsigned long CbmDirOffset(const struct CbmDir *Dir)
+{
+	return Dir->Stream.Pos;
+}
+
+/******************************************************************************
+* Return the totals of the entries read so far
+******************************************************************************/
+const struct ArcTotals *CbmDirTotals(const struct CbmDir *Dir)
+{
+	return &Dir->Totals;
+}
+
+/******************************************************************************
+* Finish reading a directory; the file is left open
+******************************************************************************/
+void CbmCloseDir(struct CbmDir *Dir)
+{
+	free(Dir->Decoder);
+	free(Dir->State);
+	free(Dir);
+}
+
+/******************************************************************************
+* Pass each entry of an opened directory to the context's callbacks
+******************************************************************************/
+static int ListDir(struct CbmContext *Ctx, struct CbmDir *Dir,
+		struct ArcTotals *Totals)
+{
+	struct CbmEntry Entry;
+	int Status;
+	int Stop = 0;
+
+	if (Dir == NULL)
+		return Ctx->Error;
+	Ctx->DisplayStart(Ctx->UserData, Dir->Type, CbmDirTitle(Dir));
+
+	while ((Status = CbmNextEntry(Dir, &Entry)) > 0) {
+		Ctx->EntryHash = Entry.Hash;
+		Stop = Ctx->DisplayEntry(Ctx->UserData, Entry.Name, Entry.Type,
+				Entry.Length, Entry.Blocks, Entry.Storage, Entry.Compression,
+				Entry.BlocksNow, Entry.Checksum, Entry.RawName);
+		if (Stop)
+			break;
+	}
+
+	Ctx->EntryHash = "";
+	*Totals = *CbmDirTotals(Dir);
+	CbmCloseDir(Dir);
+	return Status < 0 ? Ctx->Error : Stop;
+}
+
+/******************************************************************************
+* Read the archive directory, passing each entry to the context's callbacks
+* Stops early if DisplayEntry returns nonzero, and returns that value.
+* Otherwise returns 0 or a CbmErrors code, with the details left in the context
+******************************************************************************/
+int DirSource(struct CbmContext *Ctx, struct CbmSource *Src,
+		enum ArchiveTypes ArchiveType, struct ArcTotals *Totals)
+{
+	return ListDir(Ctx, OpenDir(Ctx, Src, NULL, ArchiveType), Totals);
+}
+
+int DirArchive(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType, struct ArcTotals *Totals)
+{
+	return ListDir(Ctx, OpenDir(Ctx, NULL, InFile, ArchiveType), Totals);
 }
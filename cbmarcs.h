@@ -17,6 +17,9 @@
  * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
  */
 
+#ifndef CBMARCS_H
+#define CBMARCS_H
+
 /*
  * System type defined upon the following
  * __TURBOC__ : All Borland C/C++ versions
@@ -70,7 +73,7 @@ typedef long LONG;				/* 32 bits */
 #endif
 
 /* Codes for each identifiable archive type */
-/* Remember to change ArchiveFormats[], DirFunctions[] and TestFunctions[]
+/* Remember to change ArchiveFormats[], DirFormats[] and TestFunctions[]
    if you change these enums */
 enum ArchiveTypes {
 	C64_ARC,
@@ -100,7 +103,22 @@ enum ArchiveTypes {
 };
 
 extern const char * const ArchiveFormats[];
-extern int WideFormat;
+
+/* Entry fields that can be requested from DirArchive()
+   Fields that are not requested may be passed to DisplayEntryFunc as 0 if they
+   are expensive to find, in which case the totals made from them are also 0 */
+enum ArcFields {
+	FIELD_NAME = 0x01,
+	FIELD_TYPE = 0x02,
+	FIELD_LENGTH = 0x04,
+	FIELD_BLOCKS = 0x08,
+	FIELD_STORAGE = 0x10,
+	FIELD_COMPRESSION = 0x20,
+	FIELD_BLOCKSNOW = 0x40,
+	FIELD_CHECKSUM = 0x80,
+
+	FIELD_ALL = 0xff
+};
 
 struct ArcTotals {
 	int ArchiveEntries;
@@ -108,6 +126,8 @@ struct ArcTotals {
 	int TotalBlocksNow;
 	long TotalLength;
 	int DearcerBlocks;
+	int BlocksFree;		/* Free blocks on a disk image from its BAM,
+						   or -1 if it isn't one */
 
 	int Version;		/* Not a total, but still interesting info */
 						/* Version > 0 is an integer
@@ -115,12 +135,268 @@ struct ArcTotals {
 						   Version = 0 is unknown or n/a */
 };
 
+/* Where an archive is read from, so it needn't be in a stdio file. Each kind
+   of source is a struct starting with this one, set up by its CbmInit*Source()
+   function, but a program may supply its own. */
+struct CbmSource {
+	/* Read up to Len bytes at Offset into Buf. Returns the number of bytes
+	   read, which is short only at the end of the archive, or -1 on error
+	   with errno set */
+	long (*ReadAt)(struct CbmSource *Src, unsigned long Offset, void *Buf,
+			size_t Len);
+	/* Returns the length of the archive in bytes, or -1 on error */
+	long (*Size)(struct CbmSource *Src);
+	/* May be NULL. Returns Len bytes at Offset in place, valid as long as the
+	   source is, or NULL if they can't be; ReadAt is used then instead */
+	const void *(*Map)(struct CbmSource *Src, unsigned long Offset,
+			unsigned long Len);
+};
+
+/* An archive already in memory */
+struct CbmMemSource {
+	struct CbmSource Src;
+	const unsigned char *Data;
+	unsigned long Len;
+};
+
+/* An archive in an open file descriptor; on POSIX systems its file offset
+   isn't used, so the descriptor may be shared */
+struct CbmFdSource {
+	struct CbmSource Src;
+	int Fd;
+};
+
+/* An archive in an open stdio file */
+struct CbmFileSource {
+	struct CbmSource Src;
+	FILE *File;
+};
+
+/* Len bytes of another source starting at Offset, read as if they were all
+   of it, such as an archive found inside some other file */
+struct CbmSubSource {
+	struct CbmSource Src;
+	struct CbmSource *Parent;
+	unsigned long Offset;
+	unsigned long Len;
+};
+
+struct CbmSource *CbmInitMemSource(struct CbmMemSource *Mem, const void *Data,
+		unsigned long Len);
+struct CbmSource *CbmInitFdSource(struct CbmFdSource *FdSrc, int Fd);
+struct CbmSource *CbmInitFileSource(struct CbmFileSource *FileSrc, FILE *File);
+struct CbmSource *CbmInitSubSource(struct CbmSubSource *Sub,
+		struct CbmSource *Parent, unsigned long Offset, unsigned long Len);
 
 enum ArchiveTypes DetermineArchiveType(FILE *InFile, const char *FileName);
+enum ArchiveTypes DetermineSourceType(struct CbmSource *Src,
+		const char *FileName);
+/* Returns nonzero if the archive looks like the given type, without the
+   types DetermineSourceType() would try first getting a say */
+int CbmIsArchiveType(struct CbmSource *Src, enum ArchiveTypes ArchiveType,
+		const char *FileName);
 
-typedef void (*DisplayStartFunc)(enum ArchiveTypes ArchiveType, const char *Name);
-typedef	int (*DisplayEntryFunc)(const char *Name, const char *Type,
+/* Callbacks are passed the UserData pointer from the context */
+typedef void (*DisplayStartFunc)(void *UserData, enum ArchiveTypes ArchiveType,
+			const char *Name);
+/* Name is converted to ASCII for display; RawName is the name as stored in the
+   archive (normally PETSCII) without any $A0 padding.
+   Returning nonzero stops DirArchive() after this entry. */
+typedef	int (*DisplayEntryFunc)(void *UserData, const char *Name, const char *Type,
 			unsigned long Length, unsigned Blocks, const char *Storage,
-			int Compression, unsigned BlocksNow, long Checksum);
-int DirArchive(FILE *InFile, enum ArchiveTypes SDAType,
-		struct ArcTotals *Totals, DisplayStartFunc, DisplayEntryFunc);
+			int Compression, unsigned BlocksNow, long Checksum,
+			const char *RawName);
+/* Msg describes a problem that didn't stop the archive from being read */
+typedef void (*WarningFunc)(void *UserData, const char *Msg);
+
+/* Error codes returned by DirArchive() */
+enum CbmErrors {
+	CBM_OK = 0,
+	CBM_ERR_ARCHIVE = 2,		/* archive couldn't be read or is corrupt */
+	CBM_ERR_UNSUPPORTED = 3,	/* archive type or variant isn't supported */
+	CBM_ERR_MEMORY = 4			/* out of memory */
+};
+
+#define CBM_MAX_MSG 80			/* longest error message, including NUL */
+
+/* Hashes of entry contents that can be requested; see cbmhash.h */
+enum CbmHashTypes {
+	CBM_HASH_NONE,
+	CBM_HASH_XXH64,				/* xxHash64; needs a C99 compiler */
+	CBM_HASH_SHA1
+};
+
+#define CBM_MAX_HASH 41			/* longest hash in hex, including NUL */
+
+struct CbmFilter;		/* see cbmfilt.h */
+
+/* Everything needed to read one archive; the library keeps no other state,
+   so archives may be read concurrently using a separate context for each */
+struct CbmContext {
+	/* Options; these may be changed before each call */
+	unsigned Fields;				/* ArcFields wanted from DirArchive() */
+	DisplayStartFunc DisplayStart;	/* called once before the entries */
+	DisplayEntryFunc DisplayEntry;	/* called for each entry */
+	WarningFunc Warning;			/* may be NULL to ignore warnings */
+	const struct CbmFilter *Filter;	/* entries to read and total, or NULL */
+	int Hash;						/* CbmHashTypes to find for each entry */
+	void *UserData;					/* passed to each callback */
+
+	/* Results of the last call */
+	int Error;						/* CbmErrors code */
+	int SysErrno;					/* errno of a failed system call, or 0 */
+	char ErrorMsg[CBM_MAX_MSG];		/* description of the error */
+	/* Hash of the entry being passed to DisplayEntry, or "" if none was
+	   requested or the entry's contents can't be read */
+	const char *EntryHash;
+};
+
+/* One directory entry, as passed to DisplayEntryFunc */
+struct CbmEntry {
+	const char *Name;
+	const char *Type;
+	unsigned long Length;
+	unsigned Blocks;
+	const char *Storage;
+	int Compression;
+	unsigned BlocksNow;
+	long Checksum;
+	const char *RawName;
+	const char *Hash;		/* as the context's EntryHash */
+};
+
+/* An archive directory being read with CbmNextEntry() */
+struct CbmDir;
+
+void CbmInitContext(struct CbmContext *Ctx);
+int DirArchive(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType, struct ArcTotals *Totals);
+int DirSource(struct CbmContext *Ctx, struct CbmSource *Src,
+		enum ArchiveTypes ArchiveType, struct ArcTotals *Totals);
+
+/* Read a directory one entry at a time instead of through callbacks; only the
+   context's Fields, Filter, Hash and Warning are used. The file must stay open
+   until the directory is closed, but may be used in between calls. */
+struct CbmDir *CbmOpenDir(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType);
+struct CbmDir *CbmOpenSource(struct CbmContext *Ctx, struct CbmSource *Src,
+		enum ArchiveTypes ArchiveType);
+int CbmNextEntry(struct CbmDir *Dir, struct CbmEntry *Entry);
+/* Read the contents of the entry last returned by CbmNextEntry(), Len bytes at
+   a time. Returns the number of bytes read, 0 at the end of the entry or -1 on
+   error. ARC and LHA entries are expanded and TAP entries decoded as they're
+   read, and fail once all their bytes have been returned if those don't match
+   the entry's checksum or CRC. For squashed ARC entries and LHA methods other
+   than lh0, lh1, lh4 and lh5 this fails with CBM_ERR_UNSUPPORTED. Nothing is
+   read for an entry until this is called for it, unless a hash was
+   requested. */
+long CbmReadEntry(struct CbmDir *Dir, void *Buf, size_t Len);
+/* The checksums kept for each entry by ARC archives (the sum of its bytes) and
+   LHA archives (CRC-16 with polynomial 0xA001), as in struct CbmEntry. Each
+   adds Len more bytes to a checksum begun at 0 and returns it, so an entry's
+   contents can be checked a buffer at a time as they're read. */
+unsigned CbmArcSum(unsigned Sum, const void *Buf, size_t Len);
+unsigned CbmCRC16(unsigned Crc, const void *Buf, size_t Len);
+/* Where the contents of an entry are, when they're stored as one run of bytes
+   in the archive, so they can be copied straight from the archive file */
+struct CbmExtent {
+	unsigned char Prefix[2];	/* bytes that come before the run, such as */
+	unsigned PrefixLen;			/* the load address of a file in a T64 image */
+	unsigned long Offset;		/* start of the run in the archive */
+	unsigned long Length;		/* bytes in the run */
+};
+/* Find where the contents of the entry last returned by CbmNextEntry() are.
+   Returns 1 with Extent filled in, 0 if they aren't stored as a run (as in
+   disk images), so must be read with CbmReadEntry(), or -1 on error, with
+   CBM_ERR_UNSUPPORTED where CbmReadEntry() can't read them either. Any reading
+   of the entry with CbmReadEntry() starts over afterwards. */
+int CbmEntryExtent(struct CbmDir *Dir, struct CbmExtent *Extent);
+/* A piece of an entry's contents in a disk image, where each sector holds a
+   link to the next as well as data */
+struct CbmSlice {
+	unsigned long Offset;		/* start of the piece in the archive */
+	unsigned Length;			/* bytes in it */
+};
+#define CBM_MAX_SLICES 4166		/* most slices in a file, in an 8250 image */
+/* Find the pieces of a disk image that make up the contents of the entry last
+   returned by CbmNextEntry(), in order, by following its chain of sectors.
+   Returns the number of slices filled in, up to Max, which is 0 if there are
+   none or the contents aren't stored that way (see CbmEntryExtent()), or -1 on
+   error, such as a chain that loops or is longer than Max. Any reading of the
+   entry with CbmReadEntry() starts over afterwards. */
+long CbmEntrySlices(struct CbmDir *Dir, struct CbmSlice *Slices, unsigned Max);
+
+/* An entry open for random access */
+struct CbmFile;
+/* Open the contents of the entry last returned by CbmNextEntry() so they can be
+   read from any offset, as with the load address of a PRG or a record of a REL
+   file. The sectors of an entry in a disk image are indexed once here, so
+   seeking never follows its chain again. Stored ARC and LHA entries are read
+   as they are, without checking their checksums; compressed ones and files in
+   TAP images can't be opened, failing with CBM_ERR_UNSUPPORTED, and nor can
+   entries that can't be read with CbmReadEntry(). The file can be used until
+   the directory is closed, while other entries are read. Returns NULL on
+   error. */
+struct CbmFile *CbmOpenFile(struct CbmDir *Dir);
+/* Returns the number of bytes read, 0 at the end or -1 on error */
+long CbmReadFile(struct CbmFile *File, void *Buf, size_t Len);
+/* Set the offset of the next byte to read. Returns 0, or -1 if it's past the
+   end of the file. */
+int CbmSeekFile(struct CbmFile *File, unsigned long Offset);
+unsigned long CbmFileLength(const struct CbmFile *File);
+void CbmCloseFile(struct CbmFile *File);
+const char *CbmDirTitle(const struct CbmDir *Dir);
+
+/* Problems found in a disk image by CbmCheckDisk(); a chain stops being
+   followed at its first problem, while BAM problems are counted by sector */
+struct CbmDiskCheck {
+	unsigned Files;			/* files in the directory whose chains were followed */
+	unsigned CrossLinked;	/* chains running into a sector already in use */
+	unsigned Loops;			/* chains running back into themselves */
+	unsigned BadLinks;		/* chains linking to a sector not on the disk */
+	unsigned Orphans;		/* sectors allocated in the BAM but not used */
+	unsigned FreeUsed;		/* sectors in use but free in the BAM */
+};
+/* Follow the chain of every file in a D64 or X64 disk image directory once,
+   noting which sectors it uses, and compare them against the BAM. Each problem
+   is described through the context's Warning callback as well as counted.
+   Returns 0 when the check could be done, whatever it found, or -1 on error;
+   archives that aren't disk images fail with CBM_ERR_UNSUPPORTED. */
+int CbmCheckDisk(struct CbmDir *Dir, struct CbmDiskCheck *Check);
+
+/* Match a file name against a pattern as a Commodore drive does: ? matches any
+   character and * the rest of the name. Case matters unless IgnoreCase is
+   nonzero. Returns nonzero if it matches. */
+int CbmMatchName(const char *Pattern, const char *Name, int IgnoreCase);
+/* A disk image directory indexed by file name */
+struct CbmNameIndex;
+/* One file in the index */
+struct CbmIndexEntry {
+	char Name[17];			/* as in struct CbmEntry, without the $A0 padding */
+	const char *Type;
+	unsigned Blocks;
+	unsigned Number;		/* position in the directory listing, from 0 */
+	unsigned char Track;	/* first sector of the file */
+	unsigned char Sector;
+};
+/* Read the directory of a D64 or X64 disk image once and index its files by
+   name, so that looking one up needn't read the directory again or follow any
+   chains. The index keeps its own copy, so it can be used after the directory
+   is closed. Returns NULL on error; archives that aren't disk images fail
+   with CBM_ERR_UNSUPPORTED. */
+struct CbmNameIndex *CbmIndexNames(struct CbmDir *Dir);
+/* Find the first file matching Pattern after After, or from the start if it's
+   NULL. A name without wildcards is found through the hash table; a pattern
+   with them is matched against each name in the index. Returns NULL when
+   there are no more. */
+const struct CbmIndexEntry *CbmFindName(const struct CbmNameIndex *Index,
+		const char *Pattern, const struct CbmIndexEntry *After);
+void CbmFreeIndex(struct CbmNameIndex *Index);
+/* How far into the archive the directory has been read: the offset just past
+   the last byte read from it, which after CbmNextEntry() is the end of that
+   entry's header in archives that keep each header with its entry */
+unsigned long CbmDirOffset(const struct CbmDir *Dir);
+const struct ArcTotals *CbmDirTotals(const struct CbmDir *Dir);
+void CbmCloseDir(struct CbmDir *Dir);
+
+#endif
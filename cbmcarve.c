@@ -0,0 +1,212 @@
+/*
+ * cbmcarve.c
+ *
+ * Finding archives inside other data
+ * See cbmcarve.h for an overview
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include "cbmcarve.h"
+#include "cbmsrch.h"
+
+#define D64_BAM_OFFSET 0x16500UL	/* track 18, sector 0 of a 1541 disk */
+#define D64_SIZE 174848UL			/* 683 sectors */
+
+/* Bytes found at Offset from the start of archives of types First to Last,
+   as their readers look for them */
+struct CarveSig {
+	const char *Magic;
+	unsigned Len;
+	unsigned long Offset;
+	enum ArchiveTypes First;
+	enum ArchiveTypes Last;
+	unsigned long Size;			/* of the archive, or 0 to the end of the data */
+	const char *Name;			/* for types known by their file name */
+	/* Returns nonzero if the archive at Start is worth trying to read, for
+	   signatures too short to be trusted alone; NULL if it always is */
+	int (*Check)(struct CbmSource *Src, unsigned long Start);
+};
+
+/******************************************************************************
+* Check the method and sum of the first LHA entry header, which is stored
+* before it
+* "-lh" turns up in other data often enough that each one found would
+* otherwise be read as an archive of one garbage entry. The methods are the
+* ones the LHA reader can name.
+******************************************************************************/
+static int CheckLHA(struct CbmSource *Src, unsigned long Start)
+{
+	unsigned char Header[2 + 255];
+	unsigned Sum = 0;
+	unsigned i;
+
+	if ((Src->ReadAt(Src, Start, Header, 2) != 2) || (Header[0] < 5) ||
+		(Src->ReadAt(Src, Start + 2, Header + 2, Header[0]) != (long) Header[0]) ||
+		!Header[5] || !strchr("0123456789AB", Header[5]) ||
+		(Header[6] != '-'))
+		return 0;
+	for (i = 0; i < Header[0]; ++i)
+		Sum += Header[2 + i];
+	return (Sum & 0xff) == Header[1];
+}
+
+static const struct CarveSig CarveSigs[] = {
+	/* The BASIC line that runs the dearcer of an SDA, or the extractor of an
+	   SFX, after the load address and link */
+	{"\x9e(2063)\0\0\0", 10, 6, C64_10, C64_15, 0, NULL, NULL},
+	{"\x9e(7183)\0\0\0", 10, 6, C128_15, C128_15, 0, NULL, NULL},
+	{"\x97\x32\x30\x2c\x30\x3a\x8b\xc2\x28\x32", 10, 6, LHA_SFX, LHA_SFX, 0, NULL, NULL},
+	/* The method of the first entry, after the header length and sum */
+	{"-lh", 3, 2, LHA, LHA, 0, NULL, CheckLHA},
+	{" 1   LYNX ", 10, 0, Lynx, Lynx, 0, NULL, NULL},
+	{"\x97" "53280,0:\x97" "53281,0:\x97" "646,\xc2(", 25, 6, LynxNew, LynxNew, 0, NULL, NULL},
+	{"C64 tape", 8, 0, T64, T64, 0, NULL, NULL},
+	{"C64S tape", 9, 0, T64, T64, 0, NULL, NULL},
+	{"C64-TAPE-RAW", 12, 0, TAP, TAP, 0, NULL, NULL},
+	{"\x43\x15\x41\x64", 4, 0, X64, X64, 0, NULL, NULL},
+	{"C64\x01", 4, 0, N64, N64, 0, NULL, NULL},
+	{"DWB", 3, 0, LBR, LBR, 0, NULL, NULL},
+	/* Link to the first directory sector, DOS version 'A' and the unused byte
+	   of a single sided disk */
+	{"\x12\x01\x41\x00", 4, D64_BAM_OFFSET, D64, D64, D64_SIZE, "carved.d64", NULL}
+};
+#define NUM_SIGS (sizeof(CarveSigs) / sizeof(CarveSigs[0]))
+
+struct Carve {
+	struct CbmContext Open;		/* for reading the directory of each candidate */
+	struct CbmSource *Src;
+	unsigned long Size;
+	CbmCarveFunc Found;
+	void *UserData;
+	int Any;					/* nonzero once an archive has been found, */
+	unsigned long LastStart;	/* starting here, */
+	unsigned long LastRead;		/* with its directory read up to here */
+};
+
+/******************************************************************************
+* Look for an archive at Start of a type a signature is found in
+* Returns nonzero if the caller wants to stop, or with Open.Error set on error
+******************************************************************************/
+static int CarveAt(struct Carve *C, const struct CarveSig *Sig,
+		unsigned long Start)
+{
+	struct CbmSubSource Sub;
+	struct CbmDir *Dir;
+	struct CbmEntry Entry;
+	enum ArchiveTypes Type;
+	unsigned long Entries = 0;
+	unsigned long Read = 0;
+
+	/* Part of an archive already found */
+	if ((C->Any && (Start >= C->LastStart) && (Start < C->LastRead)) ||
+		(Sig->Check && !Sig->Check(C->Src, Start)))
+		return 0;
+
+	CbmInitSubSource(&Sub, C->Src, Start, Sig->Size ? Sig->Size : C->Size - Start);
+	for (Type = Sig->First; Type <= Sig->Last; ++Type)
+		if (CbmIsArchiveType(&Sub.Src, Type, Sig->Name))
+			break;
+	if ((Type > Sig->Last) || ((Dir = CbmOpenSource(&C->Open, &Sub.Src, Type)) == NULL))
+		return C->Open.Error == CBM_ERR_MEMORY;
+
+	/* A damaged archive is still worth knowing about if any of it can be read.
+	   Looking for the end of the directory can read into whatever follows, so
+	   only what was read for the entries counts. */
+	while (CbmNextEntry(Dir, &Entry) > 0) {
+		++Entries;
+		Read = CbmDirOffset(Dir);
+	}
+	CbmCloseDir(Dir);
+	if (C->Open.Error == CBM_ERR_MEMORY)
+		return 1;
+	if (!Entries)
+		return 0;
+
+	C->Any = 1;
+	C->LastStart = Start;
+	C->LastRead = Start + Read;
+	return C->Found(C->UserData, Start, Type, Entries);
+}
+
+/******************************************************************************
+* Called by the search for each signature found
+******************************************************************************/
+static int FoundSig(void *UserData, unsigned Pat, unsigned long Offset)
+{
+	struct Carve *C = (struct Carve *) UserData;
+	const struct CarveSig *Sig = &CarveSigs[Pat];
+
+	if ((Offset < Sig->Offset) ||
+		(Sig->Size && (Sig->Size > C->Size - (Offset - Sig->Offset))))
+		return 0;
+	return CarveAt(C, Sig, Offset - Sig->Offset);
+}
+
+/******************************************************************************
+* Look for archives anywhere in the data
+******************************************************************************/
+int CbmCarve(struct CbmContext *Ctx, struct CbmSource *Src,
+		CbmCarveFunc Found, void *UserData)
+{
+	struct CbmSearch Search;
+	struct Carve C;
+	long Size;
+	unsigned i;
+	int Status;
+
+	Ctx->Error = CBM_OK;
+	Ctx->SysErrno = 0;
+	Ctx->ErrorMsg[0] = '\0';
+
+	CbmSearchInit(&Search);
+	for (i = 0; i < NUM_SIGS; ++i)
+		CbmSearchAdd(&Search, CarveSigs[i].Magic, CarveSigs[i].Len);
+
+	errno = 0;
+	if ((Size = Src->Size(Src)) < 0) {
+		Ctx->SysErrno = errno;
+		Ctx->Error = CBM_ERR_UNSUPPORTED;
+		strcpy(Ctx->ErrorMsg, "Can't tell the size of the data");
+		return -1;
+	}
+
+	/* Candidates are only confirmed, so nothing about them is reported */
+	CbmInitContext(&C.Open);
+	C.Open.Fields = FIELD_NAME;
+	C.Src = Src;
+	C.Size = (unsigned long) Size;
+	C.Found = Found;
+	C.UserData = UserData;
+	C.Any = 0;
+	C.LastStart = C.LastRead = 0;
+
+	errno = 0;
+	if ((Status = CbmSearchSource(&Search, Src, FoundSig, &C)) < 0) {
+		Ctx->SysErrno = errno;
+		Ctx->Error = CBM_ERR_ARCHIVE;
+		strncpy(Ctx->ErrorMsg, errno ? strerror(errno) : "Read error",
+				CBM_MAX_MSG - 1);
+		Ctx->ErrorMsg[CBM_MAX_MSG - 1] = '\0';
+		return -1;
+	}
+	if (C.Open.Error == CBM_ERR_MEMORY) {
+		Ctx->Error = CBM_ERR_MEMORY;
+		strcpy(Ctx->ErrorMsg, C.Open.ErrorMsg);
+		return -1;
+	}
+	return Status;
+}
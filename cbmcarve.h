@@ -0,0 +1,56 @@
+/*
+ * cbmcarve.h
+ *
+ * Finding archives inside other data
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Raw dumps, such as hard disk images or captured downloads, can hold
+ * archives at any offset. The signatures of all the archive types that have
+ * one are looked for at once with cbmsrch.h in a single pass through a fixed
+ * buffer, so data of any size is scanned in the same memory. Each place a
+ * signature is found is only a candidate: the archive is confirmed by reading
+ * its directory from there through a struct CbmSubSource, with the usual
+ * readers, after a further check of signatures short enough to turn up by
+ * chance, such as LHA's. Archives without a signature, such as plain ARC
+ * files, can't be found this way; D64 images are found by the BAM of a 1541
+ * disk.
+ *
+ * An archive found inside another is reported as well, but not when it's
+ * inside the part of the one just found that its directory was read from,
+ * so the entries of an LHA archive or the LHA archive in an SFX file aren't
+ * reported as archives of their own.
+ */
+
+#ifndef CBMCARVE_H
+#define CBMCARVE_H
+
+#include "cbmarcs.h"
+
+/* Called for each archive found at Offset, with the number of entries read
+   from its directory. Returning nonzero stops the scan. */
+typedef int (*CbmCarveFunc)(void *UserData, unsigned long Offset,
+		enum ArchiveTypes ArchiveType, unsigned long Entries);
+
+/* Look for archives anywhere in Src, which must be able to tell its size.
+   Directories are read with a context of their own that asks only for names,
+   so none of Ctx's options or callbacks are used. Returns 0 when all of Src
+   was scanned, 1 if Found() stopped the scan or -1 on error, with the details
+   left in Ctx. */
+int CbmCarve(struct CbmContext *Ctx, struct CbmSource *Src,
+		CbmCarveFunc Found, void *UserData);
+
+#endif
@@ -0,0 +1,311 @@
+/*
+ * cbmcat.c
+ *
+ * Binary catalog format for archive directory listings
+ * See cbmcat.h for a description of the format
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "cbmcat.h"
+
+enum { MAX_CAT_PATH = 1025 };	/* longest path stored; longer ones are truncated */
+
+/******************************************************************************
+* Little-endian encoding
+* These work byte by byte so the host byte order and alignment do not matter
+******************************************************************************/
+static unsigned char *PutWord(unsigned char *Out, unsigned Num)
+{
+	*Out++ = (unsigned char) (Num & 0xff);
+	*Out++ = (unsigned char) ((Num >> 8) & 0xff);
+	return Out;
+}
+
+static unsigned char *PutLong(unsigned char *Out, unsigned long Num)
+{
+	Out = PutWord(Out, (unsigned) (Num & 0xffff));
+	return PutWord(Out, (unsigned) ((Num >> 16) & 0xffff));
+}
+
+static unsigned char *PutBytes(unsigned char *Out, const char *Str, unsigned Len)
+{
+	if (!Len)
+		return Out;		/* Str may be NULL, as for an untitled archive */
+	memcpy(Out, Str, Len);
+	return Out + Len;
+}
+
+static unsigned GetWord(const unsigned char *In)
+{
+	return In[0] | ((unsigned) In[1] << 8);
+}
+
+static unsigned long GetLong(const unsigned char *In)
+{
+	return GetWord(In) | ((unsigned long) GetWord(In + 2) << 16);
+}
+
+/* Sign extend a 32-bit value */
+static long GetSignedLong(const unsigned char *In)
+{
+	unsigned long Num = GetLong(In);
+	return (Num & 0x80000000UL) ? -(long) (0xffffffffUL - Num) - 1 : (long) Num;
+}
+
+/* Length of a string field, truncated to fit in a byte */
+static unsigned ShortLen(const char *Str)
+{
+	size_t Len = Str ? strlen(Str) : 0;
+	return Len > 255 ? 255 : (unsigned) Len;
+}
+
+/******************************************************************************
+* Write a record prefix and body
+******************************************************************************/
+static int WriteRecord(struct CatWriter *Writer, enum CatRecordTypes Type,
+		unsigned char *Record, unsigned char *End)
+{
+	unsigned BodyLen = (unsigned) (End - Record - CAT_PREFIX_LEN);
+
+	PutWord(Record, BodyLen);
+	Record[2] = (unsigned char) Type;
+	Record[3] = 0;
+	if (fwrite(Record, (size_t) (End - Record), 1, Writer->Out) != 1)
+		return 2;
+	return 0;
+}
+
+/******************************************************************************
+* Start a new catalog
+******************************************************************************/
+int CatWriteHeader(struct CatWriter *Writer, FILE *Out)
+{
+	unsigned char Header[CAT_HEADER_LEN];
+	unsigned char *Ptr = Header;
+
+	Writer->Out = Out;
+	Writer->Archives = 0;
+	Writer->Entries = 0;
+
+	Ptr = PutBytes(Ptr, CAT_MAGIC, 8);
+	Ptr = PutWord(Ptr, CAT_VERSION);
+	Ptr = PutWord(Ptr, CAT_HEADER_LEN);
+	PutLong(Ptr, 0);
+	if (fwrite(Header, sizeof(Header), 1, Out) != 1)
+		return 2;
+	return 0;
+}
+
+/******************************************************************************
+* Start the records for a new archive
+******************************************************************************/
+int CatWriteArchive(struct CatWriter *Writer, int ArchiveType,
+		const char *Format, const char *Title, const char *Path)
+{
+	unsigned char Record[CAT_PREFIX_LEN + 5 + 255 + 255 + MAX_CAT_PATH];
+	unsigned char *Ptr = Record + CAT_PREFIX_LEN;
+	unsigned FormatLen = ShortLen(Format);
+	unsigned TitleLen = ShortLen(Title);
+	size_t PathLen = strlen(Path);
+
+	if (PathLen > MAX_CAT_PATH)
+		PathLen = MAX_CAT_PATH;
+	*Ptr++ = (unsigned char) ArchiveType;
+	*Ptr++ = (unsigned char) FormatLen;
+	*Ptr++ = (unsigned char) TitleLen;
+	Ptr = PutWord(Ptr, (unsigned) PathLen);
+	Ptr = PutBytes(Ptr, Format, FormatLen);
+	Ptr = PutBytes(Ptr, Title, TitleLen);
+	Ptr = PutBytes(Ptr, Path, (unsigned) PathLen);
+
+	++Writer->Archives;
+	return WriteRecord(Writer, CAT_ARCHIVE, Record, Ptr);
+}
+
+/******************************************************************************
+* Write one archive entry
+******************************************************************************/
+int CatWriteEntry(struct CatWriter *Writer, unsigned long Length,
+		unsigned long Blocks, unsigned long BlocksNow, long Checksum,
+		int Compression, const char *Type, const char *Storage,
+		const char *Name)
+{
+	unsigned char Record[CAT_PREFIX_LEN + 21 + 3 * 255];
+	unsigned char *Ptr = Record + CAT_PREFIX_LEN;
+	unsigned TypeLen = ShortLen(Type);
+	unsigned StorageLen = ShortLen(Storage);
+	unsigned NameLen = ShortLen(Name);
+
+	Ptr = PutLong(Ptr, Length);
+	Ptr = PutLong(Ptr, Blocks);
+	Ptr = PutLong(Ptr, BlocksNow);
+	Ptr = PutLong(Ptr, (unsigned long) Checksum);
+	Ptr = PutWord(Ptr, (unsigned) Compression);
+	*Ptr++ = (unsigned char) TypeLen;
+	*Ptr++ = (unsigned char) StorageLen;
+	*Ptr++ = (unsigned char) NameLen;
+	Ptr = PutBytes(Ptr, Type, TypeLen);
+	Ptr = PutBytes(Ptr, Storage, StorageLen);
+	Ptr = PutBytes(Ptr, Name, NameLen);
+
+	++Writer->Entries;
+	return WriteRecord(Writer, CAT_ENTRY, Record, Ptr);
+}
+
+/******************************************************************************
+* Write the totals for the current archive
+******************************************************************************/
+int CatWriteTotals(struct CatWriter *Writer, long ArchiveEntries,
+		long TotalLength, long TotalBlocks, long TotalBlocksNow,
+		long DearcerBlocks, long Version, long BlocksFree)
+{
+	unsigned char Record[CAT_PREFIX_LEN + 28];
+	unsigned char *Ptr = Record + CAT_PREFIX_LEN;
+
+	Ptr = PutLong(Ptr, (unsigned long) ArchiveEntries);
+	Ptr = PutLong(Ptr, (unsigned long) TotalLength);
+	Ptr = PutLong(Ptr, (unsigned long) TotalBlocks);
+	Ptr = PutLong(Ptr, (unsigned long) TotalBlocksNow);
+	Ptr = PutLong(Ptr, (unsigned long) DearcerBlocks);
+	Ptr = PutLong(Ptr, (unsigned long) Version);
+	Ptr = PutLong(Ptr, (unsigned long) BlocksFree);
+	return WriteRecord(Writer, CAT_TOTALS, Record, Ptr);
+}
+
+/******************************************************************************
+* Finish the catalog
+******************************************************************************/
+int CatWriteEnd(struct CatWriter *Writer)
+{
+	unsigned char Record[CAT_FOOTER_LEN];
+	unsigned char *Ptr = Record + CAT_PREFIX_LEN;
+
+	Ptr = PutLong(Ptr, Writer->Archives);
+	Ptr = PutLong(Ptr, Writer->Entries);
+	Ptr = PutBytes(Ptr, CAT_END_MAGIC, 4);
+	return WriteRecord(Writer, CAT_END, Record, Ptr);
+}
+
+/******************************************************************************
+* Start reading a catalog held in memory
+* Returns 0 on success, 3 if the data is not a catalog
+******************************************************************************/
+int CatOpen(struct CatReader *Reader, const void *Data, unsigned long Len)
+{
+	const unsigned char *Bytes = (const unsigned char *) Data;
+
+	Reader->Data = Bytes;
+	Reader->Len = Len;
+	Reader->Pos = CAT_HEADER_LEN;
+	Reader->Complete = 0;
+
+	if ((Len < CAT_HEADER_LEN) || (memcmp(Bytes, CAT_MAGIC, 8) != 0)
+		|| (GetWord(Bytes + 8) != CAT_VERSION)
+		|| (GetWord(Bytes + 10) < CAT_HEADER_LEN))
+		return 3;
+	Reader->Pos = GetWord(Bytes + 10);
+
+	/* A catalog that was cut short is still readable up to the cut */
+	Reader->Complete = (Len >= CAT_HEADER_LEN + CAT_FOOTER_LEN)
+		&& (Bytes[Len - CAT_FOOTER_LEN + 2] == CAT_END)
+		&& (memcmp(Bytes + Len - 4, CAT_END_MAGIC, 4) == 0);
+	return 0;
+}
+
+/******************************************************************************
+* Decode the next record
+* Returns 1 if a record was decoded, 0 at the end of the catalog or -1 if the
+* catalog is corrupt
+* Strings in Record point into the catalog data and are not NUL terminated
+******************************************************************************/
+int CatNext(struct CatReader *Reader, struct CatRecord *Record)
+{
+	const unsigned char *Rec = Reader->Data + Reader->Pos;
+	const unsigned char *Body;
+	unsigned BodyLen;
+	long Compression;
+
+	if (Reader->Pos + CAT_PREFIX_LEN > Reader->Len)
+		return 0;
+	BodyLen = GetWord(Rec);
+	if (Reader->Pos + CAT_PREFIX_LEN + BodyLen > Reader->Len)
+		return -1;
+	Body = Rec + CAT_PREFIX_LEN;
+	Record->Type = (enum CatRecordTypes) Rec[2];
+
+	switch (Record->Type) {
+		case CAT_ARCHIVE:
+			if ((BodyLen < 5) ||
+				(BodyLen < 5U + Body[1] + Body[2] + GetWord(Body + 3)))
+				return -1;
+			Record->u.Archive.ArchiveType = Body[0];
+			Record->u.Archive.Format.Len = Body[1];
+			Record->u.Archive.Title.Len = Body[2];
+			Record->u.Archive.Path.Len = GetWord(Body + 3);
+			Record->u.Archive.Format.Str = Body + 5;
+			Record->u.Archive.Title.Str = Record->u.Archive.Format.Str + Body[1];
+			Record->u.Archive.Path.Str = Record->u.Archive.Title.Str + Body[2];
+			break;
+
+		case CAT_ENTRY:
+			if ((BodyLen < 21) ||
+				(BodyLen < 21U + Body[18] + Body[19] + Body[20]))
+				return -1;
+			Record->u.Entry.Length = GetLong(Body);
+			Record->u.Entry.Blocks = GetLong(Body + 4);
+			Record->u.Entry.BlocksNow = GetLong(Body + 8);
+			Record->u.Entry.Checksum = GetSignedLong(Body + 12);
+			Compression = (long) GetWord(Body + 16);
+			if (Compression >= 0x8000L)
+				Compression -= 0x10000L;
+			Record->u.Entry.Compression = (int) Compression;
+			Record->u.Entry.Type.Len = Body[18];
+			Record->u.Entry.Storage.Len = Body[19];
+			Record->u.Entry.Name.Len = Body[20];
+			Record->u.Entry.Type.Str = Body + 21;
+			Record->u.Entry.Storage.Str = Record->u.Entry.Type.Str + Body[18];
+			Record->u.Entry.Name.Str = Record->u.Entry.Storage.Str + Body[19];
+			break;
+
+		case CAT_TOTALS:
+			if (BodyLen < 24)
+				return -1;
+			Record->u.Totals.ArchiveEntries = GetSignedLong(Body);
+			Record->u.Totals.TotalLength = GetSignedLong(Body + 4);
+			Record->u.Totals.TotalBlocks = GetSignedLong(Body + 8);
+			Record->u.Totals.TotalBlocksNow = GetSignedLong(Body + 12);
+			Record->u.Totals.DearcerBlocks = GetSignedLong(Body + 16);
+			Record->u.Totals.Version = GetSignedLong(Body + 20);
+			/* Catalogs written before it was added leave it out */
+			Record->u.Totals.BlocksFree = (BodyLen < 28) ?
+				-1 : GetSignedLong(Body + 24);
+			break;
+
+		case CAT_END:
+			if (BodyLen < 12)
+				return -1;
+			Record->u.End.Archives = GetLong(Body);
+			Record->u.End.Entries = GetLong(Body + 4);
+			break;
+
+		default:
+			/* Skip unknown record types so the format can be extended */
+			break;
+	}
+
+	Reader->Pos += CAT_PREFIX_LEN + BodyLen;
+	return 1;
+}
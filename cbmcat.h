@@ -0,0 +1,166 @@
+/*
+ * cbmcat.h
+ *
+ * Binary catalog format for archive directory listings
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A catalog is a stream of records describing any number of archives. All
+ * numbers are little-endian regardless of the host and there is no padding,
+ * so a catalog can be read in place from a memory-mapped file.
+ *
+ * File header (16 bytes):
+ *   8  Magic "FVCBMCAT"
+ *   2  Format version (CAT_VERSION)
+ *   2  Header length (16)
+ *   4  Reserved (0)
+ *
+ * Each record starts with a 4 byte prefix:
+ *   2  Length of the record body following the prefix
+ *   1  Record type (enum CatRecordTypes)
+ *   1  Reserved (0)
+ *
+ * CAT_ARCHIVE body; starts each archive:
+ *   1  Archive type (enum ArchiveTypes)
+ *   1  Length of format name
+ *   1  Length of title (0 if none)
+ *   2  Length of archive path
+ *   n  Format name (ASCII, as ArchiveFormats[] without padding)
+ *   n  Title (as displayed)
+ *   n  Archive path
+ *
+ * CAT_ENTRY body; one per archive entry:
+ *   4  Length in bytes
+ *   4  Blocks
+ *   4  Blocks now
+ *   4  Checksum (signed; -1 if none)
+ *   2  Compression (signed)
+ *   1  Length of file type
+ *   1  Length of storage method
+ *   1  Length of name
+ *   n  File type (ASCII)
+ *   n  Storage method (ASCII)
+ *   n  Name (raw PETSCII as stored in the archive, $A0 padding removed)
+ *
+ * CAT_TOTALS body; ends each archive:
+ *   4  Number of entries
+ *   4  Total length in bytes
+ *   4  Total blocks
+ *   4  Total blocks now
+ *   4  Dearcer blocks
+ *   4  Version (signed; see struct ArcTotals)
+ *   4  Blocks free (signed; -1 if not a disk image; absent in older catalogs)
+ *
+ * CAT_END body; always the last 16 bytes of a complete catalog:
+ *   4  Number of archives
+ *   4  Number of entries
+ *   4  Magic "CEND"
+ */
+
+#ifndef CBMCAT_H
+#define CBMCAT_H
+
+#include <stdio.h>
+
+#define CAT_MAGIC "FVCBMCAT"
+#define CAT_END_MAGIC "CEND"
+enum {
+	CAT_VERSION = 1,
+	CAT_HEADER_LEN = 16,
+	CAT_PREFIX_LEN = 4,
+	CAT_FOOTER_LEN = 16
+};
+
+enum CatRecordTypes {
+	CAT_ARCHIVE = 1,
+	CAT_ENTRY = 2,
+	CAT_TOTALS = 3,
+	CAT_END = 0xff
+};
+
+/* A string inside the catalog; not NUL terminated */
+struct CatString {
+	const unsigned char *Str;
+	unsigned Len;
+};
+
+/* One decoded record; strings point into the catalog data */
+struct CatRecord {
+	enum CatRecordTypes Type;
+	union {
+		struct {
+			int ArchiveType;
+			struct CatString Format;
+			struct CatString Title;
+			struct CatString Path;
+		} Archive;
+		struct {
+			unsigned long Length;
+			unsigned long Blocks;
+			unsigned long BlocksNow;
+			long Checksum;
+			int Compression;
+			struct CatString Type;
+			struct CatString Storage;
+			struct CatString Name;
+		} Entry;
+		struct {
+			long ArchiveEntries;
+			long TotalLength;
+			long TotalBlocks;
+			long TotalBlocksNow;
+			long DearcerBlocks;
+			long Version;
+			long BlocksFree;
+		} Totals;
+		struct {
+			unsigned long Archives;
+			unsigned long Entries;
+		} End;
+	} u;
+};
+
+/* Catalog writer state */
+struct CatWriter {
+	FILE *Out;
+	unsigned long Archives;
+	unsigned long Entries;
+};
+
+int CatWriteHeader(struct CatWriter *Writer, FILE *Out);
+int CatWriteArchive(struct CatWriter *Writer, int ArchiveType,
+		const char *Format, const char *Title, const char *Path);
+int CatWriteEntry(struct CatWriter *Writer, unsigned long Length,
+		unsigned long Blocks, unsigned long BlocksNow, long Checksum,
+		int Compression, const char *Type, const char *Storage,
+		const char *Name);
+int CatWriteTotals(struct CatWriter *Writer, long ArchiveEntries,
+		long TotalLength, long TotalBlocks, long TotalBlocksNow,
+		long DearcerBlocks, long Version, long BlocksFree);
+int CatWriteEnd(struct CatWriter *Writer);
+
+/* Catalog reader state over a catalog held in memory */
+struct CatReader {
+	const unsigned char *Data;
+	unsigned long Len;
+	unsigned long Pos;
+	int Complete;		/* nonzero if the catalog ends with a valid footer */
+};
+
+int CatOpen(struct CatReader *Reader, const void *Data, unsigned long Len);
+int CatNext(struct CatReader *Reader, struct CatRecord *Record);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * cbmdup.c
+ *
+ * Finding archive entries with the same contents
+ * See cbmdup.h for an overview
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "cbmdup.h"
+
+#define DUP_MIN_SLOTS 1024
+#define DUP_MAX_RECS 0xfffffffeUL	/* record numbers plus 1 must fit */
+
+/******************************************************************************
+* Start an empty table
+******************************************************************************/
+void CbmDupInit(struct CbmDupTable *Table)
+{
+	memset(Table, 0, sizeof(*Table));
+}
+
+/******************************************************************************
+* Free everything in a table
+******************************************************************************/
+void CbmDupFree(struct CbmDupTable *Table)
+{
+	free(Table->Rec);
+	free(Table->Slot);
+	CbmDupInit(Table);
+}
+
+/******************************************************************************
+* Returns the first slot to look in for a fingerprint
+* The fingerprint is already a good hash, so some of it is used as is
+******************************************************************************/
+static CbmDupIndex SlotOf(const struct CbmDupTable *Table,
+		const unsigned char *Fp, unsigned long Length)
+{
+	unsigned long h = ((unsigned long) Fp[0] << 24) | ((unsigned long) Fp[1] << 16) |
+		((unsigned long) Fp[2] << 8) | Fp[3];
+
+	return (CbmDupIndex) ((h ^ Length) & (Table->Slots - 1));
+}
+
+/******************************************************************************
+* Find the slot for a set, or the empty one where it would go
+******************************************************************************/
+static CbmDupIndex FindSlot(const struct CbmDupTable *Table,
+		const unsigned char *Fp, unsigned long Length)
+{
+	CbmDupIndex Slot = SlotOf(Table, Fp, Length);
+
+	while (Table->Slot[Slot]) {
+		const struct CbmDupRec *Rec = &Table->Rec[Table->Slot[Slot] - 1];
+		if ((Rec->Length == Length) && !memcmp(Rec->Fp, Fp, CBM_DUP_FP_LEN))
+			break;
+		Slot = (Slot + 1) & (Table->Slots - 1);
+	}
+	return Slot;
+}
+
+/******************************************************************************
+* Double the number of slots, keeping the table at most half full
+* Returns 0 or -1 if out of memory
+******************************************************************************/
+static int GrowSlots(struct CbmDupTable *Table)
+{
+	CbmDupIndex *Old = Table->Slot;
+	CbmDupIndex OldSlots = Table->Slots;
+	CbmDupIndex NewSlots = OldSlots ? OldSlots * 2 : DUP_MIN_SLOTS;
+	CbmDupIndex i;
+
+	if ((NewSlots < OldSlots) || ((CbmDupIndex) (size_t) NewSlots != NewSlots) ||
+		((Table->Slot = (CbmDupIndex *) calloc((size_t) NewSlots,
+				sizeof(*Table->Slot))) == NULL)) {
+		Table->Slot = Old;
+		return -1;
+	}
+	Table->Slots = NewSlots;
+	for (i = 0; i < OldSlots; ++i)
+		if (Old[i]) {
+			const struct CbmDupRec *Rec = &Table->Rec[Old[i] - 1];
+			Table->Slot[FindSlot(Table, Rec->Fp, Rec->Length)] = Old[i];
+		}
+	free(Old);
+	return 0;
+}
+
+/******************************************************************************
+* Make room for another record
+* Returns 0 or -1 if out of memory
+******************************************************************************/
+static int GrowRecs(struct CbmDupTable *Table)
+{
+	struct CbmDupRec *New;
+	unsigned long Max = Table->Max ? Table->Max * 2UL : 4096UL;
+
+	if ((Max > DUP_MAX_RECS) || (Max < Table->Max))
+		Max = DUP_MAX_RECS;
+	if ((Max <= Table->Max) ||
+		((size_t) Max > (size_t) -1 / sizeof(*New)) ||
+		((New = (struct CbmDupRec *) realloc(Table->Rec,
+				(size_t) Max * sizeof(*New))) == NULL))
+		return -1;
+	Table->Rec = New;
+	Table->Max = (CbmDupIndex) Max;
+	return 0;
+}
+
+/******************************************************************************
+* Convert the start of a hex hash into a fingerprint
+* Returns 0 or -1 if it's too short
+******************************************************************************/
+static int ParseFp(unsigned char *Fp, const char *Hash)
+{
+	int i;
+
+	for (i = 0; i < CBM_DUP_FP_LEN * 2; ++i) {
+		int Digit;
+		if ((Hash[i] >= '0') && (Hash[i] <= '9'))
+			Digit = Hash[i] - '0';
+		else if ((Hash[i] >= 'a') && (Hash[i] <= 'f'))
+			Digit = Hash[i] - 'a' + 10;
+		else
+			return -1;
+		if (i & 1)
+			Fp[i / 2] = (unsigned char) (Fp[i / 2] | Digit);
+		else
+			Fp[i / 2] = (unsigned char) (Digit << 4);
+	}
+	return 0;
+}
+
+/******************************************************************************
+* Add an entry with the given content hash (in hex, as from CbmHashHex())
+* Archive and Entry are the caller's; they're only stored.
+* Returns 0, or -1 if out of memory or the hash is too short
+******************************************************************************/
+int CbmDupAdd(struct CbmDupTable *Table, const char *Hash,
+		unsigned long Length, unsigned long Archive, unsigned long Entry)
+{
+	struct CbmDupRec *Rec;
+	CbmDupIndex Slot;
+	CbmDupIndex Num = Table->Len;
+	unsigned char Fp[CBM_DUP_FP_LEN];
+
+	if (ParseFp(Fp, Hash) < 0)
+		return -1;
+	if ((Table->Len >= Table->Max) && (GrowRecs(Table) < 0))
+		return -1;
+	if ((Table->Sets >= Table->Slots / 2) && (GrowSlots(Table) < 0))
+		return -1;
+
+	Rec = &Table->Rec[Num];
+	memcpy(Rec->Fp, Fp, sizeof(Fp));
+	Rec->Length = (CbmDupIndex) Length;
+	Rec->Archive = (CbmDupIndex) Archive;
+	Rec->Entry = (CbmDupIndex) Entry;
+	Slot = FindSlot(Table, Fp, Rec->Length);
+
+	if (Table->Slot[Slot]) {
+		/* Add to the end of the set, after its last record */
+		struct CbmDupRec *Last = &Table->Rec[Table->Slot[Slot] - 1];
+		Rec->Next = Last->Next;
+		Rec->Count = 0;
+		Last->Next = Num;
+		++Table->Rec[Rec->Next].Count;
+	} else {
+		/* Start a new set */
+		Rec->Next = Num;
+		Rec->Count = 1;
+		++Table->Sets;
+	}
+	Table->Slot[Slot] = Num + 1;
+	++Table->Len;
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * cbmdup.h
+ *
+ * Finding archive entries with the same contents
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each entry is recorded as a fingerprint, the first 64 bits of its content
+ * hash, together with its length and its location as an archive number and
+ * entry number, which is all that's needed to find it again. Entries with the
+ * same fingerprint and length are linked into a set, a circular list in the
+ * order they were added. A hash table of 32-bit record numbers finds an
+ * entry's set, so each entry takes about 36 bytes and tens of millions of
+ * them fit in memory. Names aren't kept, since only those
+ * of the duplicates are wanted in the end; the caller can read them again.
+ */
+
+#ifndef CBMDUP_H
+#define CBMDUP_H
+
+#include "cbmarcs.h"
+
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+typedef uint32_t CbmDupIndex;	/* 32 bits */
+#else
+typedef unsigned long CbmDupIndex;
+#endif
+
+#define CBM_DUP_FP_LEN 8		/* bytes of fingerprint */
+
+struct CbmDupRec {
+	unsigned char Fp[CBM_DUP_FP_LEN];
+	CbmDupIndex Length;
+	CbmDupIndex Archive;		/* caller's numbers for where the entry is */
+	CbmDupIndex Entry;
+	CbmDupIndex Next;			/* next record in the set; the last one's
+								   is the first */
+	CbmDupIndex Count;			/* records in the set if this is the first
+								   one, otherwise 0 */
+};
+
+struct CbmDupTable {
+	struct CbmDupRec *Rec;		/* in the order they were added */
+	CbmDupIndex Len;
+	CbmDupIndex Max;			/* records allocated */
+	CbmDupIndex *Slot;			/* last record of a set plus 1, or 0 */
+	CbmDupIndex Slots;			/* a power of 2 */
+	CbmDupIndex Sets;
+};
+
+/* A record is a duplicate if another has the same contents */
+#define CBM_DUP_IS_DUP(Rec) ((Rec)->Count != 1)
+
+void CbmDupInit(struct CbmDupTable *Table);
+int CbmDupAdd(struct CbmDupTable *Table, const char *Hash,
+		unsigned long Length, unsigned long Archive, unsigned long Entry);
+void CbmDupFree(struct CbmDupTable *Table);
+
+#endif
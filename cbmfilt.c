@@ -0,0 +1,327 @@
+/*
+ * cbmfilt.c
+ *
+ * Archive entry filter expressions
+ * See cbmfilt.h for the expression syntax
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include "cbmarcs.h"
+#include "cbmfilt.h"
+
+/* Filter instructions */
+enum FilterOps {
+	FOP_NAME,		/* push whether the name matches Str */
+	FOP_TYPE,		/* push whether the type is Str */
+	FOP_BLOCKS,		/* push whether the blocks are Rel Num */
+	FOP_NOT,		/* negate the top of the stack */
+	FOP_AND,		/* replace the top two with their conjunction */
+	FOP_OR			/* replace the top two with their disjunction */
+};
+
+/* Relations */
+enum FilterRels {
+	REL_EQ,
+	REL_NE,
+	REL_LT,
+	REL_LE,
+	REL_GT,
+	REL_GE
+};
+
+/* Characters that end an unquoted value */
+static const char OperatorChars[] = "()!=<>&|\"";
+
+/* Compiler state */
+struct FilterParser {
+	const char *Pos;		/* next character of the expression */
+	struct CbmFilter *Filter;
+	int Depth;				/* results on the stack when run */
+	int Error;
+};
+
+static int NoCaseEqual(const char *Str1, const char *Str2)
+{
+	for (; *Str1 && *Str2; ++Str1, ++Str2)
+		if (toupper((unsigned char) *Str1) != toupper((unsigned char) *Str2))
+			return 0;
+	return *Str1 == *Str2;
+}
+
+/******************************************************************************
+* Append an instruction to the program
+* Pushes is the change it makes to the stack depth
+******************************************************************************/
+static struct CbmFilterOp *Emit(struct FilterParser *P, enum FilterOps Op,
+		int Pushes)
+{
+	struct CbmFilterOp *FOp;
+
+	if (P->Filter->Len >= FILTER_MAX_OPS) {
+		P->Error = 1;
+		return NULL;
+	}
+	FOp = &P->Filter->Prog[P->Filter->Len++];
+	memset(FOp, 0, sizeof(*FOp));
+	FOp->Op = (unsigned char) Op;
+	P->Depth += Pushes;
+	return FOp;
+}
+
+static void SkipSpace(struct FilterParser *P)
+{
+	while (isspace((unsigned char) *P->Pos))
+		++P->Pos;
+}
+
+/******************************************************************************
+* Consume an operator, or a keyword that isn't just the start of a longer word
+* Returns nonzero if it was there
+******************************************************************************/
+static int Accept(struct FilterParser *P, const char *Token)
+{
+	size_t Len = strlen(Token);
+	size_t i;
+
+	SkipSpace(P);
+	for (i = 0; i < Len; ++i)
+		if (tolower((unsigned char) P->Pos[i]) != Token[i])
+			return 0;
+	if (isalpha((unsigned char) Token[0]) && P->Pos[Len] &&
+		!isspace((unsigned char) P->Pos[Len]) && !strchr(OperatorChars, P->Pos[Len]))
+		return 0;
+	P->Pos += Len;
+	return 1;
+}
+
+/******************************************************************************
+* Read a value, quoted or not, into Value of size MaxLen
+* Returns nonzero if one was there
+******************************************************************************/
+static int ReadValue(struct FilterParser *P, char *Value, size_t MaxLen)
+{
+	size_t Len = 0;
+	int Quoted;
+
+	SkipSpace(P);
+	if ((Quoted = (*P->Pos == '"')) != 0)
+		++P->Pos;
+	while (*P->Pos && (Quoted ? (*P->Pos != '"') :
+		(!isspace((unsigned char) *P->Pos) && !strchr(OperatorChars, *P->Pos)))) {
+		if (Len + 1 >= MaxLen)
+			return 0;
+		Value[Len++] = *P->Pos++;
+	}
+	Value[Len] = '\0';
+	if (Quoted) {
+		if (*P->Pos != '"')
+			return 0;
+		++P->Pos;
+		return 1;
+	}
+	return Len > 0;
+}
+
+/******************************************************************************
+* Compile one comparison
+******************************************************************************/
+static void ParseCompare(struct FilterParser *P)
+{
+	struct CbmFilterOp *FOp;
+	enum FilterOps Op;
+	enum FilterRels Rel;
+	char Value[FILTER_MAX_STR];
+
+	if (Accept(P, "name")) {
+		Op = FOP_NAME;
+		P->Filter->Fields |= FIELD_NAME;
+	} else if (Accept(P, "type")) {
+		Op = FOP_TYPE;
+		P->Filter->Fields |= FIELD_TYPE;
+	} else if (Accept(P, "blocks")) {
+		Op = FOP_BLOCKS;
+		P->Filter->Fields |= FIELD_BLOCKS;
+	} else {
+		P->Error = 1;
+		return;
+	}
+
+	/* Check the two character relations first */
+	if (Accept(P, "!="))
+		Rel = REL_NE;
+	else if (Accept(P, "<="))
+		Rel = REL_LE;
+	else if (Accept(P, ">="))
+		Rel = REL_GE;
+	else if (Accept(P, "=="))
+		Rel = REL_EQ;
+	else if (Accept(P, "="))
+		Rel = REL_EQ;
+	else if (Accept(P, "<"))
+		Rel = REL_LT;
+	else if (Accept(P, ">"))
+		Rel = REL_GT;
+	else {
+		P->Error = 1;
+		return;
+	}
+
+	if (!ReadValue(P, Value, sizeof(Value))) {
+		P->Error = 1;
+		return;
+	}
+
+	if (Op == FOP_BLOCKS) {
+		unsigned long Num = 0;
+		const char *Digit;
+		for (Digit = Value; *Digit; ++Digit) {
+			if (!isdigit((unsigned char) *Digit)) {
+				P->Error = 1;
+				return;
+			}
+			Num = Num * 10 + (unsigned long) (*Digit - '0');
+		}
+		if ((FOp = Emit(P, Op, 1)) != NULL) {
+			FOp->Rel = (unsigned char) Rel;
+			FOp->Num = Num;
+		}
+
+	} else {
+		/* Names and types can only be the same or different */
+		if ((Rel != REL_EQ) && (Rel != REL_NE)) {
+			P->Error = 1;
+			return;
+		}
+		if ((FOp = Emit(P, Op, 1)) != NULL)
+			strcpy(FOp->Str, Value);
+		if (Rel == REL_NE)
+			Emit(P, FOP_NOT, 0);
+	}
+}
+
+static void ParseOr(struct FilterParser *P);
+
+/******************************************************************************
+* Compile a negation, parenthesized expression or comparison
+******************************************************************************/
+static void ParseUnary(struct FilterParser *P)
+{
+	if (P->Error)
+		return;
+	if (Accept(P, "not") || Accept(P, "!")) {
+		ParseUnary(P);
+		Emit(P, FOP_NOT, 0);
+	} else if (Accept(P, "(")) {
+		ParseOr(P);
+		if (!Accept(P, ")"))
+			P->Error = 1;
+	} else
+		ParseCompare(P);
+}
+
+static void ParseAnd(struct FilterParser *P)
+{
+	ParseUnary(P);
+	while (!P->Error && (Accept(P, "&&") || Accept(P, "and"))) {
+		ParseUnary(P);
+		Emit(P, FOP_AND, -1);
+	}
+}
+
+static void ParseOr(struct FilterParser *P)
+{
+	ParseAnd(P);
+	while (!P->Error && (Accept(P, "||") || Accept(P, "or"))) {
+		ParseAnd(P);
+		Emit(P, FOP_OR, -1);
+	}
+}
+
+/******************************************************************************
+* Compile a filter expression
+* Returns 0, or -1 if the expression is invalid or too long
+******************************************************************************/
+int CbmFilterCompile(struct CbmFilter *Filter, const char *Expr)
+{
+	struct FilterParser P;
+
+	Filter->Len = 0;
+	Filter->Fields = 0;
+	P.Pos = Expr;
+	P.Filter = Filter;
+	P.Depth = 0;
+	P.Error = 0;
+
+	ParseOr(&P);
+	SkipSpace(&P);
+	if (P.Error || *P.Pos || (P.Depth != 1))
+		return -1;
+	return 0;
+}
+
+/******************************************************************************
+* Run a compiled filter on an entry
+* Returns nonzero if the entry is wanted
+******************************************************************************/
+int CbmFilterMatch(const struct CbmFilter *Filter, const char *Name,
+		const char *Type, unsigned long Blocks)
+{
+	/* The stack can't be deeper than the program is long */
+	unsigned char Stack[FILTER_MAX_OPS];
+	unsigned Top = 0;
+	unsigned i;
+
+	for (i = 0; i < Filter->Len; ++i) {
+		const struct CbmFilterOp *FOp = &Filter->Prog[i];
+		switch (FOp->Op) {
+			case FOP_NAME:
+				Stack[Top++] = (unsigned char) CbmMatchName(FOp->Str, Name, 1);
+				break;
+
+			case FOP_TYPE:
+				Stack[Top++] = (unsigned char) NoCaseEqual(FOp->Str, Type);
+				break;
+
+			case FOP_BLOCKS:
+				switch (FOp->Rel) {
+					case REL_EQ: Stack[Top] = Blocks == FOp->Num; break;
+					case REL_NE: Stack[Top] = Blocks != FOp->Num; break;
+					case REL_LT: Stack[Top] = Blocks < FOp->Num; break;
+					case REL_LE: Stack[Top] = Blocks <= FOp->Num; break;
+					case REL_GT: Stack[Top] = Blocks > FOp->Num; break;
+					default:     Stack[Top] = Blocks >= FOp->Num; break;
+				}
+				++Top;
+				break;
+
+			case FOP_NOT:
+				Stack[Top-1] = !Stack[Top-1];
+				break;
+
+			case FOP_AND:
+				--Top;
+				Stack[Top-1] = Stack[Top-1] && Stack[Top];
+				break;
+
+			case FOP_OR:
+				--Top;
+				Stack[Top-1] = Stack[Top-1] || Stack[Top];
+				break;
+		}
+	}
+	return Top ? Stack[Top-1] : 1;
+}
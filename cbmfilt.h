@@ -0,0 +1,65 @@
+/*
+ * cbmfilt.h
+ *
+ * Archive entry filter expressions
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A filter selects archive entries using only the fields that are known
+ * as soon as the directory entry is read, so the archive readers can reject
+ * an entry before doing anything expensive for it, like following a file's
+ * sector chain to find its length.
+ *
+ * Comparisons:
+ *   name=PATTERN   the name matches PATTERN, where ? matches any character
+ *                  and * matches the rest of the name, as on a Commodore drive
+ *   type=TYPE      the file type, e.g. PRG
+ *   blocks<N       the size in blocks; =, !=, <, <=, > and >= may be used
+ * name and type may also use != and ignore case. Values holding spaces or
+ * operator characters may be quoted with "".
+ *
+ * These are combined with && (or "and"), || (or "or"), ! (or "not") and
+ * parentheses, e.g.
+ *   type=PRG && blocks>10 && !name="DEMO*"
+ */
+
+#ifndef CBMFILT_H
+#define CBMFILT_H
+
+enum {
+	FILTER_MAX_OPS = 32,	/* longest filter program */
+	FILTER_MAX_STR = 17		/* longest name or type value, including NUL */
+};
+
+/* One instruction of a compiled filter; these run on a stack of results */
+struct CbmFilterOp {
+	unsigned char Op;		/* enum FilterOps in cbmfilt.c */
+	unsigned char Rel;		/* relation for comparisons */
+	unsigned long Num;
+	char Str[FILTER_MAX_STR];
+};
+
+struct CbmFilter {
+	unsigned Len;			/* number of instructions in Prog */
+	unsigned Fields;		/* ArcFields the filter looks at */
+	struct CbmFilterOp Prog[FILTER_MAX_OPS];
+};
+
+int CbmFilterCompile(struct CbmFilter *Filter, const char *Expr);
+int CbmFilterMatch(const struct CbmFilter *Filter, const char *Name,
+		const char *Type, unsigned long Blocks);
+
+#endif
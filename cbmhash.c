@@ -0,0 +1,350 @@
+/*
+ * cbmhash.c
+ *
+ * Hashing the contents of archive entries
+ * See cbmhash.h for an overview
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "cbmhash.h"
+
+static const char * const HashNames[] = {
+	"none",
+	"xxh64",
+	"sha1"
+};
+
+static const char HexDigits[] = "0123456789abcdef";
+
+/*---------------------------------------------------------------------------*/
+
+#ifdef CBM_HAVE_XXH64
+/******************************************************************************
+* xxHash64 with a seed of 0
+******************************************************************************/
+#define XXH_BLOCK 32		/* bytes consumed by one round of the accumulators */
+
+static const uint64_t XXHPrime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXHPrime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXHPrime3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXHPrime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXHPrime5 = 0x27D4EB2F165667C5ULL;
+
+#define XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t XXHRead64(const unsigned char *p)
+{
+	return (uint64_t) p[0] | ((uint64_t) p[1] << 8) |
+		((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24) |
+		((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) |
+		((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static uint64_t XXHRound(uint64_t Acc, uint64_t Input)
+{
+	Acc += Input * XXHPrime2;
+	Acc = XXH_ROTL(Acc, 31);
+	return Acc * XXHPrime1;
+}
+
+static uint64_t XXHMerge(uint64_t Acc, uint64_t Val)
+{
+	Acc ^= XXHRound(0, Val);
+	return Acc * XXHPrime1 + XXHPrime4;
+}
+
+static void XXHInit(struct CbmHash *Hash)
+{
+	uint64_t *V = Hash->State.XXH64;
+
+	V[0] = XXHPrime1 + XXHPrime2;
+	V[1] = XXHPrime2;
+	V[2] = 0;
+	V[3] = 0 - XXHPrime1;
+}
+
+static void XXHBlock(struct CbmHash *Hash, const unsigned char *Block)
+{
+	uint64_t *V = Hash->State.XXH64;
+
+	V[0] = XXHRound(V[0], XXHRead64(Block));
+	V[1] = XXHRound(V[1], XXHRead64(Block + 8));
+	V[2] = XXHRound(V[2], XXHRead64(Block + 16));
+	V[3] = XXHRound(V[3], XXHRead64(Block + 24));
+}
+
+static void XXHFinal(struct CbmHash *Hash, char *Hex)
+{
+	const uint64_t *V = Hash->State.XXH64;
+	const unsigned char *p = Hash->Buf;
+	const unsigned char *End = Hash->Buf + Hash->BufLen;
+	uint64_t Total = ((uint64_t) Hash->Len[1] << 32) | Hash->Len[0];
+	uint64_t h;
+	int i;
+
+	if (Total >= XXH_BLOCK) {
+		h = XXH_ROTL(V[0], 1) + XXH_ROTL(V[1], 7) +
+			XXH_ROTL(V[2], 12) + XXH_ROTL(V[3], 18);
+		for (i = 0; i < 4; ++i)
+			h = XXHMerge(h, V[i]);
+	} else
+		h = XXHPrime5;
+	h += Total;
+
+	for (; p + 8 <= End; p += 8) {
+		h ^= XXHRound(0, XXHRead64(p));
+		h = XXH_ROTL(h, 27) * XXHPrime1 + XXHPrime4;
+	}
+	if (p + 4 <= End) {
+		h ^= ((uint64_t) p[0] | ((uint64_t) p[1] << 8) |
+			((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24)) * XXHPrime1;
+		h = XXH_ROTL(h, 23) * XXHPrime2 + XXHPrime3;
+		p += 4;
+	}
+	for (; p < End; ++p) {
+		h ^= *p * XXHPrime5;
+		h = XXH_ROTL(h, 11) * XXHPrime1;
+	}
+
+	h ^= h >> 33;
+	h *= XXHPrime2;
+	h ^= h >> 29;
+	h *= XXHPrime3;
+	h ^= h >> 32;
+
+	/* Most significant digit first, as the reference implementation shows it */
+	for (i = 15; i >= 0; --i, h >>= 4)
+		Hex[i] = HexDigits[h & 0xf];
+	Hex[16] = '\0';
+}
+#endif /* CBM_HAVE_XXH64 */
+
+/*---------------------------------------------------------------------------*/
+
+/******************************************************************************
+* SHA-1 (FIPS 180-4)
+* The arithmetic is done in unsigned long, which is at least 32 bits
+******************************************************************************/
+#define SHA1_BLOCK 64
+#define M32(x) ((x) & 0xffffffffUL)
+#define ROTL32(x, r) M32(((x) << (r)) | (M32(x) >> (32 - (r))))
+
+static void SHA1Init(struct CbmHash *Hash)
+{
+	unsigned long *H = Hash->State.SHA1;
+
+	H[0] = 0x67452301UL;
+	H[1] = 0xEFCDAB89UL;
+	H[2] = 0x98BADCFEUL;
+	H[3] = 0x10325476UL;
+	H[4] = 0xC3D2E1F0UL;
+}
+
+static void SHA1Block(struct CbmHash *Hash, const unsigned char *Block)
+{
+	unsigned long *H = Hash->State.SHA1;
+	unsigned long W[80];
+	unsigned long a, b, c, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; ++i)
+		W[i] = ((unsigned long) Block[i*4] << 24) |
+			((unsigned long) Block[i*4+1] << 16) |
+			((unsigned long) Block[i*4+2] << 8) | Block[i*4+3];
+	for (; i < 80; ++i)
+		W[i] = ROTL32(W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16], 1);
+
+	a = H[0];
+	b = H[1];
+	c = H[2];
+	d = H[3];
+	e = H[4];
+	for (i = 0; i < 80; ++i) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999UL;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1UL;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDCUL;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6UL;
+		}
+		t = M32(ROTL32(a, 5) + M32(f) + e + k + W[i]);
+		e = d;
+		d = c;
+		c = ROTL32(b, 30);
+		b = a;
+		a = t;
+	}
+	H[0] = M32(H[0] + a);
+	H[1] = M32(H[1] + b);
+	H[2] = M32(H[2] + c);
+	H[3] = M32(H[3] + d);
+	H[4] = M32(H[4] + e);
+}
+
+static void SHA1Final(struct CbmHash *Hash, char *Hex)
+{
+	unsigned char Tail[SHA1_BLOCK * 2];
+	unsigned long BitsHi = M32((Hash->Len[1] << 3) | (Hash->Len[0] >> 29));
+	unsigned long BitsLo = M32(Hash->Len[0] << 3);
+	unsigned TailLen;
+	int i;
+
+	/* Pad with a 1 bit, zeros and the length in bits to fill whole blocks */
+	memcpy(Tail, Hash->Buf, Hash->BufLen);
+	TailLen = Hash->BufLen;
+	Tail[TailLen++] = 0x80;
+	while (TailLen % SHA1_BLOCK != SHA1_BLOCK - 8)
+		Tail[TailLen++] = 0;
+	for (i = 3; i >= 0; --i)
+		Tail[TailLen++] = (unsigned char) (BitsHi >> (i * 8));
+	for (i = 3; i >= 0; --i)
+		Tail[TailLen++] = (unsigned char) (BitsLo >> (i * 8));
+	SHA1Block(Hash, Tail);
+	if (TailLen > SHA1_BLOCK)
+		SHA1Block(Hash, Tail + SHA1_BLOCK);
+
+	for (i = 0; i < 40; ++i)
+		Hex[i] = HexDigits[(Hash->State.SHA1[i / 8] >> (28 - (i % 8) * 4)) & 0xf];
+	Hex[40] = '\0';
+}
+
+/*---------------------------------------------------------------------------*/
+
+/******************************************************************************
+* Look up a hash by name
+* Returns its CbmHashTypes code, or -1 if it's unknown or not built in
+******************************************************************************/
+int CbmHashType(const char *Name)
+{
+	int Type;
+
+	for (Type = CBM_HASH_NONE; Type <= CBM_HASH_SHA1; ++Type)
+		if (!strcmp(Name, HashNames[Type])) {
+#ifndef CBM_HAVE_XXH64
+			if (Type == CBM_HASH_XXH64)
+				break;
+#endif
+			return Type;
+		}
+	return -1;
+}
+
+/******************************************************************************
+* Returns the name of a hash type
+******************************************************************************/
+const char *CbmHashName(int Type)
+{
+	return ((Type >= CBM_HASH_NONE) && (Type <= CBM_HASH_SHA1)) ?
+		HashNames[Type] : "unknown";
+}
+
+/******************************************************************************
+* Start hashing
+* Returns 0, or -1 if the hash type isn't available
+******************************************************************************/
+int CbmHashInit(struct CbmHash *Hash, int Type)
+{
+	memset(Hash, 0, sizeof(*Hash));
+	Hash->Type = Type;
+	switch (Type) {
+#ifdef CBM_HAVE_XXH64
+		case CBM_HASH_XXH64:
+			XXHInit(Hash);
+			return 0;
+#endif
+		case CBM_HASH_SHA1:
+			SHA1Init(Hash);
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/******************************************************************************
+* Hash Len more bytes
+******************************************************************************/
+void CbmHashUpdate(struct CbmHash *Hash, const void *Data, size_t Len)
+{
+	const unsigned char *In = (const unsigned char *) Data;
+	unsigned BlockLen;
+	void (*Block)(struct CbmHash *, const unsigned char *);
+
+	switch (Hash->Type) {
+#ifdef CBM_HAVE_XXH64
+		case CBM_HASH_XXH64:
+			BlockLen = XXH_BLOCK;
+			Block = XXHBlock;
+			break;
+#endif
+		case CBM_HASH_SHA1:
+			BlockLen = SHA1_BLOCK;
+			Block = SHA1Block;
+			break;
+		default:
+			return;
+	}
+
+	Hash->Len[0] = M32(Hash->Len[0] + (unsigned long) Len);
+	if (Hash->Len[0] < (unsigned long) Len)
+		++Hash->Len[1];
+
+	/* Finish a partial block first, then hash whole blocks in place */
+	if (Hash->BufLen) {
+		size_t Chunk = BlockLen - Hash->BufLen;
+		if (Chunk > Len)
+			Chunk = Len;
+		memcpy(Hash->Buf + Hash->BufLen, In, Chunk);
+		Hash->BufLen += (unsigned) Chunk;
+		In += Chunk;
+		Len -= Chunk;
+		if (Hash->BufLen < BlockLen)
+			return;
+		Block(Hash, Hash->Buf);
+		Hash->BufLen = 0;
+	}
+	for (; Len >= BlockLen; In += BlockLen, Len -= BlockLen)
+		Block(Hash, In);
+	memcpy(Hash->Buf, In, Len);
+	Hash->BufLen = (unsigned) Len;
+}
+
+/******************************************************************************
+* Finish hashing and write the hash to Hex as lower case hexadecimal digits
+* Hex must hold CBM_MAX_HASH characters. Returns Hex.
+******************************************************************************/
+char *CbmHashHex(struct CbmHash *Hash, char *Hex)
+{
+	switch (Hash->Type) {
+#ifdef CBM_HAVE_XXH64
+		case CBM_HASH_XXH64:
+			XXHFinal(Hash, Hex);
+			break;
+#endif
+		case CBM_HASH_SHA1:
+			SHA1Final(Hash, Hex);
+			break;
+		default:
+			Hex[0] = '\0';
+			break;
+	}
+	return Hex;
+}
@@ -0,0 +1,56 @@
+/*
+ * cbmhash.h
+ *
+ * Hashing the contents of archive entries
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Hashes are computed a block at a time, so an entry's contents can be
+ * hashed as they're read without ever being held in memory whole. Two kinds
+ * are available: xxHash64, which is fast and good enough to find duplicates,
+ * and SHA-1 for comparing against other collections' catalogues. xxHash64
+ * needs a 64-bit integer type, so it's only built by C99 compilers.
+ */
+
+#ifndef CBMHASH_H
+#define CBMHASH_H
+
+#include "cbmarcs.h"
+
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+#define CBM_HAVE_XXH64
+#endif
+
+struct CbmHash {
+	int Type;					/* CbmHashTypes */
+	unsigned long Len[2];		/* bytes hashed, low then high 32 bits */
+	unsigned char Buf[64];		/* a partial block */
+	unsigned BufLen;
+	union {
+#ifdef CBM_HAVE_XXH64
+		uint64_t XXH64[4];		/* xxHash64 accumulators */
+#endif
+		unsigned long SHA1[5];	/* SHA-1 state; only 32 bits are used */
+	} State;
+};
+
+int CbmHashType(const char *Name);
+const char *CbmHashName(int Type);
+int CbmHashInit(struct CbmHash *Hash, int Type);
+void CbmHashUpdate(struct CbmHash *Hash, const void *Data, size_t Len);
+char *CbmHashHex(struct CbmHash *Hash, char *Hex);
+
+#endif
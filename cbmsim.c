@@ -0,0 +1,330 @@
+/*
+ * cbmsim.c
+ *
+ * Finding archives with mostly the same files
+ * See cbmsim.h for an overview
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "cbmsim.h"
+
+#define SIM_MAX_SIGS 0xfffffffeUL	/* signature numbers plus 1 must fit */
+#define M32(x) ((x) & 0xffffffffUL)
+
+/******************************************************************************
+* Scramble 32 bits (the MurmurHash3 finalizer)
+******************************************************************************/
+static unsigned long Mix(unsigned long h)
+{
+	h = M32(h);
+	h ^= h >> 16;
+	h = M32(h * 0x85EBCA6BUL);
+	h ^= h >> 13;
+	h = M32(h * 0xC2B2AE35UL);
+	h ^= h >> 16;
+	return h;
+}
+
+/******************************************************************************
+* Start a signature of no files
+******************************************************************************/
+void CbmSimInit(struct CbmSimSig *Sig)
+{
+	int i;
+
+	for (i = 0; i < CBM_SIM_HASHES; ++i)
+		Sig->Min[i] = (CbmSimValue) 0xffffffffUL;
+	Sig->Files = 0;
+}
+
+/******************************************************************************
+* Add a file with the given content hash (in hex, as from CbmHashHex())
+* Returns 0 or -1 if the hash is too short
+******************************************************************************/
+int CbmSimAdd(struct CbmSimSig *Sig, const char *Hash)
+{
+	unsigned long Half[2];		/* the first 64 bits of the hash */
+	int i;
+
+	Half[0] = Half[1] = 0;
+	for (i = 0; i < 16; ++i) {
+		int Digit;
+		if ((Hash[i] >= '0') && (Hash[i] <= '9'))
+			Digit = Hash[i] - '0';
+		else if ((Hash[i] >= 'a') && (Hash[i] <= 'f'))
+			Digit = Hash[i] - 'a' + 10;
+		else
+			return -1;
+		Half[i / 8] = (Half[i / 8] << 4) | (unsigned long) Digit;
+	}
+
+	/* Each hash function is the mix of the file's hash with a different seed */
+	for (i = 0; i < CBM_SIM_HASHES; ++i) {
+		unsigned long h = Mix(Half[0] ^ Mix(Half[1] ^
+				Mix((unsigned long) (i + 1) * 0x9E3779B9UL)));
+		if (h < Sig->Min[i])
+			Sig->Min[i] = (CbmSimValue) h;
+	}
+	++Sig->Files;
+	return 0;
+}
+
+/******************************************************************************
+* Estimate the similarity of the archives with two signatures
+* Returns it as a percentage
+******************************************************************************/
+unsigned CbmSimCompare(const struct CbmSimSig *Sig1,
+		const struct CbmSimSig *Sig2)
+{
+	unsigned Same = 0;
+	int i;
+
+	if (!Sig1->Files || !Sig2->Files)
+		return 0;
+	for (i = 0; i < CBM_SIM_HASHES; ++i)
+		Same += Sig1->Min[i] == Sig2->Min[i];
+	return Same * 100U / CBM_SIM_HASHES;
+}
+
+/******************************************************************************
+* Start an empty table of signatures
+******************************************************************************/
+void CbmSimTableInit(struct CbmSimTable *Table)
+{
+	memset(Table, 0, sizeof(*Table));
+}
+
+/******************************************************************************
+* Free everything in a table
+******************************************************************************/
+void CbmSimTableFree(struct CbmSimTable *Table)
+{
+	free(Table->Sig);
+	free(Table->Parent);
+	CbmSimTableInit(Table);
+}
+
+/******************************************************************************
+* Add a copy of an archive's signature; it's numbered from 0 in order
+* Returns 0 or -1 if out of memory
+******************************************************************************/
+int CbmSimTableAdd(struct CbmSimTable *Table, const struct CbmSimSig *Sig)
+{
+	if (Table->Len >= Table->Max) {
+		unsigned long Max = Table->Max ? Table->Max * 2 : 256;
+		struct CbmSimSig *New;
+		if ((Max > SIM_MAX_SIGS) || (Max < Table->Max))
+			Max = SIM_MAX_SIGS;
+		if ((Max <= Table->Max) || ((size_t) Max != Max) ||
+			((size_t) Max > (size_t) -1 / sizeof(*New)) ||
+			((New = (struct CbmSimSig *) realloc(Table->Sig,
+					(size_t) Max * sizeof(*New))) == NULL))
+			return -1;
+		Table->Sig = New;
+		Table->Max = Max;
+	}
+	Table->Sig[Table->Len++] = *Sig;
+	return 0;
+}
+
+/******************************************************************************
+* Returns the first signature in the cluster holding signature Num
+* Only valid after CbmSimCluster()
+******************************************************************************/
+unsigned long CbmSimFind(struct CbmSimTable *Table, unsigned long Num)
+{
+	CbmSimValue *Parent = Table->Parent;
+
+	while (Parent[Num] != Num) {
+		Parent[Num] = Parent[Parent[Num]];	/* shorten the path for next time */
+		Num = Parent[Num];
+	}
+	return Num;
+}
+
+/******************************************************************************
+* Join two clusters; the first signature of either is first of the result
+******************************************************************************/
+static void Join(struct CbmSimTable *Table, unsigned long Num1,
+		unsigned long Num2)
+{
+	unsigned long Root1 = CbmSimFind(Table, Num1);
+	unsigned long Root2 = CbmSimFind(Table, Num2);
+
+	if (Root1 < Root2)
+		Table->Parent[Root2] = (CbmSimValue) Root1;
+	else
+		Table->Parent[Root1] = (CbmSimValue) Root2;
+}
+
+/******************************************************************************
+* Returns where to start looking for a band in the band table
+******************************************************************************/
+static unsigned long BandSlot(const CbmSimValue *Band, unsigned long Slots)
+{
+	unsigned long h = 0;
+	int i;
+
+	for (i = 0; i < CBM_SIM_ROWS; ++i)
+		h = Mix(h ^ Band[i]);
+	return h & (Slots - 1);
+}
+
+/******************************************************************************
+* Order signatures by their values, for qsort()
+******************************************************************************/
+static int SigOrder(const void *Sig1, const void *Sig2)
+{
+	const CbmSimValue *Min1 = (*(const struct CbmSimSig * const *) Sig1)->Min;
+	const CbmSimValue *Min2 = (*(const struct CbmSimSig * const *) Sig2)->Min;
+	int i;
+
+	for (i = 0; i < CBM_SIM_HASHES; ++i)
+		if (Min1[i] != Min2[i])
+			return Min1[i] < Min2[i] ? -1 : 1;
+	return 0;
+}
+
+/******************************************************************************
+* Cluster the archives with a similarity of at least Percent
+* For each band, a hash table finds the bucket of archives with the same
+* values in that band. A bucket keeps one archive of each cluster it has seen,
+* chained through Next, and each is compared with the one being added, which
+* joins the list only if it isn't in any of their clusters by then. A cluster
+* absorbed by another is dropped from the list the next time it's walked. A
+* band shared by many archives that aren't similar, such as one from a common
+* loader, says little about them, so only the SIM_BUCKET_CLUSTERS clusters
+* added last are kept in each bucket; the time taken grows with the number of
+* archives rather than the number of pairs.
+* Which archive is compared with which is decided by the values of their
+* signatures, by going through them in sorted order, so the clusters don't
+* depend on the order the archives were added in. Afterwards, CbmSimFind()
+* returns the cluster each archive is in.
+* Returns 0 or -1 if out of memory
+******************************************************************************/
+#define SIM_BUCKET_CLUSTERS 8
+
+int CbmSimCluster(struct CbmSimTable *Table, unsigned Percent)
+{
+	const struct CbmSimSig **Order;	/* the signatures sorted by value */
+	CbmSimValue *Slot;			/* first archive in each band's bucket, plus 1 */
+	CbmSimValue *Next;			/* next archive in the same bucket, plus 1 */
+	CbmSimValue *Seen;			/* archive plus 1 whose walk found each root */
+	unsigned long Slots = 1024;
+	unsigned long Len = Table->Len ? Table->Len : 1;
+	unsigned long i, k;
+	int Band;
+
+	/* Keep the band table at most half full */
+	while (Slots < Table->Len * 2) {
+		if (Slots * 2 < Slots)
+			return -1;
+		Slots *= 2;
+	}
+	free(Table->Parent);
+	Table->Parent = NULL;
+	Table->Compares = 0;
+	if ((size_t) Slots != Slots)
+		return -1;
+	Table->Parent = (CbmSimValue *) malloc((size_t) Len * sizeof(*Table->Parent));
+	Order = (const struct CbmSimSig **) malloc((size_t) Len * sizeof(*Order));
+	Slot = (CbmSimValue *) malloc((size_t) Slots * sizeof(*Slot));
+	Next = (CbmSimValue *) malloc((size_t) Len * sizeof(*Next));
+	Seen = (CbmSimValue *) malloc((size_t) Len * sizeof(*Seen));
+	if (!Table->Parent || !Order || !Slot || !Next || !Seen) {
+		free(Table->Parent);
+		Table->Parent = NULL;
+		free(Order);
+		free(Slot);
+		free(Next);
+		free(Seen);
+		return -1;
+	}
+	for (i = 0; i < Table->Len; ++i) {
+		Table->Parent[i] = (CbmSimValue) i;
+		Order[i] = &Table->Sig[i];
+	}
+	qsort(Order, (size_t) Table->Len, sizeof(*Order), SigOrder);
+
+	/* Archives with the same signature are the same as far as clustering goes,
+	   so only the first of them is looked for in the buckets */
+	for (k = 1; k < Table->Len; ++k)
+		if (Order[k]->Files && Order[k - 1]->Files &&
+			!SigOrder(&Order[k], &Order[k - 1]) &&
+			(CbmSimCompare(Order[k], Order[k - 1]) >= Percent))
+			Join(Table, (unsigned long) (Order[k] - Table->Sig),
+				 (unsigned long) (Order[k - 1] - Table->Sig));
+
+	for (Band = 0; Band < CBM_SIM_BANDS; ++Band) {
+		memset(Slot, 0, (size_t) Slots * sizeof(*Slot));
+		memset(Seen, 0, (size_t) Len * sizeof(*Seen));
+		for (k = 0; k < Table->Len; ++k) {
+			const CbmSimValue *Values = Order[k]->Min + Band * CBM_SIM_ROWS;
+			unsigned long s = BandSlot(Values, Slots);
+			CbmSimValue *Link;
+			unsigned Kept = 0;
+			int Represented = 0;	/* nonzero once its cluster is in the list */
+
+			if (k && Order[k]->Files && Order[k - 1]->Files &&
+				!SigOrder(&Order[k], &Order[k - 1]))
+				continue;
+			i = (unsigned long) (Order[k] - Table->Sig);
+			for (; Slot[s]; s = (s + 1) & (Slots - 1))
+				if (!memcmp(Table->Sig[Slot[s] - 1].Min + Band * CBM_SIM_ROWS,
+						Values, CBM_SIM_ROWS * sizeof(*Values)))
+					break;
+
+			for (Link = &Slot[s]; *Link; ) {
+				unsigned long Other = *Link - 1;
+				unsigned long Root;
+
+				if (Kept < SIM_BUCKET_CLUSTERS) {
+					if (CbmSimFind(Table, Other) != CbmSimFind(Table, i)) {
+						++Table->Compares;
+						if (CbmSimCompare(&Table->Sig[Other], &Table->Sig[i]) >= Percent)
+							Join(Table, Other, i);
+					}
+					Root = CbmSimFind(Table, Other);
+					if (Root == CbmSimFind(Table, i)) {
+						if (!Represented) {
+							Represented = 1;
+							++Kept;
+							Link = &Next[Other];
+							continue;
+						}
+					} else if (Seen[Root] != i + 1) {
+						Seen[Root] = (CbmSimValue) (i + 1);
+						++Kept;
+						Link = &Next[Other];
+						continue;
+					}
+				}
+				/* Its cluster is already in the list, or the list is full */
+				*Link = Next[Other];
+			}
+			if (!Represented) {
+				Next[i] = Slot[s];
+				Slot[s] = (CbmSimValue) (i + 1);
+			}
+		}
+	}
+	free(Order);
+	free(Slot);
+	free(Next);
+	free(Seen);
+	return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * cbmsim.h
+ *
+ * Finding archives with mostly the same files
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * An archive is treated as the set of the content hashes of its files, so
+ * the order of its directory and where the files are stored don't matter.
+ * The similarity of two archives is the Jaccard index of their sets: the
+ * number of files they share divided by the number of different files in
+ * either one.
+ *
+ * Each archive is summarized by a MinHash signature: for each of
+ * CBM_SIM_HASHES hash functions, the smallest hash of any of its files. The
+ * fraction of the signatures' values that two archives share estimates their
+ * similarity. Locality sensitive hashing then finds the archives worth
+ * comparing: signatures are cut into bands of CBM_SIM_ROWS values, and only
+ * archives that have a band the same are compared. Similar archives are
+ * joined into clusters, so the time taken grows with the number of archives
+ * instead of the number of pairs of them.
+ */
+
+#ifndef CBMSIM_H
+#define CBMSIM_H
+
+#include "cbmarcs.h"
+
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+typedef uint32_t CbmSimValue;	/* 32 bits */
+#else
+typedef unsigned long CbmSimValue;
+#endif
+
+enum {
+	CBM_SIM_HASHES = 64,		/* values in a signature */
+	CBM_SIM_ROWS = 2,			/* values in each band */
+	CBM_SIM_BANDS = CBM_SIM_HASHES / CBM_SIM_ROWS
+};
+
+struct CbmSimSig {
+	CbmSimValue Min[CBM_SIM_HASHES];
+	unsigned long Files;		/* files added */
+};
+
+struct CbmSimTable {
+	struct CbmSimSig *Sig;		/* in the order they were added */
+	unsigned long Len;
+	unsigned long Max;			/* signatures allocated */
+	CbmSimValue *Parent;		/* set by CbmSimCluster() */
+	unsigned long Compares;		/* signatures CbmSimCluster() compared */
+};
+
+void CbmSimInit(struct CbmSimSig *Sig);
+int CbmSimAdd(struct CbmSimSig *Sig, const char *Hash);
+unsigned CbmSimCompare(const struct CbmSimSig *Sig1,
+		const struct CbmSimSig *Sig2);
+
+void CbmSimTableInit(struct CbmSimTable *Table);
+int CbmSimTableAdd(struct CbmSimTable *Table, const struct CbmSimSig *Sig);
+int CbmSimCluster(struct CbmSimTable *Table, unsigned Percent);
+unsigned long CbmSimFind(struct CbmSimTable *Table, unsigned long Num);
+void CbmSimTableFree(struct CbmSimTable *Table);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * cbmsrch.c
+ *
+ * Searching the contents of archive entries for byte strings
+ * See cbmsrch.h for an overview
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "cbmsrch.h"
+
+#if defined(__MSDOS__) || defined(__Z88DK)
+#define SEARCH_BUF_SIZE 1024	/* bytes of an entry searched at a time */
+#else
+#define SEARCH_BUF_SIZE 16384
+#endif
+
+/******************************************************************************
+* Start a search with no patterns
+******************************************************************************/
+void CbmSearchInit(struct CbmSearch *Search)
+{
+	memset(Search, 0, sizeof(*Search));
+	Search->FirstByte = -1;
+}
+
+/******************************************************************************
+* Add a pattern to look for
+* Returns its number, or -1 if it's empty, too long or there are too many
+******************************************************************************/
+int CbmSearchAdd(struct CbmSearch *Search, const void *Pat, unsigned Len)
+{
+	const unsigned char *Str = (const unsigned char *) Pat;
+	unsigned Num = Search->Count;
+
+	if (!Len || (Len > SEARCH_MAX_LEN) || (Num >= SEARCH_MAX_PATS))
+		return -1;
+	memcpy(Search->Pat[Num].Str, Str, Len);
+	Search->Pat[Num].Len = Len;
+	Search->Starts[Str[0]] |= 1U << Num;
+	if (Len > Search->MaxLen)
+		Search->MaxLen = Len;
+
+	/* A single first byte can be found with memchr(), which C libraries
+	   usually vectorize, instead of looking at each byte here */
+	if (!Num)
+		Search->FirstByte = Str[0];
+	else if (Search->FirstByte != Str[0])
+		Search->FirstByte = -1;
+
+	++Search->Count;
+	return (int) Num;
+}
+
+/******************************************************************************
+* Report the patterns found at Pos in Buf, which holds Avail bytes
+* Returns nonzero if the caller wants to stop
+******************************************************************************/
+static int CheckAt(const struct CbmSearch *Search, const unsigned char *Buf,
+		size_t Pos, size_t Avail, unsigned long Base, CbmFoundFunc Found,
+		void *UserData)
+{
+	unsigned Candidates = Search->Starts[Buf[Pos]];
+	unsigned Num;
+
+	for (Num = 0; Candidates; ++Num, Candidates >>= 1) {
+		const struct CbmSearchPat *Pat = &Search->Pat[Num];
+		if ((Candidates & 1) && (Pat->Len <= Avail - Pos) &&
+			(memcmp(Buf + Pos, Pat->Str, Pat->Len) == 0) &&
+			Found(UserData, Num, Base + Pos))
+			return 1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+* Search everything Read() returns, block by block, until it returns 0
+* Returns 0 at the end, 1 if Found() stopped the search or -1 if Read() failed
+******************************************************************************/
+typedef long (*SearchReadFunc)(void *From, unsigned long Offset, void *Buf,
+		size_t Len);
+
+static int SearchStream(const struct CbmSearch *Search, SearchReadFunc Read,
+		void *From, CbmFoundFunc Found, void *UserData)
+{
+	unsigned char Buf[SEARCH_BUF_SIZE + SEARCH_MAX_LEN];
+	unsigned long Base = 0;		/* offset of Buf[0] */
+	size_t Kept = 0;			/* bytes carried over from the last block */
+	int End = 0;
+
+	if (!Search->Count)
+		return 0;
+
+	while (!End) {
+		long Got = Read(From, Base + Kept, Buf + Kept, SEARCH_BUF_SIZE);
+		size_t Avail;
+		size_t Limit;			/* where a match might not fit in Buf yet */
+		size_t Pos = 0;
+
+		if (Got < 0)
+			return -1;
+		End = Got == 0;
+		Avail = Kept + (size_t) Got;
+
+		/* Patterns starting near the end are looked for with the next block */
+		if (End)
+			Limit = Avail;
+		else if (Avail >= Search->MaxLen)
+			Limit = Avail - Search->MaxLen + 1;
+		else
+			Limit = 0;
+
+		if (Search->FirstByte >= 0) {
+			const unsigned char *Hit;
+			while ((Pos < Limit) && ((Hit = (const unsigned char *)
+					memchr(Buf + Pos, Search->FirstByte, Limit - Pos)) != NULL)) {
+				Pos = (size_t) (Hit - Buf);
+				if (CheckAt(Search, Buf, Pos, Avail, Base, Found, UserData))
+					return 1;
+				++Pos;
+			}
+		} else {
+			for (; Pos < Limit; ++Pos)
+				if (Search->Starts[Buf[Pos]] &&
+					CheckAt(Search, Buf, Pos, Avail, Base, Found, UserData))
+					return 1;
+		}
+
+		/* Keep what couldn't be checked yet */
+		Kept = Avail - Limit;
+		memmove(Buf, Buf + Limit, Kept);
+		Base += Limit;
+	}
+	return 0;
+}
+
+/* An entry is read in order, so the offset isn't needed */
+static long ReadEntry(void *From, unsigned long Offset, void *Buf, size_t Len)
+{
+	(void) Offset;
+	return CbmReadEntry((struct CbmDir *) From, Buf, Len);
+}
+
+static long ReadSource(void *From, unsigned long Offset, void *Buf, size_t Len)
+{
+	struct CbmSource *Src = (struct CbmSource *) From;
+
+	return Src->ReadAt(Src, Offset, Buf, Len);
+}
+
+/******************************************************************************
+* Search the contents of the entry last returned by CbmNextEntry()
+* Returns 0 when the whole entry has been searched, 1 if Found() stopped the
+* search or -1 on an error reading the entry, with the details left in the
+* directory's context
+******************************************************************************/
+int CbmSearchEntry(const struct CbmSearch *Search, struct CbmDir *Dir,
+		CbmFoundFunc Found, void *UserData)
+{
+	return SearchStream(Search, ReadEntry, Dir, Found, UserData);
+}
+
+/******************************************************************************
+* Search a whole source from start to end, such as a file that isn't an archive
+* Returns 0 when all of it has been searched, 1 if Found() stopped the search
+* or -1 on an error reading it, with errno set
+******************************************************************************/
+int CbmSearchSource(const struct CbmSearch *Search, struct CbmSource *Src,
+		CbmFoundFunc Found, void *UserData)
+{
+	return SearchStream(Search, ReadSource, Src, Found, UserData);
+}
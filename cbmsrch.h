@@ -0,0 +1,63 @@
+/*
+ * cbmsrch.h
+ *
+ * Searching the contents of archive entries for byte strings
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Several patterns are looked for at once in a single pass over each entry's
+ * contents, which are streamed through a fixed buffer with CbmReadEntry() so
+ * that no file is ever held in memory whole. Matches may overlap and may span
+ * the sectors of a disk image file. A whole source can be searched the same
+ * way, for looking through data that isn't an archive.
+ */
+
+#ifndef CBMSRCH_H
+#define CBMSRCH_H
+
+#include "cbmarcs.h"
+
+enum {
+	SEARCH_MAX_PATS = 16,	/* most patterns searched for at once */
+	SEARCH_MAX_LEN = 64		/* longest pattern */
+};
+
+struct CbmSearchPat {
+	unsigned Len;
+	unsigned char Str[SEARCH_MAX_LEN];
+};
+
+struct CbmSearch {
+	unsigned Count;			/* number of patterns */
+	unsigned MaxLen;		/* length of the longest one */
+	struct CbmSearchPat Pat[SEARCH_MAX_PATS];
+	/* Bit n is set in Starts[c] if pattern n starts with byte c */
+	unsigned Starts[256];
+	int FirstByte;			/* byte every pattern starts with, or -1 */
+};
+
+/* Called for each match of pattern number Pat at Offset in the entry.
+   Returning nonzero stops searching the entry. */
+typedef int (*CbmFoundFunc)(void *UserData, unsigned Pat, unsigned long Offset);
+
+void CbmSearchInit(struct CbmSearch *Search);
+int CbmSearchAdd(struct CbmSearch *Search, const void *Pat, unsigned Len);
+int CbmSearchEntry(const struct CbmSearch *Search, struct CbmDir *Dir,
+		CbmFoundFunc Found, void *UserData);
+int CbmSearchSource(const struct CbmSearch *Search, struct CbmSource *Src,
+		CbmFoundFunc Found, void *UserData);
+
+#endif
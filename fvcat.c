@@ -0,0 +1,174 @@
+/*
+ * fvcat.c
+ *
+ * Display a binary catalog written by fvcbm --format=binary
+ * This also serves as an example of reading catalogs with cbmcat.h
+ *
+ * fvcbm is copyright (C) 1995-2025 by Daniel Fandrich
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/******************************************************************************
+* Include files
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define USE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "cbmcat.h"
+
+static const char * const ProgName = "fvcat";
+
+/******************************************************************************
+* Display a catalog string, escaping anything not printable ASCII
+******************************************************************************/
+static void PutCatString(const struct CatString *Str)
+{
+	unsigned i;
+
+	for (i = 0; i < Str->Len; ++i) {
+		unsigned char Ch = Str->Str[i];
+		if ((Ch < 0x20) || (Ch >= 0x7f) || (Ch == '\\'))
+			printf("\\x%02x", Ch);
+		else
+			putchar(Ch);
+	}
+}
+
+/******************************************************************************
+* Display every record in the catalog
+******************************************************************************/
+static int DumpCatalog(const void *Data, unsigned long Len)
+{
+	struct CatReader Reader;
+	struct CatRecord Record;
+	int Status;
+
+	if (CatOpen(&Reader, Data, Len) != 0) {
+		fprintf(stderr, "%s: Not a catalog\n", ProgName);
+		return 3;
+	}
+
+	while ((Status = CatNext(&Reader, &Record)) > 0) {
+		switch (Record.Type) {
+			case CAT_ARCHIVE:
+				fputs("archive\t", stdout);
+				PutCatString(&Record.u.Archive.Path);
+				putchar('\t');
+				PutCatString(&Record.u.Archive.Format);
+				putchar('\t');
+				PutCatString(&Record.u.Archive.Title);
+				putchar('\n');
+				break;
+
+			case CAT_ENTRY:
+				fputs("entry\t", stdout);
+				PutCatString(&Record.u.Entry.Name);
+				putchar('\t');
+				PutCatString(&Record.u.Entry.Type);
+				printf("\t%lu\t%lu\t", Record.u.Entry.Length, Record.u.Entry.Blocks);
+				PutCatString(&Record.u.Entry.Storage);
+				printf("\t%d\t%lu\t%ld\n", Record.u.Entry.Compression,
+					   Record.u.Entry.BlocksNow, Record.u.Entry.Checksum);
+				break;
+
+			case CAT_TOTALS:
+				printf("totals\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\n",
+					   Record.u.Totals.ArchiveEntries, Record.u.Totals.TotalLength,
+					   Record.u.Totals.TotalBlocks, Record.u.Totals.TotalBlocksNow,
+					   Record.u.Totals.DearcerBlocks, Record.u.Totals.Version,
+					   Record.u.Totals.BlocksFree);
+				break;
+
+			case CAT_END:
+				printf("end\t%lu\t%lu\n", Record.u.End.Archives, Record.u.End.Entries);
+				break;
+		}
+	}
+
+	if (Status < 0) {
+		fprintf(stderr, "%s: Corrupt catalog\n", ProgName);
+		return 2;
+	}
+	if (!Reader.Complete) {
+		fprintf(stderr, "%s: Catalog is incomplete\n", ProgName);
+		return 2;
+	}
+	return 0;
+}
+
+/******************************************************************************
+* Main
+******************************************************************************/
+int main(int argc, char *argv[])
+{
+	int Error;
+	void *Data;
+	unsigned long Len;
+#ifdef USE_MMAP
+	struct stat StatBuf;
+	int fd;
+#else
+	FILE *InFile;
+	long FileLen;
+#endif
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage:\n  %s catalog\n", ProgName);
+		return 1;
+	}
+
+#ifdef USE_MMAP
+	if (((fd = open(argv[1], O_RDONLY)) < 0) || (fstat(fd, &StatBuf) != 0)) {
+		perror(argv[1]);
+		return 2;
+	}
+	Len = (unsigned long) StatBuf.st_size;
+	Data = Len ? mmap(NULL, (size_t) Len, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+	if (Data == MAP_FAILED) {
+		perror(argv[1]);
+		return 2;
+	}
+	Error = DumpCatalog(Data, Len);
+	if (Len)
+		munmap(Data, (size_t) Len);
+	close(fd);
+
+#else
+	/* Without mmap, read the whole catalog into memory instead */
+	if (((InFile = fopen(argv[1], "rb")) == NULL) ||
+		(fseek(InFile, 0, SEEK_END) != 0) || ((FileLen = ftell(InFile)) < 0)) {
+		perror(argv[1]);
+		return 2;
+	}
+	Len = (unsigned long) FileLen;
+	rewind(InFile);
+	if (((Data = malloc(Len ? (size_t) Len : 1)) == NULL) ||
+		(Len && (fread(Data, (size_t) Len, 1, InFile) != 1))) {
+		perror(argv[1]);
+		return 2;
+	}
+	fclose(InFile);
+	Error = DumpCatalog(Data, Len);
+	free(Data);
+#endif
+
+	return Error;
+}
@@ -36,18 +36,45 @@
 /******************************************************************************
 * Include files
 ******************************************************************************/
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* for copy_file_range() */
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
 
 #if defined(__TURBOC__)
 #include <dir.h>
 #include <io.h>
 #include <fcntl.h>
 
-#elif defined(MSC) || defined(__ZTC__) || defined(__SC__) || defined(__WATCOMC__) || defined(__DJGPP__)
+#elif defined(MSC) || defined(__ZTC__) || defined(__SC__) || defined(__WATCOMC__) || defined(__DJGPP__) || defined(_WIN32)
 #include <io.h>
 #include <fcntl.h>
+
+#elif !defined(__Z88DK)
+#include <unistd.h>
+#endif
+
+/* Ways of copying between files without the data passing through here */
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/uio.h>
+#include <limits.h>
+#define HAVE_WRITEV
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#define HAVE_O_EXCL
+#endif
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
 #endif
 
 /* Get some automatic filename globbing */
@@ -59,6 +86,13 @@ WILDCARDS
 #endif
 
 #include "cbmarcs.h"
+#include "cbmcat.h"
+#include "cbmfilt.h"
+#include "cbmsrch.h"
+#include "cbmhash.h"
+#include "cbmdup.h"
+#include "cbmsim.h"
+#include "cbmcarve.h"
 
 /******************************************************************************
 * Constants
@@ -72,6 +106,12 @@ WILDCARDS
 #define MAXPATH 1025			/* length of longest permissible file path */
 #endif
 
+#if defined(__MSDOS__) || defined(__Z88DK)
+#define OUTPUT_BUFFER 512	/* size of stdout buffer when not a terminal */
+#else
+#define OUTPUT_BUFFER 65536L	/* size of stdout buffer when not a terminal */
+#endif
+
 #if defined(__TURBOC__)
 unsigned _stklen = 8000;	/* printf() does strange things sometimes with the
 							   default 4k stack */
@@ -92,48 +132,229 @@ NULL
 /******************************************************************************
 * Global Variables
 ******************************************************************************/
-int WideFormat;			/* zero when 1541-style listing is selected */
+static int WideFormat;		/* zero when 1541-style listing is selected */
+static int TotalsOnly;		/* nonzero when only archive totals are displayed */
+static struct CbmFilter Filter;	/* entries selected with --where */
+static int Filtering;		/* nonzero when Filter is in use */
+static struct CbmSearch Search;	/* contents searched for with --grep */
+static const char *GrepArgs[SEARCH_MAX_PATS];	/* each pattern as given */
+static int HashType;		/* CbmHashTypes shown with --hash */
+#define MAX_FINDS 16		/* most names looked up with --find */
+static const char *FindArgs[MAX_FINDS];	/* each name as given */
+static int Finding;			/* number of names in FindArgs */
+static char DumpName[17];	/* files shown with --dump */
+static unsigned long DumpOffset;	/* where in each one to start */
+
+static const char *CurrentArchive;		/* path of the archive being listed */
+static enum ArchiveTypes CurrentType;	/* type of the archive being listed */
+
+/******************************************************************************
+* Row formatting
+* Each row of the listing is assembled into a line buffer by these emitters
+* then written in one piece, which avoids printf() format parsing for every
+* field of every entry.
+* Each emitter returns a pointer to the end of the text it wrote.
+******************************************************************************/
+#define MAX_ROW 256			/* longer than any formatted row */
+#define MAX_DIGITS (sizeof(unsigned long) * 3 + 1)	/* of a long, with a sign */
+
+/* Copy a string */
+static char *FmtStr(char *Out, const char *Str)
+{
+	while (*Str)
+		*Out++ = *Str++;
+	return Out;
+}
+
+/* Copy a string, left justified in a field (like %-*s) */
+static char *FmtStrLeft(char *Out, const char *Str, int Width)
+{
+	while (*Str) {
+		*Out++ = *Str++;
+		--Width;
+	}
+	for (; Width > 0; --Width)
+		*Out++ = ' ';
+	return Out;
+}
+
+/* Unsigned decimal number, right justified in a field (like %*lu) */
+static char *FmtUnsigned(char *Out, unsigned long Num, int Width)
+{
+	char Digits[MAX_DIGITS];
+	int Len = 0;
+
+	do {
+		Digits[Len++] = (char) ('0' + Num % 10);
+		Num /= 10;
+	} while (Num);
+	for (; Width > Len; --Width)
+		*Out++ = ' ';
+	while (Len)
+		*Out++ = Digits[--Len];
+	return Out;
+}
+
+/* Unsigned decimal number, left justified in a field (like %-*u) */
+static char *FmtUnsignedLeft(char *Out, unsigned long Num, int Width)
+{
+	char *Start = Out;
+
+	Out = FmtUnsigned(Out, Num, 0);
+	for (Width -= (int) (Out - Start); Width > 0; --Width)
+		*Out++ = ' ';
+	return Out;
+}
+
+/* Signed decimal number, right justified in a field (like %*d) */
+static char *FmtSigned(char *Out, long Num, int Width)
+{
+	char Digits[MAX_DIGITS];
+	int Len = 0;
+	unsigned long Mag = Num < 0 ? 0UL - (unsigned long) Num : (unsigned long) Num;
+
+	do {
+		Digits[Len++] = (char) ('0' + Mag % 10);
+		Mag /= 10;
+	} while (Mag);
+	if (Num < 0)
+		Digits[Len++] = '-';
+	for (; Width > Len; --Width)
+		*Out++ = ' ';
+	while (Len)
+		*Out++ = Digits[--Len];
+	return Out;
+}
+
+/* Four-digit upper case hexadecimal number (like %04X) */
+static char *FmtHex4(char *Out, unsigned Num)
+{
+	static const char HexDigits[] = "0123456789ABCDEF";
+
+	*Out++ = HexDigits[(Num >> 12) & 0xf];
+	*Out++ = HexDigits[(Num >> 8) & 0xf];
+	*Out++ = HexDigits[(Num >> 4) & 0xf];
+	*Out++ = HexDigits[Num & 0xf];
+	return Out;
+}
+
+/* Terminate the row and send it to the output */
+static void FmtWrite(char *Row, char *Out)
+{
+	*Out++ = '\n';
+	fwrite(Row, 1, (size_t) (Out - Row), stdout);
+}
+
+/******************************************************************************
+* Returns the hash of the entry being displayed, "" if it couldn't be found or
+* NULL if --hash wasn't given
+******************************************************************************/
+static const char *EntryHash(void *UserData)
+{
+	return HashType ? ((const struct CbmContext *) UserData)->EntryHash : NULL;
+}
+
+/******************************************************************************
+* Display the rule under the wide listing's headings and above its totals
+******************************************************************************/
+static void DisplayRule(void)
+{
+	char Row[MAX_ROW];
+	char *Out = Row;
+
+	Out = FmtStr(Out, "================  ====  ======  ====  ========  ====  ====  =====");
+	if (HashType) {
+		const char *Rule = "========================================";
+		Out = FmtStr(Out, "  ");
+		Out = FmtStr(Out, Rule + (HashType == CBM_HASH_SHA1 ? 0 : 24));
+	}
+	FmtWrite(Row, Out);
+}
 
 /******************************************************************************
 * Display header information about an archive
 ******************************************************************************/
-static void DisplayHeader(enum ArchiveTypes ArchiveType, const char *Name)
+static void DisplayHeader(void *UserData, enum ArchiveTypes ArchiveType,
+		const char *Name)
 {
+	(void) UserData;
 	(void) ArchiveType;
+	if (TotalsOnly)
+		return;
 	if (WideFormat) {
-		if (Name)
-			printf("Title:   %s\n", Name);
-		printf("\nName              Type  Length  Blks  Method     SF   Now   Check\n");
-		printf(  "================  ====  ======  ====  ========  ====  ====  =====\n");
+		if (Name) {
+			fputs("Title:   ", stdout);
+			fputs(Name, stdout);
+			putchar('\n');
+		}
+		fputs("\nName              Type  Length  Blks  Method     SF   Now   Check", stdout);
+		if (HashType)
+			fputs("  Hash", stdout);
+		putchar('\n');
+		DisplayRule();
 
 	} else {
-		if (Name)
-			printf("\n     \"%s\"", Name);
-		printf("\n");
+		if (Name) {
+			fputs("\n     \"", stdout);
+			fputs(Name, stdout);
+			putchar('"');
+		}
+		putchar('\n');
 	}
 }
 
 /******************************************************************************
 * Display a file's name and info
 ******************************************************************************/
-static int DisplayFile(const char *Name, const char *Type, unsigned long Length,
-		unsigned Blocks, const char *Storage, int Compression,
-		unsigned BlocksNow, long Checksum)
+static int DisplayFile(void *UserData, const char *Name, const char *Type,
+		unsigned long Length, unsigned Blocks, const char *Storage,
+		int Compression, unsigned BlocksNow, long Checksum,
+		const char *RawName)
 {
+	char Row[MAX_ROW];
+	char *Out = Row;
+	const char *Hash = EntryHash(UserData);
+
+	(void) RawName;
 	if (WideFormat) {
-		printf("%-16s  %s  %7lu  %4u  %-8s %4d%%  %4u",
-				Name, Type, Length, Blocks, Storage, Compression, BlocksNow);
-		if (Checksum >= 0)
-			printf("   %04X", (int) Checksum);
-		printf("\n");
+		Out = FmtStrLeft(Out, Name, 16);
+		Out = FmtStr(Out, "  ");
+		Out = FmtStr(Out, Type);
+		Out = FmtStr(Out, "  ");
+		Out = FmtUnsigned(Out, Length, 7);
+		Out = FmtStr(Out, "  ");
+		Out = FmtUnsigned(Out, Blocks, 4);
+		Out = FmtStr(Out, "  ");
+		Out = FmtStrLeft(Out, Storage, 8);
+		*Out++ = ' ';
+		Out = FmtSigned(Out, Compression, 4);
+		Out = FmtStr(Out, "%  ");
+		Out = FmtUnsigned(Out, BlocksNow, 4);
+		if (Checksum >= 0) {
+			Out = FmtStr(Out, "   ");
+			Out = FmtHex4(Out, (unsigned) Checksum);
+		} else if (Hash && *Hash)
+			Out = FmtStr(Out, "       ");
+		if (Hash && *Hash) {
+			Out = FmtStr(Out, "  ");
+			Out = FmtStr(Out, Hash);
+		}
 	} else {
-		char QuoteName[19];
-		QuoteName[0] = '"';
-		strcpy(QuoteName+1,Name);
-		strcat(QuoteName,"\"");
-		printf("%-5u%-18s %s\n",
-			Blocks, QuoteName, Type);
+		char *QuoteStart;
+		Out = FmtUnsignedLeft(Out, Blocks, 5);
+		QuoteStart = Out;
+		*Out++ = '"';
+		Out = FmtStr(Out, Name);
+		*Out++ = '"';
+		Out = FmtStrLeft(Out, "", 18 - (int) (Out - QuoteStart));
+		*Out++ = ' ';
+		Out = FmtStr(Out, Type);
+		if (Hash && *Hash) {
+			*Out++ = ' ';
+			Out = FmtStr(Out, Hash);
+		}
 	}
+	FmtWrite(Row, Out);
 	return 0;
 }
 
@@ -142,165 +363,1767 @@ static int DisplayFile(const char *Name, const char *Type, unsigned long Length,
 ******************************************************************************/
 static void DisplayTrailer(enum ArchiveTypes ArchiveType, const struct ArcTotals *Totals)
 {
+	char Row[MAX_ROW];
+	char *Out = Row;
+
 	if (WideFormat) {
-		printf("================  ====  ======  ====  ========  ====  ====  =====\n");
-		printf("*total %5u           %7lu  %4d  %s",
-			Totals->ArchiveEntries,
-			Totals->TotalLength,
-			Totals->TotalBlocks,
-			ArchiveFormats[ArchiveType]);
+		if (!TotalsOnly)
+			DisplayRule();
+		Out = FmtStr(Out, "*total ");
+		Out = FmtUnsigned(Out, (unsigned) Totals->ArchiveEntries, 5);
+		Out = FmtStr(Out, "           ");
+		Out = FmtUnsigned(Out, Totals->TotalLength, 7);
+		Out = FmtStr(Out, "  ");
+		Out = FmtSigned(Out, Totals->TotalBlocks, 4);
+		Out = FmtStr(Out, "  ");
+		Out = FmtStr(Out, ArchiveFormats[ArchiveType]);
 		if (Totals->Version > 0)
-			printf("%4u", Totals->Version);
-		else if (Totals->Version < 0)
-			printf("%2u.%u",
-				-Totals->Version / 10,
-				-Totals->Version - 10 * (-Totals->Version / 10)
-			);
-		else
-			printf("    ");
-		printf(" %4d%%  %4d",
-			Totals->TotalBlocks == 0 ?
+			Out = FmtUnsigned(Out, (unsigned) Totals->Version, 4);
+		else if (Totals->Version < 0) {
+			Out = FmtUnsigned(Out, (unsigned) (-Totals->Version / 10), 2);
+			*Out++ = '.';
+			Out = FmtUnsigned(Out,
+					(unsigned) (-Totals->Version - 10 * (-Totals->Version / 10)), 0);
+		} else
+			Out = FmtStr(Out, "    ");
+		*Out++ = ' ';
+		Out = FmtSigned(Out, Totals->TotalBlocks == 0 ?
 				0 :
-				(unsigned) (100 - (Totals->TotalBlocksNow * 100L / (Totals->TotalBlocks))),
-			Totals->TotalBlocksNow
-		);
-		if (Totals->DearcerBlocks > 0)
-			printf("+%d\n", Totals->DearcerBlocks);
-		else
-			printf("\n");
+				(int) (100 - (Totals->TotalBlocksNow * 100L / (Totals->TotalBlocks))),
+			4);
+		Out = FmtStr(Out, "%  ");
+		Out = FmtSigned(Out, Totals->TotalBlocksNow, 4);
+		if (Totals->DearcerBlocks > 0) {
+			*Out++ = '+';
+			Out = FmtSigned(Out, Totals->DearcerBlocks, 0);
+		}
 
-	} else
-		printf("%u BLOCKS USED.\n", Totals->TotalBlocks);
+	} else if (Totals->BlocksFree >= 0) {
+		/* a disk image can show what the drive would */
+		Out = FmtUnsigned(Out, (unsigned) Totals->BlocksFree, 0);
+		Out = FmtStr(Out, " BLOCKS FREE.");
+	} else {
+		Out = FmtUnsigned(Out, (unsigned) Totals->TotalBlocks, 0);
+		Out = FmtStr(Out, " BLOCKS USED.");
+	}
+	FmtWrite(Row, Out);
 }
 
 
 /******************************************************************************
-* Main loop
+* Display the name of an archive before its directory
 ******************************************************************************/
-int main(int argc, char *argv[])
+static void DisplayArchive(const char *Name)
 {
-	int ArgNum;
-	int Error = 0;
-	int DispError;
-	int FirstFileName = 1;
-	char FileName[MAXPATH+1];
-	FILE *InFile;
-	enum ArchiveTypes ArchiveType;
-	struct ArcTotals Totals;
+	fputs("Archive: ", stdout);
+	fputs(Name, stdout);
+	putchar('\n');
+}
 
-#ifndef __Z88DK
-	setvbuf(stdout, NULL, _IOLBF, 82);		/* speed up screen output */
-#endif
+/******************************************************************************
+* Machine-readable output
+* One record is written per archive entry as soon as it is read, so memory use
+* does not depend on the size of the archive.
+******************************************************************************/
 
-	if ((argc > 1) &&
-		((argv[FirstFileName][0] == '-') || (argv[FirstFileName][0] == '/')) &&
-		((argv[FirstFileName][1] == 'd')
-#ifdef CPM
-		  || (argv[FirstFileName][1] == 'D')
-#endif
-		) && (argv[FirstFileName][2] == '\x0')) {
-		WideFormat = 0;		/* 1541-style output */
-		++FirstFileName;
-	} else {
-		WideFormat = 1;		/* wide FV-style output */
+/* Returns the archive type name without its display padding */
+static const char *FormatName(enum ArchiveTypes Type)
+{
+	const char *Name = ArchiveFormats[Type];
+
+	while (*Name == ' ')
+		++Name;
+	return Name;
+}
+
+/* Write an unsigned decimal number */
+static void PutUnsigned(unsigned long Num)
+{
+	char Buf[MAX_DIGITS];
+	fwrite(Buf, 1, (size_t) (FmtUnsigned(Buf, Num, 0) - Buf), stdout);
+}
+
+/* Write a signed decimal number */
+static void PutSigned(long Num)
+{
+	char Buf[MAX_DIGITS];
+	fwrite(Buf, 1, (size_t) (FmtSigned(Buf, Num, 0) - Buf), stdout);
+}
+
+/* Write a quoted JSON string */
+static void PutJsonString(const char *Str)
+{
+	static const char HexDigits[] = "0123456789abcdef";
+
+	putchar('"');
+	for (; *Str; ++Str) {
+		unsigned char Ch = (unsigned char) *Str;
+		if ((Ch == '"') || (Ch == '\\')) {
+			putchar('\\');
+			putchar(Ch);
+		} else if ((Ch < 0x20) || (Ch == 0x7f)) {
+			fputs("\\u00", stdout);
+			putchar(HexDigits[Ch >> 4]);
+			putchar(HexDigits[Ch & 0xf]);
+		} else
+			putchar(Ch);
+	}
+	putchar('"');
+}
+
+/* Write a CSV field, quoting it only if necessary */
+static void PutCsvField(const char *Str)
+{
+	if (strpbrk(Str, ",\"\r\n") == NULL) {
+		fputs(Str, stdout);
+		return;
+	}
+	putchar('"');
+	for (; *Str; ++Str) {
+		if (*Str == '"')
+			putchar('"');
+		putchar(*Str);
 	}
+	putchar('"');
+}
 
-	if ((argc <= FirstFileName) ||
-		(((argv[FirstFileName][0] == '-') || (argv[FirstFileName][0] == '/')) &&
-		 ((argv[FirstFileName][1] == '?') || (argv[FirstFileName][1] == 'h')
-#ifdef CPM
-		  || (argv[FirstFileName][1] == 'H')
+static void RecordStart(void *UserData, enum ArchiveTypes Type, const char *Name)
+{
+	(void) UserData;
+	(void) Name;
+	CurrentType = Type;
+}
+
+static int JsonEntry(void *UserData, const char *Name, const char *Type,
+		unsigned long Length, unsigned Blocks, const char *Storage,
+		int Compression, unsigned BlocksNow, long Checksum,
+		const char *RawName)
+{
+	const char *Hash = EntryHash(UserData);
+
+	(void) RawName;
+	fputs("{\"archive\":", stdout);
+	PutJsonString(CurrentArchive);
+	fputs(",\"format\":", stdout);
+	PutJsonString(FormatName(CurrentType));
+	fputs(",\"name\":", stdout);
+	PutJsonString(Name);
+	fputs(",\"type\":", stdout);
+	PutJsonString(Type);
+	fputs(",\"length\":", stdout);
+	PutUnsigned(Length);
+	fputs(",\"blocks\":", stdout);
+	PutUnsigned(Blocks);
+	fputs(",\"method\":", stdout);
+	PutJsonString(Storage);
+	fputs(",\"compression\":", stdout);
+	PutSigned(Compression);
+	fputs(",\"blocks_now\":", stdout);
+	PutUnsigned(BlocksNow);
+	fputs(",\"checksum\":", stdout);
+	if (Checksum >= 0)
+		PutSigned(Checksum);
+	else
+		fputs("null", stdout);
+	if (Hash) {
+		fputs(",\"hash\":", stdout);
+		if (*Hash)
+			PutJsonString(Hash);
+		else
+			fputs("null", stdout);
+	}
+	fputs("}\n", stdout);
+	return 0;
+}
+
+static void CsvBegin(void)
+{
+	fputs("archive,format,name,type,length,blocks,method,compression,blocks_now,checksum",
+		  stdout);
+	if (HashType)
+		fputs(",hash", stdout);
+	putchar('\n');
+}
+
+static int CsvEntry(void *UserData, const char *Name, const char *Type,
+		unsigned long Length, unsigned Blocks, const char *Storage,
+		int Compression, unsigned BlocksNow, long Checksum,
+		const char *RawName)
+{
+	const char *Hash = EntryHash(UserData);
+
+	(void) RawName;
+	PutCsvField(CurrentArchive);
+	putchar(',');
+	PutCsvField(FormatName(CurrentType));
+	putchar(',');
+	PutCsvField(Name);
+	putchar(',');
+	PutCsvField(Type);
+	putchar(',');
+	PutUnsigned(Length);
+	putchar(',');
+	PutUnsigned(Blocks);
+	putchar(',');
+	PutCsvField(Storage);
+	putchar(',');
+	PutSigned(Compression);
+	putchar(',');
+	PutUnsigned(BlocksNow);
+	putchar(',');
+	if (Checksum >= 0)
+		PutSigned(Checksum);
+	if (Hash) {
+		putchar(',');
+		PutCsvField(Hash);
+	}
+	putchar('\n');
+	return 0;
+}
+
+/******************************************************************************
+* Binary catalog output; see cbmcat.h
+******************************************************************************/
+static struct CatWriter Catalog;
+static int CatalogFailed;		/* nonzero once a record couldn't be written */
+
+static void CatalogBegin(void)
+{
+#if defined(__MSDOS__) || defined(_WIN32)
+	setmode(fileno(stdout), O_BINARY);	/* put standard output into binary mode */
 #endif
-		 ) &&
-		 (argv[FirstFileName][2] == '\x0'))) {
-		printf("%s  ver. " VERSION "  " VERDATE "  by Daniel Fandrich\n", ProgName);
-		printf("Usage:\n  %s [-d] filename1 [filenameN ...]\n"
-			   "View directory of Commodore 64/128 archive and self-dissolving archive files.\n"
-			   "Supports ARC230, Lynx, LZH (SFX), T64, TAP, D64, X64, N64, PC64 & LBR archive\n"
-			   "types.\n"
-			   "fvcbm is copyright (C) 1995-2025 by Daniel Fandrich, et. al.\n"
-			   "This program comes with NO WARRANTY. See the file COPYING for details.\n",
-			   ProgName);
+	if (CatWriteHeader(&Catalog, stdout))
+		CatalogFailed = 1;
+}
+
+static void CatalogStart(void *UserData, enum ArchiveTypes Type, const char *Name)
+{
+	(void) UserData;
+	if (CatWriteArchive(&Catalog, Type, FormatName(Type), Name, CurrentArchive))
+		CatalogFailed = 1;
+}
+
+static int CatalogEntry(void *UserData, const char *Name, const char *Type,
+		unsigned long Length, unsigned Blocks, const char *Storage,
+		int Compression, unsigned BlocksNow, long Checksum,
+		const char *RawName)
+{
+	(void) UserData;
+	(void) Name;
+	if (CatWriteEntry(&Catalog, Length, Blocks, BlocksNow, Checksum,
+					  Compression, Type, Storage, RawName)) {
+		CatalogFailed = 1;
 		return 1;
 	}
+	return 0;
+}
+
+static void CatalogTrailer(enum ArchiveTypes Type, const struct ArcTotals *Totals)
+{
+	(void) Type;
+	if (CatWriteTotals(&Catalog, Totals->ArchiveEntries, Totals->TotalLength,
+					   Totals->TotalBlocks, Totals->TotalBlocksNow,
+					   Totals->DearcerBlocks, Totals->Version, Totals->BlocksFree))
+		CatalogFailed = 1;
+}
 
-	/* -- ends options */
-	if ((argv[FirstFileName][0] == '-') && (argv[FirstFileName][1] == '-')) {
-		++FirstFileName;
+/* A catalog cut short by a full disk must not look like a good one */
+static int CatalogEnd(void)
+{
+	if (CatWriteEnd(&Catalog) || (fflush(stdout) == EOF) || CatalogFailed) {
+		fprintf(stderr, "%s: Error writing the catalog\n", ProgName);
+		return 2;
 	}
+	return 0;
+}
 
 /******************************************************************************
-* Loop through archive display for each file name
+* Output formats selectable with --format
 ******************************************************************************/
-	for (ArgNum=FirstFileName; ArgNum<argc; ++ArgNum) {
+struct OutputFormat {
+	const char *Name;
+	void (*Begin)(void);				/* before the first archive; may be NULL */
+	void (*Archive)(const char *Name);	/* before each archive; may be NULL */
+	DisplayStartFunc Start;
+	DisplayEntryFunc Entry;
+	void (*Trailer)(enum ArchiveTypes ArchiveType, const struct ArcTotals *Totals);
+	int (*End)(void);					/* after the last archive, returning an
+										   exit status; may be NULL */
+	int Separate;						/* nonzero to separate archives by a blank line */
+};
+
+static void NoTrailer(enum ArchiveTypes Type, const struct ArcTotals *Totals)
+{
+	(void) Type;
+	(void) Totals;
+}
+
+static int NoEntry(void *UserData, const char *Name, const char *Type,
+		unsigned long Length, unsigned Blocks, const char *Storage,
+		int Compression, unsigned BlocksNow, long Checksum,
+		const char *RawName)
+{
+	(void) UserData;
+	(void) Name;
+	(void) Type;
+	(void) Length;
+	(void) Blocks;
+	(void) Storage;
+	(void) Compression;
+	(void) BlocksNow;
+	(void) Checksum;
+	(void) RawName;
+	return 0;
+}
+
+static const struct OutputFormat OutputFormats[] = {
+	{"text", NULL, DisplayArchive, DisplayHeader, DisplayFile, DisplayTrailer, NULL, 1},
+	{"jsonl", NULL, NULL, RecordStart, JsonEntry, NoTrailer, NULL, 0},
+	{"csv", CsvBegin, NULL, RecordStart, CsvEntry, NoTrailer, NULL, 0},
+	{"binary", CatalogBegin, NULL, CatalogStart, CatalogEntry, CatalogTrailer, CatalogEnd, 0},
+	{NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0}
+};
 
 /******************************************************************************
-* Open the archive file
+* Display a problem found while reading an archive
+* Standard output may be fully buffered, so flush it first to keep the message
+* in sequence with the listing.
 ******************************************************************************/
-		strncpy(FileName, argv[ArgNum], sizeof(FileName) - MAX_EXT_LEN);
-		FileName[sizeof(FileName)-1] = 0;
-
-		if (strcmp(FileName,"-") == 0) {		/* "-" means read from stdin */
-			InFile = stdin;
-#ifdef __MSDOS__
-			setmode(fileno(stdin), O_BINARY);	/* put standard input into binary mode */
-#endif
-		} else if ((InFile = fopen(FileName, "rb")) == NULL) {
+static void DisplayWarning(void *UserData, const char *Msg)
+{
+	(void) UserData;
+	fflush(stdout);
+	fprintf(stderr, "%s: %s\n", ProgName, Msg);
+}
 
 /******************************************************************************
-* Given name wasn't found--add extensions and keep searching
+* --grep output: one line for each match instead of a listing
 ******************************************************************************/
-			const char * const *Ext;
-			char TryFileName[MAXPATH+1];
+static const struct OutputFormat GrepFormat =
+	{"grep", NULL, NULL, NULL, NULL, NoTrailer, NULL, 0};
 
-			for (Ext = Extensions; *Ext != NULL; ++Ext) {
-				strcat(strcpy(TryFileName, FileName), *Ext);
-				if ((InFile = fopen(TryFileName, "rb")) != NULL) {
-					strcpy(FileName, TryFileName);
-					break;
-				}
-			}
+static int GrepFound(void *UserData, unsigned Pat, unsigned long Offset)
+{
+	const struct CbmEntry *Entry = (const struct CbmEntry *) UserData;
+
+	printf("%s:%s:%lu:%s\n", CurrentArchive, Entry->Name, Offset, GrepArgs[Pat]);
+	return 0;
+}
+
+/* Without a listing, messages need to say which archive they're about */
+static void ArchiveWarning(void *UserData, const char *Msg)
+{
+	(void) UserData;
+	fflush(stdout);
+	fprintf(stderr, "%s: %s: %s\n", ProgName, CurrentArchive, Msg);
+}
 
 /******************************************************************************
-* Couldn't find any variation of the file name
+* Search the contents of each entry in an archive
+* Returns the exit status
 ******************************************************************************/
-			if (InFile == NULL) {
-				perror(FileName);
-				printf("\n");
-				Error = 2;
-				continue;		/* go do next file */
-			}
+static int GrepArchive(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType)
+{
+	struct CbmDir *Dir;
+	struct CbmEntry Entry;
+	int Status;
+	int Error = 0;
+	int Unsupported = 0;
+
+	if ((Dir = CbmOpenDir(Ctx, InFile, ArchiveType)) == NULL) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		return Ctx->Error;
+	}
+	while ((Status = CbmNextEntry(Dir, &Entry)) > 0) {
+		if (CbmSearchEntry(&Search, Dir, GrepFound, &Entry) >= 0)
+			continue;
+		if (Ctx->Error == CBM_ERR_UNSUPPORTED) {
+			/* Only say so once for the archive */
+			if (!Unsupported++)
+				ArchiveWarning(NULL, Ctx->ErrorMsg);
+		} else {
+			/* Carry on with the other entries */
+			ArchiveWarning(NULL, Ctx->ErrorMsg);
+			Error = Ctx->Error;
 		}
+	}
+	if (Status < 0) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		Error = Ctx->Error;
+	}
+	CbmCloseDir(Dir);
+	return Error;
+}
 
 /******************************************************************************
-* Display header
-* To do: Add display of archive comment
+* --dups and --similar report on all the archives together at the end, so
+* they keep the path of each one they need to show, numbered from 0
 ******************************************************************************/
-		printf("Archive: %s\n", FileName);
+static char **Paths;
+static unsigned long NumPaths;
+static int OutOfMemory;			/* nonzero once there's no room for more */
 
-		if ((ArchiveType = DetermineArchiveType(InFile,FileName)) == UnknownArchive) {
-			fprintf(stderr,"%s: Not a known Commodore archive\n", ProgName);
-			Error = 3;
-		} else {
+static int NoMemory(void)
+{
+	fflush(stdout);
+	fprintf(stderr, "%s: Out of memory\n", ProgName);
+	OutOfMemory = 1;
+	return CBM_ERR_MEMORY;
+}
+
+/* Save the path of the current archive; returns 0 or -1 if out of memory */
+static int SavePath(void)
+{
+	char **New;
+
+	if ((New = (char **) realloc(Paths, (size_t) (NumPaths + 1) * sizeof(*Paths))) == NULL)
+		return -1;
+	Paths = New;
+	if ((Paths[NumPaths] = (char *) malloc(strlen(CurrentArchive) + 1)) == NULL)
+		return -1;
+	strcpy(Paths[NumPaths++], CurrentArchive);
+	return 0;
+}
 
 /******************************************************************************
-* Display the archive contents
+* --dups output: sets of entries with the same contents in all the archives
+* The entries are only fingerprinted while the archives are read. Once the
+* duplicates are known, the archives holding them are read again for their
+* names.
 ******************************************************************************/
-			if ((DispError = DirArchive(InFile, ArchiveType, &Totals,
-										DisplayHeader, DisplayFile)) != 0)
-				Error = DispError;
-			else
-				DisplayTrailer(ArchiveType, &Totals);	/* show output trailer */
+static const struct OutputFormat DupFormat =
+	{"dups", NULL, NULL, NULL, NULL, NoTrailer, NULL, 0};
+
+static struct CbmDupTable Dups;
+static char *DupNames;			/* names of duplicates; "?" for unknown ones */
+static unsigned long DupNamesLen;
+static unsigned long DupNamesMax;
+
+/******************************************************************************
+* Fingerprint each entry in an archive
+* Returns the exit status
+******************************************************************************/
+static int DupArchive(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType)
+{
+	struct CbmDir *Dir;
+	struct CbmEntry Entry;
+	unsigned long Num;
+	int Status;
+
+	if (OutOfMemory)
+		return CBM_ERR_MEMORY;
+	if (SavePath() < 0)
+		return NoMemory();
+
+	if ((Dir = CbmOpenDir(Ctx, InFile, ArchiveType)) == NULL) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		return Ctx->Error;
+	}
+	/* Entries that couldn't be hashed can't be compared */
+	for (Num = 0; (Status = CbmNextEntry(Dir, &Entry)) > 0; ++Num)
+		if (*Entry.Hash &&
+			(CbmDupAdd(&Dups, Entry.Hash, Entry.Length, NumPaths - 1, Num) < 0)) {
+			CbmCloseDir(Dir);
+			return NoMemory();
 		}
+	if (Status < 0)
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+	CbmCloseDir(Dir);
+	return Status < 0 ? Ctx->Error : 0;
+}
 
 /******************************************************************************
-* Go do next file name on command line
+* Store a name for the report
+* Returns its offset in DupNames, or 0 for "?" if out of memory
+******************************************************************************/
+static CbmDupIndex AddDupName(const char *Name)
+{
+	unsigned long Len = (unsigned long) strlen(Name) + 1;
+	unsigned long Ofs = DupNamesLen;
+
+	if (DupNamesLen + Len > DupNamesMax) {
+		unsigned long Max = DupNamesMax * 2 + Len;
+		char *New;
+		if ((Max < DupNamesMax) || ((size_t) Max != Max) ||
+			((New = (char *) realloc(DupNames, (size_t) Max)) == NULL))
+			return 0;
+		DupNames = New;
+		DupNamesMax = Max;
+	}
+	memcpy(DupNames + Ofs, Name, (size_t) Len);
+	DupNamesLen += Len;
+	return (CbmDupIndex) Ofs;
+}
+
+/******************************************************************************
+* Read the directory of the archive holding records First to End again,
+* replacing the entry numbers of the duplicates with their names' offsets
 ******************************************************************************/
+static void NameDups(struct CbmContext *Ctx, CbmDupIndex First, CbmDupIndex End)
+{
+	const char *Path = Paths[Dups.Rec[First].Archive];
+	CbmDupIndex r = First;
+	FILE *InFile;
+
+	if ((InFile = fopen(Path, "rb")) != NULL) {
+		struct CbmDir *Dir = CbmOpenDir(Ctx, InFile,
+				DetermineArchiveType(InFile, Path));
+		struct CbmEntry Entry;
+		unsigned long Num;
+
+		for (Num = 0; Dir && (r < End) && (CbmNextEntry(Dir, &Entry) > 0); ++Num)
+			if (Dups.Rec[r].Entry == Num) {
+				if (CBM_DUP_IS_DUP(&Dups.Rec[r]))
+					Dups.Rec[r].Entry = AddDupName(Entry.Name);
+				++r;
+			}
+		if (Dir)
+			CbmCloseDir(Dir);
 		fclose(InFile);
-		if (ArgNum<argc-1)
-			printf("\n");
 	}
+	/* e.g. standard input, which can't be read twice */
+	for (; r < End; ++r)
+		Dups.Rec[r].Entry = 0;
+}
+
+/******************************************************************************
+* Find the names of all the duplicates
+* The entries were recorded in order, so each archive is read once at most.
+******************************************************************************/
+static void FindDupNames(struct CbmContext *Ctx)
+{
+	CbmDupIndex First = 0;
+
+	DupNamesLen = DupNamesMax = 0;
+	AddDupName("?");
+	Ctx->Hash = CBM_HASH_NONE;
+	Ctx->Fields = FIELD_NAME;
+	Ctx->Warning = NULL;		/* they were shown the first time */
+
+	while (First < Dups.Len) {
+		CbmDupIndex End = First;
+		int AnyDups = 0;
+		for (; (End < Dups.Len) && (Dups.Rec[End].Archive == Dups.Rec[First].Archive);
+				++End)
+			AnyDups |= CBM_DUP_IS_DUP(&Dups.Rec[End]);
+		if (AnyDups)
+			NameDups(Ctx, First, End);
+		First = End;
+	}
+}
+
+/******************************************************************************
+* Display each set of duplicates and what removing them would save
+******************************************************************************/
+static void DisplayDups(void)
+{
+	unsigned long Sets = 0;
+	unsigned long Copies = 0;
+	unsigned long Saved = 0;
+	CbmDupIndex i;
+
+	for (i = 0; i < Dups.Len; ++i) {
+		const struct CbmDupRec *First = &Dups.Rec[i];
+		const struct CbmDupRec *Rec = First;
+		int b;
+
+		if (First->Count < 2)
+			continue;
+		printf("%lu copies of %lu bytes, fingerprint ", (unsigned long) First->Count,
+				(unsigned long) First->Length);
+		for (b = 0; b < CBM_DUP_FP_LEN; ++b)
+			printf("%02x", First->Fp[b]);
+		putchar('\n');
+		do {
+			printf("  %s: %s\n", Paths[Rec->Archive],
+					DupNames ? DupNames + Rec->Entry : "?");
+			Rec = &Dups.Rec[Rec->Next];
+		} while (Rec != First);
+		putchar('\n');
+
+		++Sets;
+		Copies += First->Count - 1;
+		Saved += (First->Count - 1) * (unsigned long) First->Length;
+	}
+	printf("*total %lu sets of duplicates, %lu extra copies, %lu bytes could be saved\n",
+			Sets, Copies, Saved);
+}
+
+/******************************************************************************
+* --similar output: clusters of archives that have most of their files in
+* common, found by comparing the MinHash signatures of their files' hashes
+******************************************************************************/
+static const struct OutputFormat SimFormat =
+	{"similar", NULL, NULL, NULL, NULL, NoTrailer, NULL, 0};
 
+static struct CbmSimTable Similar;
+static unsigned SimPercent = 50;	/* least similarity within a cluster */
+
+/******************************************************************************
+* Make a signature of the files in an archive
+* Returns the exit status
+******************************************************************************/
+static int SimArchive(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType)
+{
+	struct CbmDir *Dir;
+	struct CbmEntry Entry;
+	struct CbmSimSig Sig;
+	int Status;
+
+	if (OutOfMemory)
+		return CBM_ERR_MEMORY;
+	if ((Dir = CbmOpenDir(Ctx, InFile, ArchiveType)) == NULL) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		return Ctx->Error;
+	}
+	CbmSimInit(&Sig);
+	while ((Status = CbmNextEntry(Dir, &Entry)) > 0)
+		if (*Entry.Hash)
+			CbmSimAdd(&Sig, Entry.Hash);
+	if (Status < 0)
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+	CbmCloseDir(Dir);
+
+	/* An archive without any files that could be hashed is like no other */
+	if (Sig.Files && ((SavePath() < 0) || (CbmSimTableAdd(&Similar, &Sig) < 0)))
+		return NoMemory();
+	return Status < 0 ? Ctx->Error : 0;
+}
+
+/******************************************************************************
+* Display each cluster of similar archives
+* Returns the exit status
+******************************************************************************/
+static int DisplaySimilar(void)
+{
+	unsigned long *Next;		/* next archive in the same cluster plus 1 */
+	unsigned long Clusters = 0;
+	unsigned long i;
+
+	if ((CbmSimCluster(&Similar, SimPercent) < 0) ||
+		((Next = (unsigned long *) calloc((size_t) (Similar.Len ? Similar.Len : 1),
+				sizeof(*Next))) == NULL))
+		return NoMemory();
+
+	/* Link the archives in each cluster in order, starting from the first */
+	for (i = Similar.Len; i-- > 0; ) {
+		unsigned long First = CbmSimFind(&Similar, i);
+		if (First != i) {
+			Next[i] = Next[First];
+			Next[First] = i + 1;
+		}
+	}
+
+	for (i = 0; i < Similar.Len; ++i) {
+		const struct CbmSimSig *FirstSig = &Similar.Sig[i];
+		unsigned long Member;
+		unsigned long Count = 1;
+
+		if ((CbmSimFind(&Similar, i) != i) || !Next[i])
+			continue;
+		for (Member = Next[i]; Member; Member = Next[Member - 1])
+			++Count;
+		printf("%lu similar archives\n", Count);
+		printf("  %s: %lu files\n", Paths[i], FirstSig->Files);
+		for (Member = Next[i]; Member; Member = Next[Member - 1])
+			printf("  %s: %lu files, %u%% similar\n", Paths[Member - 1],
+					Similar.Sig[Member - 1].Files,
+					CbmSimCompare(FirstSig, &Similar.Sig[Member - 1]));
+		putchar('\n');
+		++Clusters;
+	}
+	printf("*total %lu clusters of similar archives\n", Clusters);
+	free(Next);
+	return 0;
+}
+
+/******************************************************************************
+* --check output: the problems found in each disk image and a summary of them
+******************************************************************************/
+static const struct OutputFormat CheckFormat =
+	{"check", NULL, NULL, NULL, NULL, NoTrailer, NULL, 0};
+
+/* Problems found are the output, so they go with it */
+static void CheckWarning(void *UserData, const char *Msg)
+{
+	(void) UserData;
+	printf("%s: %s\n", CurrentArchive, Msg);
+}
+
+/******************************************************************************
+* Check the chains and BAM of a disk image
+* Returns the exit status, which is CBM_ERR_ARCHIVE if problems were found
+******************************************************************************/
+static int CheckArchive(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType)
+{
+	struct CbmDir *Dir;
+	struct CbmDiskCheck Check;
+	int Status;
+
+	if ((Dir = CbmOpenDir(Ctx, InFile, ArchiveType)) == NULL) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		return Ctx->Error;
+	}
+	Status = CbmCheckDisk(Dir, &Check);
+	CbmCloseDir(Dir);
+	if (Status < 0) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		return Ctx->Error;
+	}
+	printf("%s: %u files, %u cross-linked, %u loops, %u bad links, "
+		   "%u orphaned, %u free but used\n", CurrentArchive, Check.Files,
+		   Check.CrossLinked, Check.Loops, Check.BadLinks, Check.Orphans,
+		   Check.FreeUsed);
+	return (Check.CrossLinked || Check.Loops || Check.BadLinks ||
+			Check.Orphans || Check.FreeUsed) ? CBM_ERR_ARCHIVE : 0;
+}
+
+/******************************************************************************
+* --verify output: whether the checksum of each entry in ARC and LHA archives
+* matches its contents, and a summary for each archive
+******************************************************************************/
+static const struct OutputFormat VerifyFormat =
+	{"verify", NULL, NULL, NULL, NULL, NoTrailer, NULL, 0};
+
+#define VERIFY_BUF_SIZE 32768	/* bytes checked at a time */
+
+/******************************************************************************
+* Read the contents of each entry in an archive and compare their checksum with
+* the one stored for it
+* Returns the exit status, which is CBM_ERR_ARCHIVE if any didn't match
+******************************************************************************/
+static int VerifyArchive(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType)
+{
+	static unsigned char Buf[VERIFY_BUF_SIZE];
+	unsigned (*Checksum)(unsigned, const void *, size_t);
+	struct CbmDir *Dir;
+	struct CbmEntry Entry;
+	unsigned long Files = 0, Good = 0, Bad = 0, Unread = 0;
+	unsigned long Done;
+	unsigned Sum;
+	long Got;
+	int Status;
+	int Error = 0;
+
+	switch (ArchiveType) {
+		case C64_ARC:
+		case C64_10:
+		case C64_13:
+		case C64_15:
+		case C128_15:
+			Checksum = CbmArcSum;
+			break;
+		case LHA_SFX:
+		case LHA:
+			Checksum = CbmCRC16;
+			break;
+		default:
+			ArchiveWarning(NULL, "Archive has no checksums");
+			return CBM_ERR_UNSUPPORTED;
+	}
+
+	if ((Dir = CbmOpenDir(Ctx, InFile, ArchiveType)) == NULL) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		return Ctx->Error;
+	}
+	while ((Status = CbmNextEntry(Dir, &Entry)) > 0) {
+		++Files;
+		Sum = 0;
+		Done = 0;
+		while ((Got = CbmReadEntry(Dir, Buf, sizeof(Buf))) > 0) {
+			Sum = Checksum(Sum, Buf, (size_t) Got);
+			Done += (unsigned long) Got;
+		}
+		/* The library's own mismatch comes after all the contents, so only
+		   an error before then means they couldn't be read */
+		if ((Got < 0) && (Done < Entry.Length)) {
+			printf("%s: %s: %s\n", CurrentArchive, Entry.Name, Ctx->ErrorMsg);
+			++Unread;
+			Error = Ctx->Error;
+		} else if ((long) Sum != Entry.Checksum) {
+			printf("%s: %s: checksum %04lx, contents have %04x\n", CurrentArchive,
+				   Entry.Name, (unsigned long) Entry.Checksum, Sum);
+			++Bad;
+			Error = CBM_ERR_ARCHIVE;
+		} else
+			++Good;
+	}
+	CbmCloseDir(Dir);
+	if (Status < 0) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		return Ctx->Error;
+	}
+	printf("%s: %lu files, %lu good, %lu bad, %lu unreadable\n", CurrentArchive,
+		   Files, Good, Bad, Unread);
+	return Error;
+}
+
+/******************************************************************************
+* --find output: one line for each file found instead of a listing
+******************************************************************************/
+static const struct OutputFormat FindFormat =
+	{"find", NULL, NULL, NULL, NULL, NoTrailer, NULL, 0};
+
+static void FoundName(const char *Name, const char *Type, unsigned Blocks,
+		const char *Pattern)
+{
+	printf("%s:%s:%s:%u:%s\n", CurrentArchive, Name, Type, Blocks, Pattern);
+}
+
+/******************************************************************************
+* Look for each name in archives that can't be indexed by reading the whole
+* directory for each
+* Returns the exit status
+******************************************************************************/
+static int ScanArchive(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType)
+{
+	struct CbmDir *Dir;
+	struct CbmEntry Entry;
+	int Status;
+	int i;
+
+	for (i = 0; i < Finding; ++i) {
+		if ((Dir = CbmOpenDir(Ctx, InFile, ArchiveType)) == NULL) {
+			ArchiveWarning(NULL, Ctx->ErrorMsg);
+			return Ctx->Error;
+		}
+		while ((Status = CbmNextEntry(Dir, &Entry)) > 0)
+			if (CbmMatchName(FindArgs[i], Entry.Name, 0))
+				FoundName(Entry.Name, Entry.Type, Entry.Blocks, FindArgs[i]);
+		CbmCloseDir(Dir);
+		if (Status < 0) {
+			ArchiveWarning(NULL, Ctx->ErrorMsg);
+			return Ctx->Error;
+		}
+	}
+	return 0;
+}
+
+/******************************************************************************
+* Look for each name in an archive, through an index of a disk image
+* directory so it's read just once
+* Returns the exit status
+******************************************************************************/
+static int FindArchive(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType)
+{
+	struct CbmDir *Dir;
+	struct CbmNameIndex *Index;
+	const struct CbmIndexEntry *Found;
+	int i;
+
+	if ((Dir = CbmOpenDir(Ctx, InFile, ArchiveType)) == NULL) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		return Ctx->Error;
+	}
+	Index = CbmIndexNames(Dir);
+	CbmCloseDir(Dir);
+	if (!Index) {
+		if (Ctx->Error == CBM_ERR_UNSUPPORTED)
+			return ScanArchive(Ctx, InFile, ArchiveType);
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		return Ctx->Error;
+	}
+	for (i = 0; i < Finding; ++i)
+		for (Found = NULL;
+			 (Found = CbmFindName(Index, FindArgs[i], Found)) != NULL; )
+			FoundName(Found->Name, Found->Type, Found->Blocks, FindArgs[i]);
+	CbmFreeIndex(Index);
+	return 0;
+}
+
+/******************************************************************************
+* --dump output: the length and any load address of each file, and some of its
+* contents in hexadecimal
+******************************************************************************/
+static const struct OutputFormat DumpFormat =
+	{"dump", NULL, NULL, NULL, NULL, NoTrailer, NULL, 0};
+
+#define DUMP_LEN 64				/* bytes shown of each file */
+
+/******************************************************************************
+* Show the current entry, reading it through CbmOpenFile() to go straight to
+* DumpOffset, which counts from the start of the file including any load address
+* Returns 0 or -1 on error
+******************************************************************************/
+static int DumpFile(struct CbmDir *Dir, const struct CbmEntry *Entry)
+{
+	struct CbmFile *File;
+	unsigned char Buf[DUMP_LEN];
+	long Len = 0;
+	long i;
+
+	if ((File = CbmOpenFile(Dir)) == NULL)
+		return -1;
+	printf("%s:%s:%s:%lu", CurrentArchive, Entry->Name, Entry->Type,
+		   CbmFileLength(File));
+	if ((strcmp(Entry->Type, "PRG") == 0) &&
+		((Len = CbmReadFile(File, Buf, 2)) == 2))
+		printf(":%04X", Buf[0] | (Buf[1] << 8));
+	printf("\n");
+	if ((Len < 0) || (CbmSeekFile(File, DumpOffset) < 0) ||
+		((Len = CbmReadFile(File, Buf, sizeof(Buf))) < 0)) {
+		CbmCloseFile(File);
+		return -1;
+	}
+	for (i = 0; i < Len; ++i) {
+		if (!(i % 16))
+			printf("%06lx:", DumpOffset + (unsigned long) i);
+		printf(" %02x", Buf[i]);
+		if ((i % 16 == 15) || (i == Len - 1))
+			printf("\n");
+	}
+	CbmCloseFile(File);
+	return 0;
+}
+
+/******************************************************************************
+* Show each file in an archive called DumpName
+* Returns the exit status
+******************************************************************************/
+static int DumpArchive(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType)
+{
+	struct CbmDir *Dir;
+	struct CbmEntry Entry;
+	char Msg[40 + CBM_MAX_MSG];
+	int Status;
+	int Error = 0;
+
+	if ((Dir = CbmOpenDir(Ctx, InFile, ArchiveType)) == NULL) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		return Ctx->Error;
+	}
+	while ((Status = CbmNextEntry(Dir, &Entry)) > 0)
+		if (CbmMatchName(DumpName, Entry.Name, 0) &&
+			(DumpFile(Dir, &Entry) < 0)) {
+			sprintf(Msg, "%.36s: %s", Entry.Name, Ctx->ErrorMsg);
+			ArchiveWarning(NULL, Msg);
+			Error = Ctx->Error;
+		}
+	CbmCloseDir(Dir);
+	if (Status < 0) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		return Ctx->Error;
+	}
+	return Error;
+}
+
+/******************************************************************************
+* --carve output: one line for each archive found inside the files, which
+* needn't be archives themselves
+******************************************************************************/
+static const struct OutputFormat CarveFormat =
+	{"carve", NULL, NULL, NULL, NULL, NoTrailer, NULL, 0};
+
+static int CarveFound(void *UserData, unsigned long Offset,
+		enum ArchiveTypes ArchiveType, unsigned long Entries)
+{
+	(void) UserData;
+	printf("%s:%lu:%s:%lu\n", CurrentArchive, Offset, FormatName(ArchiveType),
+		   Entries);
+	return 0;
+}
+
+/******************************************************************************
+* Look for archives anywhere in a file
+* Returns the exit status
+******************************************************************************/
+static int CarveFile(struct CbmContext *Ctx, FILE *InFile)
+{
+	struct CbmFileSource FileSrc;
+
+	if (CbmCarve(Ctx, CbmInitFileSource(&FileSrc, InFile), CarveFound, NULL) < 0) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		return Ctx->Error;
+	}
+	return 0;
+}
+
+/******************************************************************************
+* --extract output: the contents of each entry go to a file of their own, or
+* all to standard output
+******************************************************************************/
+static const struct OutputFormat ExtractFormat =
+	{"extract", NULL, NULL, NULL, NULL, NoTrailer, NULL, 0};
+
+static const char *ExtractDir;	/* where to put the files, or "-" for stdout */
+
+#define COPY_BUF_SIZE 4096		/* bytes copied at a time through here */
+
+/******************************************************************************
+* Make a file name for an entry that's safe to create: characters with a
+* special meaning in paths are replaced, and the type is added as an extension
+******************************************************************************/
+static void ExtractName(char *Path, const struct CbmEntry *Entry)
+{
+	const char *Ch;
+	char *Out;
+
+	Out = Path + strlen(strcat(strcpy(Path, ExtractDir), "/"));
+	for (Ch = Entry->Name; *Ch && (Ch < Entry->Name + 16); ++Ch)
+		*Out++ = (iscntrl((unsigned char) *Ch) || strchr("/\\:*?\"<>|", *Ch) ||
+				 ((Ch == Entry->Name) && (*Ch == '.'))) ? '_' : *Ch;
+	if (Ch == Entry->Name)
+		*Out++ = '_';
+	if (*Entry->Type) {
+		*Out++ = '.';
+		for (Ch = Entry->Type; *Ch && isalnum((unsigned char) *Ch) &&
+			 (Ch < Entry->Type + MAX_EXT_LEN - 1); ++Ch)
+			*Out++ = (char) tolower((unsigned char) *Ch);
+	}
+	*Out = '\0';
+}
+
+/******************************************************************************
+* Copy Len bytes at Offset in one file to the current position of another
+* inside the kernel, so they never pass through this program
+* Returns the number of bytes copied; any that weren't must be copied some
+* other way, as when the system doesn't support it for these files
+******************************************************************************/
+static unsigned long CopyRange(int InFd, unsigned long Offset, int OutFd,
+		unsigned long Len)
+{
+	unsigned long Done = 0;
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+	ssize_t Got;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	/* Between regular files, even sharing their blocks on some file systems */
+	while (Done < Len) {
+		loff_t InPos = (loff_t) (Offset + Done);
+		if ((Got = copy_file_range(InFd, &InPos, OutFd, NULL,
+								   (size_t) (Len - Done), 0)) <= 0)
+			break;
+		Done += (unsigned long) Got;
+	}
+#endif
+#ifdef HAVE_SENDFILE
+	/* To anything, including a pipe */
+	while (Done < Len) {
+		off_t InPos = (off_t) (Offset + Done);
+		if ((Got = sendfile(OutFd, InFd, &InPos, (size_t) (Len - Done))) <= 0)
+			break;
+		Done += (unsigned long) Got;
+	}
+#else
+	(void) InFd;
+	(void) Offset;
+	(void) OutFd;
+#endif
+	return Done;
+}
+
+/******************************************************************************
+* Write the contents of the current entry
+* Returns 0, or -1 on error with errno set or, if it's 0, the context's error
+******************************************************************************/
+static int ExtractEntry(struct CbmDir *Dir, FILE *InFile,
+		const struct CbmExtent *Extent, FILE *Out)
+{
+	char Buf[COPY_BUF_SIZE];
+	unsigned long Offset, Left;
+	size_t Chunk;
+	long Got;
+
+	errno = 0;
+	if (!Extent) {
+		/* It's in pieces, so let the library put them together */
+		while ((Got = CbmReadEntry(Dir, Buf, sizeof(Buf))) > 0)
+			if (fwrite(Buf, 1, (size_t) Got, Out) != (size_t) Got)
+				return -1;
+		if (Got < 0)
+			errno = 0;
+		return Got < 0 ? -1 : 0;
+	}
+
+	if ((fwrite(Extent->Prefix, 1, Extent->PrefixLen, Out) != Extent->PrefixLen) ||
+		(fflush(Out) != 0))
+		return -1;
+	Offset = Extent->Offset;
+	Left = Extent->Length;
+	Got = (long) CopyRange(fileno(InFile), Offset, fileno(Out), Left);
+	Offset += (unsigned long) Got;
+	Left -= (unsigned long) Got;
+
+	/* Copy whatever the system couldn't */
+	if (Left && (fseek(InFile, (long) Offset, SEEK_SET) != 0))
+		return -1;
+	for (; Left; Left -= Chunk) {
+		Chunk = Left < sizeof(Buf) ? (size_t) Left : sizeof(Buf);
+		if (fread(Buf, 1, Chunk, InFile) != Chunk) {
+			if (!ferror(InFile))
+				errno = EIO;	/* the archive got shorter */
+			return -1;
+		}
+		if (fwrite(Buf, 1, Chunk, Out) != Chunk)
+			return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+* Write the slices of a disk image in memory that make up an entry, gathering
+* as many as the system allows with each write
+* Returns 0, or -1 on error with errno set
+******************************************************************************/
+#if defined(IOV_MAX) && (IOV_MAX < 1024)
+#define WRITE_IOVS IOV_MAX
+#else
+#define WRITE_IOVS 1024			/* most slices written at a time */
+#endif
+
+static int WriteSlices(unsigned char *Image, const struct CbmSlice *Slices,
+		long Count, FILE *Out)
+{
+#ifdef HAVE_WRITEV
+	struct iovec Iov[WRITE_IOVS];
+	int Batch, i;
+	ssize_t Got;
+
+	if (fflush(Out) != 0)
+		return -1;
+	for (; Count > 0; Count -= Batch, Slices += Batch) {
+		Batch = Count < WRITE_IOVS ? (int) Count : WRITE_IOVS;
+		for (i = 0; i < Batch; ++i) {
+			Iov[i].iov_base = Image + Slices[i].Offset;
+			Iov[i].iov_len = Slices[i].Length;
+		}
+		/* A write may stop part way, even through a slice */
+		for (i = 0; i < Batch; ) {
+			if ((Got = writev(fileno(Out), &Iov[i], Batch - i)) < 0) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			for (; (i < Batch) && ((size_t) Got >= Iov[i].iov_len); ++i)
+				Got -= (ssize_t) Iov[i].iov_len;
+			if (i < Batch) {
+				Iov[i].iov_base = (unsigned char *) Iov[i].iov_base + Got;
+				Iov[i].iov_len -= (size_t) Got;
+			}
+		}
+	}
+#else
+	for (; Count > 0; --Count, ++Slices)
+		if (fwrite(Image + Slices->Offset, 1, Slices->Length, Out) != Slices->Length)
+			return -1;
+#endif
+	return 0;
+}
+
+/******************************************************************************
+* Load a whole archive into memory
+* Returns the copy, which must be freed, or NULL if it can't be made
+******************************************************************************/
+static unsigned char *LoadArchive(FILE *InFile, unsigned long *Len)
+{
+	unsigned char *Image;
+	long Size;
+
+	if ((fseek(InFile, 0, SEEK_END) != 0) || ((Size = ftell(InFile)) <= 0) ||
+		((unsigned long) (size_t) Size != (unsigned long) Size) ||
+		((Image = (unsigned char *) malloc((size_t) Size)) == NULL))
+		return NULL;
+	rewind(InFile);
+	if (fread(Image, 1, (size_t) Size, InFile) != (size_t) Size) {
+		free(Image);
+		return NULL;
+	}
+	*Len = (unsigned long) Size;
+	return Image;
+}
+
+/******************************************************************************
+* Create a file for writing, but only if nothing is there already
+* Checking first and then creating it would let a file or symbolic link made
+* in between be overwritten, so the check is done as it's created where
+* possible.
+* Returns the open file, or NULL with errno set to EEXIST if it exists
+******************************************************************************/
+static FILE *CreateNew(const char *Path)
+{
+#if defined(HAVE_O_EXCL)
+	FILE *Out;
+	int Fd = open(Path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+
+	if (Fd < 0)
+		return NULL;
+	if ((Out = fdopen(Fd, "wb")) == NULL)
+		close(Fd);
+	return Out;
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+	return fopen(Path, "wbx");
+#else
+	FILE *Out;
+
+	if ((Out = fopen(Path, "rb")) != NULL) {
+		fclose(Out);
+		errno = EEXIST;
+		return NULL;
+	}
+	return fopen(Path, "wb");
+#endif
+}
+
+/******************************************************************************
+* Extract each entry in an archive
+* Returns the exit status
+******************************************************************************/
+static int ExtractArchive(struct CbmContext *Ctx, FILE *InFile,
+		enum ArchiveTypes ArchiveType)
+{
+	struct CbmDir *Dir;
+	struct CbmEntry Entry;
+	struct CbmExtent Extent;
+	struct CbmMemSource Mem;
+	unsigned char *Image = NULL;	/* the whole disk image, if in memory */
+	unsigned long ImageLen;
+	struct CbmSlice *Slices = NULL;	/* where the entry is in Image */
+	long NumSlices = 0;
+	char Path[MAXPATH+1];
+	char Msg[MAXPATH+40];
+	FILE *Out;
+	int Status;
+	int Error = 0;
+	int Unsupported = 0;
+
+	/* The files in a disk image are in pieces all over it, so they're gathered
+	   from one copy of the image in memory instead of read a sector at a time */
+	if (((ArchiveType == D64) || (ArchiveType == C1581) || (ArchiveType == X64)) &&
+		((Image = LoadArchive(InFile, &ImageLen)) != NULL) &&
+		((Slices = (struct CbmSlice *) malloc(CBM_MAX_SLICES * sizeof(*Slices)))
+				== NULL)) {
+		free(Image);
+		Image = NULL;
+	}
+	if ((Dir = Image ?
+			CbmOpenSource(Ctx, CbmInitMemSource(&Mem, Image, ImageLen), ArchiveType) :
+			CbmOpenDir(Ctx, InFile, ArchiveType)) == NULL) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		free(Slices);
+		free(Image);
+		return Ctx->Error;
+	}
+	while ((Status = CbmNextEntry(Dir, &Entry)) > 0) {
+		int Run = Image ?
+			((NumSlices = CbmEntrySlices(Dir, Slices, CBM_MAX_SLICES)) < 0 ? -1 : 0) :
+			CbmEntryExtent(Dir, &Extent);
+		if (Run < 0) {
+			if (Ctx->Error != CBM_ERR_UNSUPPORTED) {
+				ArchiveWarning(NULL, Ctx->ErrorMsg);
+				Error = Ctx->Error;
+			} else if (!Unsupported++) {
+				/* Only say so once for the archive */
+				ArchiveWarning(NULL, Ctx->ErrorMsg);
+				Error = Ctx->Error;
+			}
+			continue;
+		}
+
+		if (strcmp(ExtractDir, "-") == 0) {
+			Out = stdout;
+			strcpy(Path, "standard output");
+		} else {
+			ExtractName(Path, &Entry);
+			/* Never overwrite anything */
+			errno = 0;
+			if ((Out = CreateNew(Path)) == NULL) {
+				if (errno == EEXIST) {
+					sprintf(Msg, "%s already exists", Path);
+					ArchiveWarning(NULL, Msg);
+				} else {
+					fflush(stdout);
+					perror(Path);
+				}
+				Error = 2;
+				continue;
+			}
+		}
+
+		if ((Image ? WriteSlices(Image, Slices, NumSlices, Out) :
+			 ExtractEntry(Dir, InFile, Run ? &Extent : NULL, Out)) < 0 ||
+			(fflush(Out) != 0)) {
+			if (errno) {
+				fflush(stdout);
+				perror(Path);
+			} else
+				ArchiveWarning(NULL, Ctx->ErrorMsg);
+			Error = 2;
+		}
+		if (Out != stdout) {
+			if (fclose(Out) != 0) {
+				perror(Path);
+				Error = 2;
+			} else
+				printf("%s\n", Path);
+		}
+	}
+	if (Status < 0) {
+		ArchiveWarning(NULL, Ctx->ErrorMsg);
+		Error = Ctx->Error;
+	}
+	CbmCloseDir(Dir);
+	free(Slices);
+	free(Image);
+	return Error;
+}
+
+/******************************************************************************
+* Convert a --grep pattern into bytes; \xHH is any byte and \\ a backslash
+* Returns the length, or 0 if it's not valid
+******************************************************************************/
+static unsigned ParsePattern(const char *Arg, unsigned char *Pat, unsigned MaxLen)
+{
+	unsigned Len = 0;
+
+	while (*Arg) {
+		if (Len >= MaxLen)
+			return 0;
+		if (*Arg != '\\')
+			Pat[Len++] = (unsigned char) *Arg++;
+		else if (Arg[1] == '\\') {
+			Pat[Len++] = '\\';
+			Arg += 2;
+		} else if ((Arg[1] == 'x') && isxdigit((unsigned char) Arg[2]) &&
+				   isxdigit((unsigned char) Arg[3])) {
+			char Hex[3];
+			Hex[0] = Arg[2];
+			Hex[1] = Arg[3];
+			Hex[2] = '\0';
+			Pat[Len++] = (unsigned char) strtoul(Hex, NULL, 16);
+			Arg += 4;
+		} else
+			return 0;
+	}
+	return Len;
+}
+
+/******************************************************************************
+* Returns nonzero if the argument is the given single letter option
+******************************************************************************/
+static int IsOption(const char *Arg, char Letter)
+{
+	return ((Arg[0] == '-') || (Arg[0] == '/')) &&
+		((Arg[1] == Letter)
+#ifdef CPM
+		  || (Arg[1] == toupper(Letter))
+#endif
+		) && (Arg[2] == '\0');
+}
+
+/******************************************************************************
+* What to do with the archives instead of listing them
+* Each mode is chosen by its own option, and only one can be chosen.
+******************************************************************************/
+enum Modes {
+	MODE_LIST,
+	MODE_GREP,
+	MODE_DUPS,
+	MODE_SIMILAR,
+	MODE_CHECK,
+	MODE_VERIFY,
+	MODE_EXTRACT,
+	MODE_FIND,
+	MODE_DUMP,
+	MODE_CARVE
+};
+
+static const struct ModeInfo {
+	const char *Option;
+	const struct OutputFormat *Format;
+	/* Reads each archive, returning an exit status; NULL to list it */
+	int (*Run)(struct CbmContext *Ctx, FILE *InFile, enum ArchiveTypes ArchiveType);
+	unsigned Fields;			/* only those shown are asked for */
+	WarningFunc Warning;
+	int Hash;					/* nonzero if --hash may be used */
+	int Where;					/* nonzero if --where may be used */
+} Modes[] = {
+/* MODE_LIST */		{NULL, NULL, NULL, 0, DisplayWarning, 1, 1},
+/* MODE_GREP */		{"--grep", &GrepFormat, GrepArchive, FIELD_NAME,
+					 ArchiveWarning, 0, 1},
+/* MODE_DUPS */		{"--dups", &DupFormat, DupArchive, FIELD_NAME | FIELD_LENGTH,
+					 ArchiveWarning, 1, 1},
+/* MODE_SIMILAR */	{"--similar", &SimFormat, SimArchive, FIELD_NAME | FIELD_LENGTH,
+					 ArchiveWarning, 1, 1},
+/* MODE_CHECK */	{"--check", &CheckFormat, CheckArchive, FIELD_NAME,
+					 CheckWarning, 0, 1},
+/* MODE_VERIFY */	{"--verify", &VerifyFormat, VerifyArchive,
+					 FIELD_NAME | FIELD_LENGTH | FIELD_CHECKSUM, ArchiveWarning, 0, 1},
+/* MODE_EXTRACT */	{"--extract", &ExtractFormat, ExtractArchive, FIELD_NAME | FIELD_TYPE,
+					 ArchiveWarning, 0, 1},
+/* MODE_FIND */		{"--find", &FindFormat, FindArchive,
+					 FIELD_NAME | FIELD_TYPE | FIELD_BLOCKS, ArchiveWarning, 0, 0},
+/* MODE_DUMP */		{"--dump", &DumpFormat, DumpArchive, FIELD_NAME | FIELD_TYPE,
+					 ArchiveWarning, 0, 1},
+/* MODE_CARVE */	{"--carve", &CarveFormat, NULL, 0, DisplayWarning, 0, 0}
+};
+
+/******************************************************************************
+* Note the mode chosen by an option, and the first other one chosen after it
+******************************************************************************/
+static void ChooseMode(enum Modes *Mode, enum Modes *Other, enum Modes New)
+{
+	if ((*Mode == MODE_LIST) || (*Mode == New))
+		*Mode = New;
+	else if (*Other == MODE_LIST)
+		*Other = New;
+}
+
+/******************************************************************************
+* Display the usage message
+* It's written in pieces to keep each string within what any C compiler takes.
+******************************************************************************/
+static void Usage(void)
+{
+	printf("%s  ver. " VERSION "  " VERDATE "  by Daniel Fandrich\n", ProgName);
+	printf("Usage:\n  %s [-d] [-s] [--format=text|jsonl|csv|binary] [--where=EXPR]\n",
+		   ProgName);
+	fputs("        [--hash=xxh64|sha1] [--grep=PATTERN ...] [--dups] [--similar[=PERCENT]]\n"
+		  "        [--check] [--verify] [--extract[=DIR]] [--find=NAME ...]\n"
+		  "        [--dump=NAME[,OFFSET]] [--carve] filename1 [filenameN ...]\n", stdout);
+	fputs("View directory of Commodore 64/128 archive and self-dissolving archive files.\n"
+		  "Supports ARC230, Lynx, LZH (SFX), T64, TAP, D64, X64, N64, PC64 & LBR archive\n"
+		  "types.\n", stdout);
+	fputs("fvcbm is copyright (C) 1995-2025 by Daniel Fandrich, et. al.\n"
+		  "This program comes with NO WARRANTY. See the file COPYING for details.\n",
+		  stdout);
+}
+
+
+/******************************************************************************
+* Main loop
+******************************************************************************/
+int main(int argc, char *argv[])
+{
+	int ArgNum;
+	int Error = 0;
+	int FirstFileName = 1;
+	char FileName[MAXPATH+1];
+	int EndOptions = 0;
+	FILE *InFile;
+	enum ArchiveTypes ArchiveType;
+	struct ArcTotals Totals;
+	const struct OutputFormat *Format = OutputFormats;
+	struct CbmContext Ctx;
+	int Grepping = 0;
+	enum Modes Mode = MODE_LIST;
+	enum Modes OtherMode = MODE_LIST;	/* another mode also chosen */
+	const char *Clash = NULL;
+
+#ifndef __Z88DK
+	if (isatty(fileno(stdout)))
+		setvbuf(stdout, NULL, _IOLBF, 82);		/* speed up screen output */
+	else
+		setvbuf(stdout, NULL, _IOFBF, (size_t) OUTPUT_BUFFER);	/* one write per block */
+#endif
+
+	WideFormat = 1;		/* wide FV-style output */
+	CbmSearchInit(&Search);
+
+	for (FirstFileName = 1; FirstFileName < argc; ++FirstFileName) {
+		const char *Arg = argv[FirstFileName];
+
+		if (strcmp(Arg, "--") == 0) {	/* -- ends options */
+			EndOptions = 1;
+			++FirstFileName;
+			break;
+
+		} else if (IsOption(Arg, 'd')) {
+			WideFormat = 0;		/* 1541-style output */
+
+		} else if (IsOption(Arg, 's')) {
+			TotalsOnly = 1;		/* archive totals only */
+
+		} else if (IsOption(Arg, 'h') || IsOption(Arg, '?')) {
+			Usage();
+			return 1;
+
+		} else if (strncmp(Arg, "--format=", 9) == 0) {
+			for (Format = OutputFormats; Format->Name; ++Format)
+				if (strcmp(Arg + 9, Format->Name) == 0)
+					break;
+			if (!Format->Name) {
+				fprintf(stderr, "%s: Unknown output format %s\n", ProgName, Arg + 9);
+				return 1;
+			}
+
+		} else if (strncmp(Arg, "--where=", 8) == 0) {
+			if (CbmFilterCompile(&Filter, Arg + 8) != 0) {
+				fprintf(stderr, "%s: Bad filter expression %s\n", ProgName, Arg + 8);
+				return 1;
+			}
+			Filtering = 1;
+
+		} else if (strncmp(Arg, "--grep=", 7) == 0) {
+			unsigned char Pat[SEARCH_MAX_LEN];
+			unsigned Len = ParsePattern(Arg + 7, Pat, sizeof(Pat));
+			if (!Len || (CbmSearchAdd(&Search, Pat, Len) < 0)) {
+				fprintf(stderr, "%s: Bad search pattern %s\n", ProgName, Arg + 7);
+				return 1;
+			}
+			GrepArgs[Grepping++] = Arg + 7;
+			ChooseMode(&Mode, &OtherMode, MODE_GREP);
+
+		} else if ((strcmp(Arg, "--extract") == 0) ||
+				   (strncmp(Arg, "--extract=", 10) == 0)) {
+			ExtractDir = Arg[9] ? Arg + 10 : ".";
+			if (!*ExtractDir ||
+				(strlen(ExtractDir) > MAXPATH - 16 - MAX_EXT_LEN - 2)) {
+				fprintf(stderr, "%s: Bad directory %s\n", ProgName, ExtractDir);
+				return 1;
+			}
+			ChooseMode(&Mode, &OtherMode, MODE_EXTRACT);
+
+		} else if (strcmp(Arg, "--check") == 0) {
+			ChooseMode(&Mode, &OtherMode, MODE_CHECK);
+
+		} else if (strcmp(Arg, "--verify") == 0) {
+			ChooseMode(&Mode, &OtherMode, MODE_VERIFY);
+
+		} else if (strcmp(Arg, "--carve") == 0) {
+			ChooseMode(&Mode, &OtherMode, MODE_CARVE);
+
+		} else if (strncmp(Arg, "--find=", 7) == 0) {
+			if (!Arg[7] || (strlen(Arg + 7) > 16) || (Finding >= MAX_FINDS)) {
+				fprintf(stderr, "%s: Bad file name %s\n", ProgName, Arg + 7);
+				return 1;
+			}
+			FindArgs[Finding++] = Arg + 7;
+			ChooseMode(&Mode, &OtherMode, MODE_FIND);
+
+		} else if (strncmp(Arg, "--dump=", 7) == 0) {
+			const char *Comma = strchr(Arg + 7, ',');
+			size_t Len = Comma ? (size_t) (Comma - (Arg + 7)) : strlen(Arg + 7);
+			const char *Digits = Comma ? Comma + 1 : "";
+			int Base = 10;
+			char *End = NULL;
+			if ((Digits[0] == '0') && ((Digits[1] == 'x') || (Digits[1] == 'X'))) {
+				Digits += 2;
+				Base = 16;
+			}
+			errno = 0;
+			if (Comma)
+				DumpOffset = strtoul(Digits, &End, Base);
+			if (!Len || (Len >= sizeof(DumpName)) ||
+				(Comma && (!isxdigit((unsigned char) Digits[0]) || *End ||
+						   (errno == ERANGE) || (DumpOffset == ULONG_MAX)))) {
+				fprintf(stderr, "%s: Bad file name %s\n", ProgName, Arg + 7);
+				return 1;
+			}
+			memcpy(DumpName, Arg + 7, Len);
+			DumpName[Len] = '\0';
+			ChooseMode(&Mode, &OtherMode, MODE_DUMP);
+
+		} else if (strcmp(Arg, "--dups") == 0) {
+			ChooseMode(&Mode, &OtherMode, MODE_DUPS);
+
+		} else if ((strcmp(Arg, "--similar") == 0) ||
+				   (strncmp(Arg, "--similar=", 10) == 0)) {
+			if (Arg[9]) {
+				char *End;
+				unsigned long Percent = strtoul(Arg + 10, &End, 10);
+				if (!isdigit((unsigned char) Arg[10]) || *End || !Percent ||
+					(Percent > 100)) {
+					fprintf(stderr, "%s: Bad similarity %s\n", ProgName, Arg + 10);
+					return 1;
+				}
+				SimPercent = (unsigned) Percent;
+			}
+			ChooseMode(&Mode, &OtherMode, MODE_SIMILAR);
+
+		} else if (strncmp(Arg, "--hash=", 7) == 0) {
+			if ((HashType = CbmHashType(Arg + 7)) < 0) {
+				fprintf(stderr, "%s: Unknown hash type %s\n", ProgName, Arg + 7);
+				return 1;
+			}
+
+		} else if ((Arg[0] == '-') && (Arg[1] == '-')) {
+			fprintf(stderr, "%s: Unknown option %s\n", ProgName, Arg);
+			return 1;
+
+		} else
+			break;
+	}
+
+	if ((FirstFileName >= argc) && !EndOptions) {
+		Usage();
+		return 1;
+	}
+
+	/* A mode lists the entries its own way, so can't be used with -s or
+	   --format, or with a mode that lists them some other way */
+	if (OtherMode != MODE_LIST)
+		Clash = Modes[OtherMode].Option;
+	else if (Mode == MODE_LIST) {
+		if (HashType && TotalsOnly)
+			Clash = "-s";
+		else if (HashType && (Format->Entry == CatalogEntry))
+			Clash = "--format=binary";
+	} else if (TotalsOnly)
+		Clash = "-s";
+	else if (Format != OutputFormats)
+		Clash = "--format";
+	else if (HashType && !Modes[Mode].Hash)
+		Clash = "--hash";
+	else if (Filtering && !Modes[Mode].Where)
+		Clash = "--where";
+	if (Clash) {
+		fprintf(stderr, "%s: %s can't be used with %s\n", ProgName,
+				Mode == MODE_LIST ? "--hash" : Modes[Mode].Option, Clash);
+		return 1;
+	}
+
+	if (Mode != MODE_LIST)
+		Format = Modes[Mode].Format;
+	if ((Mode == MODE_DUPS) || (Mode == MODE_SIMILAR)) {
+		/* Any hash will do, but xxHash64 is faster if it's available */
+		if (!HashType && ((HashType = CbmHashType("xxh64")) < 0))
+			HashType = CBM_HASH_SHA1;
+	}
+#if defined(__MSDOS__) || defined(_WIN32)
+	if ((Mode == MODE_EXTRACT) && (strcmp(ExtractDir, "-") == 0))
+		setmode(fileno(stdout), O_BINARY);	/* put standard output into binary mode */
+#endif
+
+	if (TotalsOnly && (Format->Trailer == NoTrailer)) {
+		fprintf(stderr, "%s: -s can't be used with --format=%s\n", ProgName, Format->Name);
+		return 1;
+	}
+
+/******************************************************************************
+* Only ask for the entry fields that will be displayed, since some are
+* expensive to find
+******************************************************************************/
+	CbmInitContext(&Ctx);
+	Ctx.DisplayStart = Format->Start;
+	Ctx.Warning = Modes[Mode].Warning;
+	Ctx.UserData = &Ctx;	/* for EntryHash() */
+	Ctx.Hash = HashType;
+	if (Filtering)
+		Ctx.Filter = &Filter;
+	if (Mode != MODE_LIST)
+		Ctx.Fields = Modes[Mode].Fields;
+	else if (TotalsOnly) {
+		Ctx.DisplayEntry = NoEntry;
+		Ctx.Fields = WideFormat || (Format != OutputFormats) ?
+			FIELD_LENGTH | FIELD_BLOCKS | FIELD_BLOCKSNOW : FIELD_BLOCKS;
+	} else {
+		Ctx.DisplayEntry = Format->Entry;
+		Ctx.Fields = WideFormat || (Format != OutputFormats) ?
+			FIELD_ALL : FIELD_NAME | FIELD_TYPE | FIELD_BLOCKS;
+	}
+
+	if (Format->Begin)
+		Format->Begin();
+
+/******************************************************************************
+* Loop through archive display for each file name
+******************************************************************************/
+	for (ArgNum=FirstFileName; ArgNum<argc; ++ArgNum) {
+
+/******************************************************************************
+* Open the archive file
+******************************************************************************/
+		strncpy(FileName, argv[ArgNum], sizeof(FileName) - MAX_EXT_LEN);
+		FileName[sizeof(FileName)-1] = 0;
+
+		if (strcmp(FileName,"-") == 0) {		/* "-" means read from stdin */
+			InFile = stdin;
+#ifdef __MSDOS__
+			setmode(fileno(stdin), O_BINARY);	/* put standard input into binary mode */
+#endif
+		} else if ((InFile = fopen(FileName, "rb")) == NULL) {
+
+/******************************************************************************
+* Given name wasn't found--add extensions and keep searching
+******************************************************************************/
+			const char * const *Ext;
+			char TryFileName[MAXPATH+1];
+
+			for (Ext = Extensions; *Ext != NULL; ++Ext) {
+				strcat(strcpy(TryFileName, FileName), *Ext);
+				if ((InFile = fopen(TryFileName, "rb")) != NULL) {
+					strcpy(FileName, TryFileName);
+					break;
+				}
+			}
+
+/******************************************************************************
+* Couldn't find any variation of the file name
+******************************************************************************/
+			if (InFile == NULL) {
+				fflush(stdout);
+				perror(FileName);
+				if (Format->Separate)
+					printf("\n");
+				Error = 2;
+				continue;		/* go do next file */
+			}
+		}
+
+/******************************************************************************
+* Display header
+* To do: Add display of archive comment
+******************************************************************************/
+		CurrentArchive = FileName;
+		if (Format->Archive)
+			Format->Archive(FileName);
+
+		if (Mode == MODE_CARVE) {
+			/* Any file may hold archives */
+			int CarveError = CarveFile(&Ctx, InFile);
+			if (CarveError)
+				Error = CarveError;
+		} else if ((ArchiveType = DetermineArchiveType(InFile,FileName)) == UnknownArchive) {
+			fflush(stdout);
+			fprintf(stderr,"%s: Not a known Commodore archive\n", ProgName);
+			Error = 3;
+		} else {
+
+/******************************************************************************
+* Display the archive contents
+******************************************************************************/
+			if (Modes[Mode].Run) {
+				int ModeError = Modes[Mode].Run(&Ctx, InFile, ArchiveType);
+				if (ModeError)
+					Error = ModeError;
+			} else if (DirArchive(&Ctx, InFile, ArchiveType, &Totals) != CBM_OK) {
+				DisplayWarning(NULL, Ctx.ErrorMsg);
+				Error = Ctx.Error;
+			} else
+				Format->Trailer(ArchiveType, &Totals);	/* show output trailer */
+		}
+
+/******************************************************************************
+* Go do next file name on command line
+******************************************************************************/
+		fclose(InFile);
+		if (Format->Separate && (ArgNum<argc-1))
+			printf("\n");
+	}
+
+	if (Mode == MODE_DUPS) {
+		FindDupNames(&Ctx);
+		DisplayDups();
+	} else if (Mode == MODE_SIMILAR) {
+		int SimError = DisplaySimilar();
+		if (SimError)
+			Error = SimError;
+	}
+
+	if (Format->End) {
+		int EndError = Format->End();
+		if (EndError)
+			Error = EndError;
+	}
 	fflush(stdout);		/* Make sure the buffered output is displayed */
 
 	return Error;
@@ -0,0 +1,123 @@
+/*
+ * simtest.c
+ *
+ * Test of how clustering with cbmsim.c scales, run by "make test"
+ *
+ * fvcbm is copyright 1993-2025 Dan Fandrich, et. al.
+ * fvcbm is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * fvcbm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fvcbm; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every archive holds the same loader, so the bands made from it are shared
+ * by all of them, as well as files shared only with the other archives of
+ * its group of GROUP_SIZE, which are the clusters that should be found. The
+ * number of comparisons for each archive must stay the same however many
+ * archives there are, and clustering them in the opposite order must give
+ * the same clusters.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cbmsim.h"
+
+#define GROUP_SIZE 5		/* archives in each cluster */
+#define GROUP_FILES 3		/* files shared within a cluster */
+#define MAX_COMPARES (CBM_SIM_BANDS * 10UL)	/* most for each archive */
+
+/******************************************************************************
+* Add the file with the given number to a signature
+******************************************************************************/
+static void AddFile(struct CbmSimSig *Sig, unsigned long Kind, unsigned long Num)
+{
+	char Hash[17];
+
+	sprintf(Hash, "%08lx%08lx", Kind, Num & 0xffffffffUL);
+	CbmSimAdd(Sig, Hash);
+}
+
+/******************************************************************************
+* Fill a table with Len archives, either in order or reversed
+* Returns 0 or -1 if out of memory
+******************************************************************************/
+static int MakeTable(struct CbmSimTable *Table, unsigned long Len, int Reverse)
+{
+	struct CbmSimSig Sig;
+	unsigned long i, Num;
+	int f;
+
+	CbmSimTableInit(Table);
+	for (i = 0; i < Len; ++i) {
+		Num = Reverse ? Len - 1 - i : i;
+		CbmSimInit(&Sig);
+		AddFile(&Sig, 1, 0);			/* the loader */
+		for (f = 0; f < GROUP_FILES; ++f)
+			AddFile(&Sig, 2 + f, Num / GROUP_SIZE);
+		AddFile(&Sig, 9, Num);
+		if (CbmSimTableAdd(Table, &Sig) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+* Cluster Len archives both ways round and show what was found
+* Returns 0, or 1 if it took too many comparisons or the order mattered
+******************************************************************************/
+static int Run(unsigned long Len)
+{
+	struct CbmSimTable Forward, Backward;
+	unsigned long *Map;
+	unsigned long i, Compares;
+	unsigned long Clusters = 0, BackClusters = 0;
+	int Same = 1;
+
+	if ((MakeTable(&Forward, Len, 0) < 0) || (MakeTable(&Backward, Len, 1) < 0) ||
+		(CbmSimCluster(&Forward, 50) < 0) || (CbmSimCluster(&Backward, 50) < 0) ||
+		((Map = (unsigned long *) malloc(Len * sizeof(*Map))) == NULL)) {
+		fprintf(stderr, "simtest: Out of memory\n");
+		exit(2);
+	}
+
+	/* Each cluster one way round must be within one the other way round,
+	   and there must be as many of them */
+	for (i = 0; i < Len; ++i) {
+		unsigned long First = CbmSimFind(&Forward, i);
+		unsigned long Other = CbmSimFind(&Backward, Len - 1 - i);
+		if (First == i) {
+			++Clusters;
+			Map[i] = Other;
+		} else if (Map[First] != Other)
+			Same = 0;
+		if (CbmSimFind(&Backward, i) == i)
+			++BackClusters;
+	}
+	Compares = Forward.Compares;
+
+	printf("%lu archives: %lu clusters, %lu comparisons each, %s in reverse\n",
+		   Len, Clusters, (Compares + Len - 1) / Len,
+		   Same && (Clusters == BackClusters) ? "the same" : "different");
+	free(Map);
+	CbmSimTableFree(&Forward);
+	CbmSimTableFree(&Backward);
+	return !Same || (Clusters != BackClusters) || (Compares > MAX_COMPARES * Len);
+}
+
+int main(void)
+{
+	int Error = 0;
+
+	Error |= Run(1000UL);
+	Error |= Run(10000UL);
+	Error |= Run(100000UL);
+	return Error;
+}